@@ -1,3 +1,7 @@
+#import "HMAC.hpp"
+#import "JSON.hpp"
+
+#import <algorithm>
 #import <arpa/inet.h>
 #import <assert.h>
 #import <beast/core/streambuf.hpp>
@@ -7,10 +11,14 @@
 #import <boost/property_tree/json_parser.hpp>
 #import <boost/property_tree/ptree.hpp>
 #import <boost/variant.hpp>
+#import <chrono>
+#import <cstdlib>
 #import <fstream>
 #import <iostream>
+#import <map>
 #import <sstream>
 #import <sys/socket.h>
+#import <thread>
 #import <tuple>
 #import <vector>
 
@@ -58,7 +66,8 @@ typedef enum TestErrorCode {
 } TestErrorCode;
 
 static ssvim::Result<response<string_body>, TestErrorCode>
-PostRequest(std::string port, std::string path, std::string body) {
+SendRequest(std::string port, std::string method, std::string path,
+            std::string body, std::map<std::string, std::string> fields = {}) {
   io_service ios;
 
   // Run tests on localhost
@@ -70,7 +79,7 @@ PostRequest(std::string port, std::string path, std::string body) {
     connect(sock, it);
     auto ep = sock.remote_endpoint();
     request<string_body> req;
-    req.method = "POST";
+    req.method = method;
     req.url = path;
     req.body = body;
     req.version = 11;
@@ -78,6 +87,9 @@ PostRequest(std::string port, std::string path, std::string body) {
                                   boost::lexical_cast<std::string>(ep.port()));
     req.fields.insert("User-Agent", "ssvim-integration_tests/http");
     req.fields.insert("Content-Type", "application/json");
+    for (auto &field : fields) {
+      req.fields.insert(field.first, field.second);
+    }
     prepare(req);
     write(sock, req);
     response<string_body> res;
@@ -92,6 +104,11 @@ PostRequest(std::string port, std::string path, std::string body) {
   return TestErrorCodeUndefined;
 }
 
+static ssvim::Result<response<string_body>, TestErrorCode>
+PostRequest(std::string port, std::string path, std::string body) {
+  return SendRequest(port, "POST", path, body);
+}
+
 std::string ReadFile(const std::string &fileName) {
   std::ifstream ifs(fileName.c_str(),
                     std::ios::in | std::ios::binary | std::ios::ate);
@@ -122,6 +139,46 @@ std::string MakeCompletionPostBody(int line, int column, std::string fileName,
   return oss.str();
 }
 
+// A port nothing listens on, for a server of a test's own
+static std::string FreePort() {
+  io_service ios;
+  ip::tcp::acceptor acceptor(ios, ip::tcp::endpoint(ip::tcp::v4(), 0));
+  return std::to_string(acceptor.local_endpoint().port());
+}
+
+// Start a server in the background, and wait until it accepts connections
+static bool StartServer(std::string port, std::string options,
+                        std::string environment = "") {
+  auto startCmd = "`" + environment + " ./build/http_server --port " + port +
+                  " " + options + " >/dev/null`&";
+  if (system(startCmd.c_str()) != 0) {
+    return false;
+  }
+  for (int i = 0; i < 100; i++) {
+    io_service ios;
+    ip::tcp::socket sock(ios);
+    boost::system::error_code ec;
+    sock.connect(ip::tcp::endpoint(ip::address_v4::loopback(),
+                                   std::stoi(port)),
+                 ec);
+    if (!ec) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+// The X-Ycm-Hmac header of a request to a server with this secret
+static std::string RequestHMAC(std::string secret, std::string method,
+                               std::string path, std::string body) {
+  using ssvim::HMACSHA256;
+  auto joined = HMACSHA256::Digest(secret, method) +
+                HMACSHA256::Digest(secret, path) +
+                HMACSHA256::Digest(secret, body);
+  return ssvim::Base64Encode(HMACSHA256::Digest(secret, joined));
+}
+
 std::string GetExamplesDir() {
   char cwd[1024];
   if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -158,11 +215,516 @@ public:
     assert(res.status == 200);
   }
 
+  // Files with the same imports and flags share the global results of an
+  // unqualified completion, so the second file gets them from the cache
+  void testGlobalCompletions() {
+    auto exampleDir = GetExamplesDir();
+    auto example = ReadFile(exampleDir + std::string("some_swift.swift"));
+    std::vector<std::string> flags;
+
+    using namespace ssvim::ResultStatus;
+    std::vector<std::size_t> counts;
+    for (auto name : {"global_a.swift", "global_b.swift"}) {
+      auto body =
+          MakeCompletionPostBody(19, 9, exampleDir + name, example, flags);
+      auto res = Get<response<string_body>>(
+          PostRequest(_boundPort, "/completions", body));
+      assert(res.status == 200);
+      std::istringstream is(res.body);
+      boost::property_tree::ptree results;
+      boost::property_tree::read_json(is, results);
+      // Keys hold dots, so separate the path with slashes
+      counts.push_back(
+          results.get_child(boost::property_tree::ptree::path_type(
+                                "key.results", '/'))
+              .size());
+    }
+    assert(counts[0] > 0 && counts[0] == counts[1]);
+  }
+
+  // Candidates leave out their details, which are resolved one at a time
+  void testResolveCompletion() {
+    auto exampleDir = GetExamplesDir();
+    auto exampleName = exampleDir + std::string("some_swift.swift");
+    auto example = ReadFile(exampleName);
+    std::vector<std::string> flags;
+
+    using namespace ssvim::ResultStatus;
+    auto body = MakeCompletionPostBody(19, 15, exampleName, example, flags);
+    auto res = Get<response<string_body>>(
+        PostRequest(_boundPort, "/completions", body));
+    assert(res.status == 200);
+    assert(res.body.find("\"key.associated_usrs\"") == std::string::npos);
+    std::istringstream is(res.body);
+    boost::property_tree::ptree results;
+    boost::property_tree::read_json(is, results);
+    using path = boost::property_tree::ptree::path_type;
+    auto session = results.get<std::string>(path("key.session", '/'));
+    auto id = results.get_child(path("key.results", '/'))
+                  .front()
+                  .second.get<std::string>(path("key.id", '/'));
+
+    auto resolve = [&](std::string session) {
+      return Get<response<string_body>>(PostRequest(
+          _boundPort, "/completions/resolve",
+          "{\"session\":\"" + session + "\",\"id\":" + id + "}"));
+    };
+    auto resolved = resolve(session);
+    assert(resolved.status == 200);
+    assert(resolved.body.find("\"key.associated_usrs\"") != std::string::npos);
+    assert(resolved.body.find("\"key.annotated_decl\"") != std::string::npos);
+    assert(resolve("gone").status == 404);
+  }
+
+  // Editors may count columns in UTF-16 units or in characters. Past
+  // non-ASCII text, each names the same place as its count of bytes.
+  void testColumnEncodings() {
+    auto exampleName = GetExamplesDir() + std::string("columns.swift");
+    // é is 2 bytes and 1 unit, and 😀 is 4 bytes and 2 units, or 1 character.
+    // The cursor is on the b, so a column one off either way completes
+    // somewhere else.
+    std::string line = "let s = \"\xc3\xa9\xf0\x9f\x98\x80\"; s.ab.c";
+    auto column = line.find("b.c");
+    auto complete = [&](int column, std::string encoding) {
+      using boost::property_tree::ptree;
+      ptree out;
+      out.put("file_name", exampleName);
+      out.put("contents", line + "\n");
+      out.put("line", 1);
+      out.put("column", column);
+      out.put("column_encoding", encoding);
+      out.put("detail", "full");
+      out.add_child("flags", ptree());
+      std::ostringstream oss;
+      boost::property_tree::write_json(oss, out);
+
+      using namespace ssvim::ResultStatus;
+      auto res = Get<response<string_body>>(
+          PostRequest(_boundPort, "/completions", oss.str()));
+      assert(res.status == 200);
+      std::istringstream is(res.body);
+      ptree results;
+      boost::property_tree::read_json(is, results);
+      return results.get_child(ptree::path_type("key.results", '/'));
+    };
+    auto bytes = complete(column, "utf-8");
+    assert(bytes.size() > 0);
+    assert(complete(column - 3, "utf-16") == bytes);
+    assert(complete(column - 4, "utf-32") == bytes);
+    assert(complete(column - 3, "utf-8") != bytes);
+    assert(complete(column + 1, "utf-8") != bytes);
+  }
+
+  // Usages in the module's other files are found on disk, and matches that
+  // sourcekitd doesn't confirm, like words in comments, are left out
+  void testUsages() {
+    auto exampleDir = GetExamplesDir();
+    auto mainName = exampleDir + std::string("usages_main.swift");
+    auto otherName = std::string("/tmp/ssvim_usages_other.swift");
+    std::ofstream(otherName) << "func answer() -> Int { return total }\n";
+
+    using boost::property_tree::ptree;
+    ptree flags;
+    for (auto &name : {mainName, otherName}) {
+      ptree flag;
+      flag.put("", name);
+      flags.push_back(std::make_pair("", flag));
+    }
+    ptree out;
+    out.put("file_name", mainName);
+    out.put("contents", "let total = 1\n"
+                        "// total, in a comment\n"
+                        "let totals = total + 2\n");
+    out.put("line", 1);
+    out.put("column", 5);
+    out.add_child("flags", flags);
+    std::ostringstream oss;
+    boost::property_tree::write_json(oss, out);
+
+    using namespace ssvim::ResultStatus;
+    auto res = Get<response<string_body>>(
+        PostRequest(_boundPort, "/usages", oss.str()));
+    assert(res.status == 200);
+    std::istringstream is(res.body);
+    ptree usages;
+    boost::property_tree::read_json(is, usages);
+    using path = ptree::path_type;
+    assert(usages.get<std::string>(path("key.name", '/')) == "total");
+    assert(!usages.count("key.partial"));
+    std::vector<std::string> found;
+    for (auto &usage : usages.get_child(path("key.usages", '/'))) {
+      found.push_back(
+          usage.second.get<std::string>(path("key.filepath", '/')) + ":" +
+          usage.second.get<std::string>(path("key.line", '/')) + ":" +
+          usage.second.get<std::string>(path("key.column", '/')));
+    }
+    std::sort(found.begin(), found.end());
+    std::vector<std::string> expected = {mainName + ":1:5", mainName + ":3:14",
+                                         otherName + ":1:31"};
+    std::sort(expected.begin(), expected.end());
+    assert(found == expected);
+  }
+
+  // Editing a file diagnoses the other files of its module in the
+  // background, so they're up to date before they're asked for again
+  void testModuleDiagnostics() {
+    auto exampleDir = GetExamplesDir();
+    auto example = ReadFile(exampleDir + std::string("some_swift.swift"));
+    // Files without flags make up one module
+    std::vector<std::string> flags;
+    auto diagnose = [&](std::string name, std::string contents) {
+      using namespace ssvim::ResultStatus;
+      auto body =
+          MakeCompletionPostBody(0, 0, exampleDir + name, contents, flags);
+      auto res = Get<response<string_body>>(
+          PostRequest(_boundPort, "/diagnostics", body));
+      assert(res.status == 200);
+    };
+    diagnose("module_a.swift", example);
+    diagnose("module_b.swift", example);
+    diagnose("module_a.swift", example + "\nlet edited = 1\n");
+
+    using namespace ssvim::ResultStatus;
+    std::string metrics;
+    for (int i = 0; i < 100; i++) {
+      metrics = Get<response<string_body>>(
+                    SendRequest(_boundPort, "GET", "/metrics", ""))
+                    .body;
+      if (metrics.find("ssvim_background_diagnostics_total 1") !=
+          std::string::npos) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    assert(metrics.find("ssvim_background_diagnostics_total 1") !=
+           std::string::npos);
+    diagnose("module_b.swift", example);
+    metrics = Get<response<string_body>>(
+                  SendRequest(_boundPort, "GET", "/metrics", ""))
+                  .body;
+    assert(metrics.find("ssvim_diagnostics_cache_total{result=\"hit\"} 1") !=
+           std::string::npos);
+  }
+
+  // Requests refer to uploaded buffers by hash. Until a buffer is uploaded,
+  // its hash is listed as missing.
+  void testBlobs() {
+    auto exampleDir = GetExamplesDir();
+    auto exampleName = exampleDir + std::string("some_swift.swift");
+    auto example = ReadFile(exampleName);
+    ssvim::SHA256 sha;
+    sha.update(example.data(), example.size());
+    auto hash = ssvim::HexEncode(sha.digest());
+
+    using boost::property_tree::ptree;
+    ptree out;
+    out.put("file_name", exampleName);
+    out.put("hash", hash);
+    out.add_child("flags", ptree());
+    std::ostringstream oss;
+    boost::property_tree::write_json(oss, out);
+
+    using namespace ssvim::ResultStatus;
+    auto missing = Get<response<string_body>>(
+        PostRequest(_boundPort, "/structure", oss.str()));
+    assert(missing.status == 409);
+    assert(missing.body.find(hash) != std::string::npos);
+
+    auto mismatched = Get<response<string_body>>(
+        SendRequest(_boundPort, "PUT", "/blobs/" + hash, example + " "));
+    assert(mismatched.status == 400);
+    auto uploaded = Get<response<string_body>>(
+        SendRequest(_boundPort, "PUT", "/blobs/" + hash, example));
+    assert(uploaded.status == 201);
+
+    auto res = Get<response<string_body>>(
+        PostRequest(_boundPort, "/structure", oss.str()));
+    assert(res.status == 200);
+  }
+
+  void testCoalescing() {
+    // The server is started with every request for this document slowed
+    // down, so the second request joins the first while it's in flight
+    auto exampleDir = GetExamplesDir();
+    auto exampleName = exampleDir + std::string("coalesced.swift");
+    auto example = ReadFile(exampleDir + std::string("some_swift.swift"));
+
+    using boost::property_tree::ptree;
+    ptree out;
+    out.put("file_name", exampleName);
+    out.put("contents", example);
+    out.add_child("flags", ptree());
+    std::ostringstream oss;
+    boost::property_tree::write_json(oss, out);
+
+    using namespace ssvim::ResultStatus;
+    std::string bodies[2];
+    std::thread requests[2];
+    for (auto i = 0; i < 2; i++) {
+      requests[i] = std::thread([&, i] {
+        auto res = Get<response<string_body>>(
+            PostRequest(_boundPort, "/structure", oss.str()));
+        assert(res.status == 200);
+        bodies[i] = res.body;
+      });
+    }
+    for (auto &request : requests) {
+      request.join();
+    }
+    assert(bodies[0] == bodies[1]);
+
+    auto metrics = Get<response<string_body>>(
+                       SendRequest(_boundPort, "GET", "/metrics", ""))
+                       .body;
+    auto counter =
+        std::string("ssvim_coalesced_requests_total{endpoint=\"structure\"} ");
+    auto found = metrics.find(counter);
+    assert(found != std::string::npos);
+    assert(std::stoul(metrics.substr(found + counter.size())) >= 1);
+  }
+
+  // Clients that accept CBOR get it, with keys and UIDs in a string table
+  void testCBOR() {
+    auto exampleDir = GetExamplesDir();
+    auto exampleName = exampleDir + std::string("some_swift.swift");
+    auto example = ReadFile(exampleName);
+    std::vector<std::string> flags;
+
+    using namespace ssvim::ResultStatus;
+    auto body = MakeCompletionPostBody(19, 15, exampleName, example, flags);
+    auto json = Get<response<string_body>>(
+        PostRequest(_boundPort, "/completions", body));
+    auto cbor = Get<response<string_body>>(
+        SendRequest(_boundPort, "POST", "/completions", body,
+                    {{"Accept", "application/cbor"}}));
+    assert(cbor.status == 200);
+    assert(cbor.fields["Content-Type"].to_string() == "application/cbor");
+    // A stringref namespace around an indefinite length map
+    assert(cbor.body.compare(0, 4, std::string("\xd9\x01\x00\xbf", 4)) == 0);
+    assert(cbor.body.back() == '\xff');
+    assert(cbor.body.size() < json.body.size());
+  }
+
+  void testBatch() {
+    auto exampleDir = GetExamplesDir();
+    auto exampleName = exampleDir + std::string("some_swift.swift");
+    auto example = ReadFile(exampleName);
+
+    using boost::property_tree::ptree;
+    ptree file;
+    file.put("file_name", exampleName);
+    file.put("contents", example);
+    ptree files;
+    files.push_back(std::make_pair("", file));
+
+    ptree completion;
+    completion.put("path", "/completions");
+    completion.put("file_name", exampleName);
+    completion.put("line", 19);
+    completion.put("column", 15);
+    // Slim responses have a session ID of their own
+    completion.put("detail", "full");
+    ptree structure;
+    structure.put("path", "/structure");
+    structure.put("file_name", exampleName);
+    ptree requests;
+    requests.push_back(std::make_pair("", completion));
+    requests.push_back(std::make_pair("", structure));
+
+    ptree out;
+    out.add_child("files", files);
+    out.add_child("requests", requests);
+    std::ostringstream oss;
+    boost::property_tree::write_json(oss, out);
+
+    using namespace ssvim::ResultStatus;
+    auto responseValue = PostRequest(_boundPort, "/batch", oss.str());
+    auto res = Get<response<string_body>>(responseValue);
+    assert(res.status == 200);
+
+    auto readJSON = [](const std::string &body) {
+      std::istringstream is(body);
+      ptree json;
+      boost::property_tree::read_json(is, json);
+      return json;
+    };
+    auto results = readJSON(res.body).get_child("results");
+    assert(results.size() == 2);
+
+    // Each sub response is what its endpoint answers on its own
+    std::vector<ptree> alone;
+    for (auto &request : requests) {
+      auto body = request.second;
+      body.erase("path");
+      body.put("contents", example);
+      body.put("flags", "");
+      std::ostringstream oss;
+      boost::property_tree::write_json(oss, body);
+      auto res = Get<response<string_body>>(PostRequest(
+          _boundPort, request.second.get<std::string>("path"), oss.str()));
+      assert(res.status == 200);
+      alone.push_back(readJSON(res.body));
+    }
+    std::size_t i = 0;
+    for (auto &result : results) {
+      if (result.second.get<int>("status") != 200 ||
+          result.second.get_child("body") != alone[i++]) {
+        std::cerr << "Batch result differs: " << i << std::endl;
+        abort();
+      }
+    }
+  }
+
   void testStatus() {
     using namespace ssvim::ResultStatus;
     auto responseValue = PostRequest(_boundPort, "/status", "");
     auto res = Get<response<string_body>>(responseValue);
     assert(res.status == 200);
+    // Memory use by cache, under the budget
+    assert(res.body.find("\"memory\":{\"limit_bytes\":") !=
+           std::string::npos);
+  }
+
+  // A bad request is answered, and its admission slot freed, so more of
+  // them than the server has slots and queue don't lock out good ones
+  void testBadRequests() {
+    using namespace ssvim::ResultStatus;
+    for (int i = 0; i < 48; i++) {
+      auto res = Get<response<string_body>>(
+          PostRequest(_boundPort, "/completions", i % 2 ? "{" : "{}"));
+      assert(res.status == 400);
+    }
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    auto body = MakeCompletionPostBody(19, 15, exampleName,
+                                       ReadFile(exampleName), {});
+    auto res = Get<response<string_body>>(
+        PostRequest(_boundPort, "/completions", body));
+    assert(res.status == 200);
+  }
+
+  // A request whose deadline has passed by the time it starts is abandoned
+  // without calling sourcekitd
+  void testPastDeadline() {
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    auto body = MakeCompletionPostBody(19, 15, exampleName,
+                                       ReadFile(exampleName), {});
+    using namespace ssvim::ResultStatus;
+    auto res = Get<response<string_body>>(
+        SendRequest(_boundPort, "POST", "/completions", body,
+                    {{"X-SSVIM-Deadline-Ms", "0"}}));
+    assert(res.status == 504);
+    assert(res.body.front() == '"');
+  }
+
+  void testMetrics() {
+    using namespace ssvim::ResultStatus;
+    auto res = Get<response<string_body>>(
+        SendRequest(_boundPort, "GET", "/metrics", ""));
+    assert(res.status == 200);
+    // Earlier tests made completion requests
+    assert(res.body.find("ssvim_http_request_duration_seconds_count{endpoint="
+                         "\"/completions\"}") != std::string::npos);
+  }
+
+  void testFiles() {
+    using namespace ssvim::ResultStatus;
+    // The server's root is the working directory
+    auto path = "/files/Examples/some_swift.swift";
+    auto contents = ReadFile(GetExamplesDir() + "some_swift.swift");
+
+    auto full =
+        Get<response<string_body>>(SendRequest(_boundPort, "GET", path, ""));
+    assert(full.status == 200);
+    assert(full.body == contents);
+
+    auto partial = Get<response<string_body>>(
+        SendRequest(_boundPort, "GET", path, "", {{"Range", "bytes=0-4"}}));
+    assert(partial.status == 206);
+    assert(partial.body == contents.substr(0, 5));
+
+    auto tag = full.fields["ETag"].to_string();
+    auto cached = Get<response<string_body>>(
+        SendRequest(_boundPort, "GET", path, "", {{"If-None-Match", tag}}));
+    assert(cached.status == 304);
+
+    auto escaped = Get<response<string_body>>(SendRequest(
+        _boundPort, "GET", "/files/%2e%2e/%2e%2e/etc/passwd", ""));
+    assert(escaped.status == 404);
+  }
+
+  // A server with a secret only answers requests signed with it
+  void testHMAC() {
+    std::string secret = "integration secret";
+    auto secretName = std::string("/tmp/ssvim_hmac_secret.json");
+    std::ofstream(secretName)
+        << "{\"hmac_secret\":\"" << ssvim::Base64Encode(secret) << "\"}";
+    auto port = FreePort();
+    assert(StartServer(port, "--hmac-file-secret " + secretName));
+
+    auto exampleName = GetExamplesDir() + std::string("some_swift.swift");
+    auto body = MakeCompletionPostBody(19, 15, exampleName,
+                                       ReadFile(exampleName), {});
+    auto post = [&](std::map<std::string, std::string> fields) {
+      using namespace ssvim::ResultStatus;
+      return Get<response<string_body>>(
+          SendRequest(port, "POST", "/completions", body, fields));
+    };
+    auto missing = post({});
+    assert(missing.status == 401);
+    auto bad = post({{"X-Ycm-Hmac", RequestHMAC("wrong secret", "POST",
+                                                "/completions", body)}});
+    assert(bad.status == 401);
+    auto tampered = post({{"X-Ycm-Hmac", RequestHMAC(secret, "POST",
+                                                     "/completions", "{}")}});
+    assert(tampered.status == 401);
+    auto accepted = post({{"X-Ycm-Hmac", RequestHMAC(secret, "POST",
+                                                     "/completions", body)}});
+    assert(accepted.status == 200);
+
+    using namespace ssvim::ResultStatus;
+    auto shutdown = Get<response<string_body>>(SendRequest(
+        port, "POST", "/shutdown", "",
+        {{"X-Ycm-Hmac", RequestHMAC(secret, "POST", "/shutdown", "")}}));
+    assert(shutdown.status == 200);
+  }
+
+  // An endpoint with no room to queue turns requests away while its one
+  // slot is taken, and says when to try again
+  void testEndpointLimit() {
+    auto port = FreePort();
+    assert(StartServer(port, "--endpoint-limit /structure=1:0",
+                       "SSVIM_SIM_SLOW_FILE=saturated.swift "
+                       "SSVIM_SIM_SLOW_MS=1000"));
+
+    auto exampleDir = GetExamplesDir();
+    auto example = ReadFile(exampleDir + std::string("some_swift.swift"));
+    auto structure = [&](std::string name) {
+      using namespace ssvim::ResultStatus;
+      auto body = MakeCompletionPostBody(0, 0, exampleDir + name, example, {});
+      return Get<response<string_body>>(
+          PostRequest(port, "/structure", body));
+    };
+    std::thread saturating(
+        [&] { assert(structure("saturated.swift").status == 200); });
+    // Wait for the slow request to take the slot
+    using namespace ssvim::ResultStatus;
+    std::string status;
+    for (int i = 0; i < 100; i++) {
+      status = Get<response<string_body>>(PostRequest(port, "/status", ""))
+                   .body;
+      if (status.find("\"/structure\":{\"in_flight\":1") !=
+          std::string::npos) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto rejected = structure("limited.swift");
+    saturating.join();
+    assert(rejected.status == 503);
+    assert(std::stoul(rejected.fields["Retry-After"].to_string()) >= 1);
+    assert(rejected.body.front() == '"');
+
+    PostRequest(port, "/shutdown", "");
   }
 
   void testRunningAfterGarbageJSON() {
@@ -204,15 +766,13 @@ int main(int, char const *[]) {
   // session.
   auto bootInfo = testBind();
   auto boundPort = std::to_string(std::get<int>(bootInfo));
-  auto startCmd = std::string("`./build/http_server");
-  startCmd += " --port ";
-  startCmd += boundPort;
-  startCmd += " >/dev/null`&";
-
-  // Startup the service
-  int started = system(startCmd.c_str());
-  assert(started == 0 && "Failed to start");
-  sleep(1);
+  // The simulator slows down the document testCoalescing sends twice at once
+  if (!StartServer(boundPort, "",
+                   "SSVIM_SIM_SLOW_FILE=coalesced.swift "
+                   "SSVIM_SIM_SLOW_MS=1000")) {
+    std::cerr << "Failed to start" << std::endl;
+    return 1;
+  }
 
   // IntegrationTests Begin
   // NOTE: There should be no expected order to these test invocations, the
@@ -226,6 +786,51 @@ int main(int, char const *[]) {
   std::cout << "testSuccessfulCompletion" << std::endl;
   suite.testSuccessfulCompletion();
 
+  std::cout << "testGlobalCompletions" << std::endl;
+  suite.testGlobalCompletions();
+
+  std::cout << "testResolveCompletion" << std::endl;
+  suite.testResolveCompletion();
+
+  std::cout << "testColumnEncodings" << std::endl;
+  suite.testColumnEncodings();
+
+  std::cout << "testUsages" << std::endl;
+  suite.testUsages();
+
+  std::cout << "testModuleDiagnostics" << std::endl;
+  suite.testModuleDiagnostics();
+
+  std::cout << "testBlobs" << std::endl;
+  suite.testBlobs();
+
+  std::cout << "testCoalescing" << std::endl;
+  suite.testCoalescing();
+
+  std::cout << "testCBOR" << std::endl;
+  suite.testCBOR();
+
+  std::cout << "testBatch" << std::endl;
+  suite.testBatch();
+
+  std::cout << "testBadRequests" << std::endl;
+  suite.testBadRequests();
+
+  std::cout << "testPastDeadline" << std::endl;
+  suite.testPastDeadline();
+
+  std::cout << "testMetrics" << std::endl;
+  suite.testMetrics();
+
+  std::cout << "testFiles" << std::endl;
+  suite.testFiles();
+
+  std::cout << "testHMAC" << std::endl;
+  suite.testHMAC();
+
+  std::cout << "testEndpointLimit" << std::endl;
+  suite.testEndpointLimit();
+
   // TODO:
   // std::cout << "testRunningAfterGarbageJSON" << std::endl;
   // testRunningAfterGarbageJSON();
@@ -0,0 +1,530 @@
+#import "CBOR.hpp"
+#import "CompletionContext.hpp"
+#import "CompletionItems.hpp"
+#import "FutureChannel.hpp"
+#import "LineIndex.hpp"
+#import "Logging.hpp"
+#import "SwiftCorpus.hpp"
+#import "Usages.hpp"
+
+#ifdef SSVIM_BENCH_SOURCEKIT
+#import "SwiftCompleter.hpp"
+#endif
+
+#import <algorithm>
+#import <boost/program_options.hpp>
+#import <boost/property_tree/json_parser.hpp>
+#import <boost/property_tree/ptree.hpp>
+#import <chrono>
+#import <cstdio>
+#import <fcntl.h>
+#import <fstream>
+#import <functional>
+#import <iomanip>
+#import <iostream>
+#import <sstream>
+#import <thread>
+#import <unistd.h>
+#import <vector>
+
+using namespace ssvim;
+
+// Micro-benchmarks for the server's hot paths.
+//
+// Each benchmark runs for a calibrated number of iterations, then repeats the
+// run a few times. The median run is reported, along with the fastest, so
+// noise on a shared machine is visible. Sizes come from SwiftCorpus, so the
+// results for increasing sizes form scaling curves.
+
+#pragma mark - Harness
+
+// Keep the compiler from optimizing away a value that's never used
+template <class T> static void DoNotOptimize(T const &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+class BenchmarkState {
+  std::uint64_t _iterations;
+  std::uint64_t _bytesPerIteration;
+
+public:
+  BenchmarkState(std::uint64_t iterations)
+      : _iterations(iterations), _bytesPerIteration(0) {
+  }
+
+  std::uint64_t iterations() const {
+    return _iterations;
+  }
+
+  // Report throughput as well as time per iteration
+  void setBytesPerIteration(std::uint64_t bytes) {
+    _bytesPerIteration = bytes;
+  }
+
+  std::uint64_t bytesPerIteration() const {
+    return _bytesPerIteration;
+  }
+};
+
+struct Benchmark {
+  std::string name;
+  // Run state.iterations() iterations of the benchmark
+  std::function<void(BenchmarkState &)> run;
+};
+
+struct BenchmarkResult {
+  std::string name;
+  std::uint64_t iterations;
+  double medianNanoseconds;
+  double minNanoseconds;
+  std::uint64_t bytesPerIteration;
+};
+
+struct HarnessOptions {
+  std::chrono::milliseconds minTime;
+  unsigned repetitions;
+};
+
+static double RunNanosecondsPerIteration(const Benchmark &benchmark,
+                                         std::uint64_t iterations,
+                                         std::uint64_t *bytesPerIteration) {
+  BenchmarkState state(iterations);
+  auto start = std::chrono::steady_clock::now();
+  benchmark.run(state);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  *bytesPerIteration = state.bytesPerIteration();
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         iterations;
+}
+
+static BenchmarkResult RunBenchmark(const Benchmark &benchmark,
+                                    const HarnessOptions &options) {
+  // Grow the iteration count until a run takes at least minTime
+  std::uint64_t bytes = 0;
+  std::uint64_t iterations = 1;
+  auto minNanoseconds =
+      std::chrono::duration<double, std::nano>(options.minTime).count();
+  while (true) {
+    auto perIteration = RunNanosecondsPerIteration(benchmark, iterations, &bytes);
+    if (perIteration * iterations >= minNanoseconds || iterations >= 1 << 30) {
+      break;
+    }
+    auto target = minNanoseconds / std::max(perIteration, 1.0) * 1.2;
+    iterations = std::max<std::uint64_t>(
+        iterations * 2,
+        std::min<std::uint64_t>(static_cast<std::uint64_t>(target),
+                                iterations * 100));
+  }
+
+  std::vector<double> runs;
+  for (unsigned i = 0; i < options.repetitions; i++) {
+    runs.push_back(RunNanosecondsPerIteration(benchmark, iterations, &bytes));
+  }
+  std::sort(runs.begin(), runs.end());
+  return {benchmark.name, iterations, runs[runs.size() / 2], runs.front(),
+          bytes};
+}
+
+static double MegabytesPerSecond(const BenchmarkResult &result) {
+  if (result.bytesPerIteration == 0) {
+    return 0;
+  }
+  return result.bytesPerIteration / result.medianNanoseconds * 1e9 / 1e6;
+}
+
+static void PrintResult(const BenchmarkResult &result) {
+  std::cout << std::left << std::setw(40) << result.name << std::right
+            << std::setw(12) << result.iterations << std::fixed
+            << std::setprecision(1) << std::setw(14)
+            << result.medianNanoseconds << std::setw(14)
+            << result.minNanoseconds;
+  if (result.bytesPerIteration) {
+    std::cout << std::setw(12) << MegabytesPerSecond(result);
+  }
+  std::cout << std::endl;
+}
+
+static void WriteJSONResults(const std::vector<BenchmarkResult> &results,
+                             std::ostream &os) {
+  os << "[";
+  for (std::size_t i = 0; i < results.size(); i++) {
+    auto &result = results[i];
+    os << (i ? "," : "") << "\n  {\"name\":\"" << result.name << "\","
+       << "\"iterations\":" << result.iterations << ","
+       << "\"median_ns\":" << result.medianNanoseconds << ","
+       << "\"min_ns\":" << result.minNanoseconds << ","
+       << "\"bytes_per_iteration\":" << result.bytesPerIteration << ","
+       << "\"mb_per_second\":" << MegabytesPerSecond(result) << "}";
+  }
+  os << "\n]\n";
+}
+
+// Send stdout and stderr to /dev/null for the life of the scope, so logging
+// benchmarks measure the logger rather than the terminal.
+class DiscardOutput {
+  int _stdout;
+  int _stderr;
+
+public:
+  DiscardOutput() {
+    fflush(stdout);
+    fflush(stderr);
+    _stdout = dup(STDOUT_FILENO);
+    _stderr = dup(STDERR_FILENO);
+    auto devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+  }
+
+  ~DiscardOutput() {
+    logging::Flush();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(_stdout, STDOUT_FILENO);
+    dup2(_stderr, STDERR_FILENO);
+    close(_stdout);
+    close(_stderr);
+  }
+};
+
+#pragma mark - Benchmarks
+
+static const std::string CorpusFileName = "/tmp/Generated.swift";
+
+// GetOffset finds the completion point at the end of the corpus, the worst
+// case, through the document's cached line index.
+static Benchmark GetOffsetBenchmark(std::size_t lines) {
+  auto file = std::make_shared<SwiftCorpusFile>(GenerateSwiftCorpus(lines));
+  return {"GetOffset/" + std::to_string(lines), [file](BenchmarkState &state) {
+            CompletionContext ctx;
+            ctx.sourceFilename = CorpusFileName;
+            ctx.line = file->line;
+            ctx.column = file->column;
+            UnsavedFile unsavedFile;
+            unsavedFile.fileName = CorpusFileName;
+            unsavedFile.setContents(file->contents);
+            ctx.unsavedFiles.push_back(unsavedFile);
+            state.setBytesPerIteration(file->contents.size());
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              unsigned offset = 0;
+              ctx.lineIndex.reset();
+              DoNotOptimize(GetOffset(ctx, &offset));
+              DoNotOptimize(offset);
+            }
+          }};
+}
+
+// Index a new version of a document, and find a position in UTF-16 columns
+static Benchmark LineIndexBenchmark(std::size_t lines) {
+  auto file = std::make_shared<SwiftCorpusFile>(GenerateSwiftCorpus(lines));
+  return {"LineIndex/" + std::to_string(lines), [file](BenchmarkState &state) {
+            state.setBytesPerIteration(file->contents.size());
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              LineIndex index(file->contents);
+              DoNotOptimize(index.offset(file->contents, file->line,
+                                         file->column, ColumnEncodingUTF16));
+            }
+          }};
+}
+
+// The lexical scan of /usages over a file, for an identifier every function
+// in the corpus uses
+static Benchmark FindIdentifierBenchmark(std::size_t lines) {
+  auto file = std::make_shared<SwiftCorpusFile>(GenerateSwiftCorpus(lines));
+  return {"FindIdentifier/" + std::to_string(lines),
+          [file](BenchmarkState &state) {
+            state.setBytesPerIteration(file->contents.size());
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              DoNotOptimize(FindIdentifier(file->contents.data(),
+                                           file->contents.size(), "items"));
+            }
+          }};
+}
+
+// Parse a /completions body the way readJSONPostBody does
+static Benchmark ParseRequestBodyBenchmark(std::size_t lines) {
+  auto body = std::make_shared<std::string>(GenerateCompletionRequest(
+      CorpusFileName, GenerateSwiftCorpus(lines)));
+  return {"ParseRequestBody/" + std::to_string(lines),
+          [body](BenchmarkState &state) {
+            state.setBytesPerIteration(body->size());
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              boost::property_tree::ptree pt;
+              std::istringstream is(*body);
+              boost::property_tree::read_json(is, pt);
+              DoNotOptimize(pt);
+            }
+          }};
+}
+
+// The completion results, split into the fragments that
+// StreamCompletionResponse hands to its sink: one per candidate.
+static std::shared_ptr<std::vector<std::string>>
+CompletionFragments(std::size_t count) {
+  auto results = GenerateCompletionResults(count);
+  auto fragments = std::make_shared<std::vector<std::string>>();
+  std::size_t start = 0;
+  while (start < results.size()) {
+    auto end = results.find("},{", start);
+    end = end == std::string::npos ? results.size() : end + 2;
+    fragments->push_back(results.substr(start, end - start));
+    start = end;
+  }
+  return fragments;
+}
+
+static std::uint64_t FragmentsSize(const std::vector<std::string> &fragments) {
+  std::uint64_t size = 0;
+  for (auto &fragment : fragments) {
+    size += fragment.size();
+  }
+  return size;
+}
+
+// Build the whole body, then the response with a Content-Length
+static Benchmark SerializeBufferedBenchmark(std::size_t count) {
+  auto fragments = CompletionFragments(count);
+  return {"SerializeBuffered/" + std::to_string(count),
+          [fragments](BenchmarkState &state) {
+            state.setBytesPerIteration(FragmentsSize(*fragments));
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              std::string body;
+              for (auto &fragment : *fragments) {
+                body.append(fragment);
+              }
+              std::string response = "HTTP/1.1 200 OK\r\n"
+                                     "Content-Type: application/json\r\n"
+                                     "Content-Length: " +
+                                     std::to_string(body.size()) +
+                                     "\r\n\r\n" + body;
+              DoNotOptimize(response);
+            }
+          }};
+}
+
+// Buffer fragments into chunks, the way ChunkedWriter does
+static Benchmark SerializeChunkedBenchmark(std::size_t count) {
+  auto fragments = CompletionFragments(count);
+  return {"SerializeChunked/" + std::to_string(count),
+          [fragments](BenchmarkState &state) {
+            const std::size_t Capacity = 16 * 1024;
+            state.setBytesPerIteration(FragmentsSize(*fragments));
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              std::string wire = "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: application/json\r\n"
+                                 "Transfer-Encoding: chunked\r\n\r\n";
+              std::string buffer;
+              buffer.reserve(Capacity);
+              auto writeChunk = [&](const char *bytes, std::size_t length) {
+                char size[20];
+                snprintf(size, sizeof(size), "%zx\r\n", length);
+                wire.append(size);
+                wire.append(bytes, length);
+                wire.append("\r\n");
+              };
+              ResponseSink sink = [&](const char *bytes, std::size_t length) {
+                if (buffer.size() + length > Capacity) {
+                  writeChunk(buffer.data(), buffer.size());
+                  buffer.clear();
+                }
+                buffer.append(bytes, length);
+              };
+              for (auto &fragment : *fragments) {
+                sink(fragment.data(), fragment.size());
+              }
+              writeChunk(buffer.data(), buffer.size());
+              wire.append("0\r\n\r\n");
+              DoNotOptimize(wire);
+            }
+          }};
+}
+
+// Transcode fragments to CBOR as they stream, for clients that accept it.
+// Bytes are those of the JSON in.
+static Benchmark SerializeCBORBenchmark(std::size_t count) {
+  auto fragments = CompletionFragments(count);
+  return {"SerializeCBOR/" + std::to_string(count),
+          [fragments](BenchmarkState &state) {
+            state.setBytesPerIteration(FragmentsSize(*fragments));
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              std::string cbor;
+              JSONToCBOR encoder([&](const char *bytes, std::size_t length) {
+                cbor.append(bytes, length);
+              });
+              for (auto &fragment : *fragments) {
+                encoder.write(fragment.data(), fragment.size());
+              }
+              encoder.finish();
+              DoNotOptimize(cbor);
+            }
+          }};
+}
+
+// Slim each candidate for a completion menu, as slim responses do with
+// sourcekitd's. Bytes are those of the full candidates.
+static Benchmark SlimCandidatesBenchmark(std::size_t count) {
+  auto candidates = CompletionFragments(count);
+  // Leave out the results array around them
+  auto &first = candidates->front();
+  first.erase(0, first.find("[{") + 1);
+  auto &last = candidates->back();
+  last.erase(last.rfind("}]") + 1);
+  return {"SlimCandidates/" + std::to_string(count),
+          [candidates](BenchmarkState &state) {
+            state.setBytesPerIteration(FragmentsSize(*candidates));
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              for (auto &candidate : *candidates) {
+                auto slim =
+                    SlimCompletionCandidate(candidate.data(), candidate.size());
+                DoNotOptimize(slim);
+              }
+            }
+          }};
+}
+
+// Messages dropped when a ring is full are counted like any other, so this
+// measures the cost to the logging thread, not the writer's throughput.
+static Benchmark LoggerBenchmark(std::string name, LogLevel loggerLevel,
+                                 LogLevel messageLevel) {
+  return {name, [=](BenchmarkState &state) {
+            Logger logger(loggerLevel, "BENCH");
+            DiscardOutput discard;
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              logger.log(messageLevel, "DID_COMPLETE: ", CorpusFileName,
+                         " line ", i);
+            }
+          }};
+}
+
+// Threads register and fulfil futures on one channel, as SourceKit threads
+// waiting on notifications do.
+static Benchmark FutureChannelBenchmark(unsigned threadCount) {
+  return {"FutureChannel/" + std::to_string(threadCount) + "_threads",
+          [=](BenchmarkState &state) {
+            FutureChannel channel;
+            std::vector<std::thread> threads;
+            auto perThread = state.iterations() / threadCount + 1;
+            for (unsigned t = 0; t < threadCount; t++) {
+              threads.emplace_back([&channel, perThread, t] {
+                auto prefix = "/tmp/File" + std::to_string(t) + ".swift:";
+                for (std::uint64_t i = 0; i < perThread; i++) {
+                  auto key = prefix + std::to_string(i);
+                  auto future = channel.future(key);
+                  channel.set(key, "ready");
+                  DoNotOptimize(future.get());
+                }
+              });
+            }
+            for (auto &thread : threads) {
+              thread.join();
+            }
+          }};
+}
+
+#ifdef SSVIM_BENCH_SOURCEKIT
+// Constructing a completer starts a SourceKit session, which needs sourcekitd
+static Benchmark SwiftCompleterConstructionBenchmark() {
+  return {"SwiftCompleter/construct", [](BenchmarkState &state) {
+            for (std::uint64_t i = 0; i < state.iterations(); i++) {
+              SwiftCompleter completer(LogLevelError);
+              DoNotOptimize(completer);
+            }
+          }};
+}
+#endif
+
+static std::vector<Benchmark> AllBenchmarks() {
+  std::vector<Benchmark> benchmarks;
+  for (auto lines : {100, 1000, 10000, 100000}) {
+    benchmarks.push_back(GetOffsetBenchmark(lines));
+    benchmarks.push_back(LineIndexBenchmark(lines));
+    benchmarks.push_back(FindIdentifierBenchmark(lines));
+  }
+  for (auto lines : {100, 1000, 10000}) {
+    benchmarks.push_back(ParseRequestBodyBenchmark(lines));
+  }
+  for (auto count : {100, 1000, 10000}) {
+    benchmarks.push_back(SerializeBufferedBenchmark(count));
+    benchmarks.push_back(SerializeChunkedBenchmark(count));
+    benchmarks.push_back(SerializeCBORBenchmark(count));
+    benchmarks.push_back(SlimCandidatesBenchmark(count));
+  }
+  benchmarks.push_back(
+      LoggerBenchmark("Logger/enabled", LogLevelInfo, LogLevelInfo));
+  benchmarks.push_back(
+      LoggerBenchmark("Logger/filtered", LogLevelError, LogLevelInfo));
+  for (auto threads : {1, 2, 4, 8}) {
+    benchmarks.push_back(FutureChannelBenchmark(threads));
+  }
+#ifdef SSVIM_BENCH_SOURCEKIT
+  benchmarks.push_back(SwiftCompleterConstructionBenchmark());
+#endif
+  return benchmarks;
+}
+
+#pragma mark - Main
+
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Print help")(
+      "filter", po::value<std::string>()->default_value(""),
+      "Only run benchmarks whose name contains this")(
+      "min-time-ms", po::value<unsigned>()->default_value(200),
+      "Minimum time for each run")(
+      "repetitions", po::value<unsigned>()->default_value(5),
+      "Runs of each benchmark")("json", po::value<std::string>(),
+                                "Write results as JSON to this path")(
+      "list", "List benchmarks and exit")(
+      "corpus", po::value<std::size_t>(),
+      "Print a synthetic Swift file of this many lines and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+  if (vm.count("corpus")) {
+    std::cout << GenerateSwiftCorpus(vm["corpus"].as<std::size_t>()).contents;
+    return 0;
+  }
+
+  auto filter = vm["filter"].as<std::string>();
+  HarnessOptions options;
+  options.minTime =
+      std::chrono::milliseconds(vm["min-time-ms"].as<unsigned>());
+  options.repetitions = std::max(1u, vm["repetitions"].as<unsigned>());
+
+  std::vector<BenchmarkResult> results;
+  if (!vm.count("list")) {
+    std::cout << std::left << std::setw(40) << "benchmark" << std::right
+              << std::setw(12) << "iterations" << std::setw(14) << "median ns"
+              << std::setw(14) << "min ns" << std::setw(12) << "MB/s"
+              << std::endl;
+  }
+  for (auto &benchmark : AllBenchmarks()) {
+    if (benchmark.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    if (vm.count("list")) {
+      std::cout << benchmark.name << std::endl;
+      continue;
+    }
+    results.push_back(RunBenchmark(benchmark, options));
+    PrintResult(results.back());
+  }
+
+  if (vm.count("json")) {
+    std::ofstream file(vm["json"].as<std::string>());
+    WriteJSONResults(results, file);
+  }
+  return 0;
+}
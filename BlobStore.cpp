@@ -0,0 +1,79 @@
+#import "BlobStore.hpp"
+#import "HMAC.hpp"
+#import "JSON.hpp"
+#import "MemoryBudget.hpp"
+
+#import <algorithm>
+#import <cctype>
+
+using namespace ssvim;
+
+static const auto BlobsCache = "blobs";
+
+// Hex digits are accepted in either case
+static std::string NormalizedHash(std::string hash) {
+  std::transform(hash.begin(), hash.end(), hash.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return hash;
+}
+
+BlobStore &BlobStore::Shared() {
+  static BlobStore *store = new BlobStore();
+  return *store;
+}
+
+std::string BlobStore::Hash(const std::string &contents) {
+  SHA256 hash;
+  hash.update(contents.data(), contents.size());
+  return HexEncode(hash.digest());
+}
+
+bool BlobStore::put(const std::string &hash, std::string contents) {
+  auto normalized = NormalizedHash(hash);
+  if (Hash(contents) != normalized) {
+    return false;
+  }
+  auto bytes = contents.size();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _blobs[normalized] = {
+        std::make_shared<const std::string>(std::move(contents)), 0};
+  }
+  use(normalized, bytes);
+  return true;
+}
+
+std::shared_ptr<const std::string> BlobStore::get(const std::string &hash) {
+  auto normalized = NormalizedHash(hash);
+  std::shared_ptr<const std::string> blob;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _blobs.find(normalized);
+    if (found == _blobs.end()) {
+      return nullptr;
+    }
+    blob = found->second.contents;
+  }
+  use(normalized, blob->size());
+  return blob;
+}
+
+// The budget calls back without its lock held, so this must not hold ours
+void BlobStore::use(const std::string &hash, std::size_t bytes) {
+  std::uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _blobs.find(hash);
+    if (found == _blobs.end()) {
+      return;
+    }
+    generation = found->second.generation = MemoryBudget::NextGeneration();
+  }
+  MemoryBudget::Shared().use(BlobsCache, hash, bytes, [this, hash, generation] {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _blobs.find(hash);
+    if (found != _blobs.end() && found->second.generation == generation) {
+      _blobs.erase(found);
+    }
+  });
+}
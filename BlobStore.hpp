@@ -0,0 +1,44 @@
+#import <cstdint>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <unordered_map>
+
+namespace ssvim {
+
+/**
+ * BlobStore keeps uploaded buffers by the SHA-256 of their contents.
+ *
+ * An editor uploads each version of a dirty buffer once, and requests refer
+ * to it by hash from then on, rather than sending every buffer every time.
+ * Blobs are accounted against the memory budget, so ones that go unused are
+ * evicted. Requests that refer to a blob the store doesn't have are answered
+ * with the missing hashes, and the editor uploads them again.
+ */
+class BlobStore {
+  struct Blob {
+    std::shared_ptr<const std::string> contents;
+    // Of its memory budget entry
+    std::uint64_t generation;
+  };
+
+  std::mutex _mutex;
+  std::unordered_map<std::string, Blob> _blobs;
+
+public:
+  static BlobStore &Shared();
+
+  // The SHA-256 of contents, as lowercase hex
+  static std::string Hash(const std::string &contents);
+
+  // Keep contents under hash. Returns false, keeping nothing, when hash isn't
+  // the hash of contents.
+  bool put(const std::string &hash, std::string contents);
+
+  // The blob with hash, or nullptr when the store doesn't have it
+  std::shared_ptr<const std::string> get(const std::string &hash);
+
+private:
+  void use(const std::string &hash, std::size_t bytes);
+};
+} // namespace ssvim
@@ -0,0 +1,402 @@
+#import "CBOR.hpp"
+
+#import <cerrno>
+#import <cstdlib>
+#import <cstring>
+
+using namespace ssvim;
+
+// CBOR major types
+static const unsigned char MajorUnsigned = 0;
+static const unsigned char MajorNegative = 1;
+static const unsigned char MajorText = 3;
+static const unsigned char MajorTag = 6;
+
+static const char BeginMap = '\xbf';
+static const char BeginArray = '\x9f';
+static const char Break = '\xff';
+static const char Float64 = '\xfb';
+
+static const std::uint64_t TagStringRefNamespace = 256;
+static const std::uint64_t TagStringRef = 25;
+
+// A string goes in the table only when a reference to it would be shorter
+// than the string, which depends on the index it would get
+static std::size_t MinimumReferencedLength(std::uint64_t index) {
+  if (index < 24) {
+    return 3;
+  } else if (index < 256) {
+    return 4;
+  } else if (index < 65536) {
+    return 5;
+  } else if (index < 4294967296ull) {
+    return 7;
+  }
+  return 11;
+}
+
+static bool ParseHex(const char *hex, unsigned *value) {
+  *value = 0;
+  for (auto i = 0; i < 4; i++) {
+    auto c = hex[i];
+    *value <<= 4;
+    if (c >= '0' && c <= '9') {
+      *value |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      *value |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      *value |= c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void AppendUTF8(std::string &out, unsigned codePoint) {
+  if (codePoint < 0x80) {
+    out += static_cast<char>(codePoint);
+  } else if (codePoint < 0x800) {
+    out += static_cast<char>(0xc0 | (codePoint >> 6));
+    out += static_cast<char>(0x80 | (codePoint & 0x3f));
+  } else if (codePoint < 0x10000) {
+    out += static_cast<char>(0xe0 | (codePoint >> 12));
+    out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (codePoint & 0x3f));
+  } else {
+    out += static_cast<char>(0xf0 | (codePoint >> 18));
+    out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (codePoint & 0x3f));
+  }
+}
+
+// Decode the escapes of a JSON string's contents
+static bool UnescapeJSON(const char *begin, const char *end, std::string *out) {
+  out->reserve(end - begin);
+  for (auto c = begin; c < end; c++) {
+    if (*c != '\\') {
+      *out += *c;
+      continue;
+    }
+    // The closing quote follows any escape, so c + 1 is in bounds
+    switch (*++c) {
+    case 'b':
+      *out += '\b';
+      break;
+    case 'f':
+      *out += '\f';
+      break;
+    case 'n':
+      *out += '\n';
+      break;
+    case 'r':
+      *out += '\r';
+      break;
+    case 't':
+      *out += '\t';
+      break;
+    case 'u': {
+      unsigned codePoint;
+      if (end - c < 5 || !ParseHex(c + 1, &codePoint)) {
+        return false;
+      }
+      c += 4;
+      // Characters past the BMP are escaped as a surrogate pair
+      unsigned low;
+      if (codePoint >= 0xd800 && codePoint < 0xdc00 && end - c >= 7 &&
+          c[1] == '\\' && c[2] == 'u' && ParseHex(c + 3, &low) &&
+          low >= 0xdc00 && low < 0xe000) {
+        codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+        c += 6;
+      }
+      AppendUTF8(*out, codePoint);
+      break;
+    }
+    default:
+      // \", \\ and \/
+      *out += *c;
+    }
+  }
+  return true;
+}
+
+JSONToCBOR::JSONToCBOR(Sink sink) : _sink(std::move(sink)) {
+  _table.resize(1024);
+  head(MajorTag, TagStringRefNamespace);
+}
+
+void JSONToCBOR::write(const char *bytes, std::size_t length) {
+  // Most pieces end between tokens, and are transcoded where they are
+  if (_pending.empty()) {
+    auto transcoded = transcode(bytes, length, false);
+    _pending.assign(bytes + transcoded, length - transcoded);
+  } else {
+    _pending.append(bytes, length);
+    auto transcoded = transcode(_pending.data(), _pending.size(), false);
+    _pending.erase(0, transcoded);
+  }
+  flush();
+}
+
+bool JSONToCBOR::finish() {
+  auto transcoded = transcode(_pending.data(), _pending.size(), true);
+  _pending.erase(0, transcoded);
+  flush();
+  return !_failed && _pending.empty() && !_depth;
+}
+
+std::string JSONToCBOR::Encode(const std::string &json) {
+  std::string cbor;
+  JSONToCBOR encoder([&](const char *bytes, std::size_t length) {
+    cbor.append(bytes, length);
+  });
+  encoder.write(json.data(), json.size());
+  encoder.finish();
+  return cbor;
+}
+
+#pragma mark - Private
+
+std::size_t JSONToCBOR::transcode(const char *json, std::size_t length,
+                                  bool final) {
+  std::size_t position = 0;
+  while (!_failed && position < length) {
+    std::size_t end = position + 1;
+    switch (json[position]) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+    case ',':
+    case ':':
+      break;
+    case '{':
+      _out += BeginMap;
+      _depth++;
+      break;
+    case '[':
+      _out += BeginArray;
+      _depth++;
+      break;
+    case '}':
+    case ']':
+      if (!_depth) {
+        _failed = true;
+        return position;
+      }
+      _out += Break;
+      _depth--;
+      break;
+    case '"':
+      end = string(json, length, position);
+      break;
+    case 't':
+      end = literal(json, length, position, "true", 0xf5);
+      break;
+    case 'f':
+      end = literal(json, length, position, "false", 0xf4);
+      break;
+    case 'n':
+      end = literal(json, length, position, "null", 0xf6);
+      break;
+    default:
+      end = number(json, length, position, final);
+    }
+    if (!end) {
+      break;
+    }
+    position = end;
+  }
+  return position;
+}
+
+std::size_t JSONToCBOR::string(const char *json, std::size_t length,
+                               std::size_t begin) {
+  // memchr finds the closing quote, and escapes before it, a word at a time
+  auto end = json + length;
+  auto contents = json + begin + 1;
+  auto c = contents;
+  auto escaped = false;
+  const char *close;
+  for (;;) {
+    close = static_cast<const char *>(memchr(c, '"', end - c));
+    if (!close) {
+      return 0;
+    }
+    auto backslash =
+        static_cast<const char *>(memchr(c, '\\', close - c));
+    if (!backslash) {
+      break;
+    }
+    // Skip the escaped character, which may be the quote
+    escaped = true;
+    c = backslash + 2;
+    if (c > end) {
+      return 0;
+    }
+  }
+  if (!escaped) {
+    text(contents, close - contents);
+    return close - json + 1;
+  }
+  std::string value;
+  if (!UnescapeJSON(contents, close, &value)) {
+    _failed = true;
+    return 0;
+  }
+  text(value.data(), value.size());
+  return close - json + 1;
+}
+
+std::size_t JSONToCBOR::number(const char *json, std::size_t length,
+                               std::size_t begin, bool final) {
+  auto end = begin;
+  auto integral = true;
+  while (end < length && strchr("0123456789+-.eE", json[end]) &&
+         json[end] != '\0') {
+    if (json[end] == '.' || json[end] == 'e' || json[end] == 'E') {
+      integral = false;
+    }
+    end++;
+  }
+  // It may go on in the next piece
+  if (end == length && !final) {
+    return 0;
+  }
+  std::string token(json + begin, end - begin);
+  char *parsed = nullptr;
+  errno = 0;
+  if (integral && token[0] == '-') {
+    auto value = strtoll(token.c_str(), &parsed, 10);
+    if (!errno && *parsed == '\0' && value < 0) {
+      head(MajorNegative, static_cast<std::uint64_t>(-(value + 1)));
+      return end;
+    }
+  } else if (integral) {
+    auto value = strtoull(token.c_str(), &parsed, 10);
+    if (!errno && *parsed == '\0') {
+      head(MajorUnsigned, value);
+      return end;
+    }
+  }
+  // Fractions, and integers out of range, are doubles as in JSON
+  errno = 0;
+  auto value = strtod(token.c_str(), &parsed);
+  if (token.empty() || *parsed != '\0') {
+    _failed = true;
+    return 0;
+  }
+  std::uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  _out += Float64;
+  for (auto shift = 56; shift >= 0; shift -= 8) {
+    _out += static_cast<char>(bits >> shift);
+  }
+  return end;
+}
+
+std::size_t JSONToCBOR::literal(const char *json, std::size_t length,
+                                std::size_t begin, const char *word,
+                                unsigned char simple) {
+  auto wordLength = strlen(word);
+  if (length - begin < wordLength) {
+    // A prefix of the word may be completed by the next piece
+    if (strncmp(json + begin, word, length - begin) != 0) {
+      _failed = true;
+    }
+    return 0;
+  }
+  if (strncmp(json + begin, word, wordLength) != 0) {
+    _failed = true;
+    return 0;
+  }
+  _out += static_cast<char>(simple);
+  return begin + wordLength;
+}
+
+void JSONToCBOR::head(unsigned char major, std::uint64_t value) {
+  auto type = static_cast<unsigned char>(major << 5);
+  if (value < 24) {
+    _out += static_cast<char>(type | value);
+    return;
+  }
+  int bytes;
+  if (value <= 0xff) {
+    _out += static_cast<char>(type | 24);
+    bytes = 1;
+  } else if (value <= 0xffff) {
+    _out += static_cast<char>(type | 25);
+    bytes = 2;
+  } else if (value <= 0xffffffff) {
+    _out += static_cast<char>(type | 26);
+    bytes = 4;
+  } else {
+    _out += static_cast<char>(type | 27);
+    bytes = 8;
+  }
+  for (auto shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+    _out += static_cast<char>(value >> shift);
+  }
+}
+
+// A string seen before is a reference to its index in the table
+void JSONToCBOR::text(const char *value, std::size_t length) {
+  // Too short to be in the table
+  if (length < 3) {
+    head(MajorText, length);
+    _out.append(value, length);
+    return;
+  }
+  auto hash = static_cast<std::uint32_t>(
+      std::hash<std::string_view>()(std::string_view(value, length)));
+  auto mask = _table.size() - 1;
+  auto slot = hash & mask;
+  while (_table[slot].index) {
+    auto &entry = _table[slot];
+    if (entry.hash == hash) {
+      auto &string = _strings[entry.index - 1];
+      if (string.length == length &&
+          memcmp(_tableBytes.data() + string.offset, value, length) == 0) {
+        head(MajorTag, TagStringRef);
+        head(MajorUnsigned, entry.index - 1);
+        return;
+      }
+    }
+    slot = (slot + 1) & mask;
+  }
+  if (length >= MinimumReferencedLength(_strings.size())) {
+    _strings.push_back({_tableBytes.size(), length});
+    _table[slot] = {hash, static_cast<std::uint32_t>(_strings.size())};
+    _tableBytes.append(value, length);
+    if (_strings.size() * 2 > _table.size()) {
+      growTable();
+    }
+  }
+  head(MajorText, length);
+  _out.append(value, length);
+}
+
+void JSONToCBOR::growTable() {
+  std::vector<TableSlot> table(_table.size() * 2);
+  auto mask = table.size() - 1;
+  for (auto &entry : _table) {
+    if (!entry.index) {
+      continue;
+    }
+    auto slot = entry.hash & mask;
+    while (table[slot].index) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = entry;
+  }
+  _table.swap(table);
+}
+
+void JSONToCBOR::flush() {
+  if (_out.empty()) {
+    return;
+  }
+  _sink(_out.data(), _out.size());
+  _out.clear();
+}
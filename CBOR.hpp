@@ -0,0 +1,74 @@
+#import <cstddef>
+#import <cstdint>
+#import <functional>
+#import <string>
+#import <string_view>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * JSONToCBOR transcodes a JSON document into CBOR as it's written.
+ *
+ * Responses repeat the same keys and UIDs thousands of times, so strings
+ * share a table, as in the CBOR stringref extension: the document is tagged
+ * as a stringref namespace (tag 256), and a string that was seen before is
+ * written as a reference to it (tag 25) rather than again. Maps and arrays
+ * have indefinite lengths, so nothing waits for their end, and the JSON may
+ * come in pieces split anywhere, even within a token.
+ */
+class JSONToCBOR {
+public:
+  using Sink = std::function<void(const char *bytes, std::size_t length)>;
+
+  JSONToCBOR(Sink sink);
+
+  void write(const char *bytes, std::size_t length);
+
+  // Write out what's left. Returns false when the JSON was malformed, in
+  // which case the CBOR stops at the error.
+  bool finish();
+
+  // Transcode a whole document
+  static std::string Encode(const std::string &json);
+
+private:
+  Sink _sink;
+  // JSON not transcoded yet, since it ends within a token
+  std::string _pending;
+  std::string _out;
+  // The string table is open addressed, over one buffer of its strings,
+  // since looking strings up is most of the work. Slots are small, so the
+  // table stays in cache as it grows.
+  struct TableString {
+    std::size_t offset;
+    std::size_t length;
+  };
+  struct TableSlot {
+    std::uint32_t hash;
+    // 0 for an empty slot, otherwise the string's index plus one
+    std::uint32_t index;
+  };
+  std::string _tableBytes;
+  std::vector<TableString> _strings;
+  std::vector<TableSlot> _table;
+  // Maps and arrays not closed yet
+  std::size_t _depth = 0;
+  bool _failed = false;
+
+  // Returns the length transcoded, up to the start of an incomplete token
+  std::size_t transcode(const char *json, std::size_t length, bool final);
+  // These return the end of the token at begin, or 0 when it isn't all there
+  // or it's malformed
+  std::size_t string(const char *json, std::size_t length, std::size_t begin);
+  std::size_t number(const char *json, std::size_t length, std::size_t begin,
+                     bool final);
+  std::size_t literal(const char *json, std::size_t length,
+                      std::size_t begin, const char *word,
+                      unsigned char simple);
+  void head(unsigned char major, std::uint64_t value);
+  void text(const char *value, std::size_t length);
+  void growTable();
+  void flush();
+};
+} // namespace ssvim
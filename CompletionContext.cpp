@@ -0,0 +1,140 @@
+#import "CompletionContext.hpp"
+#import "Tracing.hpp"
+
+#import <algorithm>
+#import <assert.h>
+#import <cctype>
+#import <set>
+#import <sstream>
+
+using namespace ssvim;
+
+const std::string &ssvim::GetOffset(CompletionContext &ctx,
+                                    unsigned *offset) {
+  TraceSpan span("GetOffset");
+  auto unsavedFile = std::find_if(
+      ctx.unsavedFiles.begin(), ctx.unsavedFiles.end(),
+      [&](const UnsavedFile &file) {
+        return file.fileName == ctx.sourceFilename;
+      });
+  assert(unsavedFile != ctx.unsavedFiles.end() && "Missing unsaved file");
+  auto &contents = unsavedFile->contents();
+  if (!ctx.lineIndex) {
+    ctx.lineIndex = LineIndex::ForDocument(ctx.sourceFilename,
+                                           unsavedFile->version(), contents);
+  }
+
+  auto &index = *ctx.lineIndex;
+  auto start = index.lineStart(ctx.line);
+  auto end = index.lineEnd(ctx.line);
+  auto column = index.offset(contents, ctx.line, ctx.column,
+                             ctx.columnEncoding) - start;
+  // Enumerate from the column to an interesting point
+  for (auto i = column;; i--) {
+    auto someChar = start + i < end ? contents[start + i] : '\0';
+    if (someChar == ' ' || someChar == '.') {
+      *offset = static_cast<unsigned>(start + i + 1);
+      break;
+    }
+    if (i == 0) {
+      *offset = static_cast<unsigned>(start);
+      break;
+    }
+  }
+  return contents;
+}
+
+// Keywords that an expression follows
+static const std::set<std::string> ExpressionKeywords = {
+    "return", "in", "case", "if", "guard", "while", "throw", "try", "await",
+    "repeat", "else", "where", "is", "as",
+};
+
+static bool IsIdentifierCharacter(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_' ||
+         static_cast<unsigned char>(c) >= 0x80;
+}
+
+bool ssvim::IsGlobalCompletion(const std::string &text, std::size_t offset) {
+  offset = std::min(offset, text.size());
+  if (offset == 0) {
+    return true;
+  }
+  if (text[offset - 1] == '.') {
+    return false;
+  }
+  auto end = offset;
+  while (end > 0 && (text[end - 1] == ' ' || text[end - 1] == '\t')) {
+    end--;
+  }
+  if (end == 0 || text[end - 1] == '\n') {
+    // The start of a line
+    return true;
+  }
+  auto last = text[end - 1];
+  if (!IsIdentifierCharacter(last)) {
+    // After punctuation or an operator, except a closing bracket, which ends
+    // an expression
+    return last != ')' && last != ']' && last != '}' && last != '"';
+  }
+  auto start = end - 1;
+  while (start > 0 && IsIdentifierCharacter(text[start - 1])) {
+    start--;
+  }
+  return ExpressionKeywords.count(text.substr(start, end - start)) > 0;
+}
+
+std::vector<std::string> ssvim::ImportedModules(const std::string &contents) {
+  // Attributes and kinds that may come with an import
+  static const std::set<std::string> Modifiers = {
+      "@testable", "@_exported", "@_implementationOnly", "typealias",
+      "struct",    "class",      "enum",                 "protocol",
+      "let",       "var",        "func",
+  };
+  std::set<std::string> modules;
+  std::istringstream lines(contents);
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word && word != "import" && Modifiers.count(word)) {
+    }
+    if (word != "import") {
+      continue;
+    }
+    while (words >> word && Modifiers.count(word)) {
+    }
+    auto module = word.substr(0, word.find_first_of(".;"));
+    if (module.size() && module != "import") {
+      modules.insert(module);
+    }
+  }
+  return std::vector<std::string>(modules.begin(), modules.end());
+}
+
+std::vector<std::string>
+ssvim::NormalizedCompletionFlags(const std::vector<std::string> &flags) {
+  // Flags followed by a path that's particular to one file
+  static const std::set<std::string> PerFileFlags = {
+      "-primary-file",
+      "-o",
+      "-index-store-path",
+      "-emit-dependencies-path",
+      "-emit-reference-dependencies-path",
+      "-serialize-diagnostics-path",
+  };
+  std::vector<std::string> normalized;
+  for (std::size_t i = 0; i < flags.size(); i++) {
+    auto &flag = flags[i];
+    if (PerFileFlags.count(flag)) {
+      i++;
+      continue;
+    }
+    auto isSource = flag.size() > 6 &&
+                    flag.compare(flag.size() - 6, 6, ".swift") == 0;
+    if (!isSource) {
+      normalized.push_back(flag);
+    }
+  }
+  return normalized;
+}
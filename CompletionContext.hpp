@@ -0,0 +1,72 @@
+#import "LineIndex.hpp"
+#import "SwiftCompleter.hpp"
+#import <memory>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+// Context for a given completion
+struct CompletionContext {
+  // The current source source file's absolute path
+  std::string sourceFilename;
+
+  // Position of the completion
+  unsigned line;
+  unsigned column;
+  ColumnEncoding columnEncoding = ColumnEncodingUTF8;
+
+  // The source file's line index, once GetOffset needs it
+  std::shared_ptr<const LineIndex> lineIndex;
+
+  std::vector<std::string> flags;
+
+  // Unsaved files
+  std::vector<UnsavedFile> unsavedFiles;
+
+  // Work stops once the request is abandoned
+  RequestDeadline deadline;
+
+  // Modules left out of completion results, because the global completion
+  // cache already has their declarations
+  std::vector<std::string> hiddenModules;
+
+  // Return the args based on the current flags
+  // and default to the OSX SDK if none.
+  std::vector<std::string> compilerArgs() const {
+    if (flags.size() == 0) {
+      return DefaultOSXArgs();
+    }
+
+    return flags;
+  }
+
+  std::vector<std::string> DefaultOSXArgs() const {
+    return {
+        "-sdk",
+        "/Applications/Xcode.app/Contents/Developer/Platforms/"
+        "MacOSX.platform/Developer/SDKs/MacOSX.sdk",
+        "-target", "x86_64-apple-macosx10.12",
+    };
+  }
+};
+
+// Get the source file's contents and the offset for completion.
+//
+// The offset backs up from the column to just past the first interesting
+// character, a space or a dot, so it's at the start of the partial word.
+const std::string &GetOffset(CompletionContext &ctx, unsigned *offset);
+
+// Whether the completion at offset in text is unqualified, like the start of
+// a statement or an argument. Those offer every imported module's
+// declarations, rather than a type's members.
+bool IsGlobalCompletion(const std::string &text, std::size_t offset);
+
+// The modules a file imports, sorted
+std::vector<std::string> ImportedModules(const std::string &contents);
+
+// Flags without the inputs and outputs that differ from file to file in the
+// same module, like the primary file
+std::vector<std::string>
+NormalizedCompletionFlags(const std::vector<std::string> &flags);
+} // namespace ssvim
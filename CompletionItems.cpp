@@ -0,0 +1,233 @@
+#import "CompletionItems.hpp"
+#import "MemoryBudget.hpp"
+
+#import <algorithm>
+#import <cstdio>
+#import <cstring>
+#import <random>
+#import <string_view>
+
+using namespace ssvim;
+
+static const auto SessionsCache = "completion_items";
+
+// Editors resolve items of the menu they're showing, so a few sessions cover
+// every window
+static const std::size_t SessionLimit = 16;
+
+// Members left out of slim candidates, which /completions/resolve returns
+static const std::string_view DetailKeys[] = {
+    "key.doc.brief", "key.typename", "key.associated_usrs", "key.modulename"};
+
+static const char *SkipSpace(const char *c, const char *end) {
+  while (c < end && (*c == ' ' || *c == '\n' || *c == '\r' || *c == '\t')) {
+    c++;
+  }
+  return c;
+}
+
+// The end of the JSON string at c, past its closing quote, or nullptr
+static const char *StringEnd(const char *c, const char *end) {
+  for (c++; c < end; c++) {
+    c = static_cast<const char *>(memchr(c, '"', end - c));
+    if (!c) {
+      return nullptr;
+    }
+    // The quote is escaped after an odd number of backslashes
+    auto backslash = c;
+    while (backslash[-1] == '\\') {
+      backslash--;
+    }
+    if ((c - backslash) % 2 == 0) {
+      return c + 1;
+    }
+  }
+  return nullptr;
+}
+
+// The end of the JSON value at c, or nullptr
+static const char *ValueEnd(const char *c, const char *end) {
+  if (c == end) {
+    return nullptr;
+  }
+  if (*c == '"') {
+    return StringEnd(c, end);
+  }
+  if (*c == '{' || *c == '[') {
+    std::size_t depth = 0;
+    while (c < end) {
+      if (*c == '"') {
+        c = StringEnd(c, end);
+        if (!c) {
+          return nullptr;
+        }
+        continue;
+      }
+      if (*c == '{' || *c == '[') {
+        depth++;
+      } else if ((*c == '}' || *c == ']') && --depth == 0) {
+        return c + 1;
+      }
+      c++;
+    }
+    return nullptr;
+  }
+  // Numbers and literals
+  while (c < end && !strchr(",}] \n\r\t", *c)) {
+    c++;
+  }
+  return c;
+}
+
+// Call member with the key, as it's quoted, and the JSON of the value of
+// each member of an object. Returns false when it isn't an object.
+template <class Member>
+static bool ForEachMember(const char *json, std::size_t length,
+                          Member member) {
+  auto end = json + length;
+  auto c = SkipSpace(json, end);
+  if (c == end || *c != '{') {
+    return false;
+  }
+  c = SkipSpace(c + 1, end);
+  if (c < end && *c == '}') {
+    return true;
+  }
+  while (c < end && *c == '"') {
+    auto keyEnd = StringEnd(c, end);
+    if (!keyEnd) {
+      return false;
+    }
+    auto colon = SkipSpace(keyEnd, end);
+    if (colon == end || *colon != ':') {
+      return false;
+    }
+    auto value = SkipSpace(colon + 1, end);
+    auto valueEnd = ValueEnd(value, end);
+    if (!valueEnd || valueEnd == value) {
+      return false;
+    }
+    member(std::string_view(c + 1, keyEnd - c - 2),
+           std::string_view(value, valueEnd - value));
+    c = SkipSpace(valueEnd, end);
+    if (c < end && *c == '}') {
+      return true;
+    }
+    if (c == end || *c != ',') {
+      return false;
+    }
+    c = SkipSpace(c + 1, end);
+  }
+  return false;
+}
+
+std::string ssvim::SlimCompletionCandidate(const char *json,
+                                           std::size_t length) {
+  std::string slim = "{";
+  slim.reserve(length);
+  auto isObject =
+      ForEachMember(json, length, [&](std::string_view key,
+                                      std::string_view value) {
+        if (std::find(std::begin(DetailKeys), std::end(DetailKeys), key) !=
+            std::end(DetailKeys)) {
+          return;
+        }
+        if (slim.size() > 1) {
+          slim += ',';
+        }
+        slim += '"';
+        slim.append(key.data(), key.size());
+        slim += "\":";
+        slim.append(value.data(), value.size());
+      });
+  if (!isObject) {
+    return std::string(json, length);
+  }
+  slim += '}';
+  return slim;
+}
+
+bool ssvim::CompletionCandidateMember(const std::string &json,
+                                      const std::string &key,
+                                      std::string *value) {
+  auto found = false;
+  ForEachMember(json.data(), json.size(),
+                [&](std::string_view memberKey, std::string_view memberValue) {
+                  if (!found && memberKey == key) {
+                    value->assign(memberValue.data(), memberValue.size());
+                    found = true;
+                  }
+                });
+  return found;
+}
+
+const std::string *CompletionSession::candidate(std::size_t item) const {
+  if (item < candidates.size()) {
+    return &candidates[item];
+  }
+  item -= candidates.size();
+  if (shared && item < shared->size()) {
+    return &(*shared)[item];
+  }
+  return nullptr;
+}
+
+CompletionSessions &CompletionSessions::Shared() {
+  static CompletionSessions *sessions = new CompletionSessions();
+  return *sessions;
+}
+
+// IDs start with a random prefix, so a client holding one from before a
+// restart doesn't resolve another session's item
+CompletionSessions::CompletionSessions() {
+  std::random_device random;
+  char prefix[17];
+  snprintf(prefix, sizeof(prefix), "%08x%08x", random(), random());
+  _prefix = prefix;
+}
+
+std::string CompletionSessions::nextID() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _prefix + "-" + std::to_string(++_sequence);
+}
+
+void CompletionSessions::insert(
+    std::shared_ptr<const CompletionSession> session) {
+  std::vector<std::string> dropped;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sessions[session->id] = session;
+    _order.push_back(session->id);
+    while (_order.size() > SessionLimit) {
+      dropped.push_back(_order.front());
+      _sessions.erase(_order.front());
+      _order.pop_front();
+    }
+  }
+  // The budget calls back without its lock held, so this must not hold ours
+  // either
+  auto &budget = MemoryBudget::Shared();
+  for (auto &id : dropped) {
+    budget.remove(SessionsCache, id);
+  }
+  auto id = session->id;
+  budget.use(SessionsCache, id, session->bytes, [this, id] { erase(id); });
+}
+
+std::shared_ptr<const CompletionSession>
+CompletionSessions::find(const std::string &id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _sessions.find(id);
+  if (found == _sessions.end()) {
+    return nullptr;
+  }
+  return found->second;
+}
+
+#pragma mark - Private
+
+void CompletionSessions::erase(const std::string &id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _sessions.erase(id);
+  _order.erase(std::remove(_order.begin(), _order.end(), id), _order.end());
+}
@@ -0,0 +1,72 @@
+#import <cstddef>
+#import <cstdint>
+#import <deque>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+// A candidate as a completion menu needs it: without its documentation,
+// type, USRs and module, which only matter once it's selected. The JSON is
+// returned as it is when it isn't an object.
+std::string SlimCompletionCandidate(const char *json, std::size_t length);
+
+// The JSON of a top level member of a candidate, if it has one
+bool CompletionCandidateMember(const std::string &json, const std::string &key,
+                               std::string *value);
+
+/**
+ * The candidates of a slim completion response, kept for resolving.
+ *
+ * Items are numbered in the order of the response: sourcekitd's candidates,
+ * then those shared from a cached set of global completions.
+ */
+struct CompletionSession {
+  std::string id;
+  // What sourcekitd needs to look up an item's declaration
+  std::string fileName;
+  std::vector<std::string> flags;
+  // Each candidate's JSON, as sourcekitd describes it
+  std::vector<std::string> candidates;
+  std::shared_ptr<const std::vector<std::string>> shared;
+  std::uint64_t bytes = 0;
+
+  // The JSON of an item, or nullptr when there's no such item
+  const std::string *candidate(std::size_t item) const;
+};
+
+/**
+ * CompletionSessions keeps the candidates of recent slim completion
+ * responses.
+ *
+ * Editors show the details of one item at a time, so responses leave them
+ * out, and /completions/resolve finds the item here rather than asking
+ * sourcekitd for the completions again. Only the most recent sessions are
+ * kept, and they count against the memory budget.
+ */
+class CompletionSessions {
+  std::mutex _mutex;
+  std::map<std::string, std::shared_ptr<const CompletionSession>> _sessions;
+  // Oldest first
+  std::deque<std::string> _order;
+  std::string _prefix;
+  std::uint64_t _sequence = 0;
+
+public:
+  static CompletionSessions &Shared();
+
+  // An ID no other session had, in this run or an earlier one
+  std::string nextID();
+
+  void insert(std::shared_ptr<const CompletionSession> session);
+
+  std::shared_ptr<const CompletionSession> find(const std::string &id);
+
+private:
+  CompletionSessions();
+  void erase(const std::string &id);
+};
+} // namespace ssvim
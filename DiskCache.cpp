@@ -0,0 +1,248 @@
+#import "DiskCache.hpp"
+#import "Executor.hpp"
+#import "HMAC.hpp"
+#import "JSON.hpp"
+#import "Metrics.hpp"
+
+#import <algorithm>
+#import <cerrno>
+#import <cstring>
+#import <dirent.h>
+#import <fcntl.h>
+#import <map>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <vector>
+
+using namespace ssvim;
+
+// Bump when the layout of entries changes. Older entries are then misses,
+// and age out of the directory.
+static const std::uint32_t EntryFormat = 1;
+static const char EntryMagic[8] = {'s', 's', 'v', 'i', 'm', 'd', 'c', '\0'};
+
+// Every entry starts with a header, followed by the key and the value
+struct EntryHeader {
+  char magic[8];
+  std::uint32_t format;
+  std::uint32_t reserved;
+  std::uint64_t keyLength;
+  std::uint64_t valueLength;
+};
+
+DiskCache &DiskCache::Shared() {
+  static DiskCache *cache = new DiskCache();
+  return *cache;
+}
+
+DiskCache::DiskCache() : _logger(LogLevelError, "DISK") {
+}
+
+bool DiskCache::enable(const std::string &directory, std::uint64_t limit) {
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    _logger.log(LogLevelError, "Can't create the cache directory ",
+                directory, ": ", strerror(errno));
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _directory = directory;
+    _limit = limit;
+  }
+  _enabled.store(true);
+  // Whatever an earlier run left over the limit goes, without holding up
+  // startup
+  Executor::Shared().async(LaneWorker, [this] { trim(); });
+  return true;
+}
+
+bool DiskCache::enabled() const {
+  return _enabled.load(std::memory_order_relaxed);
+}
+
+bool DiskCache::get(const std::string &kind, const std::string &key,
+                    std::string *value) {
+  if (!enabled()) {
+    return false;
+  }
+  auto entryPath = path(kind, key);
+  auto fd = open(entryPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    counter(kind, "miss").increment();
+    return false;
+  }
+  struct stat info;
+  auto found = false;
+  if (fstat(fd, &info) == 0 &&
+      static_cast<std::size_t>(info.st_size) >= sizeof(EntryHeader)) {
+    auto size = static_cast<std::size_t>(info.st_size);
+    auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      auto bytes = static_cast<const char *>(mapped);
+      EntryHeader header;
+      memcpy(&header, bytes, sizeof(header));
+      auto keyBytes = bytes + sizeof(header);
+      found = memcmp(header.magic, EntryMagic, sizeof(EntryMagic)) == 0 &&
+              header.format == EntryFormat && header.keyLength == key.size() &&
+              sizeof(header) + header.keyLength + header.valueLength == size &&
+              memcmp(keyBytes, key.data(), key.size()) == 0;
+      if (found) {
+        value->assign(keyBytes + header.keyLength, header.valueLength);
+      }
+      munmap(mapped, size);
+    }
+  }
+  if (found) {
+    // The modification time orders entries for trimming
+    futimens(fd, nullptr);
+  }
+  close(fd);
+  counter(kind, found ? "hit" : "miss").increment();
+  return found;
+}
+
+void DiskCache::put(const std::string &kind, const std::string &key,
+                    std::string value) {
+  if (!enabled()) {
+    return;
+  }
+  auto entryPath = path(kind, key);
+  Executor::Shared().async(
+      LaneWorker, [this, entryPath, key, value = std::move(value)] {
+        write(entryPath, key, value);
+      });
+}
+
+#pragma mark - Private
+
+std::string DiskCache::path(const std::string &kind, const std::string &key) {
+  SHA256 hash;
+  hash.update(key.data(), key.size());
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _directory + "/" + kind + "-" + HexEncode(hash.digest());
+}
+
+// Write to a temporary file and rename it into place, so a reader, or the
+// next run after a crash, never sees part of an entry.
+void DiskCache::write(const std::string &path, const std::string &key,
+                      const std::string &value) {
+  static std::atomic<std::uint64_t> Sequence{0};
+  auto temporary = path + ".tmp" + std::to_string(getpid()) + "." +
+                   std::to_string(Sequence++);
+  EntryHeader header;
+  memcpy(header.magic, EntryMagic, sizeof(EntryMagic));
+  header.format = EntryFormat;
+  header.reserved = 0;
+  header.keyLength = key.size();
+  header.valueLength = value.size();
+
+  auto fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    _logger.log(LogLevelError, "Can't write ", temporary, ": ",
+                strerror(errno));
+    return;
+  }
+  std::string entry(reinterpret_cast<const char *>(&header), sizeof(header));
+  entry += key;
+  entry += value;
+  std::size_t written = 0;
+  while (written < entry.size()) {
+    auto result = ::write(fd, entry.data() + written, entry.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    written += static_cast<std::size_t>(result);
+  }
+  close(fd);
+  if (written != entry.size() || rename(temporary.c_str(), path.c_str())) {
+    _logger.log(LogLevelError, "Can't write ", path, ": ", strerror(errno));
+    unlink(temporary.c_str());
+    return;
+  }
+
+  // Trim once an eighth of the limit was written, rather than on every write
+  auto shouldTrim = false;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _written += entry.size();
+    if (_limit && _written > _limit / 8) {
+      _written = 0;
+      shouldTrim = true;
+    }
+  }
+  if (shouldTrim) {
+    trim();
+  }
+}
+
+// Remove the least recently used entries until the directory fits the limit
+void DiskCache::trim() {
+  std::string directory;
+  std::uint64_t limit;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    directory = _directory;
+    limit = _limit;
+  }
+  if (!limit) {
+    return;
+  }
+  auto dir = opendir(directory.c_str());
+  if (!dir) {
+    return;
+  }
+  struct Entry {
+    std::string path;
+    std::uint64_t bytes;
+    time_t used;
+  };
+  std::vector<Entry> entries;
+  std::uint64_t total = 0;
+  while (auto dirEntry = readdir(dir)) {
+    auto path = directory + "/" + dirEntry->d_name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+    entries.push_back({path, static_cast<std::uint64_t>(info.st_size),
+                       info.st_mtime});
+    total += info.st_size;
+  }
+  closedir(dir);
+  if (total <= limit) {
+    return;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &lhs, const Entry &rhs) {
+              return lhs.used < rhs.used;
+            });
+  static auto &Trimmed = MetricsRegistry::Shared().counter(
+      "ssvim_disk_cache_trimmed_total",
+      "Entries removed to keep the disk cache under its limit");
+  for (auto &entry : entries) {
+    if (total <= limit) {
+      break;
+    }
+    if (unlink(entry.path.c_str()) == 0) {
+      total -= entry.bytes;
+      Trimmed.increment();
+    }
+  }
+}
+
+// Each thread looks a kind's counters up in the registry once, so lookups
+// don't take the registry's lock
+Counter &DiskCache::counter(const std::string &kind, const char *result) {
+  static thread_local std::map<std::string, Counter *> Counters;
+  auto &counter = Counters[kind + '\0' + result];
+  if (!counter) {
+    counter = &MetricsRegistry::Shared().counter(
+        "ssvim_disk_cache_total", "Disk cache lookups by kind and result",
+        MetricLabel("kind", kind) + "," + MetricLabel("result", result));
+  }
+  return *counter;
+}
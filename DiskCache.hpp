@@ -0,0 +1,58 @@
+#import "Logging.hpp"
+
+#import <atomic>
+#import <cstdint>
+#import <mutex>
+#import <string>
+
+namespace ssvim {
+
+class Counter;
+
+/**
+ * DiskCache keeps results on disk, so they outlive the server.
+ *
+ * Each entry is a file in the cache's directory, named by its kind and the
+ * SHA-256 of its key. A file starts with a header: the format version and the
+ * whole key, which must match for the entry to be used, so keys should
+ * include whatever the result depends on, like the version of the tools that
+ * computed it. Nothing is loaded up front: an entry's file is mapped when
+ * it's looked up, and writes happen in the background. Once the directory
+ * grows past its limit, the least recently used entries are removed.
+ */
+class DiskCache {
+  std::mutex _mutex;
+  std::string _directory;
+  std::uint64_t _limit = 0;
+  // Bytes written since the directory was last trimmed
+  std::uint64_t _written = 0;
+  std::atomic<bool> _enabled{false};
+  Logger _logger;
+
+public:
+  static DiskCache &Shared();
+
+  // Keep entries in directory, and the directory under limit bytes. The
+  // cache is off until it's enabled. Returns false when the directory can't
+  // be created.
+  bool enable(const std::string &directory, std::uint64_t limit);
+  bool enabled() const;
+
+  // Returns true, with the value, when there is an entry for key
+  bool get(const std::string &kind, const std::string &key,
+           std::string *value);
+
+  // Write an entry in the background
+  void put(const std::string &kind, const std::string &key,
+           std::string value);
+
+private:
+  DiskCache();
+
+  std::string path(const std::string &kind, const std::string &key);
+  void write(const std::string &path, const std::string &key,
+             const std::string &value);
+  void trim();
+  Counter &counter(const std::string &kind, const char *result);
+};
+} // namespace ssvim
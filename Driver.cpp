@@ -1,6 +1,6 @@
+#import "Executor.hpp"
 #import "Logging.hpp"
 #import "SwiftCompleter.hpp"
-#import <dispatch/dispatch.h>
 #import <iostream>
 #import <string>
 
@@ -14,7 +14,7 @@ struct Runner {
     auto completer = SwiftCompleter(LogLevelExtreme);
     auto files = std::vector<UnsavedFile>();
     auto unsavedFile = UnsavedFile();
-    unsavedFile.contents = fileContents;
+    unsavedFile.setContents(fileContents);
     unsavedFile.fileName = fileName;
 
     files.push_back(unsavedFile);
@@ -64,8 +64,7 @@ int wrapped_main() {
 
 int main() {
   logger << "Running Test Driver";
-  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-    wrapped_main();
-  });
-  dispatch_main();
+  auto &executor = Executor::Shared();
+  executor.async(LaneSourceKit, [] { wrapped_main(); });
+  executor.runMain();
 }
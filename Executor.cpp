@@ -0,0 +1,287 @@
+#import "Executor.hpp"
+
+#import <atomic>
+#import <boost/asio/steady_timer.hpp>
+#import <condition_variable>
+#import <deque>
+#import <exception>
+#import <iostream>
+#import <mutex>
+
+#if defined(__APPLE__)
+#import <dispatch/dispatch.h>
+#endif
+
+namespace ssvim {
+
+#pragma mark - WorkStealingPool
+
+class WorkStealingPool;
+
+// The pool and queue of the current thread, if it belongs to a pool.
+static thread_local WorkStealingPool *CurrentPool = nullptr;
+static thread_local std::size_t CurrentQueue = 0;
+
+/**
+ * WorkStealingPool runs tasks on a fixed set of threads.
+ *
+ * Each thread owns a queue. Tasks pushed from a pool thread go onto that
+ * thread's queue and are run LIFO, which keeps related work on a warm
+ * thread. Idle threads steal the oldest tasks from the other queues.
+ */
+class WorkStealingPool {
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::mutex _sleepMutex;
+  std::condition_variable _wake;
+  std::size_t _pending;
+  std::atomic<std::size_t> _nextQueue;
+  bool _stopping;
+
+public:
+  WorkStealingPool(std::size_t threads)
+      : _pending(0), _nextQueue(0), _stopping(false) {
+    threads = std::max<std::size_t>(threads, 1);
+    for (std::size_t i = 0; i < threads; i++) {
+      _queues.emplace_back(new Queue);
+    }
+    for (std::size_t i = 0; i < threads; i++) {
+      _threads.emplace_back([this, i] { run(i); });
+    }
+  }
+
+  std::size_t size() const {
+    return _threads.size();
+  }
+
+  std::size_t pending() {
+    std::lock_guard<std::mutex> lock(_sleepMutex);
+    return _pending;
+  }
+
+  void push(Task task) {
+    auto index = CurrentPool == this ? CurrentQueue
+                                     : _nextQueue++ % _queues.size();
+    // Count the task before it can be popped, which uncounts it. A worker
+    // that wakes in between finds nothing and looks again.
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _pending++;
+    }
+    {
+      auto &queue = *_queues[index];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    _wake.notify_one();
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(_sleepMutex);
+      _stopping = true;
+    }
+    _wake.notify_all();
+  }
+
+  void join() {
+    for (auto &thread : _threads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+private:
+  bool pop(std::size_t index, Task &task) {
+    {
+      auto &queue = *_queues[index];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.size()) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+      }
+    }
+    for (std::size_t i = 1; i < _queues.size(); i++) {
+      auto &victim = *_queues[(index + i) % _queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (victim.tasks.size()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(std::size_t index) {
+    CurrentPool = this;
+    CurrentQueue = index;
+    while (true) {
+      Task task;
+      if (pop(index, task)) {
+        {
+          std::lock_guard<std::mutex> lock(_sleepMutex);
+          _pending--;
+        }
+        try {
+          task();
+        } catch (std::exception &e) {
+          std::cerr << "Uncaught exception in task: " << e.what()
+                    << std::endl;
+        }
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(_sleepMutex);
+      _wake.wait(lock, [&] { return _stopping || _pending > 0; });
+      if (_stopping) {
+        return;
+      }
+    }
+  }
+};
+
+#pragma mark - Executor
+
+static ExecutorOptions &SharedOptions() {
+  static ExecutorOptions options;
+  return options;
+}
+
+void Executor::Configure(ExecutorOptions options) {
+  SharedOptions() = options;
+}
+
+Executor &Executor::Shared() {
+  // Intentionally leaked: tasks may call exit(), which must not wait on
+  // the executor's own threads.
+  static Executor *executor = new Executor(SharedOptions());
+  return *executor;
+}
+
+Executor::Executor(ExecutorOptions options)
+    : _ioWork(new boost::asio::io_service::work(_ioService)) {
+  _lanes.emplace_back(new WorkStealingPool(options.workerThreads));
+  _lanes.emplace_back(new WorkStealingPool(options.sourceKitThreads));
+  _lanes.emplace_back(new WorkStealingPool(1));
+
+  auto ioThreads = std::max<std::size_t>(options.ioThreads, 1);
+  for (std::size_t i = 0; i < ioThreads; i++) {
+    _ioThreads.emplace_back([this] { _ioService.run(); });
+  }
+}
+
+Executor::~Executor() {
+  stop();
+  join();
+}
+
+void Executor::async(Lane lane, Task task) {
+  _lanes[lane]->push(std::move(task));
+}
+
+std::size_t Executor::pending(Lane lane) {
+  return _lanes[lane]->pending();
+}
+
+void Executor::after(std::chrono::milliseconds delay, Lane lane, Task task) {
+  auto timer = std::make_shared<boost::asio::steady_timer>(_ioService, delay);
+  timer->async_wait(
+      [this, timer, lane, task](boost::system::error_code const &ec) {
+        if (!ec) {
+          async(lane, task);
+        }
+      });
+}
+
+void Executor::apply(Lane lane, std::size_t count,
+                     std::function<void(std::size_t)> body) {
+  if (count == 0) {
+    return;
+  }
+
+  struct ApplyState {
+    std::atomic<std::size_t> next;
+    std::atomic<std::size_t> done;
+    std::mutex mutex;
+    std::condition_variable finished;
+    // The first exception a body threw, guarded by mutex
+    std::exception_ptr error;
+  };
+  auto state = std::make_shared<ApplyState>();
+  state->next = 0;
+  state->done = 0;
+
+  // Helpers claim indices until none are left. A helper that starts after
+  // all indices were claimed does nothing, so body is never called after
+  // apply returns. An index counts as done however body returns, or apply
+  // would wait for it forever.
+  auto work = [state, count, body] {
+    std::size_t index;
+    while ((index = state->next++) < count) {
+      try {
+        body(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->error) {
+          state->error = std::current_exception();
+        }
+      }
+      if (++state->done == count) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->finished.notify_all();
+      }
+    }
+  };
+
+  auto helpers = std::min(count - 1, _lanes[lane]->size());
+  for (std::size_t i = 0; i < helpers; i++) {
+    async(lane, work);
+  }
+  work();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->finished.wait(lock, [&] { return state->done == count; });
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+void Executor::stop() {
+  _ioWork.reset();
+  _ioService.stop();
+  for (auto &lane : _lanes) {
+    lane->stop();
+  }
+}
+
+void Executor::join() {
+  for (auto &thread : _ioThreads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  for (auto &lane : _lanes) {
+    lane->join();
+  }
+}
+
+void Executor::runMain() {
+#if defined(__APPLE__)
+  std::thread([this] {
+    join();
+    exit(0);
+  }).detach();
+  dispatch_main();
+#else
+  join();
+#endif
+}
+} // namespace ssvim
@@ -0,0 +1,99 @@
+#import <boost/asio.hpp>
+#import <chrono>
+#import <cstddef>
+#import <functional>
+#import <memory>
+#import <thread>
+#import <vector>
+
+namespace ssvim {
+
+using Task = std::function<void()>;
+
+/**
+ * Lanes partition the executor's threads by the kind of work they run.
+ */
+typedef enum Lane {
+  // Short, non blocking work like routing and serialization.
+  LaneWorker = 0,
+  // Work that blocks on synchronous sourcekitd requests.
+  LaneSourceKit,
+  // sourcekitd notification handling. Work on LaneSourceKit may wait for a
+  // notification, so notifications can't share its threads.
+  LaneNotification,
+} Lane;
+
+struct ExecutorOptions {
+  // Threads running network I/O on the io_service
+  std::size_t ioThreads = 2;
+
+  // Work stealing threads for LaneWorker
+  std::size_t workerThreads = 4;
+
+  // Threads that may block on sourcekitd, for LaneSourceKit
+  std::size_t sourceKitThreads = 4;
+};
+
+class WorkStealingPool;
+
+/**
+ * Executor runs all of the server's work.
+ *
+ * Network I/O runs on a single io_service, and everything else runs on a
+ * lane of work stealing threads. There is no other event loop: the
+ * io_service, the lanes and the timers here are the full threading model.
+ */
+class Executor {
+  boost::asio::io_service _ioService;
+  std::unique_ptr<boost::asio::io_service::work> _ioWork;
+  std::vector<std::thread> _ioThreads;
+  std::vector<std::unique_ptr<WorkStealingPool>> _lanes;
+
+public:
+  Executor(ExecutorOptions options);
+  ~Executor();
+
+  Executor(Executor const &) = delete;
+  Executor &operator=(Executor const &) = delete;
+
+  // Set the options used to create the shared executor.
+  // This must be called before the first call to Shared().
+  static void Configure(ExecutorOptions options);
+
+  // The process wide executor. It is never torn down.
+  static Executor &Shared();
+
+  boost::asio::io_service &ioService() {
+    return _ioService;
+  }
+
+  // Run task on a lane
+  void async(Lane lane, Task task);
+
+  // The number of tasks queued on a lane that haven't started
+  std::size_t pending(Lane lane);
+
+  // Run task on a lane once delay has elapsed
+  void after(std::chrono::milliseconds delay, Lane lane, Task task);
+
+  // Run body for every index in [0, count) on a lane, and return once all
+  // have finished. The calling thread runs indices too, so this can't
+  // deadlock when called from the same lane. The first exception a body
+  // throws is rethrown once the rest have finished.
+  void apply(Lane lane, std::size_t count,
+             std::function<void(std::size_t)> body);
+
+  // Stop running I/O and tasks. Queued tasks are dropped.
+  void stop();
+
+  // Block the calling thread until stop() is called.
+  //
+  // On Darwin, this must be called on the main thread: sourcekitd delivers
+  // notifications on the main dispatch queue, so the main thread services it
+  // and the process exits once the executor stops.
+  void runMain();
+
+private:
+  void join();
+};
+} // namespace ssvim
@@ -0,0 +1,61 @@
+#import <exception>
+#import <future>
+#import <map>
+#import <mutex>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+using promise_ty = std::promise<std::string> *;
+
+// future channel sets values on registered futures.
+// it operates in a shared key space.
+//
+// usage:
+// in the example of working with the document update notifications,
+// a key would be formed based on the name and notification
+//
+// {
+//  key.notification: source.notification.editor.documentupdate,
+//  key.name: "/Users/aprilmarino/swiftyswiftvim/Examples/some_swift.swift"
+//  }
+
+class FutureChannel {
+  std::map<std::string, std::vector<promise_ty>> _promises;
+  std::mutex _shared_mutex;
+
+public:
+  void set(std::string key, const std::string value) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    auto entries = _promises.find(key);
+    if (entries != _promises.end()) {
+      for (auto promise : entries->second) {
+        promise->set_value(value);
+        delete promise;
+      }
+      _promises.erase(key);
+    }
+  }
+
+  // Fail every registered future with error, as when the notifications
+  // they wait for will never come.
+  void fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    for (auto &entries : _promises) {
+      for (auto promise : entries.second) {
+        promise->set_exception(error);
+        delete promise;
+      }
+    }
+    _promises.clear();
+  }
+
+  std::future<std::string> future(std::string key) {
+    auto promise = new std::promise<std::string>;
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    _promises[key].push_back(promise);
+    return promise->get_future();
+  }
+};
+} // namespace ssvim
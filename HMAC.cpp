@@ -0,0 +1,231 @@
+#import "HMAC.hpp"
+
+#import <cstring>
+
+namespace ssvim {
+
+#pragma mark - SHA256
+
+static const std::uint32_t RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline std::uint32_t RotateRight(std::uint32_t value, unsigned bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+SHA256::SHA256()
+    : _state({{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+               0x9b05688c, 0x1f83d9ab, 0x5be0cd19}}),
+      _blockLength(0), _length(0) {
+}
+
+void SHA256::compress(const unsigned char *block) {
+  std::uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (std::uint32_t(block[i * 4]) << 24) |
+           (std::uint32_t(block[i * 4 + 1]) << 16) |
+           (std::uint32_t(block[i * 4 + 2]) << 8) |
+           std::uint32_t(block[i * 4 + 3]);
+  }
+  for (int i = 16; i < 64; i++) {
+    auto s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^
+              (w[i - 15] >> 3);
+    auto s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^
+              (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  auto a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+  auto e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+  for (int i = 0; i < 64; i++) {
+    auto s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    auto choice = (e & f) ^ (~e & g);
+    auto t1 = h + s1 + choice + RoundConstants[i] + w[i];
+    auto s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto t2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  _state[0] += a;
+  _state[1] += b;
+  _state[2] += c;
+  _state[3] += d;
+  _state[4] += e;
+  _state[5] += f;
+  _state[6] += g;
+  _state[7] += h;
+}
+
+void SHA256::update(const void *bytes, std::size_t length) {
+  auto input = static_cast<const unsigned char *>(bytes);
+  _length += length;
+
+  // Top up a partial block first
+  if (_blockLength > 0) {
+    auto count = std::min(length, BlockLength - _blockLength);
+    memcpy(_block.data() + _blockLength, input, count);
+    _blockLength += count;
+    input += count;
+    length -= count;
+    if (_blockLength < BlockLength) {
+      return;
+    }
+    compress(_block.data());
+    _blockLength = 0;
+  }
+
+  // Full blocks are compressed straight from the input
+  while (length >= BlockLength) {
+    compress(input);
+    input += BlockLength;
+    length -= BlockLength;
+  }
+
+  memcpy(_block.data(), input, length);
+  _blockLength = length;
+}
+
+std::string SHA256::digest() const {
+  SHA256 final = *this;
+  auto bitLength = _length * 8;
+  unsigned char padding[BlockLength * 2] = {0x80};
+  auto paddingLength = (_blockLength < 56 ? 56 : 120) - _blockLength;
+  final.update(padding, paddingLength);
+  unsigned char encodedLength[8];
+  for (int i = 0; i < 8; i++) {
+    encodedLength[i] = static_cast<unsigned char>(bitLength >> (56 - i * 8));
+  }
+  final.update(encodedLength, sizeof(encodedLength));
+
+  std::string output(DigestLength, '\0');
+  for (int i = 0; i < 8; i++) {
+    output[i * 4] = static_cast<char>(final._state[i] >> 24);
+    output[i * 4 + 1] = static_cast<char>(final._state[i] >> 16);
+    output[i * 4 + 2] = static_cast<char>(final._state[i] >> 8);
+    output[i * 4 + 3] = static_cast<char>(final._state[i]);
+  }
+  return output;
+}
+
+#pragma mark - HMACSHA256
+
+HMACSHA256::HMACSHA256(const std::string &key) {
+  std::string blockKey = key;
+  if (blockKey.size() > SHA256::BlockLength) {
+    SHA256 keyHash;
+    keyHash.update(blockKey.data(), blockKey.size());
+    blockKey = keyHash.digest();
+  }
+  blockKey.resize(SHA256::BlockLength, '\0');
+
+  std::string innerPad(SHA256::BlockLength, '\0');
+  std::string outerPad(SHA256::BlockLength, '\0');
+  for (std::size_t i = 0; i < SHA256::BlockLength; i++) {
+    innerPad[i] = blockKey[i] ^ 0x36;
+    outerPad[i] = blockKey[i] ^ 0x5c;
+  }
+  _inner.update(innerPad.data(), innerPad.size());
+  _outer.update(outerPad.data(), outerPad.size());
+}
+
+void HMACSHA256::update(const void *bytes, std::size_t length) {
+  _inner.update(bytes, length);
+}
+
+std::string HMACSHA256::digest() const {
+  auto innerDigest = _inner.digest();
+  SHA256 outer = _outer;
+  outer.update(innerDigest.data(), innerDigest.size());
+  return outer.digest();
+}
+
+std::string HMACSHA256::Digest(const std::string &key,
+                               const std::string &message) {
+  HMACSHA256 hmac(key);
+  hmac.update(message.data(), message.size());
+  return hmac.digest();
+}
+
+bool ConstantTimeEquals(const std::string &lhs, const std::string &rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  unsigned char difference = 0;
+  for (std::size_t i = 0; i < lhs.size(); i++) {
+    difference |= lhs[i] ^ rhs[i];
+  }
+  return difference == 0;
+}
+
+#pragma mark - Base64
+
+static const char Base64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string Base64Encode(const std::string &bytes) {
+  std::string output;
+  output.reserve((bytes.size() + 2) / 3 * 4);
+  std::size_t i = 0;
+  for (; i + 2 < bytes.size(); i += 3) {
+    std::uint32_t group = (std::uint32_t((unsigned char)bytes[i]) << 16) |
+                          (std::uint32_t((unsigned char)bytes[i + 1]) << 8) |
+                          std::uint32_t((unsigned char)bytes[i + 2]);
+    output += Base64Alphabet[(group >> 18) & 0x3f];
+    output += Base64Alphabet[(group >> 12) & 0x3f];
+    output += Base64Alphabet[(group >> 6) & 0x3f];
+    output += Base64Alphabet[group & 0x3f];
+  }
+  auto remaining = bytes.size() - i;
+  if (remaining > 0) {
+    std::uint32_t group = std::uint32_t((unsigned char)bytes[i]) << 16;
+    if (remaining == 2) {
+      group |= std::uint32_t((unsigned char)bytes[i + 1]) << 8;
+    }
+    output += Base64Alphabet[(group >> 18) & 0x3f];
+    output += Base64Alphabet[(group >> 12) & 0x3f];
+    output += remaining == 2 ? Base64Alphabet[(group >> 6) & 0x3f] : '=';
+    output += '=';
+  }
+  return output;
+}
+
+bool Base64Decode(const std::string &input, std::string *bytes) {
+  bytes->clear();
+  std::uint32_t group = 0;
+  int bits = 0;
+  for (auto c : input) {
+    if (c == '=') {
+      break;
+    }
+    auto position = strchr(Base64Alphabet, c);
+    if (c == '\0' || position == nullptr) {
+      return false;
+    }
+    group = (group << 6) | std::uint32_t(position - Base64Alphabet);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      bytes->push_back(static_cast<char>((group >> bits) & 0xff));
+    }
+  }
+  return true;
+}
+} // namespace ssvim
@@ -0,0 +1,63 @@
+#import <array>
+#import <cstddef>
+#import <cstdint>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * Incremental SHA-256.
+ *
+ * Input can be fed in any number of pieces, so large bodies are hashed as
+ * they arrive instead of in a separate pass.
+ */
+class SHA256 {
+  std::array<std::uint32_t, 8> _state;
+  std::array<unsigned char, 64> _block;
+  std::size_t _blockLength;
+  std::uint64_t _length;
+
+public:
+  static const std::size_t DigestLength = 32;
+  static const std::size_t BlockLength = 64;
+
+  SHA256();
+
+  void update(const void *bytes, std::size_t length);
+
+  // The digest of the input so far, as raw bytes. Further updates can
+  // still be made after this.
+  std::string digest() const;
+
+private:
+  void compress(const unsigned char *block);
+};
+
+/**
+ * Incremental HMAC-SHA256.
+ */
+class HMACSHA256 {
+  SHA256 _inner;
+  SHA256 _outer;
+
+public:
+  HMACSHA256(const std::string &key);
+
+  void update(const void *bytes, std::size_t length);
+
+  // The HMAC of the input so far, as raw bytes
+  std::string digest() const;
+
+  // The HMAC of message, as raw bytes
+  static std::string Digest(const std::string &key, const std::string &message);
+};
+
+// Compare in time that only depends on the length of the inputs, so an
+// attacker can't learn how much of a digest they got right.
+bool ConstantTimeEquals(const std::string &lhs, const std::string &rhs);
+
+std::string Base64Encode(const std::string &bytes);
+
+// Returns false if input isn't valid base64
+bool Base64Decode(const std::string &input, std::string *bytes);
+} // namespace ssvim
@@ -1,24 +1,78 @@
+#import "DiskCache.hpp"
+#import "Executor.hpp"
+#import "HMAC.hpp"
 #import "Logging.hpp"
+#import "MemoryBudget.hpp"
+#import "ModuleDiagnostics.hpp"
+#import "Recording.hpp"
 #import "SemanticHTTPServer.hpp"
+#import "Tracing.hpp"
 
 #import <boost/algorithm/string.hpp>
 #import <boost/program_options.hpp>
-#import <dispatch/dispatch.h>
+#import <boost/property_tree/json_parser.hpp>
+#import <boost/property_tree/ptree.hpp>
+#import <fstream>
 #import <iostream>
+#import <sstream>
 
-static void RunMainLoop() {
-  __block boost::asio::io_service *ios = new boost::asio::io_service();
-  boost::asio::signal_set signals(*ios, SIGINT, SIGTERM);
-  signals.async_wait([&](boost::system::error_code const &, int) {});
-
-  dispatch_source_t source = dispatch_source_create(
-      DISPATCH_SOURCE_TYPE_READ, 0, 0, dispatch_get_main_queue());
-  // Poll the io service when events come in
-  dispatch_source_set_event_handler(source, ^{
-    ios->poll();
+// Run until SIGINT or SIGTERM
+static void RunMainLoop(ssvim::Executor &executor) {
+  boost::asio::signal_set signals(executor.ioService(), SIGINT, SIGTERM);
+  signals.async_wait([&](boost::system::error_code const &ec, int) {
+    if (!ec) {
+      executor.stop();
+    }
   });
-  dispatch_resume(source);
-  dispatch_main();
+  executor.runMain();
+}
+
+// Parse endpoint limits of the form /path=maxInFlight:maxQueued
+static auto EndpointLimitsWithProgramOption(std::vector<std::string> options) {
+  std::map<std::string, ssvim::http::AdmissionLimits> limits;
+  for (auto &option : options) {
+    std::vector<std::string> parts;
+    boost::split(parts, option, boost::is_any_of("=:"));
+    if (parts.size() != 3) {
+      std::cerr << "Ignoring malformed endpoint limit: " << option
+                << std::endl;
+      continue;
+    }
+    limits[parts[0]] = ssvim::http::AdmissionLimits(std::stoul(parts[1]),
+                                                    std::stoul(parts[2]));
+  }
+  return limits;
+}
+
+// Read the HMAC secret from the file at path.
+//
+// ycmd style clients write a JSON file with a base64 encoded "hmac_secret".
+// Any other file is used as the secret verbatim. An empty secret disables
+// request authentication.
+static std::string HMACSecretWithProgramOption(std::string path) {
+  if (path == "none") {
+    return "";
+  }
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "Can't read hmac secret file: " << path << std::endl;
+    exit(1);
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+
+  try {
+    boost::property_tree::ptree secretJSON;
+    std::istringstream is(contents.str());
+    boost::property_tree::read_json(is, secretJSON);
+    std::string secret;
+    if (ssvim::Base64Decode(secretJSON.get<std::string>("hmac_secret"),
+                            &secret)) {
+      return secret;
+    }
+  } catch (std::exception &) {
+  }
+  return contents.str();
 }
 
 static auto LogLevelWithProgramOptionLog(std::string option) {
@@ -43,13 +97,41 @@ int main(int ac, char const *av[]) {
       "Set the port number for the server")(
       "ip", po::value<std::string>()->default_value("0.0.0.0"),
       "Set the IP address to bind to, \"0.0.0.0\" for all")(
-      "threads,n", po::value<std::size_t>()->default_value(4),
-      "Set the number of threads to use")
+      "threads,n", po::value<std::size_t>()->default_value(2),
+      "Set the number of threads for network I/O")(
+      "workers", po::value<std::size_t>()->default_value(4),
+      "Set the number of threads for request handling")(
+      "sourcekit-threads", po::value<std::size_t>()->default_value(4),
+      "Set the number of threads that may block on SourceKit")(
+      "max-inflight", po::value<std::size_t>()->default_value(8),
+      "Set the number of semantic requests run at once per endpoint")(
+      "max-queue", po::value<std::size_t>()->default_value(32),
+      "Set the number of semantic requests queued per endpoint")(
+      "endpoint-limit",
+      po::value<std::vector<std::string>>()->composing()->default_value(
+          std::vector<std::string>(), ""),
+      "Set limits for an endpoint, as /path=max-inflight:max-queue")(
+      "memory-budget-mb", po::value<std::uint64_t>()->default_value(1024),
+      "Evict least recently used documents and caches past this many MB, "
+      "0 for no limit")(
+      "background-diagnostics", po::value<std::size_t>()->default_value(2),
+      "Set the number of files diagnosed at once after a file of their "
+      "module changes, 0 to turn it off")(
+      "disk-cache-mb", po::value<std::uint64_t>()->default_value(0),
+      "Keep up to this many MB of results in .ssvim-cache under the root, "
+      "so they outlive the server, 0 to turn it off")
       // DEBUG, INFO, WARNING
       ("log,r", po::value<std::string>()->default_value("INFO"),
-       "Set the logging level")("hmac-file-secret,r",
-                                po::value<std::string>()->default_value("none"),
-                                "Set the hmac secret");
+       "Set the logging level")(
+          "log-bodies", "Log whole request bodies instead of summaries")(
+          "trace-requests", po::value<std::size_t>()->default_value(0),
+          "Keep traces of the last N requests for /debug/trace")(
+          "record", po::value<std::string>(),
+          "Append every request to this JSONL file, for ssvim_replay")(
+          "record-bodies",
+          "Record whole request bodies, not only their hashes")(
+          "hmac-file-secret,r", po::value<std::string>()->default_value("none"),
+          "Set the hmac secret");
   po::variables_map vm;
   po::store(po::parse_command_line(ac, av, desc), vm);
 
@@ -59,9 +141,17 @@ int main(int ac, char const *av[]) {
 
   std::string ip = vm["ip"].as<std::string>();
 
-  std::size_t threads = vm["threads"].as<std::size_t>();
+  ssvim::ExecutorOptions executorOptions;
+  executorOptions.ioThreads = vm["threads"].as<std::size_t>();
+  executorOptions.workerThreads = vm["workers"].as<std::size_t>();
+  executorOptions.sourceKitThreads = vm["sourcekit-threads"].as<std::size_t>();
   std::string log = vm["log"].as<std::string>();
 
+  ssvim::http::AdmissionLimits semanticLimits(
+      vm["max-inflight"].as<std::size_t>(), vm["max-queue"].as<std::size_t>());
+  auto endpointLimits = EndpointLimitsWithProgramOption(
+      vm["endpoint-limit"].as<std::vector<std::string>>());
+
   using endpoint_type = boost::asio::ip::tcp::endpoint;
   using address_type = boost::asio::ip::address;
   using namespace ssvim;
@@ -69,10 +159,33 @@ int main(int ac, char const *av[]) {
 
   std::cout << "__LISTENINGON: " << ip << ":" << port << std::endl;
   std::cout.flush();
-  ServiceContext ctx("SomeSecret", LogLevelWithProgramOptionLog(
-                                       boost::to_upper_copy<std::string>(log)));
+  ServiceContext ctx(
+      HMACSecretWithProgramOption(vm["hmac-file-secret"].as<std::string>()),
+      LogLevelWithProgramOptionLog(boost::to_upper_copy<std::string>(log)),
+      semanticLimits, endpointLimits, vm.count("log-bodies") > 0);
   endpoint_type ep{address_type::from_string(ip), port};
-  SemanticHTTPServer server(ep, threads, root, ctx);
-  RunMainLoop();
+  tracing::Enable(vm["trace-requests"].as<std::size_t>());
+  if (vm.count("record") &&
+      !recording::Enable(vm["record"].as<std::string>(),
+                         vm.count("record-bodies") > 0)) {
+    std::cerr << "Can't open recording: " << vm["record"].as<std::string>()
+              << std::endl;
+    return 1;
+  }
+  MemoryBudget::Shared().setLimit(vm["memory-budget-mb"].as<std::uint64_t>() *
+                                  1024 * 1024);
+  ModuleDiagnostics::Shared().setConcurrency(
+      vm["background-diagnostics"].as<std::size_t>());
+  Executor::Configure(executorOptions);
+  auto diskCacheMB = vm["disk-cache-mb"].as<std::uint64_t>();
+  if (diskCacheMB &&
+      !DiskCache::Shared().enable(root + "/.ssvim-cache",
+                                  diskCacheMB * 1024 * 1024)) {
+    std::cerr << "Can't create the disk cache under: " << root << std::endl;
+    return 1;
+  }
+  auto &executor = Executor::Shared();
+  SemanticHTTPServer server(ep, executor, root, ctx);
+  RunMainLoop(executor);
   return 0;
 }
@@ -0,0 +1,65 @@
+#import "JSON.hpp"
+
+#import <cstdio>
+
+namespace ssvim {
+
+#pragma mark - JSON
+
+void AppendJSONString(std::string &out, const std::string &value) {
+  out += '"';
+  // Copy runs that need no escaping whole
+  auto run = value.data();
+  auto end = value.data() + value.size();
+  for (auto c = run; c < end; c++) {
+    auto byte = static_cast<unsigned char>(*c);
+    if (byte >= 0x20 && byte != '"' && byte != '\\') {
+      continue;
+    }
+    out.append(run, c);
+    run = c + 1;
+    switch (byte) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", byte);
+      out += escaped;
+    }
+  }
+  out.append(run, end);
+  out += '"';
+}
+
+std::string QuoteJSON(const std::string &value) {
+  std::string out;
+  AppendJSONString(out, value);
+  return out;
+}
+
+#pragma mark - Hex
+
+std::string HexEncode(const std::string &bytes) {
+  static const char Digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(bytes.size() * 2);
+  for (unsigned char c : bytes) {
+    out += Digits[c >> 4];
+    out += Digits[c & 0xf];
+  }
+  return out;
+}
+} // namespace ssvim
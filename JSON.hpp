@@ -0,0 +1,13 @@
+#import <string>
+
+namespace ssvim {
+
+// Append value to out as a quoted JSON string
+void AppendJSONString(std::string &out, const std::string &value);
+
+// value as a quoted JSON string
+std::string QuoteJSON(const std::string &value);
+
+// Lowercase hex, as digests are usually written
+std::string HexEncode(const std::string &bytes);
+} // namespace ssvim
@@ -0,0 +1,153 @@
+#import "LineIndex.hpp"
+#import "MemoryBudget.hpp"
+
+#import <cstring>
+#import <map>
+#import <mutex>
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#endif
+
+using namespace ssvim;
+
+bool ssvim::ColumnEncodingWithName(const std::string &name,
+                                   ColumnEncoding *encoding) {
+  static const std::map<std::string, ColumnEncoding> Encodings = {
+      {"utf-8", ColumnEncodingUTF8},
+      {"utf-16", ColumnEncodingUTF16},
+      {"utf-32", ColumnEncodingUTF32},
+  };
+  auto found = Encodings.find(name);
+  if (found == Encodings.end()) {
+    return false;
+  }
+  *encoding = found->second;
+  return true;
+}
+
+// Append the offset after every newline in bytes, 16 bytes at a time where
+// SSE2 is available
+static void AppendLineStarts(const char *bytes, std::size_t size,
+                             std::vector<std::uint32_t> *starts) {
+  std::size_t i = 0;
+#if defined(__SSE2__)
+  auto newlines = _mm_set1_epi8('\n');
+  for (; i + 16 <= size; i += 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newlines));
+    while (mask) {
+      starts->push_back(static_cast<std::uint32_t>(i + __builtin_ctz(mask) + 1));
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i < size) {
+    auto found =
+        static_cast<const char *>(std::memchr(bytes + i, '\n', size - i));
+    if (!found) {
+      break;
+    }
+    i = found - bytes + 1;
+    starts->push_back(static_cast<std::uint32_t>(i));
+  }
+}
+
+LineIndex::LineIndex(const std::string &text) : _size(text.size()) {
+  // Source averages about 40 bytes a line
+  _lineStarts.reserve(text.size() / 32 + 1);
+  _lineStarts.push_back(0);
+  AppendLineStarts(text.data(), text.size(), &_lineStarts);
+}
+
+std::size_t LineIndex::lineStart(unsigned line) const {
+  if (line == 0) {
+    return 0;
+  }
+  if (line > _lineStarts.size()) {
+    return _size;
+  }
+  return _lineStarts[line - 1];
+}
+
+std::size_t LineIndex::lineEnd(unsigned line) const {
+  if (line == 0) {
+    line = 1;
+  }
+  if (line >= _lineStarts.size()) {
+    return _size;
+  }
+  // Before the newline that starts the next line
+  return _lineStarts[line] - 1;
+}
+
+std::size_t LineIndex::offset(const std::string &text, unsigned line,
+                              unsigned column, ColumnEncoding encoding) const {
+  auto start = lineStart(line);
+  auto end = lineEnd(line);
+  if (encoding == ColumnEncodingUTF8) {
+    return std::min(start + column, end);
+  }
+  auto i = start;
+  unsigned units = 0;
+  while (i < end) {
+    auto lead = static_cast<unsigned char>(text[i]);
+    std::size_t length = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+    // Only characters outside the BMP take a surrogate pair in UTF-16
+    unsigned width = encoding == ColumnEncodingUTF16 && length == 4 ? 2 : 1;
+    if (units + width > column) {
+      break;
+    }
+    units += width;
+    i = std::min(i + length, end);
+  }
+  return i;
+}
+
+#pragma mark - Document Indexes
+
+static const auto LineIndexesCache = "line_indexes";
+
+namespace {
+struct IndexedDocument {
+  std::size_t version;
+  std::size_t size;
+  std::shared_ptr<const LineIndex> index;
+  // Of its memory budget entry
+  std::uint64_t generation;
+};
+} // namespace
+
+static std::mutex IndexesMutex;
+static std::map<std::string, IndexedDocument> *Indexes =
+    new std::map<std::string, IndexedDocument>();
+
+std::shared_ptr<const LineIndex>
+LineIndex::ForDocument(const std::string &name, std::size_t version,
+                       const std::string &text) {
+  std::shared_ptr<const LineIndex> index;
+  auto generation = MemoryBudget::NextGeneration();
+  {
+    std::lock_guard<std::mutex> lock(IndexesMutex);
+    auto found = Indexes->find(name);
+    if (found != Indexes->end() && found->second.version == version &&
+        found->second.size == text.size()) {
+      index = found->second.index;
+      found->second.generation = generation;
+    }
+  }
+  if (!index) {
+    index = std::make_shared<const LineIndex>(text);
+    std::lock_guard<std::mutex> lock(IndexesMutex);
+    (*Indexes)[name] = {version, text.size(), index, generation};
+  }
+  // The budget calls back without its lock held, so this must not hold ours
+  MemoryBudget::Shared().use(
+      LineIndexesCache, name, index->lineCount() * 4, [name, generation] {
+        std::lock_guard<std::mutex> lock(IndexesMutex);
+        auto found = Indexes->find(name);
+        if (found != Indexes->end() && found->second.generation == generation) {
+          Indexes->erase(found);
+        }
+      });
+  return index;
+}
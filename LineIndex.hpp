@@ -0,0 +1,59 @@
+#import <cstddef>
+#import <cstdint>
+#import <memory>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * The units an editor counts columns in.
+ *
+ * Vim counts bytes of UTF-8, LSP clients usually count UTF-16 code units,
+ * and others count characters, as Unicode code points.
+ */
+typedef enum ColumnEncoding {
+  ColumnEncodingUTF8 = 0,
+  ColumnEncodingUTF16,
+  ColumnEncodingUTF32,
+} ColumnEncoding;
+
+// Parse "utf-8", "utf-16" or "utf-32". Returns false for anything else.
+bool ColumnEncodingWithName(const std::string &name, ColumnEncoding *encoding);
+
+/**
+ * The byte offset of every line of a document.
+ *
+ * Building it is a single vectorized pass for newlines. From then on, finding
+ * a position is constant time in the size of the document: a lookup for the
+ * line, and a walk along it when columns aren't bytes.
+ */
+class LineIndex {
+  // Offsets fit in 32 bits, since sourcekitd offsets are unsigned too
+  std::vector<std::uint32_t> _lineStarts;
+  std::size_t _size;
+
+public:
+  explicit LineIndex(const std::string &text);
+
+  // The index of a document's contents. Indexes are cached by file name and
+  // shared until the version of the contents changes.
+  static std::shared_ptr<const LineIndex>
+  ForDocument(const std::string &name, std::size_t version,
+              const std::string &text);
+
+  std::size_t lineCount() const {
+    return _lineStarts.size();
+  }
+
+  // Lines are 1 based. The end is the offset of the newline, or the end of
+  // the document. Lines past the end are empty, at the end.
+  std::size_t lineStart(unsigned line) const;
+  std::size_t lineEnd(unsigned line) const;
+
+  // The byte offset of column units into a line, in text, clamped to the end
+  // of the line. A column in the middle of a character goes before it.
+  std::size_t offset(const std::string &text, unsigned line, unsigned column,
+                     ColumnEncoding encoding) const;
+};
+} // namespace ssvim
@@ -0,0 +1,232 @@
+#import "LoadTesting.hpp"
+#import "SwiftCorpus.hpp"
+
+#import <algorithm>
+#import <atomic>
+#import <boost/program_options.hpp>
+#import <fstream>
+#import <iostream>
+#import <random>
+#import <thread>
+#import <vector>
+
+using namespace ssvim;
+
+// ssvim_load drives a running server with concurrent keep-alive connections
+// and reports throughput and latency percentiles.
+//
+// With --rate, requests are sent open loop, on a fixed schedule, and latency
+// is measured from when each request was due rather than when it was sent.
+// A stalled server then shows up in the percentiles instead of only slowing
+// the client down. Without --rate, every connection sends its next request
+// as soon as the last one finishes.
+
+#pragma mark - Profiles
+
+struct LoadProfile {
+  std::string name;
+  // Request names and their relative weights
+  std::vector<std::pair<std::string, unsigned>> weights;
+};
+
+static const std::vector<LoadProfile> Profiles = {
+    // Typing: mostly completions, with diagnostics as the buffer settles
+    {"editing", {{"completions", 7}, {"diagnostics", 2}, {"status", 1}}},
+    {"mixed", {{"completions", 2}, {"diagnostics", 2}, {"status", 1}}},
+    {"completions", {{"completions", 1}}},
+    {"diagnostics", {{"diagnostics", 1}}},
+    // Server overhead, without SourceKit
+    {"status", {{"status", 1}}},
+};
+
+// A connection's sequence of request names: each name repeated by its
+// weight, shuffled per connection so they don't all send the same request
+// at once.
+static std::vector<std::string> ProfileSchedule(const LoadProfile &profile,
+                                                unsigned seed) {
+  std::vector<std::string> schedule;
+  for (auto &weight : profile.weights) {
+    schedule.insert(schedule.end(), weight.second, weight.first);
+  }
+  std::shuffle(schedule.begin(), schedule.end(), std::mt19937(seed));
+  return schedule;
+}
+
+// Requests by name, for each of the files being edited
+static std::map<std::string, std::vector<LoadRequest>>
+MakeRequests(std::size_t files, std::size_t lines) {
+  std::map<std::string, std::vector<LoadRequest>> requests;
+  for (std::size_t i = 0; i < files; i++) {
+    auto fileName = "/tmp/ssvim-load/File" + std::to_string(i) + ".swift";
+    auto body = GenerateCompletionRequest(fileName, GenerateSwiftCorpus(lines, i + 1));
+    requests["completions"].push_back(
+        {"completions", "POST", "/completions", body});
+    requests["diagnostics"].push_back(
+        {"diagnostics", "POST", "/diagnostics", body});
+    requests["status"].push_back({"status", "GET", "/status", ""});
+  }
+  return requests;
+}
+
+#pragma mark - Load
+
+struct LoadOptions {
+  std::string host;
+  std::string port;
+  std::string secret;
+  unsigned connections;
+  // Requests per second across all connections, or 0 to send back to back
+  double rate;
+  std::chrono::duration<double> duration;
+  std::chrono::duration<double> warmup;
+  // Stop after this many requests, if not 0
+  std::uint64_t maxRequests;
+};
+
+static void RunConnection(unsigned index, const LoadOptions &options,
+                          const std::vector<std::string> &schedule,
+                          const std::map<std::string, std::vector<LoadRequest>>
+                              &requests,
+                          std::chrono::steady_clock::time_point start,
+                          std::atomic<std::uint64_t> &sent,
+                          LoadReport &report) {
+  using clock = std::chrono::steady_clock;
+  auto measureFrom =
+      start + std::chrono::duration_cast<clock::duration>(options.warmup);
+  auto end = measureFrom +
+             std::chrono::duration_cast<clock::duration>(options.duration);
+  LoadConnection connection(options.host, options.port, options.secret);
+  LoadResponse response;
+  std::string error;
+
+  for (std::uint64_t k = 0;; k++) {
+    auto due = clock::now();
+    if (options.rate > 0) {
+      // Connections take turns in the global schedule
+      auto offset = std::chrono::duration<double>(
+          (k * options.connections + index) / options.rate);
+      due = start + std::chrono::duration_cast<clock::duration>(offset);
+      std::this_thread::sleep_until(due);
+    }
+    if (due >= end) {
+      return;
+    }
+    if (options.maxRequests && sent++ >= options.maxRequests) {
+      return;
+    }
+
+    auto &name = schedule[k % schedule.size()];
+    auto &candidates = requests.at(name);
+    auto &request = candidates[(k / schedule.size() + index) % candidates.size()];
+    auto ok = connection.send(request, &response, &error);
+    auto latency = clock::now() - due;
+    if (due < measureFrom) {
+      continue;
+    }
+    if (ok) {
+      report.record(name, latency, response.status);
+    } else {
+      report.recordError(name);
+    }
+  }
+}
+
+#pragma mark - Main
+
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Print help")(
+      "host", po::value<std::string>()->default_value("localhost"),
+      "Server host")("port,p", po::value<std::string>()->default_value("8080"),
+                     "Server port")(
+      "connections,c", po::value<unsigned>()->default_value(8),
+      "Keep-alive connections, each on its own thread")(
+      "rate", po::value<double>()->default_value(0),
+      "Requests per second across all connections. 0 sends back to back")(
+      "duration", po::value<double>()->default_value(10),
+      "Seconds to measure for")(
+      "warmup", po::value<double>()->default_value(0),
+      "Seconds to send requests for before measuring")(
+      "requests", po::value<std::uint64_t>()->default_value(0),
+      "Stop after this many requests")(
+      "profile", po::value<std::string>()->default_value("editing"),
+      "Workload: editing, mixed, completions, diagnostics or status")(
+      "lines", po::value<std::size_t>()->default_value(1000),
+      "Lines in each synthetic Swift file")(
+      "files", po::value<std::size_t>()->default_value(1),
+      "Distinct files to send requests for")(
+      "hmac-file-secret", po::value<std::string>(),
+      "Sign requests with the secret in this file")(
+      "json", po::value<std::string>(), "Write the report as JSON to this path");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  auto profileName = vm["profile"].as<std::string>();
+  auto profile = std::find_if(
+      Profiles.begin(), Profiles.end(),
+      [&](const LoadProfile &profile) { return profile.name == profileName; });
+  if (profile == Profiles.end()) {
+    std::cerr << "ERROR: unknown profile " << profileName << std::endl;
+    return 1;
+  }
+
+  LoadOptions options;
+  options.host = vm["host"].as<std::string>();
+  options.port = vm["port"].as<std::string>();
+  options.connections = std::max(1u, vm["connections"].as<unsigned>());
+  options.rate = vm["rate"].as<double>();
+  options.duration = std::chrono::duration<double>(vm["duration"].as<double>());
+  options.warmup = std::chrono::duration<double>(vm["warmup"].as<double>());
+  options.maxRequests = vm["requests"].as<std::uint64_t>();
+  if (vm.count("hmac-file-secret")) {
+    auto path = vm["hmac-file-secret"].as<std::string>();
+    if (!ReadLoadSecret(path, &options.secret)) {
+      std::cerr << "Can't read hmac secret file: " << path << std::endl;
+      return 1;
+    }
+  }
+
+  auto requests = MakeRequests(std::max<std::size_t>(1, vm["files"].as<std::size_t>()),
+                               vm["lines"].as<std::size_t>());
+  LoadReport report;
+  std::atomic<std::uint64_t> sent(0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < options.connections; i++) {
+    auto schedule = ProfileSchedule(*profile, i);
+    threads.emplace_back([&, i, schedule] {
+      RunConnection(i, options, schedule, requests, start, sent, report);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start) -
+                 options.warmup;
+
+  report.print(std::cout, elapsed);
+  if (vm.count("json")) {
+    std::ofstream file(vm["json"].as<std::string>());
+    report.writeJSON(
+        file, elapsed,
+        {{"profile", profileName},
+         {"connections", std::to_string(options.connections)},
+         {"rate", std::to_string(options.rate)},
+         {"lines", std::to_string(vm["lines"].as<std::size_t>())},
+         {"files", std::to_string(vm["files"].as<std::size_t>())}});
+  }
+  return 0;
+}
@@ -0,0 +1,333 @@
+#import "LoadTesting.hpp"
+#import "HMAC.hpp"
+
+#import <algorithm>
+#import <array>
+#import <boost/property_tree/json_parser.hpp>
+#import <boost/property_tree/ptree.hpp>
+#import <fstream>
+#import <iomanip>
+#import <istream>
+#import <sstream>
+
+using namespace ssvim;
+using boost::asio::ip::tcp;
+
+const double ssvim::LoadPercentiles[4] = {0.5, 0.9, 0.99, 0.999};
+
+#pragma mark - Connection
+
+LoadConnection::LoadConnection(std::string host, std::string port,
+                               std::string secret)
+    : _host(host), _port(port), _secret(secret) {
+}
+
+void LoadConnection::connect() {
+  tcp::resolver resolver(_ioService);
+  auto endpoints = resolver.resolve(tcp::resolver::query{_host, _port});
+  _socket.reset(new tcp::socket(_ioService));
+  boost::asio::connect(*_socket, endpoints);
+  _socket->set_option(tcp::no_delay(true));
+  _buffer.consume(_buffer.size());
+}
+
+void LoadConnection::close() {
+  if (_socket) {
+    boost::system::error_code ec;
+    _socket->close(ec);
+    _socket.reset();
+  }
+}
+
+bool LoadConnection::send(const LoadRequest &request, LoadResponse *response,
+                          std::string *error) {
+  try {
+    if (!_socket) {
+      connect();
+    }
+    std::ostringstream os;
+    os << request.method << " " << request.path << " HTTP/1.1\r\n"
+       << "Host: " << _host << ":" << _port << "\r\n"
+       << "User-Agent: ssvim-load/http\r\n"
+       << "Content-Type: application/json\r\n"
+       << "Content-Length: " << request.body.size() << "\r\n";
+    if (_secret.size()) {
+      os << "X-Ycm-Hmac: " << SignLoadRequest(_secret, request) << "\r\n";
+    }
+    os << "\r\n";
+    auto header = os.str();
+    std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(header), boost::asio::buffer(request.body)};
+    boost::asio::write(*_socket, buffers);
+
+    readResponse(response);
+    auto connection = response->fields.find("connection");
+    if (connection != response->fields.end() && connection->second == "close") {
+      close();
+    }
+    return true;
+  } catch (boost::system::system_error const &e) {
+    *error = e.what();
+  } catch (std::exception const &e) {
+    *error = e.what();
+  }
+  close();
+  return false;
+}
+
+static std::string Lowercased(std::string value) {
+  std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+  return value;
+}
+
+static std::string Trimmed(const std::string &value) {
+  auto begin = value.find_first_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  auto end = value.find_last_not_of(" \t\r");
+  return value.substr(begin, end - begin + 1);
+}
+
+// Take a line, without its CRLF, from the front of the buffer
+static std::string ConsumeLine(boost::asio::streambuf &buffer,
+                               std::size_t length) {
+  std::string line(length, '\0');
+  std::istream is(&buffer);
+  is.read(&line[0], length);
+  return line.substr(0, line.size() - 2);
+}
+
+void LoadConnection::readResponse(LoadResponse *response) {
+  *response = LoadResponse();
+  auto length = boost::asio::read_until(*_socket, _buffer, "\r\n");
+  auto statusLine = ConsumeLine(_buffer, length);
+  // HTTP/1.1 200 OK
+  auto space = statusLine.find(' ');
+  if (statusLine.compare(0, 5, "HTTP/") || space == std::string::npos) {
+    throw std::runtime_error("Malformed status line: " + statusLine);
+  }
+  response->status = std::stoi(statusLine.substr(space + 1, 3));
+
+  while (true) {
+    length = boost::asio::read_until(*_socket, _buffer, "\r\n");
+    auto line = ConsumeLine(_buffer, length);
+    if (line.empty()) {
+      break;
+    }
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    response->fields[Lowercased(line.substr(0, colon))] =
+        Trimmed(line.substr(colon + 1));
+  }
+
+  auto transferEncoding = response->fields.find("transfer-encoding");
+  if (transferEncoding != response->fields.end() &&
+      Lowercased(transferEncoding->second) == "chunked") {
+    readChunkedBody(response);
+    return;
+  }
+
+  // Bodyless responses
+  if (response->status == 204 || response->status == 304) {
+    return;
+  }
+  auto contentLength = response->fields.find("content-length");
+  if (contentLength == response->fields.end()) {
+    throw std::runtime_error("Response without a length");
+  }
+  auto size = std::stoull(contentLength->second);
+  if (_buffer.size() < size) {
+    boost::asio::read(*_socket, _buffer,
+                      boost::asio::transfer_exactly(size - _buffer.size()));
+  }
+  response->body.resize(size);
+  std::istream is(&_buffer);
+  is.read(&response->body[0], size);
+}
+
+void LoadConnection::readChunkedBody(LoadResponse *response) {
+  while (true) {
+    auto length = boost::asio::read_until(*_socket, _buffer, "\r\n");
+    auto sizeLine = ConsumeLine(_buffer, length);
+    auto size = std::stoull(sizeLine, nullptr, 16);
+    if (size == 0) {
+      break;
+    }
+    // The chunk and its CRLF
+    if (_buffer.size() < size + 2) {
+      boost::asio::read(
+          *_socket, _buffer,
+          boost::asio::transfer_exactly(size + 2 - _buffer.size()));
+    }
+    auto offset = response->body.size();
+    response->body.resize(offset + size);
+    std::istream is(&_buffer);
+    is.read(&response->body[offset], size);
+    _buffer.consume(2);
+  }
+
+  // Trailers, like the HMAC, end with an empty line
+  while (true) {
+    auto length = boost::asio::read_until(*_socket, _buffer, "\r\n");
+    auto line = ConsumeLine(_buffer, length);
+    if (line.empty()) {
+      break;
+    }
+    auto colon = line.find(':');
+    if (colon != std::string::npos) {
+      response->fields[Lowercased(line.substr(0, colon))] =
+          Trimmed(line.substr(colon + 1));
+    }
+  }
+}
+
+std::string ssvim::SignLoadRequest(const std::string &secret,
+                                   const LoadRequest &request) {
+  auto path = request.path.substr(0, request.path.find('?'));
+  auto joined = HMACSHA256::Digest(secret, request.method) +
+                HMACSHA256::Digest(secret, path) +
+                HMACSHA256::Digest(secret, request.body);
+  return Base64Encode(HMACSHA256::Digest(secret, joined));
+}
+
+bool ssvim::ReadLoadSecret(const std::string &path, std::string *secret) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  try {
+    boost::property_tree::ptree secretJSON;
+    std::istringstream is(contents.str());
+    boost::property_tree::read_json(is, secretJSON);
+    if (Base64Decode(secretJSON.get<std::string>("hmac_secret"), secret)) {
+      return true;
+    }
+  } catch (std::exception &) {
+  }
+  *secret = contents.str();
+  return true;
+}
+
+#pragma mark - Stats
+
+void LoadStats::record(std::chrono::steady_clock::duration latency,
+                       int status) {
+  _latency.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+  std::lock_guard<std::mutex> lock(_mutex);
+  _statuses[status]++;
+}
+
+void LoadStats::recordError() {
+  _errors.increment();
+}
+
+std::map<int, std::uint64_t> LoadStats::statuses() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _statuses;
+}
+
+LoadStats &LoadReport::stats(const std::string &name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &stats = _stats[name];
+  if (!stats) {
+    stats.reset(new LoadStats());
+  }
+  return *stats;
+}
+
+void LoadReport::record(const std::string &name,
+                        std::chrono::steady_clock::duration latency,
+                        int status) {
+  stats(name).record(latency, status);
+  _total.record(latency, status);
+}
+
+void LoadReport::recordError(const std::string &name) {
+  stats(name).recordError();
+  _total.recordError();
+}
+
+static double Milliseconds(std::uint64_t microseconds) {
+  return microseconds / 1000.0;
+}
+
+static void PrintRow(std::ostream &os, const std::string &name,
+                     LoadStats &stats, double seconds) {
+  auto latency = stats.latency();
+  os << std::left << std::setw(16) << name << std::right << std::setw(10)
+     << latency.count << std::setw(8) << stats.errors() << std::fixed
+     << std::setprecision(1) << std::setw(10) << latency.count / seconds;
+  os << std::setprecision(2);
+  for (auto quantile : LoadPercentiles) {
+    os << std::setw(10) << Milliseconds(latency.valueAtQuantile(quantile));
+  }
+  os << std::setw(10) << Milliseconds(latency.valueAtQuantile(1)) << "\n";
+}
+
+void LoadReport::print(std::ostream &os,
+                       std::chrono::duration<double> elapsed) {
+  os << std::left << std::setw(16) << "request" << std::right << std::setw(10)
+     << "responses" << std::setw(8) << "errors" << std::setw(10) << "req/s"
+     << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10)
+     << "p99 ms" << std::setw(10) << "p99.9 ms" << std::setw(10) << "max ms"
+     << "\n";
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto &entry : _stats) {
+    PrintRow(os, entry.first, *entry.second, elapsed.count());
+  }
+  PrintRow(os, "total", _total, elapsed.count());
+  for (auto &status : _total.statuses()) {
+    os << "status " << status.first << ": " << status.second << "\n";
+  }
+}
+
+static void WriteStatsJSON(std::ostream &os, LoadStats &stats,
+                           double seconds) {
+  auto latency = stats.latency();
+  os << "{\"responses\":" << latency.count << ",\"errors\":" << stats.errors()
+     << ",\"requests_per_second\":" << latency.count / seconds
+     << ",\"latency_ms\":{";
+  const char *names[] = {"p50", "p90", "p99", "p99.9"};
+  for (unsigned i = 0; i < 4; i++) {
+    os << "\"" << names[i] << "\":"
+       << Milliseconds(latency.valueAtQuantile(LoadPercentiles[i])) << ",";
+  }
+  os << "\"max\":" << Milliseconds(latency.valueAtQuantile(1)) << ",\"mean\":"
+     << (latency.count ? Milliseconds(latency.sum) / latency.count : 0)
+     << "},\"statuses\":{";
+  auto first = true;
+  for (auto &status : stats.statuses()) {
+    os << (first ? "" : ",") << "\"" << status.first << "\":" << status.second;
+    first = false;
+  }
+  os << "}}";
+}
+
+void LoadReport::writeJSON(std::ostream &os,
+                           std::chrono::duration<double> elapsed,
+                           const std::map<std::string, std::string> &parameters) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  os << "{\"elapsed_seconds\":" << elapsed.count() << ",\"parameters\":{";
+  auto first = true;
+  for (auto &parameter : parameters) {
+    os << (first ? "" : ",") << "\"" << parameter.first << "\":\""
+       << parameter.second << "\"";
+    first = false;
+  }
+  os << "},\"requests\":{";
+  first = true;
+  for (auto &entry : _stats) {
+    os << (first ? "" : ",") << "\"" << entry.first << "\":";
+    WriteStatsJSON(os, *entry.second, elapsed.count());
+    first = false;
+  }
+  os << "},\"total\":";
+  WriteStatsJSON(os, _total, elapsed.count());
+  os << "}\n";
+}
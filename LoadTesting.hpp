@@ -0,0 +1,129 @@
+#import "Metrics.hpp"
+
+#import <boost/asio.hpp>
+#import <chrono>
+#import <cstdint>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <ostream>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * A request sent by the load tools.
+ */
+struct LoadRequest {
+  // Requests are reported by name, usually the endpoint
+  std::string name;
+  std::string method;
+  std::string path;
+  std::string body;
+};
+
+struct LoadResponse {
+  int status = 0;
+  // Keyed by the lower cased field name
+  std::map<std::string, std::string> fields;
+  std::string body;
+};
+
+/**
+ * A blocking, keep-alive HTTP/1.1 client connection.
+ *
+ * This is a small client rather than Beast's, so the load tools build
+ * anywhere boost does. It reads Content-Length and chunked bodies, which are
+ * all the server sends.
+ */
+class LoadConnection {
+  boost::asio::io_service _ioService;
+  std::string _host;
+  std::string _port;
+  std::string _secret;
+  std::unique_ptr<boost::asio::ip::tcp::socket> _socket;
+  boost::asio::streambuf _buffer;
+
+public:
+  // Requests are signed when secret isn't empty
+  LoadConnection(std::string host, std::string port, std::string secret = "");
+
+  // Send request and read the whole response, connecting first if the
+  // connection isn't open. Returns false, with an error, when the connection
+  // fails; it reconnects on the next send.
+  bool send(const LoadRequest &request, LoadResponse *response,
+            std::string *error);
+
+private:
+  void connect();
+  void close();
+  void readResponse(LoadResponse *response);
+  void readChunkedBody(LoadResponse *response);
+};
+
+// The X-Ycm-Hmac header value for a request, signed with secret
+std::string SignLoadRequest(const std::string &secret,
+                            const LoadRequest &request);
+
+// Read the secret like the server does: a ycmd style JSON file with a base64
+// encoded "hmac_secret", or the file's contents verbatim. Returns false if
+// the file can't be read.
+bool ReadLoadSecret(const std::string &path, std::string *secret);
+
+/**
+ * Latency and outcome counts for one kind of request.
+ *
+ * Latencies are recorded in microseconds in a Histogram, so percentiles are
+ * within its 12.5% precision. Recording is thread safe.
+ */
+class LoadStats {
+  Histogram _latency;
+  Counter _errors;
+  std::mutex _mutex;
+  std::map<int, std::uint64_t> _statuses;
+
+public:
+  void record(std::chrono::steady_clock::duration latency, int status);
+
+  // A request that failed before a response was read
+  void recordError();
+
+  HistogramSnapshot latency() const {
+    return _latency.snapshot();
+  }
+
+  std::uint64_t errors() const {
+    return _errors.value();
+  }
+
+  std::map<int, std::uint64_t> statuses();
+};
+
+/**
+ * A report of a load run, by request name and in total.
+ */
+class LoadReport {
+  std::mutex _mutex;
+  std::map<std::string, std::unique_ptr<LoadStats>> _stats;
+  LoadStats _total;
+
+public:
+  void record(const std::string &name,
+              std::chrono::steady_clock::duration latency, int status);
+
+  void recordError(const std::string &name);
+
+  // Print a table of throughput and latency percentiles
+  void print(std::ostream &os, std::chrono::duration<double> elapsed);
+
+  // Write the same as JSON, to compare runs
+  void writeJSON(std::ostream &os, std::chrono::duration<double> elapsed,
+                 const std::map<std::string, std::string> &parameters);
+
+private:
+  LoadStats &stats(const std::string &name);
+};
+
+// The percentiles reported, as quantiles
+extern const double LoadPercentiles[4];
+} // namespace ssvim
@@ -1,11 +1,221 @@
 #import "Logging.hpp"
+
+#import <algorithm>
+#import <array>
+#import <atomic>
+#import <chrono>
+#import <condition_variable>
+#import <cstdio>
+#import <cstdlib>
 #import <mutex>
-std::mutex ioMutex;
+#import <sstream>
+#import <thread>
+#import <vector>
+
+using namespace ssvim;
+
+namespace {
+
+/**
+ * A single producer, single consumer ring of records.
+ *
+ * The thread that owns the ring is the producer. The consumer is whoever
+ * holds the writer's drain lock.
+ */
+class LogRing {
+public:
+  static const std::size_t Capacity = 1024;
+
+private:
+  std::array<LogRecord, Capacity> _records;
+  // The next record to read, and the next to write
+  std::atomic<std::size_t> _head;
+  std::atomic<std::size_t> _tail;
+
+public:
+  // Set when the owning thread exits
+  std::atomic<bool> retired;
+
+  LogRing() : _head(0), _tail(0), retired(false) {
+  }
+
+  // Returns false, leaving record alone, if the ring is full
+  bool push(LogRecord &record) {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    _records[tail % Capacity] = std::move(record);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  template <class Fn> void drain(Fn fn) {
+    auto head = _head.load(std::memory_order_relaxed);
+    auto tail = _tail.load(std::memory_order_acquire);
+    for (; head != tail; head++) {
+      auto &record = _records[head % Capacity];
+      fn(record);
+      // Free the arguments here, rather than on the logging thread
+      record = LogRecord();
+      _head.store(head + 1, std::memory_order_release);
+    }
+  }
+
+  std::size_t size() {
+    return _tail.load(std::memory_order_acquire) -
+           _head.load(std::memory_order_acquire);
+  }
+};
+
+/**
+ * LogWriter drains every thread's ring on a background thread.
+ *
+ * Output is written in one write per drain rather than one per line, and
+ * stdout is only flushed when there was something to write.
+ */
+class LogWriter {
+  std::mutex _ringsMutex;
+  std::vector<std::shared_ptr<LogRing>> _rings;
+  std::mutex _drainMutex;
+  std::mutex _wakeMutex;
+  std::condition_variable _wake;
+  std::string _out;
+  std::string _err;
+
+public:
+  std::atomic<std::uint64_t> dropped;
+
+  // Leaked, so it outlives static loggers and is usable at exit
+  static LogWriter &Shared() {
+    static LogWriter *writer = new LogWriter();
+    return *writer;
+  }
+
+  std::shared_ptr<LogRing> addRing() {
+    auto ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> lock(_ringsMutex);
+    _rings.push_back(ring);
+    return ring;
+  }
+
+  void wake() {
+    _wake.notify_one();
+  }
+
+  void drain();
+
+private:
+  LogWriter() : dropped(0) {
+    std::atexit([] { LogWriter::Shared().drain(); });
+    std::thread([this] { run(); }).detach();
+  }
+
+  void run() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(_wakeMutex);
+        _wake.wait_for(lock, std::chrono::milliseconds(10));
+      }
+      drain();
+    }
+  }
+};
+
+void LogWriter::drain() {
+  std::lock_guard<std::mutex> drainLock(_drainMutex);
+  std::vector<std::shared_ptr<LogRing>> rings;
+  {
+    std::lock_guard<std::mutex> lock(_ringsMutex);
+    rings = _rings;
+  }
+
+  std::ostringstream out, err;
+  for (auto &ring : rings) {
+    // Read retired first: a retired ring gets no more records, so once it's
+    // drained it can go.
+    auto retired = ring->retired.load(std::memory_order_acquire);
+    ring->drain([&](LogRecord &record) {
+      auto &os = record.level == LogLevelError ? err : out;
+      os << *record.prefix;
+      record.format(os);
+      os << '\n';
+    });
+    if (retired) {
+      std::lock_guard<std::mutex> lock(_ringsMutex);
+      _rings.erase(std::find(_rings.begin(), _rings.end(), ring));
+    }
+  }
+  if (auto count = dropped.exchange(0)) {
+    err << "__LOG: dropped " << count << " messages\n";
+  }
+
+  _out = out.str();
+  _err = err.str();
+  if (_out.size()) {
+    fwrite(_out.data(), 1, _out.size(), stdout);
+    fflush(stdout);
+  }
+  if (_err.size()) {
+    fwrite(_err.data(), 1, _err.size(), stderr);
+  }
+}
+
+// Marks the thread's ring retired when the thread exits
+struct ThreadRing {
+  std::shared_ptr<LogRing> ring;
+
+  ~ThreadRing() {
+    if (ring) {
+      ring->retired.store(true, std::memory_order_release);
+    }
+  }
+};
+
+thread_local ThreadRing CurrentRing;
+} // namespace
+
+void ssvim::logging::Enqueue(LogRecord &&record) {
+  auto &writer = LogWriter::Shared();
+  auto &ring = CurrentRing.ring;
+  if (!ring) {
+    ring = writer.addRing();
+  }
+  while (!ring->push(record)) {
+    if (record.level != LogLevelError) {
+      writer.dropped++;
+      return;
+    }
+    // Errors are never dropped. Wait for the writer to make room.
+    writer.wake();
+    std::this_thread::yield();
+  }
+  // Wake the writer early for errors, and before a burst fills the ring
+  if (record.level == LogLevelError ||
+      ring->size() == LogRing::Capacity / 2) {
+    writer.wake();
+  }
+}
 
-void ssvim::Logger::writeLock() {
-  ioMutex.lock();
+void ssvim::logging::Flush() {
+  LogWriter::Shared().drain();
 }
 
-void ssvim::Logger::writeUnLock() {
-  ioMutex.unlock();
+std::string ssvim::SummarizePayload(const std::string &payload) {
+  // FNV-1a is plenty to tell payloads apart in a log
+  std::uint64_t hash = 0xcbf29ce484222325;
+  for (auto c : payload) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  const std::size_t PreviewLength = 48;
+  auto preview = payload.substr(0, PreviewLength);
+  for (auto &c : preview) {
+    if (static_cast<unsigned char>(c) < 0x20) {
+      c = ' ';
+    }
+  }
+  char summary[64];
+  snprintf(summary, sizeof(summary), "<%zu bytes, fnv1a %016llx> ",
+           payload.size(), static_cast<unsigned long long>(hash));
+  return summary + preview + (payload.size() > PreviewLength ? "..." : "");
 }
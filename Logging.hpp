@@ -1,4 +1,17 @@
+#import <functional>
 #import <iostream>
+#import <memory>
+#import <string>
+#import <tuple>
+#import <type_traits>
+#import <utility>
+
+// Messages above this level are compiled out: the level check folds to a
+// constant, and the call, argument copies included, is removed. Builds that
+// only want errors can define this as LogLevelError.
+#ifndef SSVIM_COMPILED_LOG_LEVEL
+#define SSVIM_COMPILED_LOG_LEVEL LogLevelExtreme
+#endif
 
 namespace ssvim {
 
@@ -8,54 +21,88 @@ typedef enum LogLevel {
   LogLevelExtreme
 } LogLevel;
 
-class Logger : public std::enable_shared_from_this<Logger> {
-  LogLevel const _level;
-  std::string _messagePrefix;
+/**
+ * A message that hasn't been formatted yet.
+ */
+struct LogRecord {
+  LogLevel level;
+  std::shared_ptr<const std::string> prefix;
+  std::function<void(std::ostream &)> format;
+};
+
+namespace logging {
+
+// Queue a record on the calling thread's ring. Records are formatted and
+// written by a background writer. Error records are never dropped; other
+// records are dropped, and counted, when the ring is full.
+void Enqueue(LogRecord &&record);
+
+// Format and write every queued record. This runs at exit as well, so
+// messages logged right before exit aren't lost.
+void Flush();
+
+// Log arguments are stored by value, since they're formatted after the
+// caller returns. C strings are copied into strings for the same reason.
+template <class T> struct Stored { using type = T; };
+template <> struct Stored<char *> { using type = std::string; };
+template <> struct Stored<const char *> { using type = std::string; };
+
+template <class T>
+using StoredType = typename Stored<typename std::decay<T>::type>::type;
+
+template <class Tuple, std::size_t... I>
+void FormatArgs(std::ostream &os, const Tuple &args,
+                std::index_sequence<I...>) {
+  ((os << std::get<I>(args)), ...);
+}
+} // namespace logging
+
+/**
+ * Logger queues messages for a background writer.
+ *
+ * Logging copies the arguments into a per thread ring, without taking a lock
+ * or formatting anything; the writer formats and writes them in batches.
+ * Copies of a Logger share its prefix.
+ */
+class Logger {
+  LogLevel _level;
+  std::shared_ptr<const std::string> _messagePrefix;
 
 public:
   Logger(LogLevel level, std::string channel = "SS")
-      : _level(level), _messagePrefix("__" + channel + ": ") {
+      : _level(level), _messagePrefix(std::make_shared<const std::string>(
+                           "__" + channel + ": ")) {
   }
 
-  template <class... Args> Logger log(LogLevel level, Args const &... args) {
-    if (level <= _level) {
-      return logArgs(level, args...);
+  // Log args on a single line
+  template <class... Args> Logger &log(LogLevel level, Args const &... args) {
+    if (!isEnabled(level)) {
+      return *this;
     }
+    std::tuple<logging::StoredType<Args>...> stored(args...);
+    logging::Enqueue({level, _messagePrefix, [stored](std::ostream &os) {
+                        logging::FormatArgs(
+                            os, stored, std::index_sequence_for<Args...>{});
+                      }});
     return *this;
   }
 
   // By default this logs debugging messages
-  template <class Args> Logger &operator<<(Args args) {
-    log(LogLevelInfo, args);
-    return *this;
-  }
-
-  auto level() {
-    return _level;
-  };
-
-private:
-  Logger &logArgs(LogLevel level) {
-    return *this;
+  template <class Arg> Logger &operator<<(Arg const &arg) {
+    return log(LogLevelInfo, arg);
   }
 
-  template <class Arg, class... Args>
-  Logger &logArgs(LogLevel level, Arg const &arg, Args const &... args) {
-    if (level == LogLevelError) {
-      writeLock();
-      std::cerr << _messagePrefix << arg << std::endl;
-      writeUnLock();
-    } else {
-      writeLock();
-      std::cout << _messagePrefix << arg << std::endl;
-      writeUnLock();
-    }
-    logArgs(level, args...);
-    return *this;
+  // Check before building expensive arguments
+  bool isEnabled(LogLevel level) const {
+    return level <= SSVIM_COMPILED_LOG_LEVEL && level <= _level;
   }
 
-  void writeLock();
-
-  void writeUnLock();
+  LogLevel level() const {
+    return _level;
+  };
 };
+
+// A short stand in for a payload that may be large, like a request body:
+// its size, a hash and the first few bytes.
+std::string SummarizePayload(const std::string &payload);
 } // namespace ssvim
@@ -0,0 +1,143 @@
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+
+using namespace ssvim;
+
+// Entries are indexed by cache and key together
+static std::string EntryID(const std::string &cache, const std::string &key) {
+  return cache + '\0' + key;
+}
+
+MemoryBudget &MemoryBudget::Shared() {
+  static MemoryBudget *budget = [] {
+    auto budget = new MemoryBudget();
+    MetricsRegistry::Shared().observe(
+        "ssvim_memory_budget_bytes", "The memory budget, 0 when unlimited",
+        "gauge", "", [budget] { return budget->limit(); });
+    return budget;
+  }();
+  return *budget;
+}
+
+std::uint64_t MemoryBudget::NextGeneration() {
+  static std::atomic<std::uint64_t> Generation(0);
+  return ++Generation;
+}
+
+void MemoryBudget::setLimit(std::uint64_t bytes) {
+  _limit.store(bytes);
+  std::vector<Evict> evicted;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    evicted = trim();
+  }
+  for (auto &evict : evicted) {
+    evict();
+  }
+}
+
+std::uint64_t MemoryBudget::limit() const {
+  return _limit.load(std::memory_order_relaxed);
+}
+
+void MemoryBudget::use(const std::string &cacheName, const std::string &key,
+                       std::uint64_t bytes, Evict evict) {
+  std::vector<Evict> evicted;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &stats = cache(cacheName);
+    auto id = EntryID(cacheName, key);
+    auto found = _index.find(id);
+    if (found != _index.end()) {
+      erase(found->second);
+    }
+    _entries.push_front({cacheName, key, bytes, std::move(evict)});
+    _index[id] = _entries.begin();
+    _total += bytes;
+    stats.bytes += bytes;
+    stats.entries++;
+    evicted = trim();
+  }
+  for (auto &evict : evicted) {
+    evict();
+  }
+}
+
+void MemoryBudget::remove(const std::string &cacheName,
+                          const std::string &key) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _index.find(EntryID(cacheName, key));
+  if (found != _index.end()) {
+    erase(found->second);
+  }
+}
+
+void MemoryBudget::clear(const std::string &cacheName) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = _entries.begin(); it != _entries.end();) {
+    auto next = std::next(it);
+    if (it->cache == cacheName) {
+      erase(it);
+    }
+    it = next;
+  }
+}
+
+std::map<std::string, MemoryCacheUsage> MemoryBudget::usage() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::map<std::string, MemoryCacheUsage> usage;
+  for (auto &entry : _caches) {
+    auto &stats = *entry.second;
+    usage[entry.first] = {stats.bytes.load(), stats.entries.load(),
+                          stats.evictions->value()};
+  }
+  return usage;
+}
+
+#pragma mark - Private
+
+MemoryBudget::Cache &MemoryBudget::cache(const std::string &name) {
+  auto &stats = _caches[name];
+  if (stats) {
+    return *stats;
+  }
+  stats.reset(new Cache());
+  auto raw = stats.get();
+  auto &registry = MetricsRegistry::Shared();
+  auto label = MetricLabel("cache", name);
+  stats->evictions = &registry.counter(
+      "ssvim_memory_evictions_total",
+      "Entries evicted to stay within the memory budget", label);
+  // These only read atomics, so writing metrics never waits on the budget
+  registry.observe("ssvim_memory_cache_bytes",
+                   "Estimated bytes held by each cache", "gauge", label,
+                   [raw] { return raw->bytes.load(); });
+  registry.observe("ssvim_memory_cache_entries", "Entries held by each cache",
+                   "gauge", label, [raw] { return raw->entries.load(); });
+  return *stats;
+}
+
+void MemoryBudget::erase(std::list<Entry>::iterator it) {
+  auto &stats = *_caches[it->cache];
+  _total -= it->bytes;
+  stats.bytes -= it->bytes;
+  stats.entries--;
+  _index.erase(EntryID(it->cache, it->key));
+  _entries.erase(it);
+}
+
+// Evict least recently used entries until the total fits. The caller runs
+// the returned evict functions once it lets go of the lock, since they may
+// block on sourcekitd or call back into the budget.
+std::vector<MemoryBudget::Evict> MemoryBudget::trim() {
+  std::vector<Evict> evicted;
+  auto limit = _limit.load();
+  // The most recently used entry stays, even when it's over the limit alone
+  while (limit && _total > limit && _entries.size() > 1) {
+    auto last = std::prev(_entries.end());
+    _caches[last->cache]->evictions->increment();
+    evicted.push_back(std::move(last->evict));
+    erase(last);
+  }
+  return evicted;
+}
@@ -0,0 +1,94 @@
+#import <atomic>
+#import <cstdint>
+#import <functional>
+#import <list>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string>
+#import <unordered_map>
+#import <vector>
+
+namespace ssvim {
+
+class Counter;
+
+/**
+ * A cache's share of the budget.
+ */
+struct MemoryCacheUsage {
+  std::uint64_t bytes;
+  std::uint64_t entries;
+  std::uint64_t evictions;
+};
+
+/**
+ * MemoryBudget bounds the memory held by the server's caches, and by
+ * sourcekitd on their behalf.
+ *
+ * Caches account an estimate of each entry's size as they add and use
+ * entries. Entries of every cache share one least recently used order, so
+ * once the total goes over the limit the least recently used entries are
+ * evicted, whichever cache holds them, until it fits again. Evicting an entry
+ * calls its evict function, which frees it: a sourcekitd document is closed,
+ * for instance.
+ *
+ * Evict functions run once the budget's lock is let go, so the key may be
+ * used again before one runs. Caches keep a generation with each entry, from
+ * NextGeneration, and evict functions ignore a generation that's been
+ * superseded.
+ */
+class MemoryBudget {
+public:
+  using Evict = std::function<void()>;
+
+  static MemoryBudget &Shared();
+
+  // A generation for a use of an entry, unique to the process
+  static std::uint64_t NextGeneration();
+
+  // 0 is no limit, the default
+  void setLimit(std::uint64_t bytes);
+  std::uint64_t limit() const;
+
+  // Add an entry, or update its size, and make it the most recently used.
+  // evict runs once the entry is evicted, without the budget's lock held.
+  void use(const std::string &cache, const std::string &key,
+           std::uint64_t bytes, Evict evict);
+
+  // Forget an entry without evicting it, as when its cache already let go
+  void remove(const std::string &cache, const std::string &key);
+
+  // Forget every entry of a cache without evicting them
+  void clear(const std::string &cache);
+
+  // Usage by cache name
+  std::map<std::string, MemoryCacheUsage> usage();
+
+private:
+  struct Entry {
+    std::string cache;
+    std::string key;
+    std::uint64_t bytes;
+    Evict evict;
+  };
+
+  struct Cache {
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> entries{0};
+    Counter *evictions;
+  };
+
+  std::mutex _mutex;
+  std::atomic<std::uint64_t> _limit{0};
+  std::uint64_t _total = 0;
+  // Most recently used first
+  std::list<Entry> _entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+  std::map<std::string, std::unique_ptr<Cache>> _caches;
+
+  Cache &cache(const std::string &name);
+  void erase(std::list<Entry>::iterator it);
+  std::vector<Evict> trim();
+};
+} // namespace ssvim
@@ -0,0 +1,219 @@
+#import "Metrics.hpp"
+
+#import <algorithm>
+#import <cmath>
+#import <iomanip>
+#import <sstream>
+
+using namespace ssvim;
+
+#pragma mark - Histogram
+
+// Threads pick a stripe round robin, the first time they record
+static std::atomic<unsigned> NextStripe(0);
+static thread_local unsigned CurrentStripe =
+    NextStripe++ % Histogram::Stripes;
+
+unsigned Histogram::BucketIndex(std::uint64_t value) {
+  if (value < SubBuckets) {
+    return static_cast<unsigned>(value);
+  }
+  unsigned exponent = 63 - __builtin_clzll(value);
+  if (exponent > MaxExponent) {
+    return BucketCount - 1;
+  }
+  auto shift = exponent - SubBucketBits;
+  auto subBucket = static_cast<unsigned>(value >> shift) & (SubBuckets - 1);
+  return SubBuckets + shift * SubBuckets + subBucket;
+}
+
+std::uint64_t Histogram::BucketUpperBound(unsigned index) {
+  if (index < SubBuckets) {
+    return index;
+  }
+  auto shift = (index - SubBuckets) / SubBuckets;
+  auto subBucket = (index - SubBuckets) % SubBuckets;
+  return ((std::uint64_t(SubBuckets + subBucket + 1)) << shift) - 1;
+}
+
+void Histogram::record(std::uint64_t value) {
+  auto &stripe = _stripes[CurrentStripe];
+  stripe.counts[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  stripe.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.counts.assign(BucketCount, 0);
+  snapshot.count = 0;
+  snapshot.sum = 0;
+  for (auto &stripe : _stripes) {
+    for (unsigned i = 0; i < BucketCount; i++) {
+      auto count = stripe.counts[i].load(std::memory_order_relaxed);
+      snapshot.counts[i] += count;
+      snapshot.count += count;
+    }
+    snapshot.sum += stripe.sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+std::uint64_t HistogramSnapshot::countAtOrBelow(std::uint64_t value) const {
+  std::uint64_t total = 0;
+  for (unsigned i = 0; i < counts.size(); i++) {
+    if (Histogram::BucketUpperBound(i) > value) {
+      break;
+    }
+    total += counts[i];
+  }
+  return total;
+}
+
+std::uint64_t HistogramSnapshot::valueAtQuantile(double quantile) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = static_cast<std::uint64_t>(quantile * count);
+  rank = std::max<std::uint64_t>(1, std::min(rank, count));
+  std::uint64_t seen = 0;
+  for (unsigned i = 0; i < counts.size(); i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return Histogram::BucketUpperBound(i);
+    }
+  }
+  return Histogram::BucketUpperBound(Histogram::BucketCount - 1);
+}
+
+#pragma mark - Registry
+
+std::string ssvim::MetricLabel(const std::string &name,
+                               const std::string &value) {
+  std::string label = name + "=\"";
+  for (auto c : value) {
+    if (c == '"' || c == '\\') {
+      label += '\\';
+      label += c;
+    } else if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  return label + "\"";
+}
+
+MetricsRegistry &MetricsRegistry::Shared() {
+  // Leaked: metrics are recorded until the process exits
+  static MetricsRegistry *registry = new MetricsRegistry();
+  return *registry;
+}
+
+MetricsRegistry::Family &MetricsRegistry::family(const std::string &name,
+                                                 const std::string &help,
+                                                 const std::string &type) {
+  auto &family = _families[name];
+  if (family.type.empty()) {
+    family.help = help;
+    family.type = type;
+  }
+  return family;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name,
+                                      const std::string &help,
+                                      HistogramUnit unit,
+                                      const std::string &labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &entry = family(name, help, "histogram");
+  entry.unit = unit;
+  auto &histogram = entry.histograms[labels];
+  if (!histogram) {
+    histogram.reset(new Histogram());
+  }
+  return *histogram;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name,
+                                  const std::string &help,
+                                  const std::string &labels) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &counter = family(name, help, "counter").counters[labels];
+  if (!counter) {
+    counter.reset(new Counter());
+  }
+  return *counter;
+}
+
+void MetricsRegistry::observe(const std::string &name, const std::string &help,
+                              const std::string &type,
+                              const std::string &labels,
+                              std::function<double()> value) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  family(name, help, type).callbacks[labels] = value;
+}
+
+// Bucket bounds for export, in exported units. The recorded buckets are much
+// finer; these are what dashboards aggregate over.
+static const std::vector<double> SecondsBounds = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1,    0.25,  0.5,    1,     2.5,  5,     10};
+static const std::vector<double> BytesBounds = {
+    256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216};
+
+static std::string JoinLabels(const std::string &labels,
+                              const std::string &extra) {
+  if (labels.empty() && extra.empty()) {
+    return "";
+  }
+  if (labels.empty() || extra.empty()) {
+    return "{" + labels + extra + "}";
+  }
+  return "{" + labels + "," + extra + "}";
+}
+
+static std::string FormatBound(double bound) {
+  std::ostringstream os;
+  os << std::setprecision(12) << bound;
+  return os.str();
+}
+
+void MetricsRegistry::writePrometheus(std::ostream &os) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  os << std::setprecision(12);
+  for (auto &entry : _families) {
+    auto &name = entry.first;
+    auto &family = entry.second;
+    os << "# HELP " << name << " " << family.help << "\n";
+    os << "# TYPE " << name << " " << family.type << "\n";
+
+    for (auto &counter : family.counters) {
+      os << name << JoinLabels(counter.first, "") << " "
+         << counter.second->value() << "\n";
+    }
+    for (auto &callback : family.callbacks) {
+      os << name << JoinLabels(callback.first, "") << " " << callback.second()
+         << "\n";
+    }
+
+    auto seconds = family.unit == HistogramUnitMicroseconds;
+    auto scale = seconds ? 1e-6 : 1;
+    auto &bounds = seconds ? SecondsBounds : BytesBounds;
+    for (auto &histogram : family.histograms) {
+      auto &labels = histogram.first;
+      auto snapshot = histogram.second->snapshot();
+      for (auto bound : bounds) {
+        auto raw = static_cast<std::uint64_t>(std::llround(bound / scale));
+        os << name << "_bucket"
+           << JoinLabels(labels, MetricLabel("le", FormatBound(bound))) << " "
+           << snapshot.countAtOrBelow(raw) << "\n";
+      }
+      os << name << "_bucket" << JoinLabels(labels, "le=\"+Inf\"") << " "
+         << snapshot.count << "\n";
+      os << name << "_sum" << JoinLabels(labels, "") << " "
+         << snapshot.sum * scale << "\n";
+      os << name << "_count" << JoinLabels(labels, "") << " "
+         << snapshot.count << "\n";
+    }
+  }
+}
@@ -0,0 +1,133 @@
+#import <array>
+#import <atomic>
+#import <cstdint>
+#import <functional>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <ostream>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+typedef enum HistogramUnit {
+  // Recorded in microseconds, exported in seconds
+  HistogramUnitMicroseconds,
+  HistogramUnitBytes,
+} HistogramUnit;
+
+/**
+ * A consistent copy of a histogram's counts.
+ */
+struct HistogramSnapshot {
+  std::vector<std::uint64_t> counts;
+  std::uint64_t count;
+  std::uint64_t sum;
+
+  // The number of recorded values at or below value
+  std::uint64_t countAtOrBelow(std::uint64_t value) const;
+
+  // The value at quantile, in [0, 1]. This is the upper bound of the bucket
+  // holding it, so it's within the histogram's precision.
+  std::uint64_t valueAtQuantile(double quantile) const;
+};
+
+/**
+ * Histogram records integer values into log linear buckets, in the style of
+ * HdrHistogram: every power of two is split into 8 buckets, so a value's
+ * bucket is within 12.5% of it from 1 up to 2^40.
+ *
+ * Recording is lock free. Each thread records into one of a few stripes of
+ * counters, so threads rarely write to the same cache line; snapshots sum
+ * the stripes.
+ */
+class Histogram {
+public:
+  static const unsigned SubBucketBits = 3;
+  static const unsigned SubBuckets = 1 << SubBucketBits;
+  static const unsigned MaxExponent = 40;
+  static const unsigned BucketCount =
+      SubBuckets + (MaxExponent - SubBucketBits + 1) * SubBuckets;
+  static const unsigned Stripes = 8;
+
+  void record(std::uint64_t value);
+
+  HistogramSnapshot snapshot() const;
+
+  // The bucket for value, and the largest value in a bucket
+  static unsigned BucketIndex(std::uint64_t value);
+  static std::uint64_t BucketUpperBound(unsigned index);
+
+private:
+  struct alignas(64) Stripe {
+    std::array<std::atomic<std::uint64_t>, BucketCount> counts{};
+    std::atomic<std::uint64_t> sum{0};
+  };
+  std::array<Stripe, Stripes> _stripes;
+};
+
+/**
+ * A monotonic counter.
+ */
+class Counter {
+  std::atomic<std::uint64_t> _value{0};
+
+public:
+  void increment(std::uint64_t by = 1) {
+    _value.fetch_add(by, std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const {
+    return _value.load(std::memory_order_relaxed);
+  }
+};
+
+// Format a Prometheus label pair, name="value", escaping the value
+std::string MetricLabel(const std::string &name, const std::string &value);
+
+/**
+ * MetricsRegistry holds the process's metrics, and writes them in the
+ * Prometheus text format.
+ *
+ * Metrics are created on first use and never destroyed, so callers on a hot
+ * path should look a metric up once and keep the reference. Values that
+ * are already tracked elsewhere, like queue depths, are registered as
+ * callbacks and read when metrics are written.
+ */
+class MetricsRegistry {
+  struct Family {
+    std::string help;
+    std::string type;
+    HistogramUnit unit = HistogramUnitMicroseconds;
+    // Keyed by the formatted label set
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::function<double()>> callbacks;
+  };
+
+  std::mutex _mutex;
+  std::map<std::string, Family> _families;
+
+public:
+  static MetricsRegistry &Shared();
+
+  Histogram &histogram(const std::string &name, const std::string &help,
+                       HistogramUnit unit, const std::string &labels = "");
+
+  Counter &counter(const std::string &name, const std::string &help,
+                   const std::string &labels = "");
+
+  // Register a gauge, or a counter, whose value is read when metrics are
+  // written. type is "gauge" or "counter".
+  void observe(const std::string &name, const std::string &help,
+               const std::string &type, const std::string &labels,
+               std::function<double()> value);
+
+  void writePrometheus(std::ostream &os);
+
+private:
+  Family &family(const std::string &name, const std::string &help,
+                 const std::string &type);
+};
+} // namespace ssvim
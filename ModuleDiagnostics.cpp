@@ -0,0 +1,263 @@
+#import "ModuleDiagnostics.hpp"
+#import "CompletionContext.hpp"
+#import "Executor.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "SwiftCompleter.hpp"
+
+using namespace ssvim;
+
+static const auto DiagnosticsCache = "module_diagnostics";
+
+// Background diagnoses get longer than a request, since nobody is waiting
+static const auto BackgroundDeadline = std::chrono::seconds(30);
+
+static Counter &DiagnosticsCounter(const char *result) {
+  return MetricsRegistry::Shared().counter(
+      "ssvim_diagnostics_cache_total",
+      "Diagnostics requests by whether cached diagnostics were up to date",
+      MetricLabel("result", result));
+}
+
+ModuleDiagnostics &ModuleDiagnostics::Shared() {
+  static ModuleDiagnostics *diagnostics = new ModuleDiagnostics();
+  return *diagnostics;
+}
+
+ModuleDiagnostics::ModuleDiagnostics()
+    : _logger(LogLevelError, "DIAG"), _hits(DiagnosticsCounter("hit")),
+      _misses(DiagnosticsCounter("miss")), _stale(DiagnosticsCounter("stale")),
+      _background(MetricsRegistry::Shared().counter(
+          "ssvim_background_diagnostics_total",
+          "Files diagnosed again after another file of their module changed")) {
+}
+
+void ModuleDiagnostics::setConcurrency(std::size_t maxRunning) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _maxRunning = maxRunning;
+  }
+  runNext();
+}
+
+std::string ModuleDiagnostics::ModuleKey(const std::vector<std::string> &flags) {
+  for (std::size_t i = 0; i + 1 < flags.size(); i++) {
+    if (flags[i] == "-module-name") {
+      return "-module-name " + flags[i + 1];
+    }
+  }
+  std::string key;
+  for (auto &flag : NormalizedCompletionFlags(flags)) {
+    key += flag;
+    key += '\0';
+  }
+  return key;
+}
+
+bool ModuleDiagnostics::contains(const std::string &fileName) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _documents.find(fileName) != _documents.end();
+}
+
+bool ModuleDiagnostics::lookup(const std::string &fileName,
+                               const std::string &contents,
+                               const std::vector<std::string> &flags,
+                               std::string *diagnostics, std::uint64_t *epoch) {
+  auto module = ModuleKey(flags);
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &moduleEpoch = _epochs[module];
+    auto found = _documents.find(fileName);
+    auto sameModule =
+        found != _documents.end() && found->second.module == module;
+    auto &document = _documents[fileName];
+    if (sameModule && document.contents == contents &&
+        document.flags == flags) {
+      *epoch = moduleEpoch;
+      if (!document.hasDiagnostics || document.epoch != moduleEpoch) {
+        _stale.increment();
+        return false;
+      }
+      *diagnostics = document.diagnostics;
+      _hits.increment();
+    } else {
+      if (sameModule) {
+        // An edit, or a save: the rest of the module is out of date
+        moduleEpoch++;
+        _logger.log(LogLevelInfo, "Invalidated the module of ", fileName);
+      }
+      document.module = module;
+      document.contents = contents;
+      document.flags = flags;
+      document.hasDiagnostics = false;
+      *epoch = moduleEpoch;
+      _misses.increment();
+      return false;
+    }
+  }
+  use(fileName, contents.size() + diagnostics->size());
+  return true;
+}
+
+void ModuleDiagnostics::store(const std::string &fileName,
+                              const std::string &contents,
+                              const std::vector<std::string> &flags,
+                              std::uint64_t epoch,
+                              const std::string &diagnostics,
+                              LogLevel logLevel) {
+  auto module = ModuleKey(flags);
+  std::vector<std::string> stale;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _documents.find(fileName);
+    if (found != _documents.end() && found->second.module == module &&
+        found->second.contents != contents) {
+      // It was edited again while these were computed
+      return;
+    }
+    auto &document = _documents[fileName];
+    document.module = module;
+    document.contents = contents;
+    document.flags = flags;
+    document.diagnostics = diagnostics;
+    document.epoch = epoch;
+    document.hasDiagnostics = true;
+    _logLevel = logLevel;
+    auto moduleEpoch = _epochs[module];
+    for (auto &entry : _documents) {
+      // Those without diagnostics are being diagnosed by a request already
+      if (entry.first != fileName && entry.second.module == module &&
+          entry.second.hasDiagnostics && entry.second.epoch < moduleEpoch) {
+        stale.push_back(entry.first);
+      }
+    }
+  }
+  use(fileName, contents.size() + diagnostics.size());
+  schedule(std::move(stale));
+}
+
+void ModuleDiagnostics::didChange(const std::string &fileName,
+                                  const std::string &contents,
+                                  const std::vector<std::string> &flags) {
+  auto module = ModuleKey(flags);
+  std::vector<std::string> stale;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _documents.find(fileName);
+    if (found == _documents.end() || found->second.module != module) {
+      // Not diagnosed yet, so nothing else was computed against it
+      return;
+    }
+    auto &document = found->second;
+    if (document.contents == contents) {
+      return;
+    }
+    auto moduleEpoch = ++_epochs[module];
+    document.contents = contents;
+    document.flags = flags;
+    for (auto &entry : _documents) {
+      if (entry.second.module == module && entry.second.hasDiagnostics &&
+          entry.second.epoch < moduleEpoch) {
+        stale.push_back(entry.first);
+      }
+    }
+  }
+  schedule(std::move(stale));
+}
+
+// The budget calls back without its lock held, so this must not hold ours
+void ModuleDiagnostics::use(const std::string &fileName, std::uint64_t bytes) {
+  std::uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _documents.find(fileName);
+    if (found == _documents.end()) {
+      return;
+    }
+    generation = found->second.generation = MemoryBudget::NextGeneration();
+  }
+  MemoryBudget::Shared().use(
+      DiagnosticsCache, fileName, fileName.size() + bytes,
+      [this, fileName, generation] {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _documents.find(fileName);
+        if (found != _documents.end() &&
+            found->second.generation == generation) {
+          _documents.erase(found);
+        }
+      });
+}
+
+#pragma mark - Background Diagnosis
+
+void ModuleDiagnostics::schedule(std::vector<std::string> fileNames) {
+  if (fileNames.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &fileName : fileNames) {
+      if (_scheduled.insert(fileName).second) {
+        _pending.push_back(fileName);
+      }
+    }
+  }
+  runNext();
+}
+
+// Start pending diagnoses while there's room. Each one starts the next as it
+// finishes, so at most _maxRunning SourceKit threads go to the background.
+void ModuleDiagnostics::runNext() {
+  std::vector<std::string> started;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    while (_running < _maxRunning && !_pending.empty()) {
+      started.push_back(_pending.front());
+      _scheduled.erase(_pending.front());
+      _pending.pop_front();
+      _running++;
+    }
+  }
+  for (auto &fileName : started) {
+    Executor::Shared().async(LaneSourceKit, [this, fileName] {
+      diagnose(fileName);
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running--;
+      }
+      runNext();
+    });
+  }
+}
+
+void ModuleDiagnostics::diagnose(const std::string &fileName) {
+  std::string contents;
+  std::vector<std::string> flags;
+  LogLevel logLevel;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _documents.find(fileName);
+    if (found == _documents.end() ||
+        found->second.epoch == _epochs[found->second.module]) {
+      // Evicted, or already diagnosed again by a request
+      return;
+    }
+    contents = found->second.contents;
+    flags = found->second.flags;
+    logLevel = _logLevel;
+  }
+  RequestDeadline deadline;
+  deadline.deadline = RequestDeadline::clock::now() + BackgroundDeadline;
+  UnsavedFile unsaved;
+  unsaved.fileName = fileName;
+  unsaved.setContents(contents);
+  try {
+    // This goes through the cache, which keeps the result
+    SwiftCompleter completer(logLevel, deadline);
+    completer.DiagnosticsForFile(fileName, {unsaved}, flags);
+    _background.increment();
+  } catch (std::exception &e) {
+    _logger.log(LogLevelError, "Background diagnosis of ", fileName,
+                " failed: ", e.what());
+  }
+}
@@ -0,0 +1,95 @@
+#import "Logging.hpp"
+
+#import <cstddef>
+#import <cstdint>
+#import <deque>
+#import <map>
+#import <mutex>
+#import <set>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+class Counter;
+
+/**
+ * ModuleDiagnostics caches the diagnostics of each file, and keeps them
+ * fresh as the other files of its module change.
+ *
+ * Files with the same -module-name, or else the same flags less the per file
+ * ones, make up a module. Each module has an epoch, bumped when one of its
+ * files changes. Diagnostics computed before the latest change are stale:
+ * they're not served from the cache, and they're computed again in the
+ * background, a few at a time, so they're ready by the time the user looks
+ * at the file.
+ */
+class ModuleDiagnostics {
+  struct Document {
+    std::string module;
+    std::string contents;
+    std::vector<std::string> flags;
+    std::string diagnostics;
+    // The module's epoch when the diagnostics were computed
+    std::uint64_t epoch = 0;
+    bool hasDiagnostics = false;
+    // Of its memory budget entry
+    std::uint64_t generation = 0;
+  };
+
+  std::mutex _mutex;
+  std::map<std::string, Document> _documents;
+  std::map<std::string, std::uint64_t> _epochs;
+  // Documents waiting for background diagnosis, and those queued or running
+  std::deque<std::string> _pending;
+  std::set<std::string> _scheduled;
+  std::size_t _running = 0;
+  std::size_t _maxRunning = 2;
+  LogLevel _logLevel = LogLevelError;
+  Logger _logger;
+  Counter &_hits;
+  Counter &_misses;
+  Counter &_stale;
+  Counter &_background;
+
+public:
+  static ModuleDiagnostics &Shared();
+
+  // The number of background diagnoses run at once. 0 turns them off.
+  void setConcurrency(std::size_t maxRunning);
+
+  // Whether the file was looked up since the server started, or since it was
+  // evicted
+  bool contains(const std::string &fileName);
+
+  // Returns true, with the cached diagnostics, when they're up to date.
+  // Otherwise sets epoch, to pass to store once they're computed. A change
+  // to a known file invalidates the rest of its module.
+  bool lookup(const std::string &fileName, const std::string &contents,
+              const std::vector<std::string> &flags, std::string *diagnostics,
+              std::uint64_t *epoch);
+
+  // Keep diagnostics computed as of epoch, and diagnose files of the module
+  // that are stale in the background.
+  void store(const std::string &fileName, const std::string &contents,
+             const std::vector<std::string> &flags, std::uint64_t epoch,
+             const std::string &diagnostics, LogLevel logLevel);
+
+  // A file changed outside of a diagnostics request, as when a request for
+  // another file brings its unsaved contents along. A change to a known file
+  // invalidates its module.
+  void didChange(const std::string &fileName, const std::string &contents,
+                 const std::vector<std::string> &flags);
+
+  // The module a file with these flags belongs to
+  static std::string ModuleKey(const std::vector<std::string> &flags);
+
+private:
+  ModuleDiagnostics();
+
+  void use(const std::string &fileName, std::uint64_t bytes);
+  void schedule(std::vector<std::string> fileNames);
+  void runNext();
+  void diagnose(const std::string &fileName);
+};
+} // namespace ssvim
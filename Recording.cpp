@@ -0,0 +1,186 @@
+#import "Recording.hpp"
+#import "HMAC.hpp"
+#import "JSON.hpp"
+
+#import <atomic>
+#import <boost/property_tree/json_parser.hpp>
+#import <boost/property_tree/ptree.hpp>
+#import <condition_variable>
+#import <cstdio>
+#import <mutex>
+#import <sstream>
+#import <thread>
+#import <vector>
+
+using namespace ssvim;
+
+#pragma mark - Format
+
+std::string ssvim::FormatRecordedRequest(const RecordedRequest &request) {
+  std::ostringstream os;
+  os << "{\"offset_ms\":"
+     << std::chrono::duration<double, std::milli>(request.offset).count()
+     << ",\"connection\":" << request.connection
+     << ",\"method\":" << QuoteJSON(request.method)
+     << ",\"path\":" << QuoteJSON(request.path)
+     << ",\"body_bytes\":" << request.bodyBytes
+     << ",\"body_sha256\":\"" << request.bodySHA256 << "\"";
+  if (request.hasBody) {
+    os << ",\"body\":" << QuoteJSON(request.body);
+  }
+  os << "}";
+  return os.str();
+}
+
+bool ssvim::ParseRecordedRequest(const std::string &line,
+                                 RecordedRequest *request) {
+  try {
+    boost::property_tree::ptree json;
+    std::istringstream is(line);
+    boost::property_tree::read_json(is, json);
+    *request = RecordedRequest();
+    auto offset = std::chrono::duration<double, std::milli>(
+        json.get<double>("offset_ms"));
+    request->offset =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            offset);
+    request->connection = json.get<std::uint64_t>("connection", 0);
+    request->method = json.get<std::string>("method");
+    request->path = json.get<std::string>("path");
+    request->bodyBytes = json.get<std::size_t>("body_bytes", 0);
+    request->bodySHA256 = json.get<std::string>("body_sha256", "");
+    auto body = json.get_optional<std::string>("body");
+    if (body) {
+      request->hasBody = true;
+      request->body = *body;
+    }
+    return true;
+  } catch (std::exception &) {
+    return false;
+  }
+}
+
+#pragma mark - Recorder
+
+namespace {
+
+struct PendingRequest {
+  std::chrono::steady_clock::time_point received;
+  std::uint64_t connection;
+  std::string method;
+  std::string path;
+  std::string body;
+};
+
+/**
+ * RequestRecorder writes recorded requests on a background thread, so the
+ * I/O threads only copy the request into a queue.
+ */
+class RequestRecorder {
+  std::mutex _pendingMutex;
+  std::vector<PendingRequest> _pending;
+  std::mutex _drainMutex;
+  std::condition_variable _wake;
+  FILE *_file;
+  bool _includeBodies;
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  std::atomic<bool> enabled;
+
+  // Leaked, so it's usable at exit
+  static RequestRecorder &Shared() {
+    static RequestRecorder *recorder = new RequestRecorder();
+    return *recorder;
+  }
+
+  bool open(const std::string &path, bool includeBodies) {
+    std::lock_guard<std::mutex> lock(_drainMutex);
+    _file = fopen(path.c_str(), "a");
+    if (!_file) {
+      return false;
+    }
+    _includeBodies = includeBodies;
+    _start = std::chrono::steady_clock::now();
+    std::atexit([] { RequestRecorder::Shared().drain(); });
+    std::thread([this] { run(); }).detach();
+    enabled.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void push(PendingRequest &&request) {
+    std::lock_guard<std::mutex> lock(_pendingMutex);
+    _pending.push_back(std::move(request));
+  }
+
+  void drain();
+
+private:
+  RequestRecorder() : _file(nullptr), _includeBodies(false), enabled(false) {
+  }
+
+  void run() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(_pendingMutex);
+        _wake.wait_for(lock, std::chrono::milliseconds(10));
+      }
+      drain();
+    }
+  }
+};
+
+void RequestRecorder::drain() {
+  std::lock_guard<std::mutex> drainLock(_drainMutex);
+  std::vector<PendingRequest> pending;
+  {
+    std::lock_guard<std::mutex> lock(_pendingMutex);
+    pending.swap(_pending);
+  }
+  if (!_file || pending.empty()) {
+    return;
+  }
+
+  std::string out;
+  for (auto &entry : pending) {
+    SHA256 hash;
+    hash.update(entry.body.data(), entry.body.size());
+    RecordedRequest request;
+    request.offset = entry.received - _start;
+    request.connection = entry.connection;
+    request.method = entry.method;
+    request.path = entry.path;
+    request.bodyBytes = entry.body.size();
+    request.bodySHA256 = HexEncode(hash.digest());
+    if (_includeBodies) {
+      request.hasBody = true;
+      request.body = std::move(entry.body);
+    }
+    out += FormatRecordedRequest(request);
+    out += '\n';
+  }
+  fwrite(out.data(), 1, out.size(), _file);
+  fflush(_file);
+}
+} // namespace
+
+bool recording::Enable(const std::string &path, bool includeBodies) {
+  return RequestRecorder::Shared().open(path, includeBodies);
+}
+
+bool recording::IsEnabled() {
+  return RequestRecorder::Shared().enabled.load(std::memory_order_relaxed);
+}
+
+void recording::Record(std::uint64_t connection, const std::string &method,
+                       const std::string &path, const std::string &body) {
+  if (!IsEnabled()) {
+    return;
+  }
+  RequestRecorder::Shared().push(
+      {std::chrono::steady_clock::now(), connection, method, path, body});
+}
+
+void recording::Flush() {
+  RequestRecorder::Shared().drain();
+}
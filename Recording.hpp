@@ -0,0 +1,52 @@
+#import <chrono>
+#import <cstddef>
+#import <cstdint>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * A request as recorded, one JSON object per line of a recording:
+ *
+ *   {"offset_ms":12.5,"connection":1,"method":"POST","path":"/completions",
+ *    "body_bytes":1024,"body_sha256":"9f86...","body":"{...}"}
+ *
+ * "body" is only there when bodies are recorded. Bodies hold whole files, so
+ * by default a recording only keeps their size and hash.
+ */
+struct RecordedRequest {
+  // Time since recording started
+  std::chrono::steady_clock::duration offset;
+  // Requests on the same connection share a number
+  std::uint64_t connection = 0;
+  std::string method;
+  std::string path;
+  std::size_t bodyBytes = 0;
+  // Hex encoded
+  std::string bodySHA256;
+  bool hasBody = false;
+  std::string body;
+};
+
+// Parse a line of a recording. Returns false if it isn't a request.
+bool ParseRecordedRequest(const std::string &line, RecordedRequest *request);
+
+std::string FormatRecordedRequest(const RecordedRequest &request);
+
+namespace recording {
+
+// Append every request the server reads to the file at path. Recording is
+// off until this is called. Returns false if the file can't be opened.
+bool Enable(const std::string &path, bool includeBodies);
+
+// A relaxed load, so checking costs next to nothing when recording is off
+bool IsEnabled();
+
+// Queue a request. Hashing and writing happen on a background thread.
+void Record(std::uint64_t connection, const std::string &method,
+            const std::string &path, const std::string &body);
+
+// Write every queued request. This runs at exit as well.
+void Flush();
+} // namespace recording
+} // namespace ssvim
@@ -0,0 +1,244 @@
+#import "LoadTesting.hpp"
+#import "Recording.hpp"
+#import "SwiftCorpus.hpp"
+
+#import <algorithm>
+#import <boost/program_options.hpp>
+#import <cstdlib>
+#import <fstream>
+#import <functional>
+#import <iostream>
+#import <map>
+#import <thread>
+#import <vector>
+
+using namespace ssvim;
+
+// ssvim_replay sends the requests in a recording, made with http_server
+// --record, to a running server, and reports latency percentiles like
+// ssvim_load does.
+//
+// Each recorded connection is replayed on a connection of its own, in order.
+// At --speed 1 requests are sent when they were recorded, relative to the
+// start of the recording, and --speed 2 sends them twice as fast. Latency is
+// measured from when each request was due, so a server that falls behind
+// the recording shows up in the percentiles. --speed 0, or max, sends every
+// connection's requests back to back.
+//
+// Recordings without bodies keep their size and hash. Those requests are
+// sent with synthetic Swift files of about the same size, the same file for
+// the same hash, so repeated and changed buffers still look that way.
+
+using std::chrono::steady_clock;
+
+struct ReplayRequest {
+  steady_clock::duration offset;
+  LoadRequest request;
+};
+
+static std::string EndpointName(const std::string &path) {
+  return path.substr(0, path.find('?'));
+}
+
+// A completion request about as big as bodyBytes, the same one for each hash
+static std::string SyntheticBody(const RecordedRequest &recorded,
+                                 std::map<std::string, std::string> &cache) {
+  auto &body = cache[recorded.bodySHA256];
+  if (body.size()) {
+    return body;
+  }
+  static const auto BytesPerLine =
+      std::max<std::size_t>(1, GenerateSwiftCorpus(100).contents.size() / 100);
+  auto seed = std::hash<std::string>()(recorded.bodySHA256);
+  auto file = GenerateSwiftCorpus(
+      std::max<std::size_t>(1, recorded.bodyBytes / BytesPerLine), seed);
+  body = GenerateCompletionRequest(
+      "/tmp/ssvim-replay/" + recorded.bodySHA256.substr(0, 16) + ".swift",
+      file);
+  return body;
+}
+
+// Requests by recorded connection, in the order they were read
+static bool ReadRecording(const std::string &path,
+                          std::map<std::uint64_t, std::vector<ReplayRequest>>
+                              *connections,
+                          std::size_t *synthesized) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::map<std::string, std::string> syntheticBodies;
+  std::string line;
+  std::size_t lineNumber = 0;
+  while (std::getline(file, line)) {
+    lineNumber++;
+    if (line.empty()) {
+      continue;
+    }
+    RecordedRequest recorded;
+    if (!ParseRecordedRequest(line, &recorded)) {
+      std::cerr << path << ":" << lineNumber << ": skipping malformed request"
+                << std::endl;
+      continue;
+    }
+    ReplayRequest replay;
+    replay.offset = recorded.offset;
+    replay.request.name = EndpointName(recorded.path);
+    replay.request.method = recorded.method;
+    replay.request.path = recorded.path;
+    if (recorded.hasBody) {
+      replay.request.body = recorded.body;
+    } else if (recorded.bodyBytes) {
+      replay.request.body = SyntheticBody(recorded, syntheticBodies);
+      (*synthesized)++;
+    }
+    (*connections)[recorded.connection].push_back(std::move(replay));
+  }
+  return true;
+}
+
+static void ReplayConnection(const std::vector<ReplayRequest> &requests,
+                             const std::string &host, const std::string &port,
+                             const std::string &secret, double speed,
+                             steady_clock::time_point start,
+                             LoadReport &report) {
+  LoadConnection connection(host, port, secret);
+  LoadResponse response;
+  std::string error;
+  for (auto &replay : requests) {
+    auto due = steady_clock::now();
+    if (speed > 0) {
+      due = start + std::chrono::duration_cast<steady_clock::duration>(
+                        replay.offset / speed);
+      std::this_thread::sleep_until(due);
+    }
+    auto ok = connection.send(replay.request, &response, &error);
+    auto latency = steady_clock::now() - due;
+    if (ok) {
+      report.record(replay.request.name, latency, response.status);
+    } else {
+      report.recordError(replay.request.name);
+    }
+  }
+}
+
+#pragma mark - Main
+
+// A multiple of the recorded speed, or max for back to back
+static bool ParseSpeed(const std::string &value, double *speed) {
+  if (value == "max") {
+    *speed = 0;
+    return true;
+  }
+  char *end = nullptr;
+  *speed = strtod(value.c_str(), &end);
+  return !value.empty() && *end == '\0' && *speed >= 0;
+}
+
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "Print help")(
+      "recording", po::value<std::string>(),
+      "The recording to replay, from http_server --record")(
+      "host", po::value<std::string>()->default_value("localhost"),
+      "Server host")("port,p", po::value<std::string>()->default_value("8080"),
+                     "Server port")(
+      "speed", po::value<std::string>()->default_value("1"),
+      "Multiple of the recorded speed. 0 or max sends requests back to back")(
+      "hmac-file-secret", po::value<std::string>(),
+      "Sign requests with the secret in this file")(
+      "json", po::value<std::string>(), "Write the report as JSON to this path");
+  po::positional_options_description positional;
+  positional.add("recording", 1);
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv)
+                  .options(desc)
+                  .positional(positional)
+                  .run(),
+              vm);
+    po::notify(vm);
+  } catch (po::error &e) {
+    std::cerr << "ERROR: " << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+  if (vm.count("help") || !vm.count("recording")) {
+    std::cout << "Usage: ssvim_replay [options] recording.jsonl" << std::endl
+              << desc << std::endl;
+    return vm.count("help") ? 0 : 1;
+  }
+
+  double speed = 1;
+  if (!ParseSpeed(vm["speed"].as<std::string>(), &speed)) {
+    std::cerr << "ERROR: Invalid speed: " << vm["speed"].as<std::string>()
+              << std::endl
+              << desc << std::endl;
+    return 1;
+  }
+
+  std::string secret;
+  if (vm.count("hmac-file-secret")) {
+    auto path = vm["hmac-file-secret"].as<std::string>();
+    if (!ReadLoadSecret(path, &secret)) {
+      std::cerr << "Can't read hmac secret file: " << path << std::endl;
+      return 1;
+    }
+  }
+
+  auto recording = vm["recording"].as<std::string>();
+  std::map<std::uint64_t, std::vector<ReplayRequest>> connections;
+  std::size_t synthesized = 0;
+  if (!ReadRecording(recording, &connections, &synthesized)) {
+    std::cerr << "Can't read recording: " << recording << std::endl;
+    return 1;
+  }
+  // Start with the first request, rather than when recording started
+  std::size_t total = 0;
+  auto first = steady_clock::duration::max();
+  for (auto &entry : connections) {
+    total += entry.second.size();
+    for (auto &replay : entry.second) {
+      first = std::min(first, replay.offset);
+    }
+  }
+  for (auto &entry : connections) {
+    for (auto &replay : entry.second) {
+      replay.offset -= first;
+    }
+  }
+  std::cout << "Replaying " << total << " requests on " << connections.size()
+            << " connections";
+  if (synthesized) {
+    std::cout << ", " << synthesized << " with synthetic bodies";
+  }
+  std::cout << std::endl;
+
+  auto host = vm["host"].as<std::string>();
+  auto port = vm["port"].as<std::string>();
+  LoadReport report;
+  auto start = steady_clock::now();
+  std::vector<std::thread> threads;
+  for (auto &entry : connections) {
+    auto &requests = entry.second;
+    threads.emplace_back([&, start] {
+      ReplayConnection(requests, host, port, secret, speed, start, report);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(steady_clock::now() - start);
+
+  report.print(std::cout, elapsed);
+  if (vm.count("json")) {
+    std::ofstream file(vm["json"].as<std::string>());
+    report.writeJSON(file, elapsed,
+                     {{"recording", recording},
+                      {"speed", std::to_string(speed)},
+                      {"connections", std::to_string(connections.size())},
+                      {"requests", std::to_string(total)}});
+  }
+  return 0;
+}
@@ -1,28 +1,47 @@
 #import "SemanticHTTPServer.hpp"
+#import "Executor.hpp"
 #import "Logging.hpp"
+#import "BlobStore.hpp"
+#import "CBOR.hpp"
+#import "HMAC.hpp"
+#import "JSON.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "Recording.hpp"
 #import "SwiftCompleter.hpp"
+#import "Tracing.hpp"
 #import "file_body.hpp"
+#import "signed_body.hpp"
 
 #import <beast/core/handler_helpers.hpp>
 #import <beast/core/handler_ptr.hpp>
 #import <beast/core/placeholders.hpp>
 #import <beast/core/streambuf.hpp>
 #import <beast/http.hpp>
+#import <beast/http/chunk_encode.hpp>
 
+#import <boost/algorithm/string.hpp>
 #import <boost/asio.hpp>
+#import <boost/filesystem.hpp>
 #import <boost/property_tree/json_parser.hpp>
 #import <boost/property_tree/ptree.hpp>
 
-#import <dispatch/dispatch.h>
+#import <sys/socket.h>
+#import <sys/stat.h>
 
+#import <array>
+#import <atomic>
+#import <chrono>
 #import <cstddef>
 #import <cstdio>
+#import <deque>
 #import <functional>
 #import <iostream>
 #import <map>
 #import <memory>
 #import <mutex>
 #import <sstream>
+#import <stdexcept>
 #import <string>
 #import <thread>
 #import <utility>
@@ -30,10 +49,41 @@
 using namespace ssvim;
 
 static auto HeaderValueContentTypeJSON = "application/json";
+static auto HeaderValueContentTypeCBOR = "application/cbor";
+static auto HeaderValueContentTypePrometheus = "text/plain; version=0.0.4";
 static auto HeaderKeyContentType = "Content-Type";
+static auto HeaderKeyAccept = "Accept";
+static auto HeaderKeyVary = "Vary";
 static auto HeaderKeyServer = "Server";
+static auto HeaderKeyRetryAfter = "Retry-After";
+static auto HeaderKeyDeadline = "X-SSVIM-Deadline-Ms";
+static auto HeaderKeyHMAC = "X-Ycm-Hmac";
+static auto HeaderKeyTrailer = "Trailer";
+static auto HeaderKeyTransferEncoding = "Transfer-Encoding";
+static auto HeaderKeyAcceptRanges = "Accept-Ranges";
+static auto HeaderKeyContentRange = "Content-Range";
+static auto HeaderKeyRange = "Range";
+static auto HeaderKeyETag = "ETag";
+static auto HeaderKeyIfNoneMatch = "If-None-Match";
+static auto HeaderValueChunked = "chunked";
 static auto HeaderValueServer = "SSVIM";
 
+// Seconds clients wait to retry after sourcekitd was interrupted
+static const unsigned SourceKitRetryAfter = 1;
+
+// Longer deadlines are cut to this, so they can't overflow a time point
+static const long long MaxDeadlineMs = 24 * 60 * 60 * 1000;
+
+// A request's deadline, from the header or the body. Negative deadlines are
+// a client error, answered with a 400.
+static std::chrono::milliseconds deadlineDuration(long long milliseconds) {
+  if (milliseconds < 0) {
+    throw std::invalid_argument("Negative deadline: " +
+                                std::to_string(milliseconds));
+  }
+  return std::chrono::milliseconds(std::min(milliseconds, MaxDeadlineMs));
+}
+
 using namespace beast::http;
 
 namespace ssvim {
@@ -41,9 +91,13 @@ namespace http {
 
 using socket_type = boost::asio::ip::tcp::socket;
 
-using req_type = request<string_body>;
+using req_type = request<signed_string_body>;
+using req_parser_type = parser_v1<true, signed_string_body, fields>;
 using resp_type = response<file_body>;
 
+// Numbers sessions, so a recording can tell connections apart
+static std::atomic<std::uint64_t> NextConnection(1);
+
 /**
  * Session is an instance of an HTTP Session.
  *
@@ -54,33 +108,229 @@ class Session;
 
 using EndpointFn = std::function<void(std::shared_ptr<Session>)>;
 
+struct AdmissionStats {
+  std::size_t inFlight;
+  std::size_t queued;
+  std::uint64_t admitted;
+  std::uint64_t rejected;
+  // Total time admitted requests waited before they started running
+  std::uint64_t queueMicros;
+};
+
+/**
+ * AdmissionController bounds the requests an endpoint runs at once.
+ *
+ * Requests beyond the in flight limit wait in a bounded queue, and requests
+ * beyond that are rejected right away. An overloaded server turns work away
+ * quickly, instead of queueing it until every client times out.
+ */
+class AdmissionController {
+  std::mutex _mutex;
+  AdmissionLimits _limits;
+  std::deque<Task> _waiting;
+  AdmissionStats _stats;
+
+public:
+  AdmissionController(AdmissionLimits limits);
+
+  // Run task on lane once there's a slot for it.
+  // Returns false, without running task, when the queue is full.
+  bool admit(Lane lane, Task task);
+
+  AdmissionLimits limits() {
+    return _limits;
+  }
+
+  AdmissionStats stats();
+
+private:
+  void run(Lane lane, Task task, std::chrono::steady_clock::time_point queued);
+  // Give a finished task's slot to the next waiting task
+  void release();
+};
+
+/**
+ * Request metrics for an endpoint.
+ *
+ * Metrics are looked up once, when the endpoint is registered, so recording
+ * a request doesn't take a lock.
+ */
+class EndpointMetrics {
+  Histogram &_duration;
+  Histogram &_responseSize;
+  // Indexed by status class, 1xx through 5xx
+  std::array<Counter *, 5> _responses;
+
+public:
+  EndpointMetrics(const std::string &endpoint);
+
+  void record(std::chrono::steady_clock::duration elapsed, int status,
+              std::uint64_t bytes);
+};
+
 class EndpointImpl : public std::enable_shared_from_this<EndpointImpl> {
   EndpointFn _start;
+  Lane _lane;
+  std::shared_ptr<AdmissionController> _admission;
+  std::shared_ptr<EndpointMetrics> _metrics;
 
 public:
-  EndpointImpl(EndpointFn start);
+  // Endpoints that block on sourcekitd must run on LaneSourceKit
+  EndpointImpl(EndpointFn start, Lane lane = LaneWorker);
   void handleRequest(std::shared_ptr<Session> session);
+
+  Lane lane() {
+    return _lane;
+  }
+
+  void setLimits(AdmissionLimits limits) {
+    _admission = std::make_shared<AdmissionController>(limits);
+  }
+
+  AdmissionStats stats() {
+    return _admission->stats();
+  }
+
+  void setMetrics(std::shared_ptr<EndpointMetrics> metrics) {
+    _metrics = metrics;
+  }
+
+  EndpointMetrics &metrics() {
+    return *_metrics;
+  }
 };
 
+using EndpointMap = std::map<std::string, EndpointImpl>;
+
 using namespace ssvim;
 
 EndpointImpl makeSlowTestEndpoint();
 EndpointImpl makeStatusEndpoint();
 EndpointImpl makeShutdownEndpoint();
 EndpointImpl makeCompletionsEndpoint();
+EndpointImpl makeResolveEndpoint();
+EndpointImpl makeUsagesEndpoint();
 EndpointImpl makeDiagnosticsEndpoint();
+EndpointImpl makeStructureEndpoint();
+EndpointImpl makeBatchEndpoint();
+EndpointImpl makeFilesEndpoint();
+EndpointImpl makeBlobsEndpoint();
+EndpointImpl makeMetricsEndpoint();
+EndpointImpl makeTraceEndpoint();
+
+response<string_body> notFoundResponse(const req_type &request);
+response<string_body> unauthorizedResponse(const req_type &request);
+response<string_body> errorResponse(const req_type &request,
+                                    std::string message,
+                                    unsigned status = 500);
+response<string_body> unavailableResponse(const req_type &request,
+                                          unsigned retryAfter,
+                                          std::string message = "");
+response<string_body> timeoutResponse(const req_type &request,
+                                      std::string message);
+response<string_body> missingBlobsResponse(const req_type &request,
+                                           const std::vector<std::string> &hashes);
+
+// Endpoints are shared by all sessions, so their admission limits bound the
+// server as a whole.
+static EndpointMap &SharedEndpoints(const ServiceContext &ctx) {
+  static EndpointMap *endpoints = [&] {
+    auto endpoints = new EndpointMap();
+    auto insert_endpoint = [&](std::string named, EndpointImpl impl) {
+      endpoints->insert(std::pair<std::string, EndpointImpl>(named, impl));
+    };
 
-response<string_body> notFoundResponse(req_type request);
-response<string_body> errorResponse(req_type request, std::string message);
+    insert_endpoint("/status", makeStatusEndpoint());
+    insert_endpoint("/metrics", makeMetricsEndpoint());
+    insert_endpoint("/debug/trace", makeTraceEndpoint());
+    insert_endpoint("/shutdown", makeShutdownEndpoint());
+    insert_endpoint("/completions", makeCompletionsEndpoint());
+    insert_endpoint("/completions/resolve", makeResolveEndpoint());
+    insert_endpoint("/usages", makeUsagesEndpoint());
+    insert_endpoint("/diagnostics", makeDiagnosticsEndpoint());
+    insert_endpoint("/structure", makeStructureEndpoint());
+    insert_endpoint("/batch", makeBatchEndpoint());
+    insert_endpoint("/files/", makeFilesEndpoint());
+    insert_endpoint("/blobs/", makeBlobsEndpoint());
+    insert_endpoint("/slow_test", makeSlowTestEndpoint());
+
+    auto &metrics = MetricsRegistry::Shared();
+    for (auto &entry : *endpoints) {
+      auto limits = ctx.endpointLimits.find(entry.first);
+      if (limits != ctx.endpointLimits.end()) {
+        entry.second.setLimits(limits->second);
+      } else if (entry.second.lane() == LaneSourceKit) {
+        entry.second.setLimits(ctx.semanticLimits);
+      }
+
+      entry.second.setMetrics(std::make_shared<EndpointMetrics>(entry.first));
+      auto impl = &entry.second;
+      auto labels = MetricLabel("endpoint", entry.first);
+      metrics.observe("ssvim_endpoint_in_flight", "Requests running", "gauge",
+                      labels, [impl] { return impl->stats().inFlight; });
+      metrics.observe("ssvim_endpoint_queued",
+                      "Requests waiting for an admission slot", "gauge",
+                      labels, [impl] { return impl->stats().queued; });
+      metrics.observe("ssvim_endpoint_rejected_total",
+                      "Requests rejected because the queue was full",
+                      "counter", labels,
+                      [impl] { return impl->stats().rejected; });
+    }
+
+    std::map<Lane, std::string> lanes = {{LaneWorker, "worker"},
+                                         {LaneSourceKit, "sourcekit"},
+                                         {LaneNotification, "notification"}};
+    for (auto &lane : lanes) {
+      auto id = lane.first;
+      metrics.observe("ssvim_executor_pending_tasks",
+                      "Tasks queued on an executor lane", "gauge",
+                      MetricLabel("lane", lane.second),
+                      [id] { return Executor::Shared().pending(id); });
+    }
+    return endpoints;
+  }();
+  return *endpoints;
+}
+
+// Find the endpoint for a request URL. Endpoints named with a trailing slash
+// serve every path under them.
+static EndpointMap::iterator FindEndpoint(EndpointMap &endpoints,
+                                          const std::string &url) {
+  auto path = url.substr(0, url.find('?'));
+  auto exact = endpoints.find(path);
+  if (exact != endpoints.end()) {
+    return exact;
+  }
+  for (auto it = endpoints.begin(); it != endpoints.end(); ++it) {
+    auto &name = it->first;
+    if (name.back() == '/' && path.compare(0, name.size(), name) == 0) {
+      return it;
+    }
+  }
+  return endpoints.end();
+}
 
 class Session : public std::enable_shared_from_this<Session> {
   streambuf _streambuf;
   socket_type _socket;
   ServiceContext _context;
   boost::asio::io_service::strand _strand;
+  std::unique_ptr<req_parser_type> _parser;
   req_type _request;
-  std::map<std::string, EndpointImpl> _endpoints;
+  RequestDeadline::clock::time_point _received;
+  std::string _rootPath;
+  EndpointMap &_endpoints;
   EndpointImpl *_endpoint;
+  // The response to the current request, for metrics
+  int _responseStatus;
+  std::uint64_t _responseBytes;
+  RequestDeadline::clock::time_point _responseStarted;
+  // The response being written. async_write only borrows the message, so it
+  // lives here until the write completes.
+  std::shared_ptr<void> _writing;
+  // The current request's trace, when tracing is on
+  std::shared_ptr<Trace> _trace;
+  const std::uint64_t _connection;
   Logger _logger;
 
 public:
@@ -89,23 +339,13 @@ public:
   Session &operator=(Session &&) = delete;
   Session &operator=(Session const &) = delete;
 
-  Session(socket_type &&sock, ServiceContext ctx)
+  Session(socket_type &&sock, ServiceContext ctx, std::string rootPath)
       : _socket(std::move(sock)), _context(ctx),
-        _strand(_socket.get_io_service()), _logger(ctx.logLevel, "HTTP") {
+        _strand(_socket.get_io_service()), _parser(), _request(), _received(),
+        _rootPath(rootPath), _endpoints(SharedEndpoints(ctx)),
+        _responseStatus(0), _responseBytes(0), _connection(NextConnection++),
+        _logger(ctx.logLevel, "HTTP") {
     _endpoint = NULL;
-    _logger.log(LogLevelInfo, "Secret:", _context.secret);
-    // Setup Endpoints.
-    // TODO: Perhaps this can be done statically
-    _endpoints = std::map<std::string, EndpointImpl>();
-    auto insert_endpoint = [&](std::string named, EndpointImpl impl) {
-      _endpoints.insert(std::pair<std::string, EndpointImpl>(named, impl));
-    };
-
-    insert_endpoint("/status", makeStatusEndpoint());
-    insert_endpoint("/shutdown", makeShutdownEndpoint());
-    insert_endpoint("/completions", makeCompletionsEndpoint());
-    insert_endpoint("/diagnostics", makeDiagnosticsEndpoint());
-    insert_endpoint("/slow_test", makeSlowTestEndpoint());
   }
 
 public:
@@ -113,26 +353,60 @@ public:
     doRead();
   }
 
-  Logger logger() {
+  Logger &logger() {
     return _logger;
   }
 
+  // Log the request body. Bodies hold whole files, so only a summary is
+  // logged unless the server runs with --log-bodies.
+  void logBody() {
+    if (!_logger.isEnabled(LogLevelInfo)) {
+      return;
+    }
+    if (_context.logBodies) {
+      _logger << _request.body;
+    } else {
+      _logger << SummarizePayload(_request.body);
+    }
+  }
+
   std::shared_ptr<Session> detach() {
     return shared_from_this();
   }
 
   void doRead() {
-    async_read(_socket, _streambuf, _request,
-               _strand.wrap(std::bind(&Session::onRead, shared_from_this(),
-                                      asio::placeholders::error)));
+    // The body is signed as it is parsed, when there's a secret
+    _parser.reset(
+        new req_parser_type(signed_string_body::value_type(_context.secret)));
+    async_parse(_socket, _streambuf, *_parser,
+                _strand.wrap(std::bind(&Session::onRead, shared_from_this(),
+                                       asio::placeholders::error)));
   }
 
   void onRead(error_code const &ec) {
     _logger << "ONREAD";
     if (ec)
       return fail(ec, "read");
+    _request = _parser->release();
+    _parser.reset();
+    _received = RequestDeadline::clock::now();
+    _endpoint = NULL;
+    if (tracing::IsEnabled()) {
+      _trace = tracing::StartTrace(_request.method + " " + _request.url);
+    }
+    if (recording::IsEnabled()) {
+      recording::Record(_connection, _request.method, _request.url,
+                        _request.body);
+    }
     auto path = _request.url;
 
+    // Reject unsigned requests before doing any work for them
+    if (!isAuthorized()) {
+      _logger << "UNAUTHORIZED: " << path;
+      write(unauthorizedResponse(_request));
+      return;
+    }
+
     // Typical flow of handling a response
     // - Detach and retain - necessary to keep this alive.
     // - Quickly return to prevent from blocking acceptor loop.
@@ -141,7 +415,7 @@ public:
     auto detachedSession = detach();
     _logger << "WILL_READ: " << path;
 
-    auto endpointImpl = _endpoints.find(std::string(path));
+    auto endpointImpl = FindEndpoint(_endpoints, path);
     if (endpointImpl != _endpoints.end()) {
       _logger << "GOTEP:";
       _endpoint = &endpointImpl->second;
@@ -154,24 +428,171 @@ public:
   }
 
   void onWrite(error_code ec) {
+    _writing.reset();
     if (ec)
       fail(ec, "write");
+    recordResponse();
     doRead();
   }
 
 #pragma mark - State
 
-  req_type request() {
+  const req_type &request() {
     return _request;
   }
 
+  const ServiceContext &context() {
+    return _context;
+  }
+
+  std::shared_ptr<Trace> trace() {
+    return _trace;
+  }
+
+  RequestDeadline::clock::time_point received() {
+    return _received;
+  }
+
+  // The directory files are served from
+  const std::string &rootPath() {
+    return _rootPath;
+  }
+
+  // The deadline from the X-SSVIM-Deadline-Ms header, if any. Throws
+  // std::invalid_argument when it is negative.
+  RequestDeadline deadline() {
+    RequestDeadline deadline;
+    auto header = _request.fields[HeaderKeyDeadline].to_string();
+    char *end = nullptr;
+    auto milliseconds = std::strtoll(header.c_str(), &end, 10);
+    if (header.size() && *end == '\0') {
+      deadline.deadline = _received + deadlineDuration(milliseconds);
+    }
+    std::weak_ptr<Session> weakSession = shared_from_this();
+    deadline.clientGone = [weakSession] {
+      auto session = weakSession.lock();
+      return !session || session->isPeerClosed();
+    };
+    return deadline;
+  }
+
+  // Check if the client closed the connection.
+  // This is only valid while the session isn't reading.
+  bool isPeerClosed() {
+    char byte;
+    auto result = ::recv(_socket.native_handle(), &byte, 1,
+                         MSG_PEEK | MSG_DONTWAIT);
+    if (result == 0) {
+      return true;
+    }
+    return result < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+  }
+
+  socket_type &socket() {
+    return _socket;
+  }
+
+#pragma mark - Authentication
+
+  // Check the request's HMAC, in the form ycmd clients send it:
+  // HMAC(HMAC(method) + HMAC(path) + HMAC(body)), base64 encoded.
+  //
+  // The body's HMAC was computed as the body was read.
+  bool isAuthorized() {
+    auto &signer = _request.body.signer;
+    if (!signer) {
+      return true;
+    }
+    std::string requestHMAC;
+    if (!Base64Decode(_request.fields[HeaderKeyHMAC].to_string(),
+                      &requestHMAC)) {
+      return false;
+    }
+    auto &secret = _context.secret;
+    auto path = _request.url.substr(0, _request.url.find('?'));
+    auto joined = HMACSHA256::Digest(secret, _request.method) +
+                  HMACSHA256::Digest(secret, path) + signer->digest();
+    return ConstantTimeEquals(requestHMAC,
+                              HMACSHA256::Digest(secret, joined));
+  }
+
+  // Sign a response body, when requests are signed
+  bool shouldSign() {
+    return _context.secret.size() > 0;
+  }
+
+  std::string sign(const std::string &body) {
+    return Base64Encode(HMACSHA256::Digest(_context.secret, body));
+  }
+
 #pragma mark - Writing messages
 
   // Schedule a write
   void write(response<string_body> res) {
-    async_write(_socket, std::move(res),
-                std::bind(&Session::onWrite, shared_from_this(),
-                          asio::placeholders::error));
+    if (shouldSign()) {
+      res.fields.insert(HeaderKeyHMAC, sign(res.body));
+    }
+    willRespond(res.status, res.body.size());
+    startWrite(std::make_shared<response<string_body>>(std::move(res)));
+  }
+
+  // Schedule a write of a file range. The range is signed from the mapped
+  // file, so a signed response reads the range once before it is sent.
+  void write(resp_type res) {
+    if (shouldSign()) {
+      error_code ec;
+      mapped_file_range range;
+      range.map(res.body.path, res.body.offset, res.body.length, ec);
+      if (ec) {
+        error(ec.message());
+        return;
+      }
+      HMACSHA256 signer(_context.secret);
+      signer.update(range.data(), range.size());
+      res.fields.insert(HeaderKeyHMAC, Base64Encode(signer.digest()));
+    }
+    willRespond(res.status, res.body.length);
+    startWrite(std::make_shared<resp_type>(std::move(res)));
+  }
+
+  // Start writing a response on the strand. Endpoints respond from worker
+  // threads, and the write's own handlers must not run while it's starting.
+  template <class Message> void startWrite(std::shared_ptr<Message> writing) {
+    auto self = shared_from_this();
+    _socket.get_io_service().post(_strand.wrap([self, writing] {
+      self->_writing = writing;
+      async_write(self->_socket, *writing,
+                  self->_strand.wrap(std::bind(&Session::onWrite, self,
+                                               asio::placeholders::error)));
+    }));
+  }
+
+  // Note the response being written, to record once the write completes
+  void willRespond(int status, std::uint64_t bytes) {
+    _responseStatus = status;
+    _responseBytes = bytes;
+    _responseStarted = RequestDeadline::clock::now();
+  }
+
+  // Record the request's latency, from when it was read until its response
+  // was written, against its endpoint.
+  void recordResponse() {
+    static EndpointMetrics UnroutedMetrics("none");
+    auto &metrics = _endpoint ? _endpoint->metrics() : UnroutedMetrics;
+    auto now = RequestDeadline::clock::now();
+    metrics.record(now - _received, _responseStatus, _responseBytes);
+    if (_trace) {
+      _trace->addSpan("write response", _responseStarted, now);
+      tracing::FinishTrace(_trace);
+      _trace.reset();
+    }
+  }
+
+  // Resume the session after a response was written directly to the socket
+  // by a ChunkedWriter.
+  void didWriteStreamed(error_code ec) {
+    _socket.get_io_service().post(_strand.wrap(
+        std::bind(&Session::onWrite, shared_from_this(), ec)));
   }
 
   void fail(error_code ec, std::string what) {
@@ -181,10 +602,106 @@ public:
 
   // Schedule an error message
   void error(std::string message) {
-    auto res = errorResponse(_request, message);
-    async_write(_socket, std::move(res),
-                std::bind(&Session::onWrite, shared_from_this(),
-                          asio::placeholders::error));
+    write(errorResponse(_request, message));
+  }
+};
+
+#pragma mark - Chunked responses
+
+/**
+ * ChunkedWriter streams a response body with chunked transfer encoding.
+ *
+ * Fragments are collected into a bounded buffer, which is written out as a
+ * single chunk whenever it fills. The client receives the first chunk while
+ * the rest of the body is still being serialized, and the server never holds
+ * more than one buffer of the body.
+ *
+ * Writes are synchronous and must happen off of the io_service threads; the
+ * session isn't reading while an endpoint is running, so the socket is owned
+ * by the writer until finish().
+ */
+class ChunkedWriter {
+  std::shared_ptr<Session> _session;
+  response_header _header;
+  std::string _buffer;
+  std::size_t _capacity;
+  bool _didWriteHeader;
+  std::uint64_t _bytes;
+  error_code _ec;
+  boost::optional<HMACSHA256> _signer;
+
+public:
+  ChunkedWriter(std::shared_ptr<Session> session, response_header header,
+                std::size_t capacity = 16 * 1024)
+      : _session(session), _header(std::move(header)), _capacity(capacity),
+        _didWriteHeader(false), _bytes(0) {
+    _header.fields.insert(HeaderKeyTransferEncoding, HeaderValueChunked);
+    // The body's HMAC isn't known until the end, so it goes in a trailer
+    if (session->shouldSign()) {
+      _signer.emplace(session->context().secret);
+      _header.fields.insert(HeaderKeyTrailer, HeaderKeyHMAC);
+    }
+    _buffer.reserve(capacity);
+  }
+
+  void write(const char *bytes, std::size_t length) {
+    // Fragments larger than the buffer go out as a chunk of their own
+    if (_buffer.size() + length > _capacity) {
+      flush();
+    }
+    if (length >= _capacity) {
+      writeChunk(bytes, length);
+      return;
+    }
+    _buffer.append(bytes, length);
+  }
+
+  // Write out what's buffered as a chunk now, for bodies that are produced
+  // slowly, piece by piece
+  void flush() {
+    if (_buffer.size() == 0) {
+      return;
+    }
+    writeChunk(_buffer.data(), _buffer.size());
+    _buffer.clear();
+  }
+
+  // Write out the remaining buffer and the final chunk, then hand the socket
+  // back to the session.
+  void finish() {
+    flush();
+    if (!_ec && _signer) {
+      auto trailer = std::string("0\r\n") + HeaderKeyHMAC + ": " +
+                     Base64Encode(_signer->digest()) + "\r\n\r\n";
+      boost::asio::write(_session->socket(), boost::asio::buffer(trailer),
+                         _ec);
+    } else if (!_ec) {
+      boost::asio::write(_session->socket(), chunk_encode_final(), _ec);
+    }
+    _session->willRespond(_header.status, _bytes);
+    _session->didWriteStreamed(_ec);
+  }
+
+private:
+  void writeChunk(const char *bytes, std::size_t length) {
+    if (_ec) {
+      return;
+    }
+    if (_signer) {
+      _signer->update(bytes, length);
+    }
+    _bytes += length;
+    TraceSpan span("write chunk");
+    if (!_didWriteHeader) {
+      _didWriteHeader = true;
+      beast::http::write(_session->socket(), _header, _ec);
+      if (_ec) {
+        return;
+      }
+    }
+    boost::asio::write(
+        _session->socket(),
+        chunk_encode(false, boost::asio::buffer(bytes, length)), _ec);
   }
 };
 
@@ -203,19 +720,86 @@ void SemanticHTTPServer::onAccept(error_code ec) {
                                             asio::placeholders::error));
 
   // Start a new Session.
-  auto session = std::make_shared<Session>(std::move(sock), _context);
+  auto session =
+      std::make_shared<Session>(std::move(sock), _context, _root_path);
   session->start();
 }
 
 #pragma mark - Endpoint impl
 
+// Make status endpoint returns an endpoint that reports
+// admission counters for each endpoint, and memory use by cache
 EndpointImpl makeStatusEndpoint() {
   return EndpointImpl([&](std::shared_ptr<Session> session) {
+    std::ostringstream body;
+    body << "{\"endpoints\":{";
+    auto first = true;
+    for (auto &entry : SharedEndpoints(session->context())) {
+      auto stats = entry.second.stats();
+      body << (first ? "" : ",") << "\"" << entry.first << "\":{"
+           << "\"in_flight\":" << stats.inFlight << ","
+           << "\"queued\":" << stats.queued << ","
+           << "\"admitted\":" << stats.admitted << ","
+           << "\"rejected\":" << stats.rejected << ","
+           << "\"queue_time_us\":" << stats.queueMicros << "}";
+      first = false;
+    }
+    auto &budget = MemoryBudget::Shared();
+    body << "},\"memory\":{\"limit_bytes\":" << budget.limit()
+         << ",\"caches\":{";
+    first = true;
+    for (auto &entry : budget.usage()) {
+      body << (first ? "" : ",") << "\"" << entry.first << "\":{"
+           << "\"bytes\":" << entry.second.bytes << ","
+           << "\"entries\":" << entry.second.entries << ","
+           << "\"evictions\":" << entry.second.evictions << "}";
+      first = false;
+    }
+    body << "}}}";
+
+    response<string_body> res;
+    res.status = 200;
+    res.version = session->request().version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+    res.body = body.str();
+    prepare(res);
+    session->write(res);
+  });
+}
+
+// Make metrics endpoint returns an endpoint that reports request, sourcekitd
+// and queue metrics in the Prometheus text format
+EndpointImpl makeMetricsEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    std::ostringstream body;
+    MetricsRegistry::Shared().writePrometheus(body);
+
+    response<string_body> res;
+    res.status = 200;
+    res.version = session->request().version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    res.fields.insert(HeaderKeyContentType, HeaderValueContentTypePrometheus);
+    res.body = body.str();
+    prepare(res);
+    session->write(res);
+  });
+}
+
+// Make trace endpoint returns an endpoint that dumps the traces of recent
+// requests in the Chrome trace_event format, for chrome://tracing.
+// Tracing is on when the server runs with --trace-requests.
+EndpointImpl makeTraceEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    std::ostringstream body;
+    tracing::WriteChromeTrace(body);
+
     response<string_body> res;
     res.status = 200;
     res.version = session->request().version;
     res.fields.insert(HeaderKeyServer, HeaderValueServer);
     res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+    res.body = body.str();
     prepare(res);
     session->write(res);
   });
@@ -230,45 +814,193 @@ EndpointImpl makeShutdownEndpoint() {
     res.fields.insert(HeaderKeyServer, HeaderValueServer);
     res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
     prepare(res);
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_SEC),
-                   dispatch_get_main_queue(), ^{
-                     session->logger() << "Shutting down...";
-                     exit(0);
-                   });
+    Executor::Shared().after(std::chrono::seconds(2), LaneWorker, [session] {
+      session->logger() << "Shutting down...";
+      exit(0);
+    });
     session->write(res);
   });
 }
 
-EndpointImpl::EndpointImpl(EndpointFn start) : _start(start) {
+#pragma mark - Admission
+
+AdmissionController::AdmissionController(AdmissionLimits limits)
+    : _limits(limits), _stats() {
+}
+
+bool AdmissionController::admit(Lane lane, Task task) {
+  auto queued = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_limits.maxInFlight == 0 || _stats.inFlight < _limits.maxInFlight) {
+    _stats.inFlight++;
+    run(lane, task, queued);
+    return true;
+  }
+  if (_waiting.size() < _limits.maxQueued) {
+    _waiting.push_back([this, lane, task, queued] { run(lane, task, queued); });
+    _stats.queued = _waiting.size();
+    return true;
+  }
+  _stats.rejected++;
+  return false;
+}
+
+// Schedule task on the lane. When it is done, its slot goes to the next
+// waiting task.
+void AdmissionController::run(Lane lane, Task task,
+                              std::chrono::steady_clock::time_point queued) {
+  Executor::Shared().async(lane, [this, task, queued] {
+    auto waited = std::chrono::steady_clock::now() - queued;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stats.admitted++;
+      _stats.queueMicros +=
+          std::chrono::duration_cast<std::chrono::microseconds>(waited)
+              .count();
+    }
+
+    // The slot is released even when task throws, or it would be held for
+    // good
+    struct SlotGuard {
+      AdmissionController *admission;
+      ~SlotGuard() {
+        admission->release();
+      }
+    } guard{this};
+    task();
+  });
+}
+
+void AdmissionController::release() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_waiting.size()) {
+    auto next = _waiting.front();
+    _waiting.pop_front();
+    _stats.queued = _waiting.size();
+    next();
+  } else {
+    _stats.inFlight--;
+  }
+}
+
+AdmissionStats AdmissionController::stats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
+
+#pragma mark - Metrics
+
+EndpointMetrics::EndpointMetrics(const std::string &endpoint)
+    : _duration(MetricsRegistry::Shared().histogram(
+          "ssvim_http_request_duration_seconds",
+          "Time from reading a request to writing its response",
+          HistogramUnitMicroseconds, MetricLabel("endpoint", endpoint))),
+      _responseSize(MetricsRegistry::Shared().histogram(
+          "ssvim_http_response_size_bytes", "Size of response bodies",
+          HistogramUnitBytes, MetricLabel("endpoint", endpoint))) {
+  for (std::size_t i = 0; i < _responses.size(); i++) {
+    auto code = std::to_string(i + 1) + "xx";
+    _responses[i] = &MetricsRegistry::Shared().counter(
+        "ssvim_http_requests_total", "Requests by endpoint and status class",
+        MetricLabel("endpoint", endpoint) + "," + MetricLabel("code", code));
+  }
+}
+
+void EndpointMetrics::record(std::chrono::steady_clock::duration elapsed,
+                             int status, std::uint64_t bytes) {
+  _duration.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  _responseSize.record(bytes);
+  auto statusClass = status / 100 - 1;
+  if (statusClass >= 0 && statusClass < static_cast<int>(_responses.size())) {
+    _responses[statusClass]->increment();
+  }
+}
+
+EndpointImpl::EndpointImpl(EndpointFn start, Lane lane)
+    : _start(start), _lane(lane),
+      _admission(std::make_shared<AdmissionController>(AdmissionLimits())) {
 }
 
 void EndpointImpl::handleRequest(std::shared_ptr<Session> session) {
-  auto logger = session->logger();
+  auto &logger = session->logger();
   logger << "HANDLE_REQUEST";
   logger << session->request().url;
-  // Assume we have a dispatch main queue running.
-  //
-  // Run the endpoint on the background thread
-  auto strongSelf = this;
-  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+  // Run the endpoint off of the I/O threads
+  auto start = _start;
+  auto queued = std::chrono::steady_clock::now();
+  auto admitted = _admission->admit(_lane, [session, start, queued] {
     session->logger() << "_START_BACKGROUND";
-    // TODO: Exception safety
-    // Assume we have a dispatch main queue running.
-    strongSelf->_start(session);
+    TraceScope traceScope(session->trace());
+    if (session->trace()) {
+      session->trace()->addSpan("queue", queued,
+                                std::chrono::steady_clock::now());
+    }
+    TraceSpan span("endpoint");
+    try {
+      // Skip requests that were abandoned while they were queued
+      if (session->deadline().isAbandoned()) {
+        throw RequestAbandoned("start");
+      }
+      start(session);
+    } catch (RequestAbandoned &e) {
+      // Free the slot right away. There is nobody to answer if the client
+      // went away.
+      session->logger() << e.what();
+      if (!session->isPeerClosed()) {
+        session->write(timeoutResponse(session->request(), e.what()));
+      }
+    } catch (SourceKitInterrupted &e) {
+      // sourcekitd restarts on its own, so the client should retry
+      session->logger() << e.what();
+      session->write(unavailableResponse(session->request(),
+                                         SourceKitRetryAfter, e.what()));
+    } catch (boost::property_tree::ptree_error &e) {
+      // A body that isn't JSON, or is missing a field
+      session->logger() << e.what();
+      session->write(errorResponse(session->request(), e.what(), 400));
+    } catch (std::invalid_argument &e) {
+      session->logger() << e.what();
+      session->write(errorResponse(session->request(), e.what(), 400));
+    } catch (std::exception &e) {
+      session->logger() << e.what();
+      session->write(errorResponse(session->request(), e.what()));
+    }
   });
+  if (!admitted) {
+    logger << "REJECTED";
+    session->write(unavailableResponse(session->request(),
+                                       _admission->limits().retryAfter));
+  }
 }
 
 using boost::property_tree::ptree;
 using boost::property_tree::read_json;
 using boost::property_tree::write_json;
 
-ptree readJSONPostBody(std::string body) {
+ptree readJSONPostBody(const std::string &body) {
+  TraceSpan span("parse JSON");
   ptree pt;
   std::istringstream is(body);
   read_json(is, pt);
   return pt;
 }
 
+// The deadline for a request is the earliest of the X-SSVIM-Deadline-Ms
+// header and the deadline_ms field of the body. Both are milliseconds from
+// when the request was read.
+RequestDeadline requestDeadline(std::shared_ptr<Session> session,
+                                const ptree &body) {
+  auto deadline = session->deadline();
+  auto field = body.get_optional<long long>("deadline_ms");
+  if (field) {
+    deadline.deadline =
+        std::min(deadline.deadline,
+                 session->received() + deadlineDuration(*field));
+  }
+  return deadline;
+}
+
 template <typename T>
 const std::vector<T> as_vector(ptree const &pt, ptree::key_type const &key) {
   std::vector<T> r;
@@ -277,27 +1009,138 @@ const std::vector<T> as_vector(ptree const &pt, ptree::key_type const &key) {
   return r;
 }
 
+// The contents of a file in a request: its contents, or the blob with its
+// hash. Returns false, adding the hash to missing, when the blob store
+// doesn't have it.
+bool contentsWithJSON(const ptree &file, std::string *contents,
+                      std::vector<std::string> *missing) {
+  auto hash = file.get_optional<std::string>("hash");
+  if (!hash) {
+    *contents = file.get<std::string>("contents");
+    return true;
+  }
+  auto blob = BlobStore::Shared().get(*hash);
+  if (!blob) {
+    missing->push_back(*hash);
+    return false;
+  }
+  *contents = *blob;
+  return true;
+}
+
+// The unsaved files of a request: its own file first, then the other dirty
+// buffers it lists in files, as { file_name, hash } or { file_name, contents }.
+// Hashes the blob store doesn't have are added to missing.
+std::vector<UnsavedFile> unsavedFilesWithJSON(const ptree &body,
+                                              const std::string &fileName,
+                                              std::vector<std::string> *missing) {
+  std::vector<UnsavedFile> files(1);
+  files[0].fileName = fileName;
+  std::string contents;
+  contentsWithJSON(body, &contents, missing);
+  files[0].setContents(std::move(contents));
+  if (body.count("files")) {
+    for (auto &item : body.get_child("files")) {
+      UnsavedFile unsaved;
+      unsaved.fileName = item.second.get<std::string>("file_name");
+      if (unsaved.fileName != fileName &&
+          contentsWithJSON(item.second, &contents, missing)) {
+        unsaved.setContents(std::move(contents));
+        files.push_back(unsaved);
+      }
+    }
+  }
+  return files;
+}
+
+// The units of a request's column. Editors that don't say count bytes.
+ColumnEncoding columnEncoding(const ptree &body) {
+  auto encoding = ColumnEncodingUTF8;
+  auto field = body.get_optional<std::string>("column_encoding");
+  if (field) {
+    ColumnEncodingWithName(*field, &encoding);
+  }
+  return encoding;
+}
+
+// How much of each candidate completions include. Candidates are slim, with
+// the rest at /completions/resolve, unless the editor asks for full ones.
+CompletionDetail completionDetail(const ptree &body) {
+  auto field = body.get_optional<std::string>("detail");
+  return field && *field == "full" ? CompletionDetailFull
+                                   : CompletionDetailSlim;
+}
+
+// Semantic responses are JSON, unless the client accepts CBOR
+bool acceptsCBOR(const req_type &request) {
+  std::vector<std::string> types;
+  auto accept = request.fields[HeaderKeyAccept].to_string();
+  boost::split(types, accept, boost::is_any_of(","));
+  for (auto &type : types) {
+    std::vector<std::string> parameters;
+    boost::split(parameters, type, boost::is_any_of(";"));
+    if (boost::trim_copy(parameters[0]) != HeaderValueContentTypeCBOR) {
+      continue;
+    }
+    // Unless it's ruled out with q=0
+    for (std::size_t i = 1; i < parameters.size(); i++) {
+      auto parameter = boost::trim_copy(parameters[i]);
+      if (boost::starts_with(parameter, "q=") &&
+          strtod(parameter.c_str() + 2, nullptr) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+// Set the content type of a semantic response, which depends on Accept
+template <class Message>
+void setSemanticContentType(const req_type &request, Message &message) {
+  message.fields.insert(HeaderKeyVary, HeaderKeyAccept);
+  message.fields.insert(HeaderKeyContentType, acceptsCBOR(request)
+                                                  ? HeaderValueContentTypeCBOR
+                                                  : HeaderValueContentTypeJSON);
+}
+
+// Set the body of a semantic response, transcoded to CBOR when the client
+// accepts it
+void setSemanticBody(const req_type &request, response<string_body> &res,
+                     std::string json) {
+  setSemanticContentType(request, res);
+  res.body = acceptsCBOR(request) ? JSONToCBOR::Encode(json) : std::move(json);
+}
+
 // Make completions endpoint returns an endpoint that
 // handles basic completion requests
 //
 // @param flags: an array of string flags
-// @param contents: the current files
+// @param contents: the current file, or
+// @param hash: the SHA-256 of the current file, uploaded to /blobs/
+// @param files: optional, the other unsaved files as { file_name, hash }
 // @param line: the users line
 // @param column: the users column
+// @param column_encoding: optional, what column counts: "utf-8" bytes, the
+// default, "utf-16" code units or "utf-32" characters
+// @param detail: optional, "full" for every candidate's documentation, type
+// and USRs. By default they're left out, and each candidate has a key.id to
+// resolve them with /completions/resolve.
 // @param file_name: the name of the users file
 EndpointImpl makeCompletionsEndpoint() {
-  return EndpointImpl([&](std::shared_ptr<Session> session) {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
     // Parse in data
-    auto logger = session->logger();
-    auto bodyString = session->request().body;
-    logger << bodyString;
+    auto &logger = session->logger();
+    auto &bodyString = session->request().body;
+    session->logBody();
     auto bodyJSON = readJSONPostBody(bodyString);
 
     auto fileName = bodyJSON.get<std::string>("file_name");
     auto column = bodyJSON.get<int>("column");
     auto line = bodyJSON.get<int>("line");
-    auto contents = bodyJSON.get<std::string>("contents");
     auto flags = as_vector<std::string>(bodyJSON, "flags");
+    auto encoding = columnEncoding(bodyJSON);
+    auto detail = completionDetail(bodyJSON);
     logger << "file_name:" << fileName;
     logger << "column:" << column;
     logger << "line:" << line;
@@ -306,47 +1149,213 @@ EndpointImpl makeCompletionsEndpoint() {
     }
 
     using namespace ssvim;
-    SwiftCompleter completer(session->logger().level());
+    SwiftCompleter completer(session->logger().level(),
+                             requestDeadline(session, bodyJSON));
 
-    auto files = std::vector<UnsavedFile>();
-    auto unsaved = UnsavedFile();
-    unsaved.contents = contents;
-    unsaved.fileName = fileName;
-    files.push_back(unsaved);
+    std::vector<std::string> missing;
+    auto files = unsavedFilesWithJSON(bodyJSON, fileName, &missing);
+    if (missing.size()) {
+      session->write(missingBlobsResponse(session->request(), missing));
+      return;
+    }
 
     logger << "SEND_REQ";
-    auto candidates = completer.CandidatesForLocationInFile(
-        fileName, line, column, files, flags);
+    // HTTP/1.0 clients can't decode a chunked body
+    if (session->request().version < 11) {
+      auto candidates = completer.CandidatesForLocationInFile(
+          fileName, line, column, files, flags, encoding, detail);
+
+      logger << "GOT_CANDIDATES";
+      session->logger().log(LogLevelExtreme, candidates);
+      // Build out response
+      response<string_body> res;
+      res.status = 200;
+      res.version = session->request().version;
+      res.fields.insert(HeaderKeyServer, HeaderValueServer);
+      setSemanticBody(session->request(), res, std::move(candidates));
+      prepare(res);
+      session->write(res);
+      return;
+    }
 
+    // Stream candidates to the client as they are serialized
+    response_header header;
+    header.status = 200;
+    header.version = session->request().version;
+    header.fields.insert(HeaderKeyServer, HeaderValueServer);
+    setSemanticContentType(session->request(), header);
+    ChunkedWriter writer(session, std::move(header));
+    ResponseSink sink = [&](const char *bytes, std::size_t length) {
+      writer.write(bytes, length);
+    };
+    // Transcoded as it streams, when the client accepts CBOR
+    boost::optional<JSONToCBOR> cbor;
+    if (acceptsCBOR(session->request())) {
+      cbor.emplace(sink);
+      sink = [&](const char *bytes, std::size_t length) {
+        cbor->write(bytes, length);
+      };
+    }
+    completer.CandidatesForLocationInFile(fileName, line, column, files, flags,
+                                          sink, encoding, detail);
     logger << "GOT_CANDIDATES";
-    session->logger().log(LogLevelExtreme, candidates);
-    // Build out response
+    if (cbor) {
+      cbor->finish();
+    }
+    writer.finish();
+  };
+  return EndpointImpl(start, LaneSourceKit);
+}
+
+// Make resolve endpoint returns an endpoint that returns the full candidate
+// for an item of a slim completion response, with its annotated declaration
+//
+// @param session: the key.session of the completion response
+// @param id: the key.id of the item
+EndpointImpl makeResolveEndpoint() {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
+    auto &logger = session->logger();
+    session->logBody();
+    auto bodyJSON = readJSONPostBody(session->request().body);
+
+    auto sessionID = bodyJSON.get<std::string>("session");
+    auto item = bodyJSON.get<std::size_t>("id");
+    logger << "session:" << sessionID;
+    logger << "id:" << item;
+
+    SwiftCompleter completer(logger.level(),
+                             requestDeadline(session, bodyJSON));
+    std::string resolved;
     response<string_body> res;
-    res.status = 200;
     res.version = session->request().version;
     res.fields.insert(HeaderKeyServer, HeaderValueServer);
-    res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
-    res.body = candidates;
+    if (!completer.ResolveCompletion(sessionID, item, &resolved)) {
+      // The session was replaced by newer ones, so the editor should drop
+      // the item's details
+      res.status = 404;
+      res.reason = "Not Found";
+      res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+      res.body = "\"Completion item not found\"";
+      prepare(res);
+      session->write(res);
+      return;
+    }
+    logger << "GOT_RESOLVED";
+    res.status = 200;
+    setSemanticBody(session->request(), res, std::move(resolved));
     prepare(res);
     session->write(res);
-  });
+  };
+  return EndpointImpl(start, LaneSourceKit);
+}
+
+// Make usages endpoint returns an endpoint that streams the usages of the
+// declaration at a location, in the module, as they're confirmed
+//
+// @param flags: an array of string flags. Its .swift files are searched.
+// @param contents: the current file, or
+// @param hash: the SHA-256 of the current file, uploaded to /blobs/
+// @param files: optional, the other unsaved files as { file_name, hash }
+// @param line: the users line
+// @param column: the users column
+// @param column_encoding: optional, what column counts: "utf-8" bytes, the
+// default, "utf-16" code units or "utf-32" characters
+// @param file_name: the name of the users file
+EndpointImpl makeUsagesEndpoint() {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
+    auto &logger = session->logger();
+    session->logBody();
+    auto bodyJSON = readJSONPostBody(session->request().body);
+
+    auto fileName = bodyJSON.get<std::string>("file_name");
+    auto column = bodyJSON.get<int>("column");
+    auto line = bodyJSON.get<int>("line");
+    auto flags = as_vector<std::string>(bodyJSON, "flags");
+    auto encoding = columnEncoding(bodyJSON);
+    logger << "file_name:" << fileName;
+    logger << "column:" << column;
+    logger << "line:" << line;
+
+    SwiftCompleter completer(logger.level(),
+                             requestDeadline(session, bodyJSON));
+
+    std::vector<std::string> missing;
+    auto files = unsavedFilesWithJSON(bodyJSON, fileName, &missing);
+    if (missing.size()) {
+      session->write(missingBlobsResponse(session->request(), missing));
+      return;
+    }
+
+    // HTTP/1.0 clients can't decode a chunked body
+    if (session->request().version < 11) {
+      std::string usages;
+      completer.UsagesForLocationInFile(
+          fileName, line, column, files, flags,
+          [&](const char *bytes, std::size_t length) {
+            usages.append(bytes, length);
+          },
+          encoding);
+      logger << "GOT_USAGES";
+      response<string_body> res;
+      res.status = 200;
+      res.version = session->request().version;
+      res.fields.insert(HeaderKeyServer, HeaderValueServer);
+      setSemanticBody(session->request(), res, std::move(usages));
+      prepare(res);
+      session->write(res);
+      return;
+    }
+
+    // Each file's usages go out as soon as they're confirmed, rather than
+    // waiting for the buffer to fill
+    response_header header;
+    header.status = 200;
+    header.version = session->request().version;
+    header.fields.insert(HeaderKeyServer, HeaderValueServer);
+    setSemanticContentType(session->request(), header);
+    ChunkedWriter writer(session, std::move(header));
+    ResponseSink sink = [&](const char *bytes, std::size_t length) {
+      writer.write(bytes, length);
+    };
+    boost::optional<JSONToCBOR> cbor;
+    if (acceptsCBOR(session->request())) {
+      cbor.emplace(sink);
+      sink = [&](const char *bytes, std::size_t length) {
+        cbor->write(bytes, length);
+      };
+    }
+    completer.UsagesForLocationInFile(
+        fileName, line, column, files, flags,
+        [&](const char *bytes, std::size_t length) {
+          sink(bytes, length);
+          writer.flush();
+        },
+        encoding);
+    logger << "GOT_USAGES";
+    if (cbor) {
+      cbor->finish();
+    }
+    writer.finish();
+  };
+  return EndpointImpl(start, LaneSourceKit);
 }
 
 // Make completions endpoint returns an endpoint that
 // handles basic completion requests
 //
 // @param flags: an array of string flags
-// @param contents: the current files
+// @param contents: the current file, or
+// @param hash: the SHA-256 of the current file, uploaded to /blobs/
+// @param files: optional, the other unsaved files as { file_name, hash }
 // @param file_name: the name of the users file
 EndpointImpl makeDiagnosticsEndpoint() {
-  return EndpointImpl([&](std::shared_ptr<Session> session) {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
     // Parse in data
-    auto bodyString = session->request().body;
-    session->logger() << bodyString;
+    auto &bodyString = session->request().body;
+    session->logBody();
     auto bodyJSON = readJSONPostBody(bodyString);
 
     auto fileName = bodyJSON.get<std::string>("file_name");
-    auto contents = bodyJSON.get<std::string>("contents");
     auto flags = as_vector<std::string>(bodyJSON, "flags");
     session->logger() << "file_name:" << fileName;
     for (auto &f : flags) {
@@ -354,13 +1363,15 @@ EndpointImpl makeDiagnosticsEndpoint() {
     }
 
     using namespace ssvim;
-    SwiftCompleter completer(session->logger().level());
+    SwiftCompleter completer(session->logger().level(),
+                             requestDeadline(session, bodyJSON));
 
-    auto files = std::vector<UnsavedFile>();
-    auto unsaved = UnsavedFile();
-    unsaved.contents = contents;
-    unsaved.fileName = fileName;
-    files.push_back(unsaved);
+    std::vector<std::string> missing;
+    auto files = unsavedFilesWithJSON(bodyJSON, fileName, &missing);
+    if (missing.size()) {
+      session->write(missingBlobsResponse(session->request(), missing));
+      return;
+    }
 
     session->logger() << "SEND_REQ";
     auto diagnostics = completer.DiagnosticsForFile(fileName, files, flags);
@@ -372,8 +1383,526 @@ EndpointImpl makeDiagnosticsEndpoint() {
     res.status = 200;
     res.version = session->request().version;
     res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    setSemanticBody(session->request(), res, std::move(diagnostics));
+    prepare(res);
+    session->write(res);
+  };
+  return EndpointImpl(start, LaneSourceKit);
+}
+
+// Make structure endpoint returns an endpoint that
+// handles syntactic structure requests
+//
+// @param flags: an array of string flags
+// @param contents: the current file, or
+// @param hash: the SHA-256 of the current file, uploaded to /blobs/
+// @param files: optional, the other unsaved files as { file_name, hash }
+// @param file_name: the name of the users file
+EndpointImpl makeStructureEndpoint() {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
+    // Parse in data
+    auto &bodyString = session->request().body;
+    session->logBody();
+    auto bodyJSON = readJSONPostBody(bodyString);
+
+    auto fileName = bodyJSON.get<std::string>("file_name");
+    auto flags = as_vector<std::string>(bodyJSON, "flags");
+    session->logger() << "file_name:" << fileName;
+
+    using namespace ssvim;
+    SwiftCompleter completer(session->logger().level(),
+                             requestDeadline(session, bodyJSON));
+
+    std::vector<std::string> missing;
+    auto files = unsavedFilesWithJSON(bodyJSON, fileName, &missing);
+    if (missing.size()) {
+      session->write(missingBlobsResponse(session->request(), missing));
+      return;
+    }
+
+    session->logger() << "SEND_REQ";
+    auto structure = completer.StructureForFile(fileName, files, flags);
+
+    session->logger() << "GOT_STRUCTURE";
+    session->logger().log(LogLevelExtreme, structure);
+    // Build out response
+    response<string_body> res;
+    res.status = 200;
+    res.version = session->request().version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    setSemanticBody(session->request(), res, std::move(structure));
+    prepare(res);
+    session->write(res);
+  };
+  return EndpointImpl(start, LaneSourceKit);
+}
+
+#pragma mark - Batch
+
+// Inputs shared by all of the sub requests in a batch.
+//
+// Sub requests that omit flags or contents use these, so the editor can send
+// a flag set or a buffer once, and it is parsed once.
+struct BatchInputs {
+  std::vector<std::string> flags;
+  std::map<std::string, std::string> contents;
+};
+
+// The result of a single sub request. The body is a JSON document.
+struct BatchResult {
+  int status;
+  std::string body;
+};
+
+// Run one sub request of a batch synchronously
+static BatchResult runBatchRequest(const ptree &subRequest,
+                                   const BatchInputs &inputs,
+                                   LogLevel logLevel,
+                                   RequestDeadline deadline) {
+  auto path = subRequest.get<std::string>("path");
+  auto fileName = subRequest.get<std::string>("file_name");
+  auto flags = subRequest.count("flags")
+                   ? as_vector<std::string>(subRequest, "flags")
+                   : inputs.flags;
+
+  auto unsaved = UnsavedFile();
+  unsaved.fileName = fileName;
+  if (subRequest.count("contents") || subRequest.count("hash")) {
+    std::vector<std::string> missing;
+    std::string contents;
+    if (!contentsWithJSON(subRequest, &contents, &missing)) {
+      return {409, "{\"missing_hashes\":[" + QuoteJSON(missing[0]) + "]}"};
+    }
+    unsaved.setContents(std::move(contents));
+  } else {
+    auto shared = inputs.contents.find(fileName);
+    if (shared == inputs.contents.end()) {
+      return {400, QuoteJSON("Missing contents for: " + fileName)};
+    }
+    unsaved.setContents(shared->second);
+  }
+  // The batch's other files are the editor's other unsaved buffers
+  auto files = std::vector<UnsavedFile>{unsaved};
+  for (auto &shared : inputs.contents) {
+    if (shared.first != fileName) {
+      auto other = UnsavedFile();
+      other.fileName = shared.first;
+      other.setContents(shared.second);
+      files.push_back(other);
+    }
+  }
+
+  SwiftCompleter completer(logLevel, deadline);
+  if (path == "/completions") {
+    auto line = subRequest.get<int>("line");
+    auto column = subRequest.get<int>("column");
+    return {200, completer.CandidatesForLocationInFile(
+                     fileName, line, column, files, flags,
+                     columnEncoding(subRequest), completionDetail(subRequest))};
+  } else if (path == "/diagnostics") {
+    return {200, completer.DiagnosticsForFile(fileName, files, flags)};
+  } else if (path == "/structure") {
+    return {200, completer.StructureForFile(fileName, files, flags)};
+  } else if (path == "/usages") {
+    auto line = subRequest.get<int>("line");
+    auto column = subRequest.get<int>("column");
+    std::string usages;
+    completer.UsagesForLocationInFile(
+        fileName, line, column, files, flags,
+        [&](const char *bytes, std::size_t length) {
+          usages.append(bytes, length);
+        },
+        columnEncoding(subRequest));
+    return {200, usages};
+  }
+  return {404, QuoteJSON("Endpoint: '" + path + "' not found")};
+}
+
+// Make batch endpoint returns an endpoint that runs several semantic
+// requests concurrently and returns their results in order
+//
+// @param requests: an array of sub requests. Each has a path of
+// /completions, /diagnostics, /structure or /usages and that endpoint's
+// params
+// @param flags: flags for sub requests that don't specify their own
+// @param files: an array of { file_name, contents } or { file_name, hash }
+// for sub requests that don't specify their own contents. Each sub request
+// sees the others as unsaved files.
+EndpointImpl makeBatchEndpoint() {
+  EndpointFn start = [&](std::shared_ptr<Session> session) {
+    auto &logger = session->logger();
+    auto bodyJSON = readJSONPostBody(session->request().body);
+
+    BatchInputs inputs;
+    if (bodyJSON.count("flags")) {
+      inputs.flags = as_vector<std::string>(bodyJSON, "flags");
+    }
+    if (bodyJSON.count("files")) {
+      std::vector<std::string> missing;
+      for (auto &item : bodyJSON.get_child("files")) {
+        contentsWithJSON(
+            item.second,
+            &inputs.contents[item.second.get<std::string>("file_name")],
+            &missing);
+      }
+      if (missing.size()) {
+        session->write(missingBlobsResponse(session->request(), missing));
+        return;
+      }
+    }
+
+    std::vector<ptree> subRequests;
+    for (auto &item : bodyJSON.get_child("requests")) {
+      subRequests.push_back(item.second);
+    }
+    logger << "BATCH_SIZE:" << subRequests.size();
+
+    // Run sub requests on the sourcekit lane, which bounds concurrency to
+    // the server's sourcekit threads. apply returns once all have finished.
+    std::vector<BatchResult> results(subRequests.size());
+    auto logLevel = logger.level();
+    auto deadline = requestDeadline(session, bodyJSON);
+    auto trace = session->trace();
+    Executor::Shared().apply(
+        LaneSourceKit, subRequests.size(), [&](std::size_t i) {
+          TraceScope traceScope(trace);
+          TraceSpan span("batch request");
+          try {
+            results[i] =
+                runBatchRequest(subRequests[i], inputs, logLevel, deadline);
+          } catch (RequestAbandoned &e) {
+            results[i] = {504, QuoteJSON(e.what())};
+          } catch (SourceKitInterrupted &e) {
+            results[i] = {503, QuoteJSON(e.what())};
+          } catch (boost::property_tree::ptree_error &e) {
+            // A sub request that isn't an object, or is missing a field
+            results[i] = {400, QuoteJSON(e.what())};
+          } catch (std::invalid_argument &e) {
+            results[i] = {400, QuoteJSON(e.what())};
+          } catch (std::exception &e) {
+            results[i] = {500, QuoteJSON(e.what())};
+          }
+        });
+    if (deadline.isAbandoned()) {
+      throw RequestAbandoned("batch response");
+    }
+
+    std::string body = "{\"results\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+      if (i > 0) {
+        body += ",";
+      }
+      body += "{\"status\":" + std::to_string(results[i].status) +
+              ",\"body\":" + results[i].body + "}";
+    }
+    body += "]}";
+    logger << "GOT_BATCH";
+
+    response<string_body> res;
+    res.status = 200;
+    res.version = session->request().version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    setSemanticBody(session->request(), res, std::move(body));
+    prepare(res);
+    session->write(res);
+  };
+  return EndpointImpl(start, LaneSourceKit);
+}
+
+#pragma mark - Files
+
+// Decode %XX escapes in a URL path. Returns false for malformed escapes and
+// for NUL bytes.
+static bool decodeURLPath(const std::string &path, std::string *decoded) {
+  decoded->clear();
+  for (std::size_t i = 0; i < path.size(); i++) {
+    if (path[i] != '%') {
+      decoded->push_back(path[i]);
+      continue;
+    }
+    if (i + 2 >= path.size() || !isxdigit(path[i + 1]) ||
+        !isxdigit(path[i + 2])) {
+      return false;
+    }
+    auto byte = static_cast<char>(std::stoi(path.substr(i + 1, 2), 0, 16));
+    if (byte == '\0') {
+      return false;
+    }
+    decoded->push_back(byte);
+    i += 2;
+  }
+  return true;
+}
+
+// Resolve a path relative to the root directory to a regular file.
+// Returns false for missing files, and for paths that escape the root
+// through .. or a symlink.
+static bool resolveRootPath(const std::string &root,
+                            const std::string &relative,
+                            std::string *resolved) {
+  namespace fs = boost::filesystem;
+  boost::system::error_code ec;
+  auto rootPath = fs::canonical(root, ec);
+  if (ec) {
+    return false;
+  }
+  auto filePath = fs::canonical(rootPath / relative, ec);
+  if (ec || !fs::is_regular_file(filePath, ec)) {
+    return false;
+  }
+
+  // Canonical paths have no .. or symlinks, so the file is under the root
+  // when the root is one of its parents.
+  for (auto parent = filePath.parent_path(); !parent.empty();
+       parent = parent.parent_path()) {
+    if (parent == rootPath) {
+      *resolved = filePath.string();
+      return true;
+    }
+    if (parent == parent.root_path()) {
+      break;
+    }
+  }
+  return false;
+}
+
+static bool parseUInt64(const std::string &value, std::uint64_t *out) {
+  if (value.empty() ||
+      value.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  errno = 0;
+  *out = std::strtoull(value.c_str(), nullptr, 10);
+  return errno == 0;
+}
+
+typedef enum ByteRange {
+  // There is no range, or it isn't understood. The whole file is sent.
+  ByteRangeNone,
+  ByteRangeSatisfiable,
+  ByteRangeUnsatisfiable,
+} ByteRange;
+
+// Resolve a Range header against a file's size.
+//
+// Only a single range is supported. A request for several ranges gets the
+// whole file, which is allowed, and is what clients fetching an artifact in
+// pieces won't ask for anyway.
+static ByteRange parseByteRange(const std::string &header, std::uint64_t size,
+                                std::uint64_t *offset, std::uint64_t *length) {
+  auto unit = std::string("bytes=");
+  if (header.compare(0, unit.size(), unit) != 0) {
+    return ByteRangeNone;
+  }
+  auto spec = header.substr(unit.size());
+  auto dash = spec.find('-');
+  if (spec.find(',') != std::string::npos || dash == std::string::npos) {
+    return ByteRangeNone;
+  }
+  auto first = spec.substr(0, dash);
+  auto last = spec.substr(dash + 1);
+
+  // bytes=-N is the last N bytes
+  if (first.empty()) {
+    std::uint64_t suffix;
+    if (!parseUInt64(last, &suffix)) {
+      return ByteRangeNone;
+    }
+    if (suffix == 0 || size == 0) {
+      return ByteRangeUnsatisfiable;
+    }
+    *offset = size - std::min(suffix, size);
+    *length = size - *offset;
+    return ByteRangeSatisfiable;
+  }
+
+  std::uint64_t start, end;
+  if (!parseUInt64(first, &start)) {
+    return ByteRangeNone;
+  }
+  if (start >= size) {
+    return ByteRangeUnsatisfiable;
+  }
+  if (last.empty()) {
+    end = size - 1;
+  } else if (!parseUInt64(last, &end) || end < start) {
+    return ByteRangeNone;
+  }
+  end = std::min(end, size - 1);
+  *offset = start;
+  *length = end - start + 1;
+  return ByteRangeSatisfiable;
+}
+
+// The ETag changes whenever the file is replaced or written to
+static std::string entityTag(const struct stat &st) {
+  char tag[64];
+  snprintf(tag, sizeof(tag), "\"%llx-%llx-%llx\"",
+           static_cast<unsigned long long>(st.st_ino),
+           static_cast<unsigned long long>(st.st_size),
+           static_cast<unsigned long long>(st.st_mtime));
+  return tag;
+}
+
+// Check an If-None-Match header, a list of tags or *, against a tag.
+// Weak tags compare equal to strong ones, as RFC 7232 requires here.
+static bool matchesEntityTag(const std::string &header,
+                             const std::string &tag) {
+  std::istringstream list(header);
+  std::string candidate;
+  while (std::getline(list, candidate, ',')) {
+    auto begin = candidate.find_first_not_of(" \t");
+    auto end = candidate.find_last_not_of(" \t");
+    if (begin == std::string::npos) {
+      continue;
+    }
+    candidate = candidate.substr(begin, end - begin + 1);
+    if (candidate.compare(0, 2, "W/") == 0) {
+      candidate = candidate.substr(2);
+    }
+    if (candidate == "*" || candidate == tag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::string contentTypeForPath(const std::string &path) {
+  auto extension = boost::filesystem::path(path).extension().string();
+  if (extension == ".json") {
+    return HeaderValueContentTypeJSON;
+  }
+  if (extension == ".swift" || extension == ".swiftinterface" ||
+      extension == ".txt") {
+    return "text/plain; charset=utf-8";
+  }
+  return "application/octet-stream";
+}
+
+// Make files endpoint returns an endpoint that serves files under the root
+// directory, such as persisted indexes, generated module interfaces and
+// cached diagnostics.
+//
+// GET /files/<path relative to --root>
+//
+// Supports a single byte Range, and If-None-Match against the ETag. The
+// body is memory mapped and written by the kernel straight from the page
+// cache. Files must be replaced by renaming over them, never truncated in
+// place: a file that shrinks while its mapping is written raises SIGBUS.
+EndpointImpl makeFilesEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    auto &request = session->request();
+    auto respond = [&](int status, std::string reason, std::string body) {
+      response<string_body> res;
+      res.status = status;
+      res.reason = reason;
+      res.version = request.version;
+      res.fields.insert(HeaderKeyServer, HeaderValueServer);
+      res.body = body;
+      return res;
+    };
+    if (request.method != "GET") {
+      auto res = respond(405, "Method Not Allowed", "Files only support GET");
+      res.fields.insert("Allow", "GET");
+      prepare(res);
+      session->write(res);
+      return;
+    }
+
+    auto url = request.url.substr(0, request.url.find('?'));
+    std::string relative, path;
+    struct stat st;
+    if (!decodeURLPath(url.substr(std::string("/files/").size()), &relative) ||
+        !resolveRootPath(session->rootPath(), relative, &path) ||
+        stat(path.c_str(), &st) != 0) {
+      session->write(notFoundResponse(request));
+      return;
+    }
+
+    auto size = static_cast<std::uint64_t>(st.st_size);
+    auto tag = entityTag(st);
+    if (request.fields.exists(HeaderKeyIfNoneMatch) &&
+        matchesEntityTag(request.fields[HeaderKeyIfNoneMatch].to_string(),
+                         tag)) {
+      auto res = respond(304, "Not Modified", "");
+      res.fields.insert(HeaderKeyETag, tag);
+      prepare(res);
+      session->write(res);
+      return;
+    }
+
+    resp_type res;
+    res.status = 200;
+    res.version = request.version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
+    res.fields.insert(HeaderKeyContentType, contentTypeForPath(path));
+    res.fields.insert(HeaderKeyAcceptRanges, "bytes");
+    res.fields.insert(HeaderKeyETag, tag);
+    res.body.path = path;
+    res.body.offset = 0;
+    res.body.length = size;
+
+    if (request.fields.exists(HeaderKeyRange)) {
+      std::uint64_t offset = 0;
+      std::uint64_t length = 0;
+      switch (parseByteRange(request.fields[HeaderKeyRange].to_string(), size,
+                             &offset, &length)) {
+      case ByteRangeNone:
+        break;
+      case ByteRangeUnsatisfiable: {
+        auto unsatisfiable = respond(416, "Range Not Satisfiable", "");
+        unsatisfiable.fields.insert(HeaderKeyContentRange,
+                                    "bytes */" + std::to_string(size));
+        prepare(unsatisfiable);
+        session->write(unsatisfiable);
+        return;
+      }
+      case ByteRangeSatisfiable:
+        res.status = 206;
+        res.reason = "Partial Content";
+        res.fields.insert(HeaderKeyContentRange,
+                          "bytes " + std::to_string(offset) + "-" +
+                              std::to_string(offset + length - 1) + "/" +
+                              std::to_string(size));
+        res.body.offset = offset;
+        res.body.length = length;
+        break;
+      }
+    }
+    prepare(res);
+    session->write(std::move(res));
+  });
+}
+
+#pragma mark - Blobs
+
+// Make blobs endpoint returns an endpoint that keeps buffers by hash, for
+// requests to refer to rather than sending their contents
+//
+// PUT /blobs/<hash> with the buffer as the body. hash is the SHA-256 of the
+// body, in hex.
+EndpointImpl makeBlobsEndpoint() {
+  return EndpointImpl([](std::shared_ptr<Session> session) {
+    auto &request = session->request();
+    response<string_body> res;
+    res.version = request.version;
+    res.fields.insert(HeaderKeyServer, HeaderValueServer);
     res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
-    res.body = diagnostics;
+    auto hash = request.url.substr(std::string("/blobs/").size());
+    if (request.method != "PUT") {
+      res.status = 405;
+      res.reason = "Method Not Allowed";
+      res.fields.insert("Allow", "PUT");
+      res.body = QuoteJSON("Blobs only support PUT");
+    } else if (!BlobStore::Shared().put(hash, request.body)) {
+      res.status = 400;
+      res.reason = "Bad Request";
+      res.body = QuoteJSON("The body's SHA-256 isn't: " + hash);
+    } else {
+      res.status = 201;
+      res.reason = "Created";
+      res.body = "{\"hash\":" + QuoteJSON(hash) + "}";
+    }
     prepare(res);
     session->write(res);
   });
@@ -382,37 +1911,102 @@ EndpointImpl makeDiagnosticsEndpoint() {
 EndpointImpl makeSlowTestEndpoint() {
   return EndpointImpl([](std::shared_ptr<Session> session) {
     // Wait for 10 seconds to write hello world.
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC),
-                   dispatch_get_main_queue(), ^{
-                     session->logger() << "Enter main: ";
-                     session->logger() << session->request().url;
-
-                     response<string_body> res;
-                     res.status = 200;
-                     res.version = session->request().version;
-                     res.fields.insert(HeaderKeyServer, HeaderValueServer);
-                     res.fields.insert(HeaderKeyContentType,
-                                       HeaderValueContentTypeJSON);
-                     res.body = "Hello World";
-                     prepare(res);
-                     session->write(res);
-                   });
+    Executor::Shared().after(std::chrono::seconds(10), LaneWorker, [session] {
+      session->logger() << "Enter timer: ";
+      session->logger() << session->request().url;
+
+      response<string_body> res;
+      res.status = 200;
+      res.version = session->request().version;
+      res.fields.insert(HeaderKeyServer, HeaderValueServer);
+      res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+      res.body = "Hello World";
+      prepare(res);
+      session->write(res);
+    });
   });
 }
 
-response<string_body> errorResponse(req_type request, std::string message) {
+// A 400 is the client's mistake, like a malformed body. Anything else is
+// the server's.
+response<string_body> errorResponse(const req_type &request,
+                                    std::string message, unsigned status) {
+  response<string_body> res;
+  res.status = status;
+  res.reason = status == 400 ? "Bad Request" : "Internal Error";
+  res.version = request.version;
+  res.fields.insert(HeaderKeyServer, HeaderValueServer);
+  res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body = QuoteJSON(status == 400 ? message
+                                     : "An internal error occurred: " +
+                                           message);
+  prepare(res);
+  return res;
+}
+
+response<string_body> unavailableResponse(const req_type &request,
+                                          unsigned retryAfter,
+                                          std::string message) {
+  response<string_body> res;
+  res.status = 503;
+  res.reason = "Service Unavailable";
+  res.version = request.version;
+  res.fields.insert(HeaderKeyServer, HeaderValueServer);
+  res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.fields.insert(HeaderKeyRetryAfter, std::to_string(retryAfter));
+  res.body = QuoteJSON(message.size()
+                            ? message
+                            : "Server is at capacity for: '" + request.url +
+                                  "'");
+  prepare(res);
+  return res;
+}
+
+response<string_body> timeoutResponse(const req_type &request,
+                                      std::string message) {
   response<string_body> res;
-  res.status = 500;
-  res.reason = "Internal Error";
+  res.status = 504;
+  res.reason = "Gateway Timeout";
   res.version = request.version;
   res.fields.insert(HeaderKeyServer, HeaderValueServer);
   res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
-  res.body = std::string{"An internal error occurred"} + message;
+  res.body = QuoteJSON(message);
+  prepare(res);
+  return res;
+}
+
+response<string_body> unauthorizedResponse(const req_type &request) {
+  response<string_body> res;
+  res.status = 401;
+  res.reason = "Unauthorized";
+  res.version = request.version;
+  res.fields.insert(HeaderKeyServer, HeaderValueServer);
+  res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body = QuoteJSON("Request HMAC is missing or invalid");
+  prepare(res);
+  return res;
+}
+
+// Requests that refer to blobs the server doesn't have list them, so the
+// client uploads them and tries again
+response<string_body> missingBlobsResponse(const req_type &request,
+                                           const std::vector<std::string> &hashes) {
+  response<string_body> res;
+  res.status = 409;
+  res.reason = "Conflict";
+  res.version = request.version;
+  res.fields.insert(HeaderKeyServer, HeaderValueServer);
+  res.fields.insert(HeaderKeyContentType, HeaderValueContentTypeJSON);
+  res.body = "{\"missing_hashes\":[";
+  for (std::size_t i = 0; i < hashes.size(); i++) {
+    res.body += (i ? "," : "") + QuoteJSON(hashes[i]);
+  }
+  res.body += "]}";
   prepare(res);
   return res;
 }
 
-response<string_body> notFoundResponse(req_type request) {
+response<string_body> notFoundResponse(const req_type &request) {
   response<string_body> res;
   res.status = 404;
   res.reason = "Not Found";
@@ -1,3 +1,4 @@
+#import "Executor.hpp"
 #import "Logging.hpp"
 #import <beast/core/handler_helpers.hpp>
 #import <beast/core/handler_ptr.hpp>
@@ -8,6 +9,7 @@
 #import <cstddef>
 #import <cstdio>
 #import <iostream>
+#import <map>
 #import <memory>
 #import <mutex>
 #import <sstream>
@@ -20,12 +22,46 @@ namespace http {
 using namespace beast;
 using namespace beast::http;
 
+/**
+ * Bounds on the requests an endpoint accepts.
+ */
+struct AdmissionLimits {
+  // Requests running at once. 0 is unbounded.
+  std::size_t maxInFlight;
+
+  // Requests waiting for a slot. Requests beyond this are rejected.
+  std::size_t maxQueued;
+
+  // Seconds a rejected client is asked to wait before retrying
+  unsigned retryAfter;
+
+  AdmissionLimits(std::size_t maxInFlight = 0, std::size_t maxQueued = 0,
+                  unsigned retryAfter = 1)
+      : maxInFlight(maxInFlight), maxQueued(maxQueued),
+        retryAfter(retryAfter) {
+  }
+};
+
 struct ServiceContext {
 public:
   const std::string secret;
   const LogLevel logLevel;
-  ServiceContext(std::string secret, LogLevel logLevel)
-      : secret(secret), logLevel(logLevel) {
+
+  // Limits for endpoints that call into SourceKit
+  const AdmissionLimits semanticLimits;
+
+  // Limits for specific endpoints, keyed by path
+  const std::map<std::string, AdmissionLimits> endpointLimits;
+
+  // Log whole request bodies, rather than summaries
+  const bool logBodies;
+
+  ServiceContext(std::string secret, LogLevel logLevel,
+                 AdmissionLimits semanticLimits = AdmissionLimits(),
+                 std::map<std::string, AdmissionLimits> endpointLimits = {},
+                 bool logBodies = false)
+      : secret(secret), logLevel(logLevel), semanticLimits(semanticLimits),
+        endpointLimits(endpointLimits), logBodies(logBodies) {
   }
 };
 
@@ -39,34 +75,30 @@ class SemanticHTTPServer {
   using socket_type = boost::asio::ip::tcp::socket;
 
   std::mutex _sharedMutex;
-  boost::asio::io_service _ioService;
+  Executor &_executor;
   boost::asio::ip::tcp::acceptor _acceptor;
   socket_type _socket;
   std::string _root_path;
-  std::vector<std::thread> _thread;
   ServiceContext _context;
 
 public:
-  SemanticHTTPServer(endpoint_type const &ep, std::size_t threads,
+  // The server does I/O on the executor's io_service, and runs endpoints on
+  // the executor's lanes.
+  SemanticHTTPServer(endpoint_type const &ep, Executor &executor,
                      std::string const &root, ServiceContext const context)
-      : _acceptor(_ioService), _socket(_ioService), _root_path(root),
-        _context(context) {
+      : _executor(executor), _acceptor(executor.ioService()),
+        _socket(executor.ioService()), _root_path(root), _context(context) {
     _acceptor.open(ep.protocol());
     _acceptor.bind(ep);
     _acceptor.listen(boost::asio::socket_base::max_connections);
     _acceptor.async_accept(_socket,
                            std::bind(&SemanticHTTPServer::onAccept, this,
                                      beast::asio::placeholders::error));
-    _thread.reserve(threads);
-    for (std::size_t i = 0; i < threads; ++i)
-      _thread.emplace_back([&] { _ioService.run(); });
   }
 
   ~SemanticHTTPServer() {
     error_code ec;
-    _ioService.dispatch([&] { _acceptor.close(ec); });
-    for (auto &t : _thread)
-      t.join();
+    _acceptor.close(ec);
   }
 
 private:
@@ -0,0 +1,100 @@
+#import <chrono>
+#import <cstdint>
+#import <exception>
+#import <future>
+#import <map>
+#import <memory>
+#import <mutex>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * SingleFlight runs work once for concurrent callers with the same key.
+ *
+ * The first caller for a key runs the work. Callers with that key that
+ * arrive while it runs wait for it and share its result, or its exception,
+ * instead of running the work again. Once the work finishes, the key is free
+ * and the next caller starts over: results aren't cached.
+ */
+template <class Result> class SingleFlight {
+  using SharedResult = std::shared_ptr<const Result>;
+
+  struct Flight {
+    std::uint64_t id;
+    std::shared_future<SharedResult> result;
+    std::size_t joined;
+  };
+  std::map<std::string, Flight> _flights;
+  std::uint64_t _nextID = 0;
+  std::mutex _mutex;
+
+public:
+  // Stop callers joining the flight for key, which work calls while it runs.
+  // Returns how many joined it, and so wait for its result. Callers that
+  // arrive later run the work themselves.
+  std::size_t close(const std::string &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _flights.find(key);
+    if (found == _flights.end()) {
+      return 0;
+    }
+    auto joined = found->second.joined;
+    _flights.erase(found);
+    return joined;
+  }
+
+  // Run work, or wait for the caller running it. While waiting, check is
+  // called every so often, and may throw to stop waiting. joined is set when
+  // the result came from another caller.
+  template <class Work, class Check>
+  SharedResult run(const std::string &key, Work work, Check check,
+                   bool *joined) {
+    std::promise<SharedResult> promise;
+    std::shared_future<SharedResult> flight;
+    std::uint64_t id = 0;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _flights.find(key);
+      *joined = found != _flights.end();
+      if (*joined) {
+        found->second.joined++;
+        flight = found->second.result;
+      } else {
+        id = ++_nextID;
+        _flights[key] = {id, promise.get_future().share(), 0};
+      }
+    }
+
+    if (*joined) {
+      static auto PollInterval = std::chrono::milliseconds(50);
+      while (flight.wait_for(PollInterval) != std::future_status::ready) {
+        check();
+      }
+      return flight.get();
+    }
+
+    SharedResult result;
+    std::exception_ptr error;
+    try {
+      result = std::make_shared<const Result>(work());
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      // Once closed, the key may be another caller's flight
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _flights.find(key);
+      if (found != _flights.end() && found->second.id == id) {
+        _flights.erase(found);
+      }
+    }
+    if (error) {
+      promise.set_exception(error);
+      std::rethrow_exception(error);
+    }
+    promise.set_value(result);
+    return result;
+  }
+};
+} // namespace ssvim
@@ -0,0 +1,1445 @@
+#import "SourceKitSimulator.hpp"
+#import "JSON.hpp"
+
+#import <algorithm>
+#import <atomic>
+#import <chrono>
+#import <condition_variable>
+#import <cstdio>
+#import <cstdlib>
+#import <cstring>
+#import <functional>
+#import <map>
+#import <mutex>
+#import <set>
+#import <sstream>
+#import <string>
+#import <thread>
+#import <unistd.h>
+#import <unordered_map>
+#import <vector>
+
+#if SOURCEKITD_HAS_BLOCKS
+#import <Block.h>
+#endif
+
+struct sourcekitd_uid_s {
+  std::string name;
+};
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+#pragma mark - Values
+
+/**
+ * A request object or a response value.
+ *
+ * Requests and responses share a representation: a reference counted tree.
+ * A variant points at a node in its response's tree.
+ */
+struct SimValue {
+  std::atomic<int> refs{1};
+  sourcekitd_variant_type_t type = SOURCEKITD_VARIANT_TYPE_NULL;
+  std::int64_t integer = 0;
+  std::string string;
+  sourcekitd_uid_t uid = nullptr;
+  // Dictionaries keep insertion order, like sourcekitd's
+  std::vector<std::pair<sourcekitd_uid_t, SimValue *>> entries;
+  std::vector<SimValue *> elements;
+};
+
+SimValue *Retain(SimValue *value) {
+  value->refs.fetch_add(1, std::memory_order_relaxed);
+  return value;
+}
+
+void Release(SimValue *value) {
+  if (value->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  for (auto &entry : value->entries) {
+    Release(entry.second);
+  }
+  for (auto element : value->elements) {
+    Release(element);
+  }
+  delete value;
+}
+
+struct SimResponse {
+  // Null for errors and empty responses
+  SimValue *value = nullptr;
+  bool isError = false;
+  sourcekitd_error_t error = SOURCEKITD_ERROR_REQUEST_FAILED;
+  std::string description;
+};
+
+sourcekitd_uid_t UID(const char *name) {
+  return sourcekitd_uid_get_from_cstr(name);
+}
+
+SimValue *MakeValue(sourcekitd_variant_type_t type) {
+  auto value = new SimValue();
+  value->type = type;
+  return value;
+}
+
+SimValue *MakeInt(std::int64_t integer) {
+  auto value = MakeValue(SOURCEKITD_VARIANT_TYPE_INT64);
+  value->integer = integer;
+  return value;
+}
+
+SimValue *MakeString(std::string string) {
+  auto value = MakeValue(SOURCEKITD_VARIANT_TYPE_STRING);
+  value->string = std::move(string);
+  return value;
+}
+
+SimValue *MakeUID(sourcekitd_uid_t uid) {
+  auto value = MakeValue(SOURCEKITD_VARIANT_TYPE_UID);
+  value->uid = uid;
+  return value;
+}
+
+// Set key to value, taking ownership of value
+void Set(SimValue *dictionary, sourcekitd_uid_t key, SimValue *value) {
+  for (auto &entry : dictionary->entries) {
+    if (entry.first == key) {
+      Release(entry.second);
+      entry.second = value;
+      return;
+    }
+  }
+  dictionary->entries.emplace_back(key, value);
+}
+
+void Set(SimValue *dictionary, const char *key, SimValue *value) {
+  Set(dictionary, UID(key), value);
+}
+
+// Set index to value, taking ownership of value
+void SetElement(SimValue *array, size_t index, SimValue *value) {
+  if (index == SOURCEKITD_ARRAY_APPEND || index >= array->elements.size()) {
+    array->elements.push_back(value);
+    return;
+  }
+  Release(array->elements[index]);
+  array->elements[index] = value;
+}
+
+SimValue *Get(const SimValue *dictionary, sourcekitd_uid_t key) {
+  if (!dictionary || dictionary->type != SOURCEKITD_VARIANT_TYPE_DICTIONARY) {
+    return nullptr;
+  }
+  for (auto &entry : dictionary->entries) {
+    if (entry.first == key) {
+      return entry.second;
+    }
+  }
+  return nullptr;
+}
+
+std::string GetString(const SimValue *dictionary, const char *key) {
+  auto value = Get(dictionary, UID(key));
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_STRING ? value->string
+                                                                 : "";
+}
+
+sourcekitd_variant_t Variant(const SimValue *value) {
+  sourcekitd_variant_t variant = {{0, 0, 0}};
+  variant.data[0] = reinterpret_cast<std::uintptr_t>(value);
+  return variant;
+}
+
+const SimValue *FromVariant(sourcekitd_variant_t variant) {
+  return reinterpret_cast<const SimValue *>(variant.data[0]);
+}
+
+#pragma mark - JSON
+
+void WriteJSON(std::string &out, const SimValue *value) {
+  if (!value) {
+    out += "null";
+    return;
+  }
+  switch (value->type) {
+  case SOURCEKITD_VARIANT_TYPE_NULL:
+    out += "null";
+    break;
+  case SOURCEKITD_VARIANT_TYPE_DICTIONARY: {
+    out += '{';
+    auto first = true;
+    for (auto &entry : value->entries) {
+      if (!first) {
+        out += ',';
+      }
+      first = false;
+      ssvim::AppendJSONString(out, entry.first->name);
+      out += ':';
+      WriteJSON(out, entry.second);
+    }
+    out += '}';
+    break;
+  }
+  case SOURCEKITD_VARIANT_TYPE_ARRAY: {
+    out += '[';
+    for (size_t i = 0; i < value->elements.size(); i++) {
+      if (i) {
+        out += ',';
+      }
+      WriteJSON(out, value->elements[i]);
+    }
+    out += ']';
+    break;
+  }
+  case SOURCEKITD_VARIANT_TYPE_INT64:
+    out += std::to_string(value->integer);
+    break;
+  case SOURCEKITD_VARIANT_TYPE_STRING:
+    ssvim::AppendJSONString(out, value->string);
+    break;
+  case SOURCEKITD_VARIANT_TYPE_UID:
+    ssvim::AppendJSONString(out, value->uid ? value->uid->name : "");
+    break;
+  case SOURCEKITD_VARIANT_TYPE_BOOL:
+    out += value->integer ? "true" : "false";
+    break;
+  }
+}
+
+char *CopyJSON(const SimValue *value) {
+  std::string out;
+  WriteJSON(out, value);
+  return strdup(out.c_str());
+}
+
+char *CopyDescription(const SimResponse *response) {
+  if (response->isError) {
+    return strdup(("error: " + response->description).c_str());
+  }
+  return CopyJSON(response->value);
+}
+
+#pragma mark - Configuration
+
+struct SimConfig {
+  double latencyMs;
+  double latencyPerKBUs;
+  double jitterMs;
+  double coldMs;
+  double semaMs;
+  std::size_t results;
+  std::size_t moduleResults;
+  double latencyPerResultUs;
+  std::size_t diagnostics;
+  double failureRate;
+  double crashRate;
+  std::uint64_t crashAfter;
+  double restartMs;
+  std::uint64_t seed;
+  std::string slowFile;
+  double slowMs;
+};
+
+double EnvDouble(const char *name, double defaultValue) {
+  auto value = getenv(name);
+  return value ? atof(value) : defaultValue;
+}
+
+std::string EnvString(const char *name) {
+  auto value = getenv(name);
+  return value ? value : "";
+}
+
+const SimConfig &Config() {
+  static SimConfig config = [] {
+    SimConfig config;
+    config.latencyMs = EnvDouble("SSVIM_SIM_LATENCY_MS", 2);
+    config.latencyPerKBUs = EnvDouble("SSVIM_SIM_LATENCY_PER_KB_US", 20);
+    config.jitterMs = EnvDouble("SSVIM_SIM_JITTER_MS", 1);
+    config.coldMs = EnvDouble("SSVIM_SIM_COLD_MS", 50);
+    config.semaMs = EnvDouble("SSVIM_SIM_SEMA_MS", 20);
+    config.results = EnvDouble("SSVIM_SIM_RESULTS", 200);
+    config.moduleResults = EnvDouble("SSVIM_SIM_MODULE_RESULTS", 2000);
+    config.latencyPerResultUs = EnvDouble("SSVIM_SIM_LATENCY_PER_RESULT_US", 5);
+    config.diagnostics = EnvDouble("SSVIM_SIM_DIAGNOSTICS", 4);
+    config.failureRate = EnvDouble("SSVIM_SIM_FAILURE_RATE", 0);
+    config.crashRate = EnvDouble("SSVIM_SIM_CRASH_RATE", 0);
+    config.crashAfter = EnvDouble("SSVIM_SIM_CRASH_AFTER", 0);
+    config.restartMs = EnvDouble("SSVIM_SIM_RESTART_MS", 500);
+    config.seed = EnvDouble("SSVIM_SIM_SEED", 1);
+    config.slowFile = EnvString("SSVIM_SIM_SLOW_FILE");
+    config.slowMs = EnvDouble("SSVIM_SIM_SLOW_MS", 0);
+    return config;
+  }();
+  return config;
+}
+
+#pragma mark - Randomness
+
+// SplitMix64: each call mixes the state into a well distributed value
+class SimRandom {
+  std::uint64_t _state;
+
+public:
+  SimRandom(std::uint64_t seed) : _state(seed) {
+  }
+
+  std::uint64_t next() {
+    auto z = (_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  // In [0, 1)
+  double unit() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  std::size_t below(std::size_t bound) {
+    return bound ? next() % bound : 0;
+  }
+};
+
+std::uint64_t Hash(const std::string &value) {
+  std::uint64_t hash = 0xcbf29ce484222325;
+  for (auto c : value) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+#pragma mark - Notifications
+
+/**
+ * Delivers notifications on a thread of its own, like sourcekitd delivers
+ * them on the main queue.
+ */
+class NotificationQueue {
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::multimap<clock::time_point, std::function<void()>> _pending;
+
+public:
+  // Leaked, so it outlives static destructors
+  static NotificationQueue &Shared() {
+    static auto queue = new NotificationQueue();
+    return *queue;
+  }
+
+  void after(clock::duration delay, std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _pending.emplace(clock::now() + delay, std::move(fn));
+    _wake.notify_one();
+  }
+
+private:
+  NotificationQueue() {
+    std::thread([this] { run(); }).detach();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      if (_pending.empty()) {
+        _wake.wait(lock);
+        continue;
+      }
+      auto next = _pending.begin();
+      if (next->first > clock::now()) {
+        _wake.wait_until(lock, next->first);
+        continue;
+      }
+      auto fn = std::move(next->second);
+      _pending.erase(next);
+      lock.unlock();
+      fn();
+      lock.lock();
+    }
+  }
+};
+
+#pragma mark - Service
+
+/**
+ * The simulated service: open documents, and whether it has crashed.
+ */
+class SimService {
+  std::mutex _mutex;
+  std::map<std::string, std::string> _documents;
+  std::set<std::string> _warm;
+  // Modules hidden by each completion session's filter rules
+  std::map<std::string, std::set<std::string>> _hiddenModules;
+  bool _crashed = false;
+  std::atomic<std::uint64_t> _sequence{0};
+  std::function<void(sourcekitd_response_t)> _notificationHandler;
+  std::function<void()> _interruptedHandler;
+
+public:
+  static SimService &Shared() {
+    static auto service = new SimService();
+    return *service;
+  }
+
+  void setNotificationHandler(std::function<void(sourcekitd_response_t)> fn) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _notificationHandler = fn;
+  }
+
+  void setInterruptedHandler(std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _interruptedHandler = fn;
+  }
+
+  SimResponse *send(const SimValue *request);
+
+private:
+  void notify(SimResponse *response) {
+    std::function<void(sourcekitd_response_t)> handler;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      handler = _notificationHandler;
+    }
+    if (handler) {
+      handler(response);
+    } else {
+      if (response->value) {
+        Release(response->value);
+      }
+      delete response;
+    }
+  }
+
+  void crash();
+  void restore();
+  void scheduleDocumentUpdate(const std::string &name);
+};
+
+SimResponse *Error(sourcekitd_error_t error, std::string description) {
+  auto response = new SimResponse();
+  response->isError = true;
+  response->error = error;
+  response->description = description;
+  return response;
+}
+
+void SimService::crash() {
+  std::function<void()> interrupted;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_crashed) {
+      return;
+    }
+    _crashed = true;
+    _documents.clear();
+    _warm.clear();
+    _hiddenModules.clear();
+    interrupted = _interruptedHandler;
+  }
+  NotificationQueue::Shared().after(
+      clock::duration::zero(), [this, interrupted] {
+        if (interrupted) {
+          interrupted();
+        }
+        notify(Error(SOURCEKITD_ERROR_CONNECTION_INTERRUPTED,
+                     "Connection interrupted"));
+      });
+  auto restart = std::chrono::duration<double, std::milli>(Config().restartMs);
+  NotificationQueue::Shared().after(
+      std::chrono::duration_cast<clock::duration>(restart),
+      [this] { restore(); });
+}
+
+void SimService::restore() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _crashed = false;
+  }
+  auto response = new SimResponse();
+  response->value = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(response->value, "key.notification",
+      MakeUID(UID("source.notification.sema_enabled")));
+  notify(response);
+}
+
+void SimService::scheduleDocumentUpdate(const std::string &name) {
+  auto delay = std::chrono::duration<double, std::milli>(Config().semaMs);
+  NotificationQueue::Shared().after(
+      std::chrono::duration_cast<clock::duration>(delay), [this, name] {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          // Updates for documents lost in a crash never arrive
+          if (_documents.find(name) == _documents.end()) {
+            return;
+          }
+        }
+        auto response = new SimResponse();
+        response->value = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+        Set(response->value, "key.notification",
+            MakeUID(UID("source.notification.editor.documentupdate")));
+        Set(response->value, "key.name", MakeString(name));
+        notify(response);
+      });
+}
+
+#pragma mark - Responses
+
+const char *const MemberNames[] = {
+    "count",    "identifier", "offset", "contents",  "isEmpty",
+    "children", "location",   "length", "timestamp", "kind",
+};
+
+const char *const TypeNames[] = {
+    "Int", "String", "Bool", "Double", "[String]", "[Int: String]",
+};
+
+const char *const Kinds[] = {
+    "source.lang.swift.decl.var.instance",
+    "source.lang.swift.decl.function.method.instance",
+    "source.lang.swift.keyword",
+    "source.lang.swift.decl.struct",
+};
+
+// Swift, and the modules the text imports
+std::set<std::string> ImportedModules(const std::string &text) {
+  std::set<std::string> modules = {"Swift"};
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream words(line);
+    std::string word;
+    if (!(words >> word) || word != "import" || !(words >> word)) {
+      continue;
+    }
+    modules.insert(word.substr(0, word.find('.')));
+  }
+  return modules;
+}
+
+// A completion is unqualified, and so offers every module's declarations,
+// unless it follows a dot
+bool IsUnqualifiedCompletion(const std::string &text, std::int64_t offset) {
+  return offset <= 0 || offset > static_cast<std::int64_t>(text.size()) ||
+         text[offset - 1] != '.';
+}
+
+// The modules a codecomplete.open's filter rules hide
+std::set<std::string> HiddenModules(const SimValue *request) {
+  std::set<std::string> hidden;
+  auto rules = Get(request, UID("key.filterrules"));
+  if (!rules || rules->type != SOURCEKITD_VARIANT_TYPE_ARRAY) {
+    return hidden;
+  }
+  for (auto rule : rules->elements) {
+    auto kind = Get(rule, UID("key.kind"));
+    auto hide = Get(rule, UID("key.hide"));
+    auto names = Get(rule, UID("key.names"));
+    if (!kind || kind->type != SOURCEKITD_VARIANT_TYPE_UID ||
+        kind->uid != UID("source.codecompletion.module") || !hide ||
+        !hide->integer || !names) {
+      continue;
+    }
+    for (auto name : names->elements) {
+      hidden.insert(name->string);
+    }
+  }
+  return hidden;
+}
+
+// Declarations of a module, the same in every file that imports it
+void AppendModuleResults(SimValue *results, const std::string &module) {
+  SimRandom random(Config().seed ^ Hash(module));
+  for (std::size_t i = 0; i < Config().moduleResults; i++) {
+    auto name = module + TypeNames[random.below(4)] + std::to_string(i);
+    auto isFunction = random.below(2) == 0;
+    auto result = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+    Set(result, "key.kind",
+        MakeUID(UID(isFunction ? "source.lang.swift.decl.function.free"
+                               : "source.lang.swift.decl.struct")));
+    Set(result, "key.name", MakeString(isFunction ? name + "(_:)" : name));
+    Set(result, "key.sourcetext",
+        MakeString(isFunction ? name + "(<#T##Int#>)" : name));
+    Set(result, "key.description",
+        MakeString(isFunction ? name + "(value: Int)" : name));
+    Set(result, "key.typename", MakeString(isFunction ? "Void" : name));
+    Set(result, "key.doc.brief",
+        MakeString("A simulated declaration of " + module +
+                   ", documented like those of the SDK."));
+    Set(result, "key.context",
+        MakeUID(UID("source.codecompletion.context.othermodule")));
+    Set(result, "key.num_bytes_to_erase", MakeInt(0));
+    Set(result, "key.associated_usrs",
+        MakeString("s:" + std::to_string(module.size()) + module +
+                   std::to_string(name.size()) + name + "V"));
+    Set(result, "key.modulename", MakeString(module));
+    SetElement(results, SOURCEKITD_ARRAY_APPEND, result);
+  }
+}
+
+// Members of the file's own types, and at unqualified positions the
+// declarations of every imported module not hidden by the session
+SimValue *CompletionResults(SimRandom &random, const std::string &text,
+                            std::int64_t offset,
+                            const std::set<std::string> &hidden) {
+  auto results = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+  for (std::size_t i = 0; i < Config().results; i++) {
+    auto name = std::string(MemberNames[random.below(10)]) + std::to_string(i);
+    auto isMethod = random.below(3) == 0;
+    auto result = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+    Set(result, "key.kind", MakeUID(UID(Kinds[isMethod ? 1 : random.below(4)])));
+    Set(result, "key.name", MakeString(isMethod ? name + "(_:)" : name));
+    Set(result, "key.sourcetext",
+        MakeString(isMethod ? name + "(<#T##Int#>)" : name));
+    Set(result, "key.description",
+        MakeString(isMethod ? name + "(value: Int)" : name));
+    Set(result, "key.typename", MakeString(TypeNames[random.below(6)]));
+    Set(result, "key.doc.brief",
+        MakeString("The " + name + " of the simulated document."));
+    Set(result, "key.context",
+        MakeUID(UID("source.codecompletion.context.thisclass")));
+    Set(result, "key.num_bytes_to_erase", MakeInt(0));
+    Set(result, "key.associated_usrs",
+        MakeString("s:9Simulated" + std::to_string(name.size()) + name + "Sivp"));
+    Set(result, "key.modulename", MakeString("Simulated"));
+    SetElement(results, SOURCEKITD_ARRAY_APPEND, result);
+  }
+  if (IsUnqualifiedCompletion(text, offset)) {
+    for (auto &module : ImportedModules(text)) {
+      if (!hidden.count(module)) {
+        AppendModuleResults(results, module);
+      }
+    }
+  }
+  auto response = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(response, "key.results", results);
+  return response;
+}
+
+bool IsIdentifierCharacter(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '_' ||
+         static_cast<unsigned char>(c) >= 0x80;
+}
+
+const std::set<std::string> &Keywords() {
+  static std::set<std::string> keywords = {
+      "class",  "struct", "enum",  "func",   "var",    "let",
+      "import", "return", "guard", "else",   "if",     "for",
+      "in",     "while",  "final", "public", "private", "static",
+  };
+  return keywords;
+}
+
+SimValue *SyntaxToken(const char *kind, std::size_t offset,
+                      std::size_t length) {
+  auto token = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(token, "key.kind", MakeUID(UID(kind)));
+  Set(token, "key.offset", MakeInt(offset));
+  Set(token, "key.length", MakeInt(length));
+  return token;
+}
+
+// A syntax map of the text's keywords, identifiers, comments and strings
+SimValue *SyntaxMap(const std::string &text) {
+  auto map = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+  std::size_t i = 0;
+  while (i < text.size()) {
+    auto c = text[i];
+    if (c == '/' && i + 1 < text.size() && text[i + 1] == '/') {
+      auto end = text.find('\n', i);
+      end = end == std::string::npos ? text.size() : end;
+      SetElement(map, SOURCEKITD_ARRAY_APPEND,
+                 SyntaxToken("source.lang.swift.syntaxtype.comment", i,
+                             end - i));
+      i = end;
+    } else if (c == '"') {
+      auto end = text.find('"', i + 1);
+      end = end == std::string::npos ? text.size() : end + 1;
+      SetElement(map, SOURCEKITD_ARRAY_APPEND,
+                 SyntaxToken("source.lang.swift.syntaxtype.string", i,
+                             end - i));
+      i = end;
+    } else if (IsIdentifierCharacter(c)) {
+      auto start = i;
+      while (i < text.size() && IsIdentifierCharacter(text[i])) {
+        i++;
+      }
+      auto word = text.substr(start, i - start);
+      auto kind = Keywords().count(word)
+                      ? "source.lang.swift.syntaxtype.keyword"
+                      : isdigit(static_cast<unsigned char>(word[0]))
+                            ? "source.lang.swift.syntaxtype.number"
+                            : "source.lang.swift.syntaxtype.identifier";
+      SetElement(map, SOURCEKITD_ARRAY_APPEND,
+                 SyntaxToken(kind, start, i - start));
+    } else {
+      i++;
+    }
+  }
+  return map;
+}
+
+// The declarations in the text: types at the top level, and their members
+SimValue *Substructure(const std::string &text) {
+  static const std::pair<const char *, const char *> Declarations[] = {
+      {"struct ", "source.lang.swift.decl.struct"},
+      {"class ", "source.lang.swift.decl.class"},
+      {"enum ", "source.lang.swift.decl.enum"},
+      {"func ", "source.lang.swift.decl.function.free"},
+      {"var ", "source.lang.swift.decl.var.instance"},
+      {"let ", "source.lang.swift.decl.var.instance"},
+  };
+  auto structure = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+  SimValue *parent = nullptr;
+  int depth = 0;
+  std::size_t lineStart = 0;
+  while (lineStart < text.size()) {
+    auto lineEnd = text.find('\n', lineStart);
+    lineEnd = lineEnd == std::string::npos ? text.size() : lineEnd;
+    auto line = text.substr(lineStart, lineEnd - lineStart);
+    for (auto &declaration : Declarations) {
+      auto found = line.find(declaration.first);
+      if (found == std::string::npos || depth > 1) {
+        continue;
+      }
+      auto nameStart = found + strlen(declaration.first);
+      auto nameEnd = nameStart;
+      while (nameEnd < line.size() && IsIdentifierCharacter(line[nameEnd])) {
+        nameEnd++;
+      }
+      auto entry = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+      Set(entry, "key.kind", MakeUID(UID(declaration.second)));
+      Set(entry, "key.name",
+          MakeString(line.substr(nameStart, nameEnd - nameStart)));
+      Set(entry, "key.offset", MakeInt(lineStart + found));
+      Set(entry, "key.length", MakeInt(line.size() - found));
+      Set(entry, "key.nameoffset", MakeInt(lineStart + nameStart));
+      Set(entry, "key.namelength", MakeInt(nameEnd - nameStart));
+      if (depth == 0) {
+        parent = entry;
+        SetElement(structure, SOURCEKITD_ARRAY_APPEND, entry);
+      } else if (parent) {
+        auto children = Get(parent, UID("key.substructure"));
+        if (!children) {
+          children = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+          Set(parent, "key.substructure", children);
+        }
+        SetElement(children, SOURCEKITD_ARRAY_APPEND, entry);
+      } else {
+        Release(entry);
+      }
+      break;
+    }
+    depth += std::count(line.begin(), line.end(), '{');
+    depth -= std::count(line.begin(), line.end(), '}');
+    depth = std::max(depth, 0);
+    lineStart = lineEnd + 1;
+  }
+  return structure;
+}
+
+SimValue *EditorOpenResponse(const std::string &text) {
+  auto response = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(response, "key.offset", MakeInt(0));
+  Set(response, "key.length", MakeInt(text.size()));
+  Set(response, "key.diagnostic_stage",
+      MakeUID(UID("source.diagnostic.stage.swift.parse")));
+  Set(response, "key.syntaxmap", SyntaxMap(text));
+  Set(response, "key.substructure", Substructure(text));
+  return response;
+}
+
+SimValue *DiagnosticsResponse(const std::string &name, const std::string &text,
+                              SimRandom &random) {
+  auto lines = std::max<std::size_t>(
+      1, std::count(text.begin(), text.end(), '\n'));
+  auto diagnostics = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+  for (std::size_t i = 0; i < Config().diagnostics; i++) {
+    auto isError = random.below(4) == 0;
+    auto diagnostic = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+    Set(diagnostic, "key.line", MakeInt(1 + random.below(lines)));
+    Set(diagnostic, "key.column", MakeInt(1 + random.below(40)));
+    Set(diagnostic, "key.filepath", MakeString(name));
+    Set(diagnostic, "key.severity",
+        MakeUID(UID(isError ? "source.diagnostic.severity.error"
+                            : "source.diagnostic.severity.warning")));
+    Set(diagnostic, "key.description",
+        MakeString(isError ? "use of unresolved identifier 'value" +
+                                 std::to_string(i) + "'"
+                           : "initialization of immutable value 'item" +
+                                 std::to_string(i) +
+                                 "' was never used; consider replacing "
+                                 "with assignment to '_' or removing it"));
+    SetElement(diagnostics, SOURCEKITD_ARRAY_APPEND, diagnostic);
+  }
+  auto response = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(response, "key.diagnostic_stage",
+      MakeUID(UID("source.diagnostic.stage.swift.sema")));
+  Set(response, "key.diagnostics", diagnostics);
+  return response;
+}
+
+SimValue *CursorInfoResponse(const std::string &name, SimRandom &random) {
+  auto member = std::string(MemberNames[random.below(10)]);
+  auto response = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  Set(response, "key.kind",
+      MakeUID(UID("source.lang.swift.ref.var.instance")));
+  Set(response, "key.name", MakeString(member));
+  Set(response, "key.usr", MakeString("s:9Simulated" + member + "Sivp"));
+  Set(response, "key.filepath", MakeString(name));
+  Set(response, "key.offset", MakeInt(random.below(4096)));
+  Set(response, "key.length", MakeInt(member.size()));
+  Set(response, "key.typename", MakeString(TypeNames[random.below(6)]));
+  Set(response, "key.annotated_decl",
+      MakeString("<Declaration>var " + member + ": Int</Declaration>"));
+  return response;
+}
+
+// A file sourcekitd hasn't opened is read from disk
+std::string ReadFile(const std::string &name) {
+  std::string text;
+  auto file = fopen(name.c_str(), "rb");
+  if (!file) {
+    return text;
+  }
+  char buffer[64 * 1024];
+  std::size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, length);
+  }
+  fclose(file);
+  return text;
+}
+
+// cursorinfo at an offset. Every identifier with the same name refers to the
+// same declaration, except in line comments, which refer to nothing.
+SimValue *ReferenceResponse(const std::string &name, const std::string &text,
+                            std::size_t offset) {
+  auto response = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  if (offset >= text.size() || !IsIdentifierCharacter(text[offset])) {
+    return response;
+  }
+  auto start = offset;
+  while (start > 0 && IsIdentifierCharacter(text[start - 1])) {
+    start--;
+  }
+  auto end = offset;
+  while (end < text.size() && IsIdentifierCharacter(text[end])) {
+    end++;
+  }
+  auto lineStart = text.rfind('\n', start);
+  lineStart = lineStart == std::string::npos ? 0 : lineStart + 1;
+  auto comment = text.find("//", lineStart);
+  if (comment != std::string::npos && comment < start) {
+    return response;
+  }
+  auto identifier = text.substr(start, end - start);
+  Set(response, "key.kind",
+      MakeUID(UID("source.lang.swift.ref.var.instance")));
+  Set(response, "key.name", MakeString(identifier));
+  Set(response, "key.usr",
+      MakeString("s:9Simulated" + std::to_string(identifier.size()) +
+                 identifier + "v"));
+  Set(response, "key.filepath", MakeString(name));
+  Set(response, "key.offset", MakeInt(start));
+  Set(response, "key.length", MakeInt(identifier.size()));
+  return response;
+}
+
+SimResponse *SimService::send(const SimValue *request) {
+  auto &config = Config();
+  auto sequence = ++_sequence;
+  auto requestUID = Get(request, UID("key.request"));
+  if (!requestUID || requestUID->type != SOURCEKITD_VARIANT_TYPE_UID) {
+    return Error(SOURCEKITD_ERROR_REQUEST_INVALID, "missing 'key.request'");
+  }
+  std::string kind = requestUID->uid->name;
+  auto name = GetString(request, "key.name");
+  if (name.empty()) {
+    name = GetString(request, "key.sourcefile");
+  }
+  auto text = GetString(request, "key.sourcetext");
+  auto offset = Get(request, UID("key.offset"));
+
+  // Content is a function of the request alone. Faults also depend on the
+  // order of requests, so repeating a request doesn't repeat its fault.
+  SimRandom contentRandom(config.seed ^ Hash(kind + name) ^
+                          (offset ? offset->integer : 0));
+  SimRandom faultRandom(config.seed ^ Hash(kind + name) ^ sequence);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_crashed) {
+      return Error(SOURCEKITD_ERROR_CONNECTION_INTERRUPTED,
+                   "Connection interrupted");
+    }
+  }
+  if (sequence == config.crashAfter ||
+      faultRandom.unit() < config.crashRate) {
+    crash();
+    return Error(SOURCEKITD_ERROR_CONNECTION_INTERRUPTED,
+                 "Connection interrupted");
+  }
+
+  auto latencyMs = config.latencyMs +
+                   config.latencyPerKBUs * text.size() / 1024 / 1000 +
+                   config.jitterMs * faultRandom.unit();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (name.size() && _warm.insert(name).second) {
+      latencyMs += config.coldMs;
+    }
+  }
+  if (config.slowFile.size() && name.size() >= config.slowFile.size() &&
+      name.compare(name.size() - config.slowFile.size(),
+                   config.slowFile.size(), config.slowFile) == 0) {
+    latencyMs += config.slowMs;
+  }
+  std::this_thread::sleep_for(
+      std::chrono::duration<double, std::milli>(latencyMs));
+
+  if (faultRandom.unit() < config.failureRate) {
+    return Error(SOURCEKITD_ERROR_REQUEST_FAILED, "Simulated failure");
+  }
+
+  auto response = new SimResponse();
+  if (kind == "source.request.codecomplete.open" ||
+      kind == "source.request.codecomplete.update") {
+    // Sessions keep the filter rules they were opened with
+    std::set<std::string> hidden;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (kind == "source.request.codecomplete.open") {
+        _hiddenModules[name] = HiddenModules(request);
+      }
+      hidden = _hiddenModules[name];
+    }
+    response->value = CompletionResults(
+        contentRandom, text, offset ? offset->integer : 0, hidden);
+    // sourcekitd's cost grows with the results it sends
+    auto results = Get(response->value, UID("key.results"));
+    std::this_thread::sleep_for(std::chrono::duration<double, std::micro>(
+        config.latencyPerResultUs * results->elements.size()));
+  } else if (kind == "source.request.editor.open") {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _documents[name] = text;
+    }
+    response->value = EditorOpenResponse(text);
+    scheduleDocumentUpdate(name);
+  } else if (kind == "source.request.editor.replacetext") {
+    std::string document;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (text.size()) {
+        _documents[name] = text;
+      }
+      document = _documents[name];
+    }
+    // Only a change to the text brings a document update
+    if (text.size()) {
+      scheduleDocumentUpdate(name);
+    }
+    response->value = DiagnosticsResponse(name, document, contentRandom);
+  } else if (kind == "source.request.editor.close") {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _documents.erase(name);
+    response->value = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  } else if (kind == "source.request.cursorinfo") {
+    if (offset && GetString(request, "key.usr").empty()) {
+      std::string document;
+      auto isOpen = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _documents.find(name);
+        if (found != _documents.end()) {
+          document = found->second;
+          isOpen = true;
+        }
+      }
+      if (!isOpen) {
+        document = ReadFile(name);
+      }
+      response->value = ReferenceResponse(name, document, offset->integer);
+    } else {
+      response->value = CursorInfoResponse(name, contentRandom);
+    }
+  } else if (kind == "source.request.codecomplete.close") {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _hiddenModules.erase(name);
+    }
+    response->value = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  } else if (kind == "source.request.protocol_version") {
+    response->value = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  } else {
+    delete response;
+    return Error(SOURCEKITD_ERROR_REQUEST_INVALID,
+                 "unknown request: " + kind);
+  }
+  return response;
+}
+
+SimValue *Object(sourcekitd_object_t object) {
+  return static_cast<SimValue *>(object);
+}
+
+SimResponse *Response(sourcekitd_response_t response) {
+  return static_cast<SimResponse *>(response);
+}
+} // namespace
+
+#pragma mark - Lifecycle
+
+void sourcekitd_initialize(void) {
+  Config();
+}
+
+void sourcekitd_shutdown(void) {
+}
+
+#if SOURCEKITD_HAS_BLOCKS
+void sourcekitd_set_interrupted_connection_handler(
+    sourcekitd_interrupted_connection_handler_t handler) {
+  if (!handler) {
+    SimService::Shared().setInterruptedHandler(nullptr);
+    return;
+  }
+  auto copied = Block_copy(handler);
+  SimService::Shared().setInterruptedHandler([copied] { copied(); });
+}
+
+void sourcekitd_set_notification_handler(
+    sourcekitd_response_receiver_t receiver) {
+  if (!receiver) {
+    SimService::Shared().setNotificationHandler(nullptr);
+    return;
+  }
+  auto copied = Block_copy(receiver);
+  SimService::Shared().setNotificationHandler(
+      [copied](sourcekitd_response_t response) { copied(response); });
+}
+
+void sourcekitd_send_request(sourcekitd_object_t req,
+                             sourcekitd_request_handle_t *out_handle,
+                             sourcekitd_response_receiver_t receiver) {
+  if (out_handle) {
+    *out_handle = nullptr;
+  }
+  auto copied = Block_copy(receiver);
+  auto request = Retain(Object(req));
+  std::thread([copied, request] {
+    auto response = SimService::Shared().send(request);
+    Release(request);
+    copied(response);
+    Block_release(copied);
+  }).detach();
+}
+
+void sourcekitd_set_uid_handler(sourcekitd_uid_handler_t handler) {
+}
+
+void sourcekitd_set_uid_handlers(sourcekitd_uid_from_str_handler_t uid_from_str,
+                                 sourcekitd_str_from_uid_handler_t str_from_uid) {
+}
+#endif
+
+void sourcekitd_set_interrupted_connection_handler_f(
+    sourcekitd_interrupted_connection_handler_f_t handler, void *context) {
+  if (!handler) {
+    SimService::Shared().setInterruptedHandler(nullptr);
+    return;
+  }
+  SimService::Shared().setInterruptedHandler(
+      [handler, context] { handler(context); });
+}
+
+void sourcekitd_set_notification_handler_f(
+    sourcekitd_response_receiver_f_t receiver, void *context) {
+  if (!receiver) {
+    SimService::Shared().setNotificationHandler(nullptr);
+    return;
+  }
+  SimService::Shared().setNotificationHandler(
+      [receiver, context](sourcekitd_response_t response) {
+        receiver(response, context);
+      });
+}
+
+sourcekitd_response_t sourcekitd_send_request_sync(sourcekitd_object_t req) {
+  return SimService::Shared().send(Object(req));
+}
+
+void sourcekitd_cancel_request(sourcekitd_request_handle_t handle) {
+}
+
+#pragma mark - UIDs
+
+sourcekitd_uid_t sourcekitd_uid_get_from_buf(const char *buf, size_t length) {
+  // Leaked: uids live as long as the process
+  static auto mutex = new std::mutex();
+  static auto uids = new std::unordered_map<std::string, sourcekitd_uid_t>();
+  std::string name(buf, length);
+  std::lock_guard<std::mutex> lock(*mutex);
+  auto &uid = (*uids)[name];
+  if (!uid) {
+    uid = new sourcekitd_uid_s{name};
+  }
+  return uid;
+}
+
+sourcekitd_uid_t sourcekitd_uid_get_from_cstr(const char *string) {
+  return sourcekitd_uid_get_from_buf(string, strlen(string));
+}
+
+size_t sourcekitd_uid_get_length(sourcekitd_uid_t obj) {
+  return obj->name.size();
+}
+
+const char *sourcekitd_uid_get_string_ptr(sourcekitd_uid_t obj) {
+  return obj->name.c_str();
+}
+
+#pragma mark - Requests
+
+sourcekitd_object_t sourcekitd_request_retain(sourcekitd_object_t object) {
+  return Retain(Object(object));
+}
+
+void sourcekitd_request_release(sourcekitd_object_t object) {
+  Release(Object(object));
+}
+
+sourcekitd_object_t
+sourcekitd_request_dictionary_create(const sourcekitd_uid_t *keys,
+                                     const sourcekitd_object_t *values,
+                                     size_t count) {
+  auto dictionary = MakeValue(SOURCEKITD_VARIANT_TYPE_DICTIONARY);
+  for (size_t i = 0; i < count; i++) {
+    Set(dictionary, keys[i], Retain(Object(values[i])));
+  }
+  return dictionary;
+}
+
+void sourcekitd_request_dictionary_set_value(sourcekitd_object_t dict,
+                                             sourcekitd_uid_t key,
+                                             sourcekitd_object_t value) {
+  Set(Object(dict), key, Retain(Object(value)));
+}
+
+void sourcekitd_request_dictionary_set_string(sourcekitd_object_t dict,
+                                              sourcekitd_uid_t key,
+                                              const char *string) {
+  Set(Object(dict), key, MakeString(string));
+}
+
+void sourcekitd_request_dictionary_set_stringbuf(sourcekitd_object_t dict,
+                                                 sourcekitd_uid_t key,
+                                                 const char *buf,
+                                                 size_t length) {
+  Set(Object(dict), key, MakeString(std::string(buf, length)));
+}
+
+void sourcekitd_request_dictionary_set_int64(sourcekitd_object_t dict,
+                                             sourcekitd_uid_t key,
+                                             int64_t val) {
+  Set(Object(dict), key, MakeInt(val));
+}
+
+void sourcekitd_request_dictionary_set_uid(sourcekitd_object_t dict,
+                                           sourcekitd_uid_t key,
+                                           sourcekitd_uid_t uid) {
+  Set(Object(dict), key, MakeUID(uid));
+}
+
+sourcekitd_object_t
+sourcekitd_request_array_create(const sourcekitd_object_t *objects,
+                                size_t count) {
+  auto array = MakeValue(SOURCEKITD_VARIANT_TYPE_ARRAY);
+  for (size_t i = 0; i < count; i++) {
+    SetElement(array, SOURCEKITD_ARRAY_APPEND, Retain(Object(objects[i])));
+  }
+  return array;
+}
+
+void sourcekitd_request_array_set_value(sourcekitd_object_t array,
+                                        size_t index,
+                                        sourcekitd_object_t value) {
+  SetElement(Object(array), index, Retain(Object(value)));
+}
+
+void sourcekitd_request_array_set_string(sourcekitd_object_t array,
+                                         size_t index, const char *string) {
+  SetElement(Object(array), index, MakeString(string));
+}
+
+void sourcekitd_request_array_set_stringbuf(sourcekitd_object_t array,
+                                            size_t index, const char *buf,
+                                            size_t length) {
+  SetElement(Object(array), index, MakeString(std::string(buf, length)));
+}
+
+void sourcekitd_request_array_set_int64(sourcekitd_object_t array,
+                                        size_t index, int64_t val) {
+  SetElement(Object(array), index, MakeInt(val));
+}
+
+void sourcekitd_request_array_set_uid(sourcekitd_object_t array, size_t index,
+                                      sourcekitd_uid_t uid) {
+  SetElement(Object(array), index, MakeUID(uid));
+}
+
+sourcekitd_object_t sourcekitd_request_int64_create(int64_t val) {
+  return MakeInt(val);
+}
+
+sourcekitd_object_t sourcekitd_request_string_create(const char *string) {
+  return MakeString(string);
+}
+
+sourcekitd_object_t sourcekitd_request_uid_create(sourcekitd_uid_t uid) {
+  return MakeUID(uid);
+}
+
+sourcekitd_object_t sourcekitd_request_create_from_yaml(const char *yaml,
+                                                        char **error) {
+  if (error) {
+    *error = strdup("The simulator doesn't parse YAML requests");
+  }
+  return nullptr;
+}
+
+void sourcekitd_request_description_dump(sourcekitd_object_t obj) {
+  auto description = CopyJSON(Object(obj));
+  fprintf(stderr, "%s\n", description);
+  free(description);
+}
+
+char *sourcekitd_request_description_copy(sourcekitd_object_t obj) {
+  return CopyJSON(Object(obj));
+}
+
+#pragma mark - Responses
+
+void sourcekitd_response_dispose(sourcekitd_response_t obj) {
+  auto response = Response(obj);
+  if (response->value) {
+    Release(response->value);
+  }
+  delete response;
+}
+
+bool sourcekitd_response_is_error(sourcekitd_response_t obj) {
+  return Response(obj)->isError;
+}
+
+sourcekitd_error_t sourcekitd_response_error_get_kind(sourcekitd_response_t err) {
+  return Response(err)->error;
+}
+
+const char *
+sourcekitd_response_error_get_description(sourcekitd_response_t err) {
+  return Response(err)->description.c_str();
+}
+
+sourcekitd_variant_t sourcekitd_response_get_value(sourcekitd_response_t resp) {
+  return Variant(Response(resp)->value);
+}
+
+void sourcekitd_response_description_dump(sourcekitd_response_t resp) {
+  sourcekitd_response_description_dump_filedesc(resp, STDERR_FILENO);
+}
+
+void sourcekitd_response_description_dump_filedesc(sourcekitd_response_t resp,
+                                                   int fd) {
+  auto description = CopyDescription(Response(resp));
+  dprintf(fd, "%s\n", description);
+  free(description);
+}
+
+char *sourcekitd_response_description_copy(sourcekitd_response_t resp) {
+  return CopyDescription(Response(resp));
+}
+
+#pragma mark - Variants
+
+sourcekitd_variant_type_t sourcekitd_variant_get_type(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value ? value->type : SOURCEKITD_VARIANT_TYPE_NULL;
+}
+
+sourcekitd_variant_t
+sourcekitd_variant_dictionary_get_value(sourcekitd_variant_t dict,
+                                        sourcekitd_uid_t key) {
+  return Variant(Get(FromVariant(dict), key));
+}
+
+const char *sourcekitd_variant_dictionary_get_string(sourcekitd_variant_t dict,
+                                                     sourcekitd_uid_t key) {
+  return sourcekitd_variant_string_get_ptr(
+      sourcekitd_variant_dictionary_get_value(dict, key));
+}
+
+int64_t sourcekitd_variant_dictionary_get_int64(sourcekitd_variant_t dict,
+                                                sourcekitd_uid_t key) {
+  return sourcekitd_variant_int64_get_value(
+      sourcekitd_variant_dictionary_get_value(dict, key));
+}
+
+bool sourcekitd_variant_dictionary_get_bool(sourcekitd_variant_t dict,
+                                            sourcekitd_uid_t key) {
+  return sourcekitd_variant_bool_get_value(
+      sourcekitd_variant_dictionary_get_value(dict, key));
+}
+
+sourcekitd_uid_t sourcekitd_variant_dictionary_get_uid(sourcekitd_variant_t dict,
+                                                       sourcekitd_uid_t key) {
+  return sourcekitd_variant_uid_get_value(
+      sourcekitd_variant_dictionary_get_value(dict, key));
+}
+
+bool sourcekitd_variant_dictionary_apply_f(
+    sourcekitd_variant_t dict, sourcekitd_variant_dictionary_applier_f_t applier,
+    void *context) {
+  auto value = FromVariant(dict);
+  if (!value || value->type != SOURCEKITD_VARIANT_TYPE_DICTIONARY) {
+    return false;
+  }
+  for (auto &entry : value->entries) {
+    if (!applier(entry.first, Variant(entry.second), context)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t sourcekitd_variant_array_get_count(sourcekitd_variant_t array) {
+  auto value = FromVariant(array);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_ARRAY
+             ? value->elements.size()
+             : 0;
+}
+
+sourcekitd_variant_t sourcekitd_variant_array_get_value(sourcekitd_variant_t array,
+                                                        size_t index) {
+  if (index >= sourcekitd_variant_array_get_count(array)) {
+    return Variant(nullptr);
+  }
+  return Variant(FromVariant(array)->elements[index]);
+}
+
+const char *sourcekitd_variant_array_get_string(sourcekitd_variant_t array,
+                                                size_t index) {
+  return sourcekitd_variant_string_get_ptr(
+      sourcekitd_variant_array_get_value(array, index));
+}
+
+int64_t sourcekitd_variant_array_get_int64(sourcekitd_variant_t array,
+                                           size_t index) {
+  return sourcekitd_variant_int64_get_value(
+      sourcekitd_variant_array_get_value(array, index));
+}
+
+bool sourcekitd_variant_array_get_bool(sourcekitd_variant_t array,
+                                       size_t index) {
+  return sourcekitd_variant_bool_get_value(
+      sourcekitd_variant_array_get_value(array, index));
+}
+
+sourcekitd_uid_t sourcekitd_variant_array_get_uid(sourcekitd_variant_t array,
+                                                  size_t index) {
+  return sourcekitd_variant_uid_get_value(
+      sourcekitd_variant_array_get_value(array, index));
+}
+
+bool sourcekitd_variant_array_apply_f(
+    sourcekitd_variant_t array, sourcekitd_variant_array_applier_f_t applier,
+    void *context) {
+  auto count = sourcekitd_variant_array_get_count(array);
+  for (size_t i = 0; i < count; i++) {
+    if (!applier(i, sourcekitd_variant_array_get_value(array, i), context)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if SOURCEKITD_HAS_BLOCKS
+bool sourcekitd_variant_dictionary_apply(
+    sourcekitd_variant_t dict, sourcekitd_variant_dictionary_applier_t applier) {
+  auto value = FromVariant(dict);
+  if (!value || value->type != SOURCEKITD_VARIANT_TYPE_DICTIONARY) {
+    return false;
+  }
+  for (auto &entry : value->entries) {
+    if (!applier(entry.first, Variant(entry.second))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sourcekitd_variant_array_apply(sourcekitd_variant_t array,
+                                    sourcekitd_variant_array_applier_t applier) {
+  auto count = sourcekitd_variant_array_get_count(array);
+  for (size_t i = 0; i < count; i++) {
+    if (!applier(i, sourcekitd_variant_array_get_value(array, i))) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+int64_t sourcekitd_variant_int64_get_value(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_INT64 ? value->integer
+                                                               : 0;
+}
+
+bool sourcekitd_variant_bool_get_value(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_BOOL && value->integer;
+}
+
+size_t sourcekitd_variant_string_get_length(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_STRING
+             ? value->string.size()
+             : 0;
+}
+
+const char *sourcekitd_variant_string_get_ptr(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_STRING
+             ? value->string.c_str()
+             : nullptr;
+}
+
+sourcekitd_uid_t sourcekitd_variant_uid_get_value(sourcekitd_variant_t obj) {
+  auto value = FromVariant(obj);
+  return value && value->type == SOURCEKITD_VARIANT_TYPE_UID ? value->uid
+                                                             : nullptr;
+}
+
+void sourcekitd_variant_description_dump(sourcekitd_variant_t obj) {
+  sourcekitd_variant_description_dump_filedesc(obj, STDERR_FILENO);
+}
+
+void sourcekitd_variant_description_dump_filedesc(sourcekitd_variant_t obj,
+                                                  int fd) {
+  auto description = CopyJSON(FromVariant(obj));
+  dprintf(fd, "%s\n", description);
+  free(description);
+}
+
+char *sourcekitd_variant_description_copy(sourcekitd_variant_t obj) {
+  return CopyJSON(FromVariant(obj));
+}
+
+char *sourcekitd_variant_json_description_copy(sourcekitd_variant_t obj) {
+  return CopyJSON(FromVariant(obj));
+}
@@ -0,0 +1,72 @@
+#import <sourcekitd/sourcekitd.h>
+
+// The sourcekitd simulator implements the sourcekitd C API without a Swift
+// toolchain, so the server builds, runs and is load tested on Linux. Build
+// with SOURCEKIT_FLAGS=simulator to link it instead of sourcekitd.
+//
+// Responses have the shapes and about the sizes that sourcekitd's do, with
+// made up content: completions, editor.open's syntax map and structure, and
+// diagnostics after the document update notification. Completions away from
+// a dot include the declarations of every imported module, unless a
+// codecomplete.open filter rule hides the module. cursorinfo at an offset
+// takes every occurrence of an identifier, outside line comments, to
+// reference the same declaration. Output depends only on the requests and
+// the seed, so runs are repeatable.
+//
+// It's configured with environment variables, read on the first request:
+//
+//   SSVIM_SIM_LATENCY_MS         Latency of every request. Default 2.
+//   SSVIM_SIM_LATENCY_PER_KB_US  Added latency per KB of source text.
+//                                Default 20.
+//   SSVIM_SIM_JITTER_MS          Up to this much is added at random.
+//                                Default 1.
+//   SSVIM_SIM_COLD_MS            Added to the first request for a document,
+//                                and again after a crash. Default 50.
+//   SSVIM_SIM_SEMA_MS            Delay before a document update
+//                                notification. Default 20.
+//   SSVIM_SIM_RESULTS            Completion results. Default 200.
+//   SSVIM_SIM_MODULE_RESULTS     Results from each imported module, Swift
+//                                included, at unqualified positions.
+//                                Default 2000.
+//   SSVIM_SIM_LATENCY_PER_RESULT_US
+//                                Added latency per completion result.
+//                                Default 5.
+//   SSVIM_SIM_DIAGNOSTICS        Diagnostics per document. Default 4.
+//   SSVIM_SIM_FAILURE_RATE       Fraction of requests that fail. Default 0.
+//   SSVIM_SIM_CRASH_RATE         Fraction of requests that crash the
+//                                service. Default 0.
+//   SSVIM_SIM_CRASH_AFTER        Crash on this request, counting from 1.
+//                                Default 0, never.
+//   SSVIM_SIM_RESTART_MS         Time a crashed service takes to come back.
+//                                Default 500.
+//   SSVIM_SIM_SEED               Seed for everything random. Default 1.
+//   SSVIM_SIM_SLOW_FILE          Requests for documents whose names end
+//                                with this take longer. Default none.
+//   SSVIM_SIM_SLOW_MS            Added to each request for the slow file.
+//                                Default 0.
+//
+// A crash behaves like sourcekitd's: the interrupted connection handler is
+// called, the notification handler gets a connection interrupted error, and
+// requests fail with the same error until the service is restored. Then the
+// notification handler gets source.notification.sema_enabled. Open documents
+// are forgotten, so the next request for each is cold.
+
+SOURCEKITD_BEGIN_DECLS
+
+// Function variants of the handler setters, for compilers without blocks.
+// These only exist in the simulator.
+
+typedef void (*sourcekitd_response_receiver_f_t)(sourcekitd_response_t resp,
+                                                 void *context);
+
+SOURCEKITD_PUBLIC
+void sourcekitd_set_notification_handler_f(
+    sourcekitd_response_receiver_f_t receiver, void *context);
+
+typedef void (*sourcekitd_interrupted_connection_handler_f_t)(void *context);
+
+SOURCEKITD_PUBLIC
+void sourcekitd_set_interrupted_connection_handler_f(
+    sourcekitd_interrupted_connection_handler_f_t handler, void *context);
+
+SOURCEKITD_END_DECLS
@@ -1,59 +1,41 @@
-#import <assert.h>
-#import <dispatch/dispatch.h>
+#import <algorithm>
+#import <atomic>
+#import <chrono>
+#import <cstring>
+#import <deque>
+#import <dlfcn.h>
 #import <fstream>
 #import <functional>
 #import <future>
 #import <iostream>
 #import <map>
+#import <memory>
+#import <mutex>
+#import <set>
 #import <sourcekitd/sourcekitd.h>
-#import <sstream>
 #import <string>
+#import <sys/stat.h>
 #import <thread>
 #import <vector>
 
+#import "CompletionContext.hpp"
+#import "CompletionItems.hpp"
+#import "DiskCache.hpp"
+#import "Executor.hpp"
+#import "FutureChannel.hpp"
+#import "HMAC.hpp"
+#import "JSON.hpp"
 #import "Logging.hpp"
+#import "MemoryBudget.hpp"
+#import "Metrics.hpp"
+#import "ModuleDiagnostics.hpp"
+#import "SingleFlight.hpp"
+#if !SOURCEKITD_HAS_BLOCKS
+#import "SourceKitSimulator.hpp"
+#endif
 #import "SwiftCompleter.hpp"
-
-#pragma mark - Futures
-
-using promise_ty = std::promise<std::string> *;
-
-// future channel sets values on registered futures.
-// it operates in a shared key space.
-//
-// usage:
-// in the example of working with the document update notifications,
-// a key would be formed based on the name and notification
-//
-// {
-//  key.notification: source.notification.editor.documentupdate,
-//  key.name: "/Users/aprilmarino/swiftyswiftvim/Examples/some_swift.swift"
-//  }
-
-class FutureChannel {
-  std::map<std::string, std::vector<promise_ty>> _promises;
-  std::mutex _shared_mutex;
-
-public:
-  void set(std::string key, const std::string value) {
-    std::lock_guard<std::mutex> lock(_shared_mutex);
-    auto entries = _promises.find(key);
-    if (entries != _promises.end()) {
-      for (auto promise : entries->second) {
-        promise->set_value(value);
-        delete promise;
-      }
-      _promises.erase(key);
-    }
-  }
-
-  std::future<std::string> future(std::string key) {
-    auto promise = new std::promise<std::string>;
-    std::lock_guard<std::mutex> lock(_shared_mutex);
-    _promises[key].push_back(promise);
-    return promise->get_future();
-  }
-};
+#import "Tracing.hpp"
+#import "Usages.hpp"
 
 #pragma mark - SourceKitD
 
@@ -72,78 +54,613 @@ static auto KeyHideLowPriority =
 static auto KeySourceFile = sourcekitd_uid_get_from_cstr("key.sourcefile");
 static auto KeySourceText = sourcekitd_uid_get_from_cstr("key.sourcetext");
 static auto KeyName = sourcekitd_uid_get_from_cstr("key.name");
+static auto KeyResults = sourcekitd_uid_get_from_cstr("key.results");
+static auto KeyContext = sourcekitd_uid_get_from_cstr("key.context");
+static auto KeyModuleName = sourcekitd_uid_get_from_cstr("key.modulename");
+static auto KeyFilterRules = sourcekitd_uid_get_from_cstr("key.filterrules");
+static auto KeyKind = sourcekitd_uid_get_from_cstr("key.kind");
+static auto KeyHide = sourcekitd_uid_get_from_cstr("key.hide");
+static auto KeyNames = sourcekitd_uid_get_from_cstr("key.names");
+static auto KeyUSR = sourcekitd_uid_get_from_cstr("key.usr");
+static auto KeyAnnotatedDecl =
+    sourcekitd_uid_get_from_cstr("key.annotated_decl");
+static auto KeyFullDocs = sourcekitd_uid_get_from_cstr("key.doc.full_as_xml");
+static auto ContextOtherModule =
+    sourcekitd_uid_get_from_cstr("source.codecompletion.context.othermodule");
+static auto KindModule =
+    sourcekitd_uid_get_from_cstr("source.codecompletion.module");
 
-#pragma mark - SourceKitD Notifications
+#pragma mark - Disk Cache
 
-using HandlerFunc = std::function<bool(sourcekitd_response_t)>;
+// Results depend on the sourcekitd that computed them, and on the SDK. Disk
+// cache keys start with a stamp of the sourcekitd library, so updating the
+// toolchain misses every entry.
+static const std::string &ToolsStamp() {
+  static std::string stamp = [] {
+    std::string stamp = "ssvim 1";
+    Dl_info library;
+    struct stat info;
+    if (dladdr(reinterpret_cast<void *>(&sourcekitd_send_request_sync),
+               &library) &&
+        library.dli_fname && stat(library.dli_fname, &info) == 0) {
+      stamp += std::string(" ") + library.dli_fname + " " +
+               std::to_string(info.st_size) + " " +
+               std::to_string(info.st_mtime);
+    }
+    return stamp;
+  }();
+  return stamp;
+}
+
+// The SDK a file is compiled against changes in place as Xcode updates, so
+// its settings file is stamped too
+static std::string SDKStamp(const std::vector<std::string> &flags) {
+  for (std::size_t i = 0; i + 1 < flags.size(); i++) {
+    struct stat info;
+    if (flags[i] == "-sdk" &&
+        stat((flags[i + 1] + "/SDKSettings.json").c_str(), &info) == 0) {
+      return std::to_string(info.st_size) + " " +
+             std::to_string(info.st_mtime);
+    }
+  }
+  return "";
+}
+
+// A result is the same for the same tools, unsaved files and flags
+static std::string DiskKey(const ssvim::CompletionContext &ctx) {
+  auto key = ToolsStamp();
+  key += '\0' + SDKStamp(ctx.flags) + '\0' + ctx.sourceFilename;
+  for (auto &file : ctx.unsavedFiles) {
+    ssvim::SHA256 hash;
+    hash.update(file.contents().data(), file.contents().size());
+    key += '\0' + file.fileName + '\0' + ssvim::HexEncode(hash.digest());
+  }
+  for (auto &flag : ctx.flags) {
+    key += '\0' + flag;
+  }
+  return key;
+}
+
+// Use the result on disk, when read is set, or compute it and write it for
+// next time. compute returns false for results that shouldn't be kept, like
+// errors.
+template <class Compute>
+static std::string WithDiskCache(const char *kind,
+                                 const ssvim::CompletionContext &ctx, bool read,
+                                 Compute compute) {
+  auto &disk = ssvim::DiskCache::Shared();
+  std::string key;
+  std::string result;
+  if (disk.enabled()) {
+    key = DiskKey(ctx);
+    if (read && disk.get(kind, key, &result)) {
+      return result;
+    }
+  }
+  if (compute(&result) && disk.enabled()) {
+    disk.put(kind, key, result);
+  }
+  return result;
+}
+
+// Strings are written with their length first
+static void AppendString(std::string &out, const std::string &value) {
+  std::uint32_t length = value.size();
+  out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+  out += value;
+}
+
+static bool ReadString(const std::string &in, std::size_t *offset,
+                       std::string *value) {
+  std::uint32_t length;
+  if (in.size() - *offset < sizeof(length)) {
+    return false;
+  }
+  memcpy(&length, in.data() + *offset, sizeof(length));
+  *offset += sizeof(length);
+  if (in.size() - *offset < length) {
+    return false;
+  }
+  value->assign(in, *offset, length);
+  *offset += length;
+  return true;
+}
+
+#pragma mark - Global Completions
 
 namespace ssvim {
 
-// Context for a given completion
-struct CompletionContext {
-  // The current source source file's absolute path
-  std::string sourceFilename;
+/**
+ * The declarations of other modules offered at an unqualified completion.
+ */
+struct GlobalCompletionSet {
+  // Each candidate's JSON, as sourcekitd describes it
+  std::vector<std::string> candidates;
+  // The same candidates, for slim responses
+  std::vector<std::string> slim;
+  // The modules they come from
+  std::set<std::string> modules;
+  std::uint64_t bytes = 0;
+};
+} // namespace ssvim
+
+/**
+ * GlobalCompletionCache shares the declarations of other modules between
+ * unqualified completions.
+ *
+ * They make up most of the results there, often tens of thousands, and are
+ * the same for every file with the same imports and flags. With a cached
+ * set, sourcekitd is asked to hide those modules, so it only sends the few
+ * local results, and the cached ones are appended to them. Sets count
+ * against the memory budget.
+ */
+class GlobalCompletionCache {
+  struct Entry {
+    std::shared_ptr<const ssvim::GlobalCompletionSet> set;
+    // Of its memory budget entry
+    std::uint64_t generation;
+  };
+
+  std::mutex _mutex;
+  std::map<std::string, Entry> _sets;
+  ssvim::Counter &_hits;
+  ssvim::Counter &_misses;
+
+public:
+  static GlobalCompletionCache &Shared() {
+    static auto cache = new GlobalCompletionCache();
+    return *cache;
+  }
+
+  // The set for the imports and flags of a completion
+  static std::string Key(const ssvim::CompletionContext &ctx) {
+    std::string key;
+    auto &contents = ctx.unsavedFiles[0].contents();
+    for (auto &module : ssvim::ImportedModules(contents)) {
+      key += module + '\n';
+    }
+    key += '\n';
+    for (auto &flag : ssvim::NormalizedCompletionFlags(ctx.compilerArgs())) {
+      key += flag + '\n';
+    }
+    key += SDKStamp(ctx.flags);
+    return key;
+  }
+
+  std::shared_ptr<const ssvim::GlobalCompletionSet>
+  find(const std::string &key) {
+    std::shared_ptr<const ssvim::GlobalCompletionSet> set;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _sets.find(key);
+      if (found != _sets.end()) {
+        set = found->second.set;
+      }
+    }
+    if (!set) {
+      // After a restart, the set may be on disk
+      set = read(key);
+      if (!set) {
+        _misses.increment();
+        return nullptr;
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sets[key] = {set, 0};
+    }
+    _hits.increment();
+    use(key, set);
+    return set;
+  }
 
-  // Position of the completion
-  unsigned line;
-  unsigned column;
+  // Slim the candidates of a new set once, rather than on every response
+  static void Slim(ssvim::GlobalCompletionSet &set) {
+    set.slim.reserve(set.candidates.size());
+    for (auto &candidate : set.candidates) {
+      set.slim.push_back(
+          ssvim::SlimCompletionCandidate(candidate.data(), candidate.size()));
+      set.bytes += set.slim.back().size();
+    }
+  }
 
-  std::vector<std::string> flags;
+  void insert(const std::string &key,
+              std::shared_ptr<const ssvim::GlobalCompletionSet> set) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sets[key] = {set, 0};
+    }
+    use(key, set);
+    write(key, *set);
+  }
 
-  // Unsaved files
-  std::vector<UnsavedFile> unsavedFiles;
+private:
+  GlobalCompletionCache()
+      : _hits(ssvim::MetricsRegistry::Shared().counter(
+            "ssvim_global_completions_total",
+            "Unqualified completions by whether their global results were "
+            "cached",
+            ssvim::MetricLabel("result", "hit"))),
+        _misses(ssvim::MetricsRegistry::Shared().counter(
+            "ssvim_global_completions_total",
+            "Unqualified completions by whether their global results were "
+            "cached",
+            ssvim::MetricLabel("result", "miss"))) {
+  }
 
-  // Return the args based on the current flags
-  // and default to the OSX SDK if none.
-  std::vector<std::string> compilerArgs() {
-    if (flags.size() == 0) {
-      return DefaultOSXArgs();
+  static std::string DiskKey(const std::string &key) {
+    return ToolsStamp() + '\0' + key;
+  }
+
+  static void write(const std::string &key,
+                    const ssvim::GlobalCompletionSet &set) {
+    auto &disk = ssvim::DiskCache::Shared();
+    if (!disk.enabled()) {
+      return;
+    }
+    std::string value;
+    AppendString(value, std::to_string(set.modules.size()));
+    for (auto &module : set.modules) {
+      AppendString(value, module);
     }
+    for (auto &candidate : set.candidates) {
+      AppendString(value, candidate);
+    }
+    disk.put("global_completions", DiskKey(key), std::move(value));
+  }
 
-    return flags;
+  static std::shared_ptr<const ssvim::GlobalCompletionSet>
+  read(const std::string &key) {
+    std::string value;
+    if (!ssvim::DiskCache::Shared().get("global_completions", DiskKey(key),
+                                        &value)) {
+      return nullptr;
+    }
+    auto set = std::make_shared<ssvim::GlobalCompletionSet>();
+    std::size_t offset = 0;
+    std::string count;
+    if (!ReadString(value, &offset, &count)) {
+      return nullptr;
+    }
+    std::string string;
+    for (auto modules = strtoul(count.c_str(), nullptr, 10); modules;
+         modules--) {
+      if (!ReadString(value, &offset, &string)) {
+        return nullptr;
+      }
+      set->modules.insert(string);
+    }
+    while (offset < value.size()) {
+      if (!ReadString(value, &offset, &string)) {
+        return nullptr;
+      }
+      set->bytes += string.size();
+      set->candidates.push_back(std::move(string));
+    }
+    Slim(*set);
+    return set;
   }
 
-  std::vector<std::string> DefaultOSXArgs() {
-    return {
-        "-sdk",
-        "/Applications/Xcode.app/Contents/Developer/Platforms/"
-        "MacOSX.platform/Developer/SDKs/MacOSX.sdk",
-        "-target", "x86_64-apple-macosx10.12",
-    };
+  // Mark a set used. The budget calls back without its lock held, so this
+  // must not hold ours either.
+  void use(const std::string &key,
+           const std::shared_ptr<const ssvim::GlobalCompletionSet> &set) {
+    std::uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto found = _sets.find(key);
+      if (found == _sets.end()) {
+        return;
+      }
+      generation = found->second.generation =
+          ssvim::MemoryBudget::NextGeneration();
+    }
+    ssvim::MemoryBudget::Shared().use(
+        "global_completions", key, set->bytes, [this, key, generation] {
+          std::lock_guard<std::mutex> lock(_mutex);
+          auto found = _sets.find(key);
+          if (found != _sets.end() && found->second.generation == generation) {
+            _sets.erase(found);
+          }
+        });
   }
 };
 
+#pragma mark - SourceKitD Notifications
+
+using HandlerFunc = std::function<bool(sourcekitd_response_t)>;
+
+namespace ssvim {
+
 class SourceKitService {
   Logger _logger;
 
 public:
   SourceKitService(LogLevel logLevel);
-  int CompletionUpdate(CompletionContext &ctx, char **oresponse);
+  int CompletionUpdate(CompletionContext &ctx, const ResponseSink &sink,
+                       const GlobalCompletionSet *merge = nullptr,
+                       GlobalCompletionSet *collect = nullptr,
+                       CompletionSession *session = nullptr);
   int CompletionOpen(CompletionContext &ctx, char **oresponse);
+  int CursorInfo(CompletionContext &ctx, const std::string &fileName,
+                 const std::string &usr, unsigned offset, HandlerFunc func);
   int EditorOpen(CompletionContext &ctx, char **oresponse);
+  void OpenUnsavedFiles(CompletionContext &ctx);
   int EditorReplaceText(CompletionContext &ctx, char **oresponse);
 };
 } // namespace ssvim
 
 static char *PrintResponse(sourcekitd_response_t resp) {
+  ssvim::TraceSpan span("PrintResponse");
   auto dict = sourcekitd_response_get_value(resp);
   auto JSONString = sourcekitd_variant_json_description_copy(dict);
   return JSONString;
 }
 
+// Write a slim candidate with its item ID
+static void SinkCompletionItem(const ssvim::ResponseSink &sink,
+                               const std::string &slim, std::size_t item) {
+  auto end = slim.rfind('}');
+  sink(slim.data(), end);
+  // Members are separated by a comma, unless there are none
+  auto id = std::string(slim.find(':') < end ? "," : "") + "\"key.id\":" +
+            std::to_string(item) + "}";
+  sink(id.data(), id.size());
+}
+
+// Serialize a completion response into sink one candidate at a time.
+//
+// This yields the same document as PrintResponse, but only a single
+// candidate's JSON is held in memory at any point. The candidates of merge
+// follow sourcekitd's, and candidates from other modules are copied into
+// collect. With a session, candidates are slim, and sourcekitd's are kept
+// in the session.
+static void StreamCompletionResponse(sourcekitd_response_t resp,
+                                     const ssvim::ResponseSink &sink,
+                                     const ssvim::GlobalCompletionSet *merge,
+                                     ssvim::GlobalCompletionSet *collect,
+                                     ssvim::CompletionSession *session) {
+  ssvim::TraceSpan span("StreamCompletionResponse");
+  static const std::string ResultsBegin = "{\"key.results\":[";
+  static const std::string ResultsEnd = "]}";
+  auto dict = sourcekitd_response_get_value(resp);
+  auto results = sourcekitd_variant_dictionary_get_value(dict, KeyResults);
+  if (session) {
+    auto begin = "{\"key.session\":\"" + session->id + "\"," +
+                 ResultsBegin.substr(1);
+    sink(begin.data(), begin.size());
+  } else {
+    sink(ResultsBegin.data(), ResultsBegin.size());
+  }
+  auto count = sourcekitd_variant_array_get_count(results);
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      sink(",", 1);
+    }
+    auto candidate = sourcekitd_variant_array_get_value(results, i);
+    auto JSONString = sourcekitd_variant_json_description_copy(candidate);
+    auto length = strlen(JSONString);
+    if (session) {
+      SinkCompletionItem(sink, ssvim::SlimCompletionCandidate(JSONString, length),
+                         i);
+      session->candidates.emplace_back(JSONString, length);
+      session->bytes += length;
+    } else {
+      sink(JSONString, length);
+    }
+    if (collect && sourcekitd_variant_dictionary_get_uid(
+                       candidate, KeyContext) == ContextOtherModule) {
+      collect->candidates.emplace_back(JSONString, length);
+      collect->bytes += length;
+      auto module =
+          sourcekitd_variant_dictionary_get_string(candidate, KeyModuleName);
+      if (module) {
+        collect->modules.insert(module);
+      }
+    }
+    free(JSONString);
+  }
+  if (merge) {
+    auto first = count == 0;
+    auto &candidates = session ? merge->slim : merge->candidates;
+    for (std::size_t i = 0; i < candidates.size(); i++) {
+      if (!first) {
+        sink(",", 1);
+      }
+      first = false;
+      if (session) {
+        SinkCompletionItem(sink, candidates[i], count + i);
+      } else {
+        sink(candidates[i].data(), candidates[i].size());
+      }
+    }
+  }
+  sink(ResultsEnd.data(), ResultsEnd.size());
+}
+
 // A Future channel for Semantic notifications.
 // This channel is shared across all SourceKitService instances
 // and SwiftCompleter instances
-static FutureChannel SemaFutureChannel;
+static ssvim::FutureChannel SemaFutureChannel;
+
+#pragma mark - SourceKitD Memory
+
+// sourcekitd holds an AST and more for every open document and completion
+// session. They count against the memory budget as this multiple of their
+// text's size, a rough estimate.
+static const std::uint64_t SourceKitBytesPerSourceByte = 16;
+
+static const std::string DocumentsCache = "sourcekitd_documents";
+static const std::string CompletionSessionsCache =
+    "sourcekitd_completion_sessions";
+
+/**
+ * The version of each document as last opened in sourcekitd.
+ *
+ * sourcekitd reads an open document's text in place of the file on disk.
+ * The other unsaved files a request brings along are opened once for each
+ * version, rather than on every request.
+ */
+class OpenDocuments {
+  struct Document {
+    std::size_t version;
+    // Of its memory budget entry
+    std::uint64_t generation;
+  };
+
+  std::mutex _mutex;
+  std::map<std::string, Document> _versions;
+
+public:
+  static std::size_t Version(const std::string &contents) {
+    return std::hash<std::string>()(contents);
+  }
+
+  bool isOpen(const std::string &name, std::size_t version) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _versions.find(name);
+    return found != _versions.end() && found->second.version == version;
+  }
+
+  // Returns the generation to close it with
+  std::uint64_t didOpen(const std::string &name, std::size_t version) {
+    auto generation = ssvim::MemoryBudget::NextGeneration();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _versions[name] = {version, generation};
+    return generation;
+  }
+
+  // Returns false, leaving it open, when it was opened again since
+  bool didClose(const std::string &name, std::uint64_t generation) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _versions.find(name);
+    if (found == _versions.end() || found->second.generation != generation) {
+      return false;
+    }
+    _versions.erase(found);
+    return true;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _versions.clear();
+  }
+};
+
+static OpenDocuments *OpenedDocuments = new OpenDocuments();
+
+#pragma mark - SourceKitD Crash Recovery
+
+// Documents opened again once sourcekitd restarts, most recent first
+static const std::size_t RewarmDocumentLimit = 8;
+
+/**
+ * SourceKitRecovery notices when the connection to sourcekitd is interrupted.
+ *
+ * Requests fail fast with SourceKitInterrupted until sourcekitd is back,
+ * rather than hanging, and diagnostics waiting on a notification are failed
+ * right away. In the background, it waits for sourcekitd to restart and
+ * opens the recently used documents again, so the next request for them
+ * doesn't pay for a cold AST.
+ */
+class SourceKitRecovery {
+  struct Document {
+    std::string name;
+    std::string contents;
+    std::vector<std::string> compilerArgs;
+  };
+
+  std::mutex _mutex;
+  std::deque<Document> _documents;
+  std::atomic<bool> _available;
+  ssvim::Logger _logger;
+  ssvim::Counter &_interruptions;
+  ssvim::Counter &_rewarmed;
+
+public:
+  SourceKitRecovery(ssvim::LogLevel logLevel)
+      : _available(true), _logger(logLevel, "RECOVERY"),
+        _interruptions(ssvim::MetricsRegistry::Shared().counter(
+            "ssvim_sourcekitd_interruptions_total",
+            "Times the connection to sourcekitd was interrupted")),
+        _rewarmed(ssvim::MetricsRegistry::Shared().counter(
+            "ssvim_sourcekitd_rewarmed_documents_total",
+            "Documents opened again after sourcekitd restarted")) {
+    ssvim::MetricsRegistry::Shared().observe(
+        "ssvim_sourcekitd_available", "1 when sourcekitd is up", "gauge", "",
+        [this] { return isAvailable() ? 1 : 0; });
+  }
+
+  bool isAvailable() {
+    return _available.load(std::memory_order_relaxed);
+  }
+
+  // Remember a document, to open it again after a restart
+  void didUse(const ssvim::CompletionContext &ctx) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _documents.begin(); it != _documents.end(); ++it) {
+      if (it->name == ctx.sourceFilename) {
+        _documents.erase(it);
+        break;
+      }
+    }
+    _documents.push_front({ctx.sourceFilename, ctx.unsavedFiles[0].contents(),
+                           ctx.compilerArgs()});
+    if (_documents.size() > RewarmDocumentLimit) {
+      _documents.pop_back();
+    }
+  }
+
+  // Forget a document that was closed
+  void didClose(const std::string &name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _documents.erase(std::remove_if(_documents.begin(), _documents.end(),
+                                    [&](const Document &document) {
+                                      return document.name == name;
+                                    }),
+                     _documents.end());
+  }
+
+  // sourcekitd went away. This is called from sourcekitd's handlers, so the
+  // work happens on the sourcekit lane.
+  void interrupted() {
+    if (!_available.exchange(false)) {
+      return;
+    }
+    _interruptions.increment();
+    _logger.log(ssvim::LogLevelError, "SOURCEKITD_INTERRUPTED");
+    // A restarted sourcekitd starts out empty
+    ssvim::MemoryBudget::Shared().clear(DocumentsCache);
+    ssvim::MemoryBudget::Shared().clear(CompletionSessionsCache);
+    OpenedDocuments->clear();
+    SemaFutureChannel.fail(std::make_exception_ptr(
+        ssvim::SourceKitInterrupted("semantic notification")));
+    ssvim::Executor::Shared().async(ssvim::LaneSourceKit,
+                                    [this] { rewarm(); });
+  }
+
+private:
+  void rewarm();
+};
+
+// Set up with the first SourceKitService
+static SourceKitRecovery *Recovery;
 
 // There is a single notification receiver per sourcekitd session
 // and currently, there is a single session per server
 // @see SourceKitService::SourceKitService()
 static void NotificationReceiver(ssvim::Logger logger,
                                  sourcekitd_response_t resp) {
-  sourcekitd_response_description_dump(resp);
+  // Notifications carry whole diagnostic sets, so only dump them when asked
+  if (logger.isEnabled(ssvim::LogLevelExtreme)) {
+    sourcekitd_response_description_dump(resp);
+    logger.log(ssvim::LogLevelExtreme, "SEMA_RESP: ", PrintResponse(resp));
+  }
+  if (sourcekitd_response_is_error(resp) &&
+      sourcekitd_response_error_get_kind(resp) ==
+          SOURCEKITD_ERROR_CONNECTION_INTERRUPTED) {
+    Recovery->interrupted();
+    return;
+  }
   sourcekitd_variant_t payload = sourcekitd_response_get_value(resp);
-  logger << "SEMA_RESP: " << PrintResponse(resp);
   if (sourcekitd_variant_get_type(payload) == SOURCEKITD_VARIANT_TYPE_NULL) {
     logger << "GARBAGE_SEMA_RESP";
     return;
@@ -170,7 +687,9 @@ static void NotificationReceiver(ssvim::Logger logger,
 
   // Send the request in the notification
   auto semaResponse = sourcekitd_send_request_sync(edReq);
-  sourcekitd_response_description_dump(semaResponse);
+  if (logger.isEnabled(ssvim::LogLevelExtreme)) {
+    sourcekitd_response_description_dump(semaResponse);
+  }
   sourcekitd_request_release(edReq);
   logger << "SEMA_DONE";
   SemaFutureChannel.set(semaName, PrintResponse(semaResponse));
@@ -189,17 +708,76 @@ static sourcekitd_object_t CreateBaseRequest(sourcekitd_uid_t requestUID,
   return request;
 }
 
-static bool SendRequestSync(sourcekitd_object_t request, HandlerFunc func) {
-  auto response = sourcekitd_send_request_sync(request);
-  bool result = func(response);
-  sourcekitd_response_dispose(response);
-  return result;
+// The latency histogram for a sourcekitd request, labelled without the
+// source.request. prefix, as in codecomplete.open
+//
+// Each thread looks a request's histogram up in the registry once, so
+// requests don't take the registry's lock.
+static ssvim::Histogram &SourceKitLatency(sourcekitd_uid_t requestUID) {
+  static thread_local std::map<sourcekitd_uid_t, ssvim::Histogram *>
+      Histograms;
+  auto &histogram = Histograms[requestUID];
+  if (histogram) {
+    return *histogram;
+  }
+  static auto Prefix = std::string("source.request.");
+  std::string name = sourcekitd_uid_get_string_ptr(requestUID);
+  if (name.compare(0, Prefix.size(), Prefix) == 0) {
+    name = name.substr(Prefix.size());
+  }
+  histogram = &ssvim::MetricsRegistry::Shared().histogram(
+      "ssvim_sourcekitd_request_duration_seconds",
+      "Time spent in synchronous sourcekitd requests",
+      ssvim::HistogramUnitMicroseconds, ssvim::MetricLabel("request", name));
+  return *histogram;
+}
+
+// Send a request, and release it. Throws SourceKitInterrupted when
+// sourcekitd is down, or goes down during the request, and passes on what
+// func throws.
+static bool SendRequestSync(sourcekitd_uid_t requestUID,
+                            sourcekitd_object_t request, HandlerFunc func) {
+  struct RequestGuard {
+    sourcekitd_object_t request;
+    ~RequestGuard() {
+      sourcekitd_request_release(request);
+    }
+  } requestGuard{request};
+  if (!Recovery->isAvailable()) {
+    throw ssvim::SourceKitInterrupted(sourcekitd_uid_get_string_ptr(requestUID));
+  }
+  auto &latency = SourceKitLatency(requestUID);
+  auto start = std::chrono::steady_clock::now();
+  sourcekitd_response_t response;
+  {
+    // uid strings live as long as the process
+    ssvim::TraceSpan span(sourcekitd_uid_get_string_ptr(requestUID));
+    response = sourcekitd_send_request_sync(request);
+  }
+  struct ResponseGuard {
+    sourcekitd_response_t response;
+    ~ResponseGuard() {
+      sourcekitd_response_dispose(response);
+    }
+  } responseGuard{response};
+  latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count());
+  if (sourcekitd_response_is_error(response) &&
+      sourcekitd_response_error_get_kind(response) ==
+          SOURCEKITD_ERROR_CONNECTION_INTERRUPTED) {
+    Recovery->interrupted();
+    throw ssvim::SourceKitInterrupted(sourcekitd_uid_get_string_ptr(requestUID));
+  }
+  return func(response);
 }
 
 static bool CodeCompleteRequest(sourcekitd_uid_t requestUID, const char *name,
                                 unsigned offset, const char *sourceText,
                                 std::vector<std::string> compilerArgs,
-                                const char *filterText, HandlerFunc func) {
+                                const char *filterText,
+                                const std::vector<std::string> &hiddenModules,
+                                HandlerFunc func) {
   auto request = CreateBaseRequest(requestUID, name, offset);
   sourcekitd_request_dictionary_set_string(request, KeySourceFile, name);
   sourcekitd_request_dictionary_set_string(request, KeySourceText, sourceText);
@@ -214,6 +792,26 @@ static bool CodeCompleteRequest(sourcekitd_uid_t requestUID, const char *name,
                                           opts);
   sourcekitd_request_release(opts);
 
+  // Leave out modules whose results are cached. Sessions keep the rules
+  // they're opened with.
+  if (hiddenModules.size()) {
+    auto rule = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+    sourcekitd_request_dictionary_set_uid(rule, KeyKind, KindModule);
+    sourcekitd_request_dictionary_set_int64(rule, KeyHide, 1);
+    auto names = sourcekitd_request_array_create(nullptr, 0);
+    for (auto &module : hiddenModules) {
+      sourcekitd_request_array_set_string(names, SOURCEKITD_ARRAY_APPEND,
+                                          module.c_str());
+    }
+    sourcekitd_request_dictionary_set_value(rule, KeyNames, names);
+    sourcekitd_request_release(names);
+    auto rules = sourcekitd_request_array_create(nullptr, 0);
+    sourcekitd_request_array_set_value(rules, SOURCEKITD_ARRAY_APPEND, rule);
+    sourcekitd_request_release(rule);
+    sourcekitd_request_dictionary_set_value(request, KeyFilterRules, rules);
+    sourcekitd_request_release(rules);
+  }
+
   auto args = sourcekitd_request_array_create(nullptr, 0);
   {
     sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
@@ -224,9 +822,7 @@ static bool CodeCompleteRequest(sourcekitd_uid_t requestUID, const char *name,
   }
   sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
   sourcekitd_request_release(args);
-  bool result = SendRequestSync(request, func);
-  sourcekitd_request_release(request);
-  return result;
+  return SendRequestSync(requestUID, request, func);
 }
 
 static bool BasicRequest(sourcekitd_uid_t requestUID, const char *name,
@@ -255,67 +851,167 @@ static bool BasicRequest(sourcekitd_uid_t requestUID, const char *name,
   }
   sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
   sourcekitd_request_release(args);
-  bool result = SendRequestSync(request, func);
-  sourcekitd_request_release(request);
-  return result;
+  return SendRequestSync(requestUID, request, func);
 }
 
-using namespace ssvim;
+// Look up the declaration with a USR, or the one referenced at an offset
+// when usr is empty, as seen from a file
+static bool CursorInfoRequest(const char *name, const std::string &usr,
+                              unsigned offset,
+                              std::vector<std::string> compilerArgs,
+                              HandlerFunc func) {
+  static auto RequestCursorInfo =
+      sourcekitd_uid_get_from_cstr("source.request.cursorinfo");
+  auto request = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+  sourcekitd_request_dictionary_set_uid(request, KeyRequest, RequestCursorInfo);
+  sourcekitd_request_dictionary_set_string(request, KeySourceFile, name);
+  if (usr.size()) {
+    sourcekitd_request_dictionary_set_string(request, KeyUSR, usr.c_str());
+  } else {
+    sourcekitd_request_dictionary_set_int64(request, KeyOffset, offset);
+  }
 
-// Get a clean file and offset for completion.
-//
-// The file ends after the first interesting character, which may prevent
-// completing symbols declared after the offset.
-//
-// This seemed necessary on Swift V2 when it was first written, but hopefully
-// it can be improved.
-static void GetOffset(CompletionContext &ctx, unsigned *offset,
-                      std::string *CleanFile) {
-  auto line = ctx.line;
-  auto column = ctx.column;
-  auto fileName = ctx.sourceFilename;
-
-  std::string unsavedInput;
-
-  for (auto unsavedFile : ctx.unsavedFiles) {
-    if (unsavedFile.fileName == fileName) {
-      unsavedInput = unsavedFile.contents;
-      break;
+  auto args = sourcekitd_request_array_create(nullptr, 0);
+  {
+    sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND, name);
+
+    // Module sources list the file itself, which must only be passed once
+    for (auto arg : compilerArgs) {
+      if (arg == name) {
+        continue;
+      }
+      sourcekitd_request_array_set_string(args, SOURCEKITD_ARRAY_APPEND,
+                                          arg.c_str());
     }
   }
+  sourcekitd_request_dictionary_set_value(request, KeyCompilerArgs, args);
+  sourcekitd_request_release(args);
+  return SendRequestSync(RequestCursorInfo, request, func);
+}
+
+using namespace ssvim;
 
-  assert(unsavedInput.length() && "Missing unsaved file");
+// Close a document or completion session evicted from the memory budget
+static void SendCloseRequest(sourcekitd_uid_t requestUID,
+                             const std::string &name, unsigned offset) {
+  auto request = CreateBaseRequest(requestUID, name.c_str(), offset);
+  try {
+    SendRequestSync(requestUID, request,
+                    [](sourcekitd_response_t) { return false; });
+  } catch (SourceKitInterrupted &) {
+    // Nothing is open once sourcekitd restarts
+  }
+}
 
-  std::istringstream sourceFile(unsavedInput);
-  std::string someLine;
-  unsigned currentLine = 0;
-  while (std::getline(sourceFile, someLine)) {
-    if (currentLine + 1 == line) {
-      // Enumerate from the column to an interesting point
-      for (auto i = column;; i--) {
-        char someChar = '\0';
-        if (someLine.length() > i) {
-          someChar = someLine.at(i);
+// Account an open document against the memory budget. Eviction closes it
+// with editor.close, on the thread of the request that pushed it out.
+static void DidOpenDocument(const std::string &name, const std::string &text,
+                            std::size_t version) {
+  static auto RequestEditorClose =
+      sourcekitd_uid_get_from_cstr("source.request.editor.close");
+  auto generation = OpenedDocuments->didOpen(name, version);
+  MemoryBudget::Shared().use(
+      DocumentsCache, name, text.size() * SourceKitBytesPerSourceByte,
+      [name, generation] {
+        if (!OpenedDocuments->didClose(name, generation)) {
+          return;
         }
+        Recovery->didClose(name);
+        SendCloseRequest(RequestEditorClose, name, 0);
+      });
+}
+
+// The generation of each file's completion session
+static std::mutex CompletionSessionsMutex;
+static std::map<std::string, std::uint64_t> *CompletionSessionGenerations =
+    new std::map<std::string, std::uint64_t>();
 
-        if (someChar == ' ' || someChar == '.' || i == 0) {
-          // Include the character in the partial file
-          std::string partialLine = "";
-          if (i == 0) {
-            partialLine = someLine;
-          } else if (someLine.length() > i) {
-            partialLine = someLine.substr(0, i + 1);
+// Account a completion session against the memory budget. sourcekitd keys
+// sessions by name and offset, so codecomplete.close needs both.
+static void DidOpenCompletionSession(const std::string &name, unsigned offset,
+                                     std::size_t textBytes) {
+  static auto RequestCodeCompleteClose =
+      sourcekitd_uid_get_from_cstr("source.request.codecomplete.close");
+  auto generation = MemoryBudget::NextGeneration();
+  {
+    std::lock_guard<std::mutex> lock(CompletionSessionsMutex);
+    (*CompletionSessionGenerations)[name] = generation;
+  }
+  MemoryBudget::Shared().use(
+      CompletionSessionsCache, name, textBytes * SourceKitBytesPerSourceByte,
+      [name, offset, generation] {
+        {
+          std::lock_guard<std::mutex> lock(CompletionSessionsMutex);
+          auto found = CompletionSessionGenerations->find(name);
+          if (found == CompletionSessionGenerations->end() ||
+              found->second != generation) {
+            return;
           }
-          CleanFile->append(partialLine);
-          *offset = CleanFile->length();
-          return;
+          CompletionSessionGenerations->erase(found);
         }
-      }
-    } else {
-      currentLine++;
-      CleanFile->append(someLine);
-      CleanFile->append("\n");
+        SendCloseRequest(RequestCodeCompleteClose, name, offset);
+      });
+}
+
+// Stop work for an abandoned request before making another sourcekitd call.
+static void CheckDeadline(const CompletionContext &ctx, const char *stage) {
+  if (ctx.deadline.isAbandoned()) {
+    throw RequestAbandoned(stage);
+  }
+}
+
+void SourceKitRecovery::rewarm() {
+  // Wait for sourcekitd to come back. The protocol version request is cheap,
+  // and fails with the same error until it does.
+  static auto RequestProtocolVersion =
+      sourcekitd_uid_get_from_cstr("source.request.protocol_version");
+  static auto GiveUpAfter = std::chrono::seconds(60);
+  auto giveUp = std::chrono::steady_clock::now() + GiveUpAfter;
+  auto backoff = std::chrono::milliseconds(50);
+  while (true) {
+    auto request = sourcekitd_request_dictionary_create(nullptr, nullptr, 0);
+    sourcekitd_request_dictionary_set_uid(request, KeyRequest,
+                                          RequestProtocolVersion);
+    auto response = sourcekitd_send_request_sync(request);
+    sourcekitd_request_release(request);
+    auto down = sourcekitd_response_is_error(response) &&
+                sourcekitd_response_error_get_kind(response) ==
+                    SOURCEKITD_ERROR_CONNECTION_INTERRUPTED;
+    sourcekitd_response_dispose(response);
+    if (!down) {
+      break;
+    }
+    if (std::chrono::steady_clock::now() > giveUp) {
+      // Let requests through, so they find out for themselves
+      _logger.log(LogLevelError, "SOURCEKITD_STILL_DOWN");
+      break;
+    }
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min(backoff * 2, std::chrono::milliseconds(1000));
+  }
+  _available.store(true);
+  _logger.log(LogLevelError, "SOURCEKITD_RESTORED");
+
+  std::deque<Document> documents;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    documents = _documents;
+  }
+  auto RequestEditorOpen =
+      sourcekitd_uid_get_from_cstr("source.request.editor.open");
+  for (auto &document : documents) {
+    try {
+      BasicRequest(RequestEditorOpen, document.name.c_str(),
+                   document.contents.c_str(), document.compilerArgs,
+                   [](sourcekitd_response_t) { return false; });
+    } catch (SourceKitInterrupted &) {
+      // Down again. The next interruption starts over.
+      return;
     }
+    DidOpenDocument(document.name, document.contents,
+                    OpenDocuments::Version(document.contents));
+    _rewarmed.increment();
+    _logger << "REWARMED: " << document.name;
   }
 }
 
@@ -330,39 +1026,69 @@ SourceKitService::SourceKitService(ssvim::LogLevel logLevel)
   // given program. It is lazily started, and never torn down. It manages
   // caching internally per session. There is an issue in SourceKitD that
   // causes us to never tear it down.
-  static dispatch_once_t onceToken;
-  dispatch_once(&onceToken, ^{
+  static std::once_flag onceToken;
+  std::call_once(onceToken, [logLevel] {
     ssvim::Logger sharedNotificationLogger(logLevel, "SKT");
+    Recovery = new SourceKitRecovery(logLevel);
     sourcekitd_initialize();
     // WARNING ( called on dispatch_main_queue ) by sourcekitd
+    //
+    // Notifications are handled on their own lane: requests on the sourcekit
+    // lane wait for them, so they can't queue up behind those requests.
+#if SOURCEKITD_HAS_BLOCKS
     sourcekitd_set_notification_handler(^(sourcekitd_response_t resp) {
-      dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
-                     ^{
-                       NotificationReceiver(sharedNotificationLogger, resp);
-                     });
+      Executor::Shared().async(LaneNotification, [=] {
+        NotificationReceiver(sharedNotificationLogger, resp);
+      });
+    });
+#else
+    // Without blocks, as with GCC and the simulator, the logger is the
+    // handler's context. It lives as long as the session.
+    sourcekitd_set_notification_handler_f(
+        [](sourcekitd_response_t resp, void *context) {
+          auto logger = *static_cast<ssvim::Logger *>(context);
+          Executor::Shared().async(LaneNotification, [=] {
+            NotificationReceiver(logger, resp);
+          });
+        },
+        new ssvim::Logger(sharedNotificationLogger));
+#endif
+
+    // Called when sourcekitd crashes, before the notification handler hears
+    // about it. Either one starts recovery.
+#if SOURCEKITD_HAS_BLOCKS
+    sourcekitd_set_interrupted_connection_handler(^{
+      Recovery->interrupted();
     });
+#else
+    sourcekitd_set_interrupted_connection_handler_f(
+        [](void *) { Recovery->interrupted(); }, nullptr);
+#endif
   });
 }
 
-// Update the file and get latest results.
+// Update the file and stream the latest results into sink.
 int SourceKitService::CompletionUpdate(CompletionContext &ctx,
-                                       char **oresponse) {
+                                       const ResponseSink &sink,
+                                       const GlobalCompletionSet *merge,
+                                       GlobalCompletionSet *collect,
+                                       CompletionSession *session) {
+  CheckDeadline(ctx, "codecomplete.update");
+  TraceSpan span("CompletionUpdate");
   _logger << "WILL_COMPLETION_UPDATE";
   sourcekitd_uid_t RequestCodeCompleteUpdate =
       sourcekitd_uid_get_from_cstr("source.request.codecomplete.update");
   unsigned CodeCompletionOffset = 0;
-  std::string CleanFile;
-  GetOffset(ctx, &CodeCompletionOffset, &CleanFile);
+  auto &SourceText = GetOffset(ctx, &CodeCompletionOffset);
 
   bool isError = CodeCompleteRequest(
       RequestCodeCompleteUpdate, ctx.sourceFilename.data(),
-      CodeCompletionOffset, CleanFile.c_str(), ctx.compilerArgs(), nullptr,
-      [&](sourcekitd_object_t response) -> bool {
+      CodeCompletionOffset, SourceText.c_str(), ctx.compilerArgs(), nullptr,
+      ctx.hiddenModules, [&](sourcekitd_object_t response) -> bool {
         if (sourcekitd_response_is_error(response)) {
           return true;
         }
-        *oresponse = PrintResponse(response);
-        _logger.log(LogLevelExtreme, *oresponse);
+        StreamCompletionResponse(response, sink, merge, collect, session);
         return false;
       });
   _logger << "DID_COMPLETION_UPDATE";
@@ -371,20 +1097,28 @@ int SourceKitService::CompletionUpdate(CompletionContext &ctx,
 
 // Open the connection and get the first set of results.
 int SourceKitService::CompletionOpen(CompletionContext &ctx, char **oresponse) {
+  CheckDeadline(ctx, "codecomplete.open");
+  TraceSpan span("CompletionOpen");
+  Recovery->didUse(ctx);
   _logger << "WILL_COMPLETION_OPEN";
   sourcekitd_uid_t RequestCodeCompleteOpen =
       sourcekitd_uid_get_from_cstr("source.request.codecomplete.open");
   unsigned CodeCompletionOffset = 0;
-  std::string CleanFile;
-  GetOffset(ctx, &CodeCompletionOffset, &CleanFile);
+  auto &SourceText = GetOffset(ctx, &CodeCompletionOffset);
 
   bool isError = CodeCompleteRequest(
       RequestCodeCompleteOpen, ctx.sourceFilename.data(), CodeCompletionOffset,
-      CleanFile.c_str(), ctx.compilerArgs(), nullptr,
+      SourceText.c_str(), ctx.compilerArgs(), nullptr, ctx.hiddenModules,
       [&](sourcekitd_object_t response) -> bool {
         if (sourcekitd_response_is_error(response)) {
           return true;
         }
+        DidOpenCompletionSession(ctx.sourceFilename, CodeCompletionOffset,
+                                 SourceText.size());
+        // Callers that only need the session opened skip serialization.
+        if (oresponse == nullptr) {
+          return false;
+        }
         *oresponse = PrintResponse(response);
         _logger.log(LogLevelExtreme, *oresponse);
         return false;
@@ -393,12 +1127,34 @@ int SourceKitService::CompletionOpen(CompletionContext &ctx, char **oresponse) {
   return isError;
 }
 
+// Look up the declaration with a USR, or at an offset of fileName when usr
+// is empty. func gets the response unless sourcekitd fails.
+int SourceKitService::CursorInfo(CompletionContext &ctx,
+                                 const std::string &fileName,
+                                 const std::string &usr, unsigned offset,
+                                 HandlerFunc func) {
+  CheckDeadline(ctx, "cursorinfo");
+  _logger << "WILL_CURSORINFO";
+  bool isError = CursorInfoRequest(
+      fileName.c_str(), usr, offset, ctx.compilerArgs(),
+      [&](sourcekitd_object_t response) -> bool {
+        if (sourcekitd_response_is_error(response)) {
+          return true;
+        }
+        return func(response);
+      });
+  _logger << "DID_CURSORINFO";
+  return isError;
+}
+
 // Open sourcekit in editor mode
 // On success, this returns a list of after the contents have
 // gone through parsing.
 int SourceKitService::EditorOpen(CompletionContext &ctx, char **oresponse) {
+  CheckDeadline(ctx, "editor.open");
   _logger << "WILL_EDITOR_OPEN";
-  auto contents = ctx.unsavedFiles[0].contents.c_str();
+  Recovery->didUse(ctx);
+  auto contents = ctx.unsavedFiles[0].contents().c_str();
   bool isError =
       BasicRequest(sourcekitd_uid_get_from_cstr("source.request.editor.open"),
                    ctx.sourceFilename.data(), contents, ctx.compilerArgs(),
@@ -406,6 +1162,9 @@ int SourceKitService::EditorOpen(CompletionContext &ctx, char **oresponse) {
                      if (sourcekitd_response_is_error(response)) {
                        return true;
                      }
+                     DidOpenDocument(ctx.sourceFilename,
+                                     ctx.unsavedFiles[0].contents(),
+                                     ctx.unsavedFiles[0].version());
                      *oresponse = PrintResponse(response);
                      _logger.log(LogLevelExtreme, *oresponse);
                      return false;
@@ -414,14 +1173,43 @@ int SourceKitService::EditorOpen(CompletionContext &ctx, char **oresponse) {
   return isError;
 }
 
+// Open the request's other unsaved files that changed since they were last
+// opened, so sourcekitd sees them in place of the files on disk.
+void SourceKitService::OpenUnsavedFiles(CompletionContext &ctx) {
+  static auto RequestEditorOpen =
+      sourcekitd_uid_get_from_cstr("source.request.editor.open");
+  for (auto &file : ctx.unsavedFiles) {
+    if (file.fileName == ctx.sourceFilename ||
+        OpenedDocuments->isOpen(file.fileName, file.version())) {
+      continue;
+    }
+    CheckDeadline(ctx, "editor.open");
+    _logger << "WILL_OPEN_UNSAVED_FILE: " << file.fileName;
+    BasicRequest(RequestEditorOpen, file.fileName.c_str(),
+                 file.contents().c_str(), ctx.compilerArgs(),
+                 [&](sourcekitd_object_t response) -> bool {
+                   if (sourcekitd_response_is_error(response)) {
+                     return true;
+                   }
+                   DidOpenDocument(file.fileName, file.contents(),
+                                   file.version());
+                   return false;
+                 });
+    // Diagnostics of the rest of its module are out of date
+    ModuleDiagnostics::Shared().didChange(file.fileName, file.contents(),
+                                          ctx.flags);
+  }
+}
+
 // Editor replace text.
 // This command puts sourcekitd into semantic mode to get full
 // diagnostics.
 int SourceKitService::EditorReplaceText(CompletionContext &ctx,
                                         char **oresponse) {
   std::string CleanFile;
+  CheckDeadline(ctx, "editor.replacetext");
   _logger << "WILL_EDITOR_REPLACETEXT";
-  auto contents = ctx.unsavedFiles[0].contents.c_str();
+  auto contents = ctx.unsavedFiles[0].contents().c_str();
   bool isError = BasicRequest(
       sourcekitd_uid_get_from_cstr("source.request.editor.replacetext"),
       ctx.sourceFilename.data(), contents, ctx.compilerArgs(),
@@ -437,14 +1225,75 @@ int SourceKitService::EditorReplaceText(CompletionContext &ctx,
   return isError;
 }
 
+#pragma mark - Coalescing
+
+// Identical requests that arrive together share one run of sourcekitd calls,
+// and its response.
+static ssvim::SingleFlight<std::string> Flights;
+
+static void HashCombine(std::size_t &seed, const std::string &value) {
+  seed ^= std::hash<std::string>()(value) + 0x9e3779b9 + (seed << 6) +
+          (seed >> 2);
+}
+
+// Requests are identical when they're for the same endpoint, file and
+// offset, with the same unsaved files and flags.
+static std::string FlightKey(const char *endpoint,
+                             const CompletionContext &ctx, unsigned offset) {
+  std::size_t contents = 0;
+  for (auto &file : ctx.unsavedFiles) {
+    HashCombine(contents, file.fileName);
+    HashCombine(contents, file.contents());
+  }
+  std::size_t flags = 0;
+  for (auto &flag : ctx.flags) {
+    HashCombine(flags, flag);
+  }
+  std::string key = endpoint;
+  key += '\0' + ctx.sourceFilename + '\0' + std::to_string(offset) + '\0' +
+         std::to_string(contents) + '\0' + std::to_string(flags);
+  return key;
+}
+
+// Run work, or share the response of an identical request running it. When
+// that request is abandoned, the ones that joined it start over rather than
+// failing with it.
+template <class Work>
+static std::shared_ptr<const std::string>
+Coalesce(const std::string &key, const CompletionContext &ctx,
+         Counter &coalesced, Work work, bool *joined) {
+  while (true) {
+    try {
+      auto response = Flights.run(
+          key, work, [&] { CheckDeadline(ctx, "coalesced request"); },
+          joined);
+      if (*joined) {
+        coalesced.increment();
+      }
+      return response;
+    } catch (RequestAbandoned &) {
+      if (!*joined || ctx.deadline.isAbandoned()) {
+        throw;
+      }
+    }
+  }
+}
+
+static Counter &CoalescedCounter(const char *endpoint) {
+  return MetricsRegistry::Shared().counter(
+      "ssvim_coalesced_requests_total",
+      "Requests that shared the response of an identical one in flight",
+      MetricLabel("endpoint", endpoint));
+}
+
 #pragma mark - SwiftCompleter
 
 namespace ssvim {
 
 // SwiftCompleter composes SourceKitService requests together
 // to implement the higher level API.
-SwiftCompleter::SwiftCompleter(LogLevel logLevel)
-    : _logger(logLevel, "COMPLETER") {
+SwiftCompleter::SwiftCompleter(LogLevel logLevel, RequestDeadline deadline)
+    : _logger(logLevel, "COMPLETER"), _deadline(deadline) {
 }
 
 SwiftCompleter::~SwiftCompleter() {
@@ -466,25 +1315,364 @@ auto DiagnosticFlagsFromFlags(std::string filename,
 const std::string SwiftCompleter::CandidatesForLocationInFile(
     const std::string &filename, int line, int column,
     const std::vector<UnsavedFile> &unsavedFiles,
-    const std::vector<std::string> &flags) {
+    const std::vector<std::string> &flags, ColumnEncoding columnEncoding,
+    CompletionDetail detail) {
+  std::string response;
+  CandidatesForLocationInFile(
+      filename, line, column, unsavedFiles, flags,
+      [&](const char *bytes, std::size_t length) {
+        response.append(bytes, length);
+      },
+      columnEncoding, detail);
+  return response;
+}
+
+void SwiftCompleter::CandidatesForLocationInFile(
+    const std::string &filename, int line, int column,
+    const std::vector<UnsavedFile> &unsavedFiles,
+    const std::vector<std::string> &flags, const ResponseSink &sink,
+    ColumnEncoding columnEncoding, CompletionDetail detail) {
   CompletionContext ctx;
   ctx.sourceFilename = filename;
   ctx.line = line;
   ctx.column = column;
+  ctx.columnEncoding = columnEncoding;
   ctx.unsavedFiles = unsavedFiles;
   ctx.flags = flags;
+  ctx.deadline = _deadline;
 
+  // Identical requests in flight share the response of the first. They can
+  // join until it starts streaming, and it only keeps a copy of what it
+  // streams when some did, so a request nobody joined stays bounded.
+  unsigned offset = 0;
+  auto &contents = GetOffset(ctx, &offset);
+  static auto &Coalesced = CoalescedCounter("completions");
+  bool joined = false;
+  auto endpoint =
+      detail == CompletionDetailSlim ? "completions.slim" : "completions";
+  auto key = FlightKey(endpoint, ctx, offset);
+  auto response = Coalesce(
+      key, ctx, Coalesced,
+      [&] {
+        std::string copy;
+        auto streaming = false;
+        auto shared = false;
+        completions(ctx, contents, offset, detail,
+                    [&](const char *bytes, std::size_t length) {
+                      if (!streaming) {
+                        streaming = true;
+                        shared = Flights.close(key) > 0;
+                      }
+                      if (shared) {
+                        copy.append(bytes, length);
+                      }
+                      sink(bytes, length);
+                    });
+        return copy;
+      },
+      &joined);
+  if (joined) {
+    sink(response->data(), response->size());
+  }
+}
+
+void SwiftCompleter::completions(CompletionContext &ctx,
+                                 const std::string &contents, unsigned offset,
+                                 CompletionDetail detail,
+                                 const ResponseSink &sink) {
   SourceKitService sktService(_logger.level());
-  char *response = NULL;
-  sktService.CompletionOpen(ctx, &response);
-  sktService.CompletionUpdate(ctx, &response);
-  if (response == NULL) {
+  sktService.OpenUnsavedFiles(ctx);
+
+  // At an unqualified position, use the cached declarations of other
+  // modules, or collect them for next time.
+  std::string globalKey;
+  std::shared_ptr<const GlobalCompletionSet> cached;
+  std::shared_ptr<GlobalCompletionSet> collected;
+  if (IsGlobalCompletion(contents, offset)) {
+    globalKey = GlobalCompletionCache::Key(ctx);
+    cached = GlobalCompletionCache::Shared().find(globalKey);
+    if (cached) {
+      ctx.hiddenModules.assign(cached->modules.begin(),
+                               cached->modules.end());
+    } else {
+      collected = std::make_shared<GlobalCompletionSet>();
+    }
+  }
+
+  // Slim responses keep the full candidates for resolving
+  std::shared_ptr<CompletionSession> session;
+  if (detail == CompletionDetailSlim) {
+    session = std::make_shared<CompletionSession>();
+    session->id = CompletionSessions::Shared().nextID();
+    session->fileName = ctx.sourceFilename;
+    session->flags = ctx.flags;
+    if (cached) {
+      session->shared = std::shared_ptr<const std::vector<std::string>>(
+          cached, &cached->candidates);
+    }
+  }
+
+  sktService.CompletionOpen(ctx, nullptr);
+  if (sktService.CompletionUpdate(ctx, sink, cached.get(), collected.get(),
+                                  session.get())) {
     // FIXME: Propagate SourceKitService Errors
-    static auto EmptyResponse = "{ 'key.results':[] }";
+    static std::string EmptyResponse = "{\"key.results\":[]}";
     _logger << "Empty response";
-    return EmptyResponse;
+    sink(EmptyResponse.data(), EmptyResponse.size());
+    return;
+  }
+  if (collected && collected->modules.size()) {
+    GlobalCompletionCache::Slim(*collected);
+    GlobalCompletionCache::Shared().insert(globalKey, collected);
+  }
+  if (session) {
+    CompletionSessions::Shared().insert(session);
   }
-  return response;
+}
+
+static Counter &ResolveCounter(const char *result) {
+  return MetricsRegistry::Shared().counter(
+      "ssvim_completion_resolve_total",
+      "Resolved completion items by whether their session was kept",
+      MetricLabel("result", result));
+}
+
+bool SwiftCompleter::ResolveCompletion(const std::string &sessionID,
+                                       std::size_t item,
+                                       std::string *resolved) {
+  static auto &Hits = ResolveCounter("hit");
+  static auto &Misses = ResolveCounter("miss");
+  auto session = CompletionSessions::Shared().find(sessionID);
+  auto candidate = session ? session->candidate(item) : nullptr;
+  if (!candidate) {
+    Misses.increment();
+    return false;
+  }
+  Hits.increment();
+
+  // The candidate, with its item ID and what sourcekitd has about the
+  // declaration of its first USR
+  auto end = candidate->rfind('}');
+  *resolved = candidate->substr(0, end);
+  auto append = [&](const std::string &key, const std::string &value) {
+    if (resolved->find(':') != std::string::npos) {
+      *resolved += ',';
+    }
+    *resolved += "\"" + key + "\":" + value;
+  };
+  append("key.id", std::to_string(item));
+  std::string usrs;
+  if (CompletionCandidateMember(*candidate, "key.associated_usrs", &usrs) &&
+      usrs.size() > 2 && usrs.find('\\') == std::string::npos) {
+    // A space separated list, in a JSON string
+    auto usr = usrs.substr(1, usrs.size() - 2);
+    usr = usr.substr(0, usr.find(' '));
+    CompletionContext ctx;
+    ctx.sourceFilename = session->fileName;
+    ctx.flags = session->flags;
+    ctx.deadline = _deadline;
+    SourceKitService sktService(_logger.level());
+    sktService.CursorInfo(
+        ctx, ctx.sourceFilename, usr, 0, [&](sourcekitd_response_t response) {
+          auto dict = sourcekitd_response_get_value(response);
+          for (auto key : {KeyAnnotatedDecl, KeyFullDocs}) {
+            auto value = sourcekitd_variant_dictionary_get_value(dict, key);
+            if (sourcekitd_variant_get_type(value) !=
+                SOURCEKITD_VARIANT_TYPE_STRING) {
+              continue;
+            }
+            auto JSONString = sourcekitd_variant_json_description_copy(value);
+            append(sourcekitd_uid_get_string_ptr(key), JSONString);
+            free(JSONString);
+          }
+          return false;
+        });
+  }
+  *resolved += '}';
+  return true;
+}
+
+static Counter &UsageCandidateCounter(const char *result) {
+  return MetricsRegistry::Shared().counter(
+      "ssvim_usage_candidates_total",
+      "Lexical matches for usages by whether sourcekitd confirmed them",
+      MetricLabel("result", result));
+}
+
+/**
+ * A file's lexical matches for a usages request.
+ */
+struct UsageFile {
+  std::string name;
+  std::vector<IdentifierOccurrence> candidates;
+  // Set for candidates that reference the declaration. Not a vector<bool>,
+  // since candidates are confirmed concurrently.
+  std::vector<char> confirmed;
+  // Candidates that haven't been checked yet
+  std::atomic<std::size_t> remaining;
+};
+
+void SwiftCompleter::UsagesForLocationInFile(
+    const std::string &filename, int line, int column,
+    const std::vector<UnsavedFile> &unsavedFiles,
+    const std::vector<std::string> &flags, const ResponseSink &sink,
+    ColumnEncoding columnEncoding) {
+  CompletionContext ctx;
+  ctx.sourceFilename = filename;
+  ctx.line = line;
+  ctx.column = column;
+  ctx.columnEncoding = columnEncoding;
+  ctx.unsavedFiles = unsavedFiles;
+  ctx.flags = flags;
+  ctx.deadline = _deadline;
+
+  std::map<std::string, const UnsavedFile *> unsaved;
+  for (auto &file : ctx.unsavedFiles) {
+    unsaved[file.fileName] = &file;
+  }
+  if (!unsaved.count(filename)) {
+    throw std::invalid_argument("Missing contents of: " + filename);
+  }
+  auto &document = *unsaved[filename];
+  auto &contents = document.contents();
+  ctx.lineIndex =
+      LineIndex::ForDocument(filename, document.version(), contents);
+  auto offset = static_cast<unsigned>(
+      ctx.lineIndex->offset(contents, line, column, columnEncoding));
+
+  // cursorinfo sees the editor's buffers rather than the files on disk
+  SourceKitService sktService(_logger.level());
+  sktService.OpenUnsavedFiles(ctx);
+  if (!OpenedDocuments->isOpen(filename, document.version())) {
+    char *response = NULL;
+    sktService.EditorOpen(ctx, &response);
+    free(response);
+  }
+
+  std::string usr;
+  std::string name;
+  sktService.CursorInfo(
+      ctx, filename, "", offset, [&](sourcekitd_response_t response) {
+        auto dict = sourcekitd_response_get_value(response);
+        auto found = sourcekitd_variant_dictionary_get_string(dict, KeyUSR);
+        usr = found ? found : "";
+        found = sourcekitd_variant_dictionary_get_string(dict, KeyName);
+        name = found ? found : "";
+        return false;
+      });
+  auto identifier = BaseName(name);
+  if (usr.empty() || identifier.empty()) {
+    static std::string EmptyResponse = "{\"key.usages\":[]}";
+    sink(EmptyResponse.data(), EmptyResponse.size());
+    return;
+  }
+  auto begin = UsagesBegin(name, usr);
+  sink(begin.data(), begin.size());
+
+  // The file itself comes first, then the editor's other buffers and the
+  // rest of the module
+  std::vector<std::string> fileNames = {filename};
+  for (auto &file : ctx.unsavedFiles) {
+    fileNames.push_back(file.fileName);
+  }
+  for (auto &source : ModuleSources(flags)) {
+    fileNames.push_back(source);
+  }
+  std::set<std::string> seen;
+  fileNames.erase(std::remove_if(fileNames.begin(), fileNames.end(),
+                                 [&](const std::string &fileName) {
+                                   return !seen.insert(fileName).second;
+                                 }),
+                  fileNames.end());
+
+  // Most of a module never mentions the identifier, so a lexical scan of
+  // every file, in parallel, leaves sourcekitd only the matches to check
+  auto trace = tracing::Current();
+  std::vector<UsageFile> files(fileNames.size());
+  {
+    TraceSpan span("FindIdentifier");
+    Executor::Shared().apply(LaneWorker, files.size(), [&](std::size_t i) {
+      TraceScope traceScope(trace);
+      auto &file = files[i];
+      file.name = fileNames[i];
+      auto buffer = unsaved.find(file.name);
+      if (buffer != unsaved.end()) {
+        auto &text = buffer->second->contents();
+        file.candidates = FindIdentifier(text.data(), text.size(), identifier);
+      } else if (!FindIdentifierInFile(file.name, identifier,
+                                       &file.candidates)) {
+        _logger << "USAGES_UNREADABLE: " << file.name;
+      }
+      file.confirmed.assign(file.candidates.size(), 0);
+      file.remaining = file.candidates.size();
+    });
+  }
+
+  // Confirm each match with cursorinfo, on the sourcekit threads. Once one
+  // fails, as when the request is abandoned or sourcekitd goes down, the
+  // rest are skipped and the response is marked partial.
+  std::vector<std::pair<std::size_t, std::size_t>> candidates;
+  for (std::size_t i = 0; i < files.size(); i++) {
+    for (std::size_t j = 0; j < files[i].candidates.size(); j++) {
+      candidates.emplace_back(i, j);
+    }
+  }
+  static auto &Confirmed = UsageCandidateCounter("confirmed");
+  static auto &Rejected = UsageCandidateCounter("rejected");
+  std::mutex sinkMutex;
+  auto first = true;
+  std::atomic<bool> stopped(false);
+  auto logLevel = _logger.level();
+  Executor::Shared().apply(
+      LaneSourceKit, candidates.size(), [&](std::size_t i) {
+        TraceScope traceScope(trace);
+        auto &file = files[candidates[i].first];
+        auto candidate = candidates[i].second;
+        if (!stopped) {
+          try {
+            SourceKitService service(logLevel);
+            service.CursorInfo(
+                ctx, file.name, "", file.candidates[candidate].offset,
+                [&](sourcekitd_response_t response) {
+                  auto dict = sourcekitd_response_get_value(response);
+                  auto found =
+                      sourcekitd_variant_dictionary_get_string(dict, KeyUSR);
+                  file.confirmed[candidate] = found && usr == found;
+                  return false;
+                });
+            (file.confirmed[candidate] ? Confirmed : Rejected).increment();
+          } catch (std::exception &e) {
+            // Abandoned, or sourcekitd went down. apply must not throw.
+            _logger << "USAGES_STOPPED: " << e.what();
+            stopped = true;
+          }
+        }
+        if (--file.remaining > 0) {
+          return;
+        }
+        std::string usages;
+        for (std::size_t j = 0; j < file.candidates.size(); j++) {
+          if (file.confirmed[j]) {
+            usages += ',';
+            usages +=
+                UsageJSON(file.name, file.candidates[j], identifier.size());
+          }
+        }
+        if (usages.empty()) {
+          return;
+        }
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        auto skip = first ? 1 : 0;
+        first = false;
+        sink(usages.data() + skip, usages.size() - skip);
+      });
+
+  std::string end = "]";
+  if (stopped) {
+    end += ",\"key.partial\":true";
+  }
+  end += "}";
+  sink(end.data(), end.size());
 }
 
 const std::string
@@ -497,27 +1685,132 @@ SwiftCompleter::DiagnosticsForFile(const std::string &filename,
   ctx.flags = DiagnosticFlagsFromFlags(filename, flags);
   ctx.line = 0;
   ctx.column = 0;
+  ctx.deadline = _deadline;
 
+  // Other unsaved files come first, since a change to one of them makes
+  // cached diagnostics of its module stale
+  SourceKitService sktService(_logger.level());
+  sktService.OpenUnsavedFiles(ctx);
+
+  // Diagnostics of a file's own contents are cached, and kept up to date as
+  // the rest of its module changes
+  auto unsaved = std::find_if(unsavedFiles.begin(), unsavedFiles.end(),
+                              [&](const UnsavedFile &file) {
+                                return file.fileName == filename;
+                              });
+  auto cacheable = unsaved != unsavedFiles.end();
+  auto &moduleDiagnostics = ModuleDiagnostics::Shared();
+  std::string cached;
+  std::uint64_t epoch = 0;
+  // Those on disk are only as fresh as the rest of the module was when they
+  // were computed, so they're only used for files the server hasn't seen,
+  // as after a restart
+  auto known = moduleDiagnostics.contains(filename);
+  if (cacheable && moduleDiagnostics.lookup(filename, unsaved->contents(),
+                                            flags, &cached, &epoch)) {
+    return cached;
+  }
+
+  // Identical requests in flight share the first one's diagnostics
+  static auto &Coalesced = CoalescedCounter("diagnostics");
+  bool joined = false;
+  auto semaresult = *Coalesce(
+      FlightKey("diagnostics", ctx, 0), ctx, Coalesced,
+      [&] {
+        return WithDiskCache("diagnostics", ctx, !known,
+                             [&](std::string *result) {
+                               return diagnostics(ctx, result);
+                             });
+      },
+      &joined);
+  if (cacheable) {
+    moduleDiagnostics.store(filename, unsaved->contents(), flags, epoch,
+                            semaresult, _logger.level());
+  }
+  return semaresult;
+}
+
+bool SwiftCompleter::diagnostics(CompletionContext &ctx,
+                                 std::string *diagnostics) {
   SourceKitService sktService(_logger.level());
   char *response = NULL;
   sktService.EditorOpen(ctx, &response);
   sktService.EditorReplaceText(ctx, &response);
   if (response == NULL) {
     // FIXME: Propagate SourceKitService Errors
-    static auto EmptyResponse = "{ 'key.diagnostics':[] }";
+    static auto EmptyResponse = "{\"key.diagnostics\":[]}";
     _logger << "Empty response";
-    return EmptyResponse;
+    *diagnostics = EmptyResponse;
+    return false;
   }
 
   // We need to wait until:
   // - the document is updated ( NotificationReceiver fires )
   // - send a request for semantic info
   // - the semantic request completes
-  // FIXME: Add a resonable timeout. If SourceKit goes down async we won't ever
-  // get the message back ( somewhat workable for now because clients will
-  // timeout )
-  auto future = SemaFutureChannel.future(filename);
-  auto semaresult = future.get();
-  return semaresult;
+  // If SourceKit goes down, recovery fails the future. The wait also ends
+  // once the request is abandoned.
+  auto future = SemaFutureChannel.future(ctx.sourceFilename);
+  static auto PollInterval = std::chrono::milliseconds(50);
+  static auto &NotificationWait = MetricsRegistry::Shared().histogram(
+      "ssvim_semantic_notification_wait_seconds",
+      "Time diagnostics requests wait for the semantic notification",
+      HistogramUnitMicroseconds);
+  auto waitStart = std::chrono::steady_clock::now();
+  {
+    TraceSpan span("semantic notification");
+    while (future.wait_for(PollInterval) != std::future_status::ready) {
+      CheckDeadline(ctx, "semantic notification");
+    }
+  }
+  NotificationWait.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - waitStart)
+          .count());
+  *diagnostics = future.get();
+  return true;
+}
+
+const std::string
+SwiftCompleter::StructureForFile(const std::string &filename,
+                                 const std::vector<UnsavedFile> &unsavedFiles,
+                                 const std::vector<std::string> &flags) {
+  CompletionContext ctx;
+  ctx.sourceFilename = filename;
+  ctx.unsavedFiles = unsavedFiles;
+  ctx.flags = DiagnosticFlagsFromFlags(filename, flags);
+  ctx.line = 0;
+  ctx.column = 0;
+  ctx.deadline = _deadline;
+
+  // Identical requests in flight share the first one's structure
+  static auto &Coalesced = CoalescedCounter("structure");
+  bool joined = false;
+  return *Coalesce(FlightKey("structure", ctx, 0), ctx, Coalesced,
+                   [&] {
+                     return WithDiskCache("structure", ctx, true,
+                                          [&](std::string *result) {
+                                            return structure(ctx, result);
+                                          });
+                   },
+                   &joined);
+}
+
+bool SwiftCompleter::structure(CompletionContext &ctx,
+                               std::string *structure) {
+  // The editor.open response includes key.substructure for the document.
+  SourceKitService sktService(_logger.level());
+  char *response = NULL;
+  sktService.EditorOpen(ctx, &response);
+  if (response == NULL) {
+    // FIXME: Propagate SourceKitService Errors
+    static auto EmptyResponse = "{\"key.substructure\":[]}";
+    _logger << "Empty response";
+    *structure = EmptyResponse;
+    return false;
+  }
+  *structure = response;
+  free(response);
+  return true;
 }
 } // namespace ssvim
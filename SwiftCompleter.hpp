@@ -1,9 +1,15 @@
+#import "LineIndex.hpp"
 #import "Logging.hpp"
+#import <chrono>
+#import <functional>
+#import <stdexcept>
 #import <string>
 #import <vector>
 
 namespace ssvim {
 
+struct CompletionContext;
+
 /**
  * An unsaved file.
  *
@@ -12,9 +18,92 @@ namespace ssvim {
  * been written to disk yet
  */
 class UnsavedFile {
+  std::string _contents;
+  mutable std::size_t _version = 0;
+  mutable bool _hasVersion = false;
+
 public:
-  std::string contents;
   std::string fileName;
+
+  const std::string &contents() const {
+    return _contents;
+  }
+
+  void setContents(std::string contents) {
+    _contents = std::move(contents);
+    _hasVersion = false;
+  }
+
+  // A hash of the contents, which keys the caches of open documents and line
+  // indexes. It's computed on first use, and again after the contents change.
+  std::size_t version() const {
+    if (!_hasVersion) {
+      _version = std::hash<std::string>()(_contents);
+      _hasVersion = true;
+    }
+    return _version;
+  }
+};
+
+/**
+ * When to give up on a request.
+ *
+ * A request is abandoned once its deadline passes or the client that sent it
+ * goes away. Its work is pointless from then on, so it stops at the next
+ * check instead of holding on to a SourceKit thread.
+ */
+class RequestDeadline {
+public:
+  using clock = std::chrono::steady_clock;
+
+  clock::time_point deadline = clock::time_point::max();
+
+  // Returns true once the client has gone away
+  std::function<bool()> clientGone;
+
+  bool isAbandoned() const {
+    return clock::now() >= deadline || (clientGone && clientGone());
+  }
+};
+
+/**
+ * Thrown when a request was abandoned before its work finished.
+ */
+class RequestAbandoned : public std::runtime_error {
+public:
+  RequestAbandoned(const std::string &stage)
+      : std::runtime_error("Request abandoned before: " + stage) {
+  }
+};
+
+/**
+ * Thrown when the connection to sourcekitd was interrupted, as when it
+ * crashes. sourcekitd restarts on its own, so the request can be retried.
+ */
+class SourceKitInterrupted : public std::runtime_error {
+public:
+  SourceKitInterrupted(const std::string &stage)
+      : std::runtime_error("SourceKit was interrupted during: " + stage) {
+  }
+};
+
+/**
+ * A sink for a response body.
+ *
+ * Large responses are handed to the sink piece by piece as they are
+ * serialized, so the caller can write them out before the whole body exists.
+ */
+using ResponseSink = std::function<void(const char *bytes, std::size_t length)>;
+
+/**
+ * How much of each candidate a completion response includes.
+ */
+enum CompletionDetail {
+  // Everything sourcekitd says about each candidate
+  CompletionDetailFull,
+  // What a completion menu shows. The response has a key.session, and each
+  // candidate a key.id, to resolve the rest with ResolveCompletion.
+  CompletionDetailSlim,
 };
 
 /**
@@ -24,19 +113,65 @@ public:
  */
 class SwiftCompleter {
   Logger _logger;
+  RequestDeadline _deadline;
 
 public:
-  SwiftCompleter(LogLevel logLevel);
+  // Requests throw RequestAbandoned once deadline is abandoned
+  SwiftCompleter(LogLevel logLevel,
+                 RequestDeadline deadline = RequestDeadline());
   ~SwiftCompleter();
 
-  const std::string
-  CandidatesForLocationInFile(const std::string &filename, int line, int column,
-                              const std::vector<UnsavedFile> &unsavedFiles,
-                              const std::vector<std::string> &flags);
+  // Columns count bytes of UTF-8, unless the editor counts in other units
+  const std::string CandidatesForLocationInFile(
+      const std::string &filename, int line, int column,
+      const std::vector<UnsavedFile> &unsavedFiles,
+      const std::vector<std::string> &flags,
+      ColumnEncoding columnEncoding = ColumnEncodingUTF8,
+      CompletionDetail detail = CompletionDetailFull);
+
+  // Stream candidates into sink one at a time, rather than building the
+  // complete JSON response in memory.
+  void CandidatesForLocationInFile(
+      const std::string &filename, int line, int column,
+      const std::vector<UnsavedFile> &unsavedFiles,
+      const std::vector<std::string> &flags, const ResponseSink &sink,
+      ColumnEncoding columnEncoding = ColumnEncodingUTF8,
+      CompletionDetail detail = CompletionDetailFull);
+
+  // The full candidate for an item of a slim completion response, with the
+  // annotated declaration sourcekitd has for it. Returns false once the
+  // session is gone.
+  bool ResolveCompletion(const std::string &session, std::size_t item,
+                         std::string *resolved);
+
+  // Stream the usages of the declaration referenced at a location, in it,
+  // the unsaved files and the Swift sources among flags. Usages of a file
+  // are written once they're all confirmed, so the first arrive before the
+  // rest are done.
+  void UsagesForLocationInFile(
+      const std::string &filename, int line, int column,
+      const std::vector<UnsavedFile> &unsavedFiles,
+      const std::vector<std::string> &flags, const ResponseSink &sink,
+      ColumnEncoding columnEncoding = ColumnEncodingUTF8);
 
   const std::string
   DiagnosticsForFile(const std::string &filename,
                      const std::vector<UnsavedFile> &unsavedFiles,
                      const std::vector<std::string> &flags);
+
+  // The syntactic structure of a file, as key.substructure.
+  const std::string
+  StructureForFile(const std::string &filename,
+                   const std::vector<UnsavedFile> &unsavedFiles,
+                   const std::vector<std::string> &flags);
+
+private:
+  // Stream the candidates at offset, once per group of identical requests
+  void completions(CompletionContext &ctx, const std::string &contents,
+                   unsigned offset, CompletionDetail detail,
+                   const ResponseSink &sink);
+  // These return false, with an empty result, when sourcekitd fails
+  bool diagnostics(CompletionContext &ctx, std::string *diagnostics);
+  bool structure(CompletionContext &ctx, std::string *structure);
 };
 } // namespace ssvim
@@ -0,0 +1,141 @@
+#import "SwiftCorpus.hpp"
+#import "JSON.hpp"
+
+#import <sstream>
+
+using namespace ssvim;
+
+namespace {
+
+// A small, fast and reproducible generator. std::mt19937 would do, but its
+// distributions aren't specified to give the same values on every standard
+// library.
+class CorpusRandom {
+  std::uint64_t _state;
+
+public:
+  CorpusRandom(std::uint64_t seed) : _state(seed * 0x9e3779b97f4a7c15 + 1) {
+  }
+
+  std::uint64_t next() {
+    // xorshift64*
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return _state * 0x2545f4914f6cdd1d;
+  }
+
+  std::size_t below(std::size_t bound) {
+    return static_cast<std::size_t>(next() % bound);
+  }
+
+  template <class T, std::size_t N> const T &pick(const T (&values)[N]) {
+    return values[below(N)];
+  }
+};
+
+const char *const TypeNames[] = {
+    "Document", "Session",  "Completion", "Diagnostic", "Token",
+    "Range",    "Position", "Buffer",     "Request",    "Response",
+};
+
+const char *const MemberNames[] = {
+    "count",    "identifier", "offset", "contents",  "isEmpty",
+    "children", "location",   "length", "timestamp", "kind",
+};
+
+const char *const BuiltinTypes[] = {
+    "Int", "String", "Bool", "Double", "[String]", "[Int: String]",
+};
+
+// Non ASCII text, so column math sees multi byte characters
+const char *const Literals[] = {
+    "hello", "naïve café", "日本語のテキスト", "emoji 🚀 ok", "plain text",
+};
+
+const char *const Comments[] = {
+    "// MARK: - Helpers",
+    "/// Returns the value for the current position.",
+    "// TODO: handle the empty case",
+    "/* A block comment that spans a single line */",
+};
+
+void WriteType(std::ostringstream &os, CorpusRandom &random, std::size_t index,
+               std::size_t *lines) {
+  auto name = std::string(random.pick(TypeNames)) + std::to_string(index);
+  os << random.pick(Comments) << "\n";
+  os << (random.below(2) ? "struct " : "final class ") << name << " {\n";
+  *lines += 2;
+
+  auto members = 2 + random.below(4);
+  for (std::size_t i = 0; i < members; i++) {
+    os << "    var " << random.pick(MemberNames) << i << ": "
+       << random.pick(BuiltinTypes) << "\n";
+  }
+  *lines += members;
+
+  os << "\n    func render(_ value: Int) -> String {\n"
+     << "        let label = \"" << random.pick(Literals) << "\"\n"
+     << "        let items = [1, 2, 3].map { $0 * value }\n"
+     << "        guard items.count > 0 else { return label }\n"
+     << "        return label + String(items.reduce(0, +))\n"
+     << "    }\n"
+     << "}\n\n";
+  *lines += 9;
+}
+} // namespace
+
+SwiftCorpusFile ssvim::GenerateSwiftCorpus(std::size_t lineCount,
+                                           std::uint64_t seed) {
+  CorpusRandom random(seed);
+  std::ostringstream os;
+  std::size_t lines = 0;
+
+  os << "//\n//  Generated.swift\n//\n\nimport Foundation\n\n";
+  lines += 6;
+  for (std::size_t index = 0; lines + 3 < lineCount; index++) {
+    WriteType(os, random, index, &lines);
+  }
+
+  // Finish on a member access, where a client would ask for completions
+  SwiftCorpusFile file;
+  os << "func complete(_ value: String) {\n    value.";
+  file.line = static_cast<unsigned>(lines + 2);
+  file.column = 11;
+  os << "\n}\n";
+  file.contents = os.str();
+  return file;
+}
+
+std::string ssvim::GenerateCompletionResults(std::size_t count,
+                                             std::uint64_t seed) {
+  CorpusRandom random(seed);
+  std::ostringstream os;
+  os << "{\"key.results\":[";
+  for (std::size_t i = 0; i < count; i++) {
+    auto member = std::string(random.pick(MemberNames)) + std::to_string(i);
+    auto type = random.pick(BuiltinTypes);
+    os << (i ? "," : "") << "{"
+       << "\"key.kind\":\"source.lang.swift.decl.var.instance\","
+       << "\"key.name\":\"" << member << "\","
+       << "\"key.sourcetext\":\"" << member << "\","
+       << "\"key.description\":\"" << member << "\","
+       << "\"key.typename\":\"" << type << "\","
+       << "\"key.context\":\"source.codecompletion.context.thisclass\","
+       << "\"key.num_bytes_to_erase\":0,"
+       << "\"key.associated_usrs\":\"s:9Generated8Document" << i << "V\","
+       << "\"key.modulename\":\"Generated\"}";
+  }
+  os << "]}";
+  return os.str();
+}
+
+std::string ssvim::GenerateCompletionRequest(const std::string &fileName,
+                                             const SwiftCorpusFile &file) {
+  std::ostringstream os;
+  os << "{\"file_name\":" << QuoteJSON(fileName) << ","
+     << "\"line\":" << file.line << ",\"column\":" << file.column << ","
+     << "\"contents\":" << QuoteJSON(file.contents) << ","
+     << "\"flags\":[]}";
+  return os.str();
+}
@@ -0,0 +1,40 @@
+#import <cstddef>
+#import <cstdint>
+#import <string>
+
+namespace ssvim {
+
+/**
+ * A synthetic Swift source file, for benchmarks.
+ */
+struct SwiftCorpusFile {
+  std::string contents;
+
+  // A completion point after the last member access in the file, 1 based
+  unsigned line;
+  unsigned column;
+};
+
+/**
+ * Generate Swift source of about lineCount lines.
+ *
+ * The source is a mix of what real files have: comments, types, members,
+ * closures, string literals with non ASCII text and member accesses. The
+ * same seed always produces the same file, so runs are comparable.
+ */
+SwiftCorpusFile GenerateSwiftCorpus(std::size_t lineCount,
+                                    std::uint64_t seed = 1);
+
+/**
+ * Generate a completion response body with count results, shaped like
+ * sourcekitd's key.results.
+ */
+std::string GenerateCompletionResults(std::size_t count,
+                                      std::uint64_t seed = 1);
+
+/**
+ * Generate a /completions request body for file.
+ */
+std::string GenerateCompletionRequest(const std::string &fileName,
+                                      const SwiftCorpusFile &file);
+} // namespace ssvim
@@ -0,0 +1,163 @@
+#import "Tracing.hpp"
+#import "JSON.hpp"
+
+#import <atomic>
+#import <deque>
+#import <utility>
+
+using namespace ssvim;
+
+static std::atomic<bool> TracingEnabled(false);
+static std::mutex TracesMutex;
+static std::deque<std::shared_ptr<Trace>> Traces;
+static std::size_t TracesCapacity = 0;
+static std::atomic<std::uint64_t> NextRequestID(1);
+
+static thread_local std::shared_ptr<Trace> CurrentTrace;
+
+// Number threads in the order they first record a span
+static std::atomic<std::size_t> NextThread(1);
+static thread_local std::size_t CurrentThread = NextThread++;
+
+// All timestamps are relative to when the process started tracing
+static const auto Epoch = std::chrono::steady_clock::now();
+
+// Keep the trace of a finished request, dropping the oldest past capacity
+static void KeepTrace(std::shared_ptr<Trace> trace) {
+  std::lock_guard<std::mutex> lock(TracesMutex);
+  Traces.push_back(trace);
+  while (Traces.size() > TracesCapacity) {
+    Traces.pop_front();
+  }
+}
+
+#pragma mark - Trace
+
+Trace::Trace(std::uint64_t requestID, std::string name)
+    : requestID(requestID), name(name),
+      start(std::chrono::steady_clock::now()) {
+}
+
+void Trace::addSpan(std::string name,
+                    std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _events.push_back({name, start, end, CurrentThread});
+}
+
+void Trace::openSpan() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _openSpans++;
+}
+
+bool Trace::shouldKeep(std::chrono::steady_clock::time_point end) {
+  if (!_finished || _openSpans > 0 || _kept) {
+    return false;
+  }
+  _kept = true;
+  _events.push_back({name, start, end, CurrentThread});
+  return true;
+}
+
+void Trace::closeSpan(std::string name,
+                      std::chrono::steady_clock::time_point start,
+                      std::chrono::steady_clock::time_point end) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _events.push_back({name, start, end, CurrentThread});
+    _openSpans--;
+    if (!shouldKeep(end)) {
+      return;
+    }
+  }
+  KeepTrace(shared_from_this());
+}
+
+void Trace::finish() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _finished = true;
+    if (!shouldKeep(std::chrono::steady_clock::now())) {
+      return;
+    }
+  }
+  KeepTrace(shared_from_this());
+}
+
+std::vector<TraceEvent> Trace::events() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _events;
+}
+
+TraceScope::TraceScope(std::shared_ptr<Trace> trace)
+    : _previous(std::move(CurrentTrace)) {
+  CurrentTrace = std::move(trace);
+}
+
+TraceScope::~TraceScope() {
+  CurrentTrace = std::move(_previous);
+}
+
+#pragma mark - Tracing
+
+void tracing::Enable(std::size_t capacity) {
+  {
+    std::lock_guard<std::mutex> lock(TracesMutex);
+    TracesCapacity = capacity;
+  }
+  TracingEnabled.store(capacity > 0, std::memory_order_relaxed);
+}
+
+bool tracing::IsEnabled() {
+  return TracingEnabled.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<Trace> tracing::StartTrace(std::string name) {
+  if (!IsEnabled()) {
+    return nullptr;
+  }
+  return std::make_shared<Trace>(NextRequestID++, name);
+}
+
+void tracing::FinishTrace(const std::shared_ptr<Trace> &trace) {
+  if (trace) {
+    trace->finish();
+  }
+}
+
+const std::shared_ptr<Trace> &tracing::Current() {
+  return CurrentTrace;
+}
+
+static long long Microseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+      .count();
+}
+
+void tracing::WriteChromeTrace(std::ostream &os) {
+  std::deque<std::shared_ptr<Trace>> traces;
+  {
+    std::lock_guard<std::mutex> lock(TracesMutex);
+    traces = Traces;
+  }
+
+  os << "{\"traceEvents\":[";
+  auto first = true;
+  for (auto &trace : traces) {
+    auto pid = trace->requestID;
+    // Name the process after the request, so the viewer lists requests
+    os << (first ? "" : ",") << "{\"name\":\"process_name\",\"ph\":\"M\","
+       << "\"pid\":" << pid << ",\"args\":{\"name\":"
+       << QuoteJSON(std::to_string(pid) + " " + trace->name) << "}}";
+    first = false;
+    for (auto &event : trace->events()) {
+      os << ",{\"name\":" << QuoteJSON(event.name) << ","
+         << "\"cat\":\"request\",\"ph\":\"X\","
+         << "\"ts\":" << Microseconds(event.start - Epoch) << ","
+         << "\"dur\":" << Microseconds(event.end - event.start) << ","
+         << "\"pid\":" << pid << ",\"tid\":" << event.thread << ","
+         << "\"args\":{\"request_id\":" << pid << "}}";
+    }
+  }
+  os << "],\"displayTimeUnit\":\"ms\"}";
+}
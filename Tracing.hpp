@@ -0,0 +1,125 @@
+#import <chrono>
+#import <cstddef>
+#import <cstdint>
+#import <memory>
+#import <mutex>
+#import <ostream>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * A timed span of work within a request.
+ */
+struct TraceEvent {
+  std::string name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  // A small per thread number, rather than the OS thread id
+  std::size_t thread;
+};
+
+/**
+ * The spans recorded for a single request.
+ *
+ * A request's work moves between threads, so spans can be added from any of
+ * them. Work may still be running when the response is written, so the trace
+ * is only kept once the request has finished and its last open span closes.
+ */
+class Trace : public std::enable_shared_from_this<Trace> {
+  std::mutex _mutex;
+  std::vector<TraceEvent> _events;
+  std::size_t _openSpans = 0;
+  bool _finished = false;
+  bool _kept = false;
+
+  // Whether the trace is ready to keep. Called with the lock held.
+  bool shouldKeep(std::chrono::steady_clock::time_point end);
+
+public:
+  const std::uint64_t requestID;
+  const std::string name;
+  const std::chrono::steady_clock::time_point start;
+
+  Trace(std::uint64_t requestID, std::string name);
+
+  void addSpan(std::string name, std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end);
+
+  // Spans that are open hold off keeping the trace until they're closed
+  void openSpan();
+  void closeSpan(std::string name,
+                 std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end);
+
+  // Add a span for the whole request, and keep the trace once no spans are
+  // open
+  void finish();
+
+  std::vector<TraceEvent> events();
+};
+
+namespace tracing {
+
+// Keep the traces of the last capacity requests. Tracing is off until this
+// is called.
+void Enable(std::size_t capacity);
+
+// A relaxed load, so checking costs next to nothing when tracing is off
+bool IsEnabled();
+
+// Start tracing a request. Returns null when tracing is off.
+std::shared_ptr<Trace> StartTrace(std::string name);
+
+// Finish a request's trace, if any. See Trace::finish.
+void FinishTrace(const std::shared_ptr<Trace> &trace);
+
+// The trace spans on this thread are recorded into, if any
+const std::shared_ptr<Trace> &Current();
+
+// Write the kept traces in the Chrome trace_event format. Each request is
+// shown as its own process, with the threads that worked on it.
+void WriteChromeTrace(std::ostream &os);
+} // namespace tracing
+
+/**
+ * Make a trace current on this thread for the life of the scope.
+ */
+class TraceScope {
+  std::shared_ptr<Trace> _previous;
+
+public:
+  TraceScope(std::shared_ptr<Trace> trace);
+  ~TraceScope();
+};
+
+/**
+ * Record a span, in the current trace, for the life of the scope.
+ *
+ * name must outlive the span. When there's no current trace this is a
+ * thread local load and a branch.
+ */
+class TraceSpan {
+  std::shared_ptr<Trace> _trace;
+  const char *_name;
+  std::chrono::steady_clock::time_point _start;
+
+public:
+  TraceSpan(const char *name) : _trace(tracing::Current()), _name(name) {
+    if (_trace) {
+      _trace->openSpan();
+      _start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (_trace) {
+      _trace->closeSpan(_name, _start, std::chrono::steady_clock::now());
+    }
+  }
+
+  TraceSpan(TraceSpan const &) = delete;
+  TraceSpan &operator=(TraceSpan const &) = delete;
+};
+} // namespace ssvim
@@ -0,0 +1,129 @@
+#import "Usages.hpp"
+#import "JSON.hpp"
+
+#import <cctype>
+#import <cstring>
+#import <fcntl.h>
+#import <set>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+using namespace ssvim;
+
+// Bytes of UTF-8 sequences count too, since identifiers may be Unicode
+static bool IsIdentifierByte(unsigned char c) {
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// The scan leans on memchr, which libc vectorizes: it skips to each byte
+// that starts the identifier, and its last byte is checked before the rest.
+// Lines are counted the same way, only up to the occurrences found.
+std::vector<IdentifierOccurrence>
+ssvim::FindIdentifier(const char *text, std::size_t length,
+                      const std::string &identifier) {
+  std::vector<IdentifierOccurrence> occurrences;
+  auto size = identifier.size();
+  if (size == 0 || size > length) {
+    return occurrences;
+  }
+  // An operator, say, isn't bounded the way an identifier is
+  auto boundedStart = IsIdentifierByte(identifier.front());
+  auto boundedEnd = IsIdentifierByte(identifier.back());
+  auto end = text + length;
+  auto limit = end - size + 1;
+  unsigned line = 1;
+  auto lineStart = text;
+  auto counted = text;
+  for (auto c = text; c < limit; c++) {
+    c = static_cast<const char *>(memchr(c, identifier.front(), limit - c));
+    if (!c) {
+      break;
+    }
+    if (c[size - 1] != identifier.back() ||
+        memcmp(c, identifier.data(), size) != 0 ||
+        (boundedStart && c > text && IsIdentifierByte(c[-1])) ||
+        (boundedEnd && c + size < end && IsIdentifierByte(c[size]))) {
+      continue;
+    }
+    while (auto newline = static_cast<const char *>(
+               memchr(counted, '\n', c - counted))) {
+      line++;
+      lineStart = counted = newline + 1;
+    }
+    counted = c;
+    occurrences.push_back({static_cast<std::size_t>(c - text), line,
+                           static_cast<unsigned>(c - lineStart + 1)});
+  }
+  return occurrences;
+}
+
+bool ssvim::FindIdentifierInFile(
+    const std::string &fileName, const std::string &identifier,
+    std::vector<IdentifierOccurrence> *occurrences) {
+  auto fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return false;
+  }
+  auto size = static_cast<std::size_t>(info.st_size);
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  *occurrences =
+      FindIdentifier(static_cast<const char *>(mapped), size, identifier);
+  munmap(mapped, size);
+  return true;
+}
+
+std::string ssvim::BaseName(const std::string &name) {
+  return name.substr(0, name.find('('));
+}
+
+std::vector<std::string>
+ssvim::ModuleSources(const std::vector<std::string> &flags) {
+  static const std::string Extension = ".swift";
+  std::vector<std::string> sources;
+  std::set<std::string> seen;
+  for (auto &flag : flags) {
+    if (flag.size() > Extension.size() &&
+        flag.compare(flag.size() - Extension.size(), Extension.size(),
+                     Extension) == 0 &&
+        seen.insert(flag).second) {
+      sources.push_back(flag);
+    }
+  }
+  return sources;
+}
+
+std::string ssvim::UsagesBegin(const std::string &name,
+                               const std::string &usr) {
+  std::string json = "{\"key.name\":";
+  AppendJSONString(json, name);
+  json += ",\"key.usr\":";
+  AppendJSONString(json, usr);
+  json += ",\"key.usages\":[";
+  return json;
+}
+
+std::string ssvim::UsageJSON(const std::string &fileName,
+                             const IdentifierOccurrence &occurrence,
+                             std::size_t length) {
+  std::string json = "{\"key.filepath\":";
+  AppendJSONString(json, fileName);
+  json += ",\"key.offset\":" + std::to_string(occurrence.offset) +
+          ",\"key.length\":" + std::to_string(length) +
+          ",\"key.line\":" + std::to_string(occurrence.line) +
+          ",\"key.column\":" + std::to_string(occurrence.column) + "}";
+  return json;
+}
@@ -0,0 +1,44 @@
+#import <cstddef>
+#import <string>
+#import <vector>
+
+namespace ssvim {
+
+/**
+ * Where an identifier occurs in a file.
+ */
+struct IdentifierOccurrence {
+  std::size_t offset;
+  // Lines are 1 based, and columns are 1 based bytes, like offsets
+  unsigned line;
+  unsigned column;
+};
+
+// Every occurrence of identifier in text that isn't part of a longer
+// identifier. The scan is lexical, so some are other declarations with the
+// same name, or words in comments and strings.
+std::vector<IdentifierOccurrence> FindIdentifier(const char *text,
+                                                 std::size_t length,
+                                                 const std::string &identifier);
+
+// FindIdentifier over a file on disk, which is mapped rather than read.
+// Returns false when it can't be read.
+bool FindIdentifierInFile(const std::string &fileName,
+                          const std::string &identifier,
+                          std::vector<IdentifierOccurrence> *occurrences);
+
+// The identifier a declaration is written as: its name without the argument
+// labels, as in foo for foo(_:bar:)
+std::string BaseName(const std::string &name);
+
+// The Swift sources of a module, as its compile command lists them
+std::vector<std::string> ModuleSources(const std::vector<std::string> &flags);
+
+// The start of a usages response, up to the first usage
+std::string UsagesBegin(const std::string &name, const std::string &usr);
+
+// A usage as it's streamed, a JSON object
+std::string UsageJSON(const std::string &fileName,
+                      const IdentifierOccurrence &occurrence,
+                      std::size_t length);
+} // namespace ssvim
@@ -24,13 +24,20 @@ cd $DIR/vendor/boost
 ./bootstrap.sh --prefix=$BOOST_PREFIX \
     --libdir=$BOOST_LIB_DIR --without-icu
 
+# On macOS, build against libc++ with the darwin toolset. Elsewhere, let b2
+# pick the system's compiler and standard library.
+if [[ "$(uname)" == "Darwin" ]]; then
+    TOOLSET_FLAGS="--user-config=user-config.jam cxxflags=-stdlib=libc++ linkflags=-stdlib=libc++"
+else
+    TOOLSET_FLAGS=""
+fi
+
 ./b2 --prefix=$BOOST_PREFIX \
     --libdir=$BOOST_LIB_DIR \
-    --user-config=user-config.jam \
     -d2 \
     -j4 \
     --layout-tagged install \
     threading=multi \
     link=static \
-    cxxflags=-stdlib=libc++ linkflags=-stdlib=libc++ 
+    $TOOLSET_FLAGS
 
@@ -12,23 +12,103 @@
 #include <beast/http/message.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/assert.hpp>
-#include <boost/filesystem.hpp>
 #include <cstdint>
-#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace beast {
 namespace http {
 
+/**
+ * A read only memory mapping of a byte range of a file.
+ *
+ * Mappings must start on a page boundary, so the mapping may begin before
+ * the range. data() points at the first byte of the range.
+ *
+ * map() checks the file's size, but a file truncated after that raises
+ * SIGBUS when the missing pages are read. Served files are replaced by
+ * rename, which leaves the mapped file intact.
+ */
+class mapped_file_range {
+  void *map_ = MAP_FAILED;
+  std::size_t map_len_ = 0;
+  std::size_t delta_ = 0;
+  std::uint64_t len_ = 0;
+
+public:
+  mapped_file_range() = default;
+  mapped_file_range(mapped_file_range const &) = delete;
+  mapped_file_range &operator=(mapped_file_range const &) = delete;
+
+  ~mapped_file_range() {
+    if (map_ != MAP_FAILED)
+      munmap(map_, map_len_);
+  }
+
+  void map(std::string const &path, std::uint64_t offset, std::uint64_t len,
+           error_code &ec) noexcept {
+    len_ = len;
+    if (len == 0)
+      return;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      ec = error_code{errno, system_category()};
+      return;
+    }
+    // Touching a mapping past the end of the file faults, so fail up front
+    // if the file shrank after the range was resolved.
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<std::uint64_t>(st.st_size) < offset + len) {
+      ec = error_code{EIO, system_category()};
+      close(fd);
+      return;
+    }
+    auto const page = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    auto const start = offset - offset % page;
+    delta_ = static_cast<std::size_t>(offset - start);
+    map_len_ = static_cast<std::size_t>(len + delta_);
+    map_ = mmap(nullptr, map_len_, PROT_READ, MAP_PRIVATE, fd,
+                static_cast<off_t>(start));
+    if (map_ == MAP_FAILED)
+      ec = error_code{errno, system_category()};
+    else
+      madvise(map_, map_len_, MADV_SEQUENTIAL);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+  }
+
+  char const *data() const noexcept {
+    return static_cast<char const *>(map_) + delta_;
+  }
+
+  std::uint64_t size() const noexcept {
+    return len_;
+  }
+};
+
+/**
+ * A body that serves a byte range of a file.
+ *
+ * The range is memory mapped and handed to the socket as a single buffer,
+ * so the file is never copied through a user space buffer and the kernel
+ * can send it in writes as large as the socket allows.
+ */
 struct file_body {
-  using value_type = std::string;
+  struct value_type {
+    std::string path;
+    // The range to send. The caller resolves the range against the file's
+    // size before writing.
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+  };
 
   class writer {
-    std::uint64_t size_ = 0;
-    std::uint64_t offset_ = 0;
-    std::string const &path_;
-    FILE *file_ = nullptr;
-    char buf_[4096];
-    std::size_t buf_len_;
+    value_type const &body_;
+    mapped_file_range range_;
 
   public:
     writer(writer const &) = delete;
@@ -36,41 +116,22 @@ struct file_body {
 
     template <bool isRequest, class Fields>
     writer(message<isRequest, file_body, Fields> const &m) noexcept
-        : path_(m.body) {
-    }
-
-    ~writer() {
-      if (file_)
-        fclose(file_);
+        : body_(m.body) {
     }
 
     void init(error_code &ec) noexcept {
-      file_ = fopen(path_.c_str(), "rb");
-      if (!file_)
-        ec = error_code{errno, system_category()};
-      else
-        size_ = boost::filesystem::file_size(path_);
+      range_.map(body_.path, body_.offset, body_.length, ec);
     }
 
     std::uint64_t content_length() const noexcept {
-      return size_;
+      return body_.length;
     }
 
     template <class WriteFunction>
     bool write(error_code &ec, WriteFunction &&wf) noexcept {
-      if (size_ - offset_ < sizeof(buf_))
-        buf_len_ = static_cast<std::size_t>(size_ - offset_);
-      else
-        buf_len_ = sizeof(buf_);
-      auto const nread = fread(buf_, 1, sizeof(buf_), file_);
-      if (ferror(file_)) {
-        ec = error_code(errno, system_category());
-        return true;
-      }
-      BOOST_ASSERT(nread != 0);
-      offset_ += nread;
-      wf(boost::asio::buffer(buf_, nread));
-      return offset_ >= size_;
+      wf(boost::asio::buffer(range_.data(),
+                             static_cast<std::size_t>(range_.size())));
+      return true;
     }
   };
 };
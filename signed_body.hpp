@@ -0,0 +1,84 @@
+#import "HMAC.hpp"
+
+#import <beast/core/error.hpp>
+#import <beast/http/message.hpp>
+#import <boost/asio/buffer.hpp>
+#import <boost/optional.hpp>
+#import <cstring>
+#import <string>
+
+namespace ssvim {
+namespace http {
+
+/**
+ * A string body that is signed with HMAC-SHA256 as it is read.
+ *
+ * The body's HMAC is updated with each piece beast reads off the socket, so
+ * a request can be verified without another pass over, or a copy of, a large
+ * body.
+ */
+struct signed_string_body {
+  class value_type : public std::string {
+  public:
+    // Signs the body read so far. Empty when requests aren't signed.
+    boost::optional<HMACSHA256> signer;
+
+    value_type() = default;
+
+    explicit value_type(const std::string &key) {
+      if (key.size()) {
+        signer.emplace(key);
+      }
+    }
+  };
+
+  class reader {
+    value_type &body_;
+
+  public:
+    template <bool isRequest, class Fields>
+    explicit reader(
+        beast::http::message<isRequest, signed_string_body, Fields> &m) noexcept
+        : body_(m.body) {
+    }
+
+    void init(beast::error_code &) noexcept {
+    }
+
+    void write(void const *data, std::size_t size,
+               beast::error_code &) noexcept {
+      auto const n = body_.size();
+      body_.resize(n + size);
+      std::memcpy(&body_[n], data, size);
+      if (body_.signer) {
+        body_.signer->update(data, size);
+      }
+    }
+  };
+
+  class writer {
+    value_type const &body_;
+
+  public:
+    template <bool isRequest, class Fields>
+    explicit writer(beast::http::message<isRequest, signed_string_body,
+                                         Fields> const &msg) noexcept
+        : body_(msg.body) {
+    }
+
+    void init(beast::error_code &) noexcept {
+    }
+
+    std::uint64_t content_length() const noexcept {
+      return body_.size();
+    }
+
+    template <class WriteFunction>
+    bool write(beast::error_code &, WriteFunction &&wf) noexcept {
+      wf(boost::asio::buffer(body_.data(), body_.size()));
+      return true;
+    }
+  };
+};
+} // namespace http
+} // namespace ssvim